@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "acl.h"
+
+/*
+ *  The rules are compiled into two multibit tries (stride 8), one for IPv4
+ *  and one for IPv6. Each node covers one address byte: entry i holds the
+ *  verdict of the longest rule ending in this byte for byte value i (prefixes
+ *  that end inside the byte are expanded over all values they cover) and the
+ *  child for the next byte. A lookup is at most 4 (IPv4) or 16 (IPv6)
+ *  dependent loads and never allocates.
+ */
+
+#define FANOUT      256
+#define ACTION_NONE -1
+#define ACTION_DENY  0
+#define ACTION_ALLOW 1
+
+#define ROOT_V4 0
+#define ROOT_V6 1
+
+struct acl_node {
+    int32_t child[FANOUT];      /* 0 -> no child, the roots are never children */
+    int8_t  action[FANOUT];
+    uint8_t plen[FANOUT];       /* prefix length of the rule that set action */
+};
+
+struct acl {
+    struct acl_node *nodes;
+    int count;
+    int cap;
+    int default_action;
+};
+
+static int new_node(struct acl *acl) {
+    if (acl->count == acl->cap) {
+        int cap = acl->cap ? acl->cap * 2 : 8;
+        struct acl_node *nodes = realloc(acl->nodes, cap * sizeof(*nodes));
+        if (nodes == NULL) {
+            return -1;
+        }
+        acl->nodes = nodes;
+        acl->cap = cap;
+    }
+
+    struct acl_node *node = &acl->nodes[acl->count];
+    memset(node->child, 0, sizeof(node->child));
+    memset(node->action, ACTION_NONE, sizeof(node->action));
+    memset(node->plen, 0, sizeof(node->plen));
+    return acl->count++;
+}
+
+static int insert(struct acl *acl, int root, const unsigned char *addr,
+                  int plen, int action) {
+    int node = root;
+    int b = 0;
+    while (plen - 8 * b > 8) {
+        int child = acl->nodes[node].child[addr[b]];
+        if (child == 0) {
+            if ((child = new_node(acl)) < 0) {
+                return -1;
+            }
+            acl->nodes[node].child[addr[b]] = child;
+        }
+        node = child;
+        ++b;
+    }
+
+    int rem   = plen - 8 * b;       /* bits of this byte in the prefix */
+    int count = 1 << (8 - rem);
+    int base  = rem ? (addr[b] & ~(count - 1) & 0xff) : 0;
+
+    struct acl_node *n = &acl->nodes[node];
+    for (int i = base; i < base + count; ++i) {
+        // a longer prefix wins, the first rule wins among equal ones
+        if (n->action[i] == ACTION_NONE || n->plen[i] < plen) {
+            n->action[i] = action;
+            n->plen[i]   = plen;
+        }
+    }
+    return 0;
+}
+
+/*
+ * "192.168.1" -> 192.168.1.0, as the old mask syntax allowed
+ */
+static int parse_ipv4(const char *str, unsigned char *addr) {
+    char buf[INET_ADDRSTRLEN + 8];
+    int dots = 0;
+    for (const char *p = str; *p; ++p) {
+        if (*p == '.') ++dots;
+    }
+    if (dots > 3 || strlen(str) >= INET_ADDRSTRLEN) {
+        return -1;
+    }
+
+    strcpy(buf, str);
+    while (dots++ < 3) {
+        strcat(buf, ".0");
+    }
+    return inet_pton(AF_INET, buf, addr) == 1 ? 0 : -1;
+}
+
+/*
+ * "24" or "255.255.255.0", mask bits must be contiguous
+ */
+static int parse_prefix(const char *str, int is_v6) {
+    int max = is_v6 ? 128 : 32;
+    if (!is_v6 && strchr(str, '.')) {
+        unsigned char mask[4];
+        if (parse_ipv4(str, mask) < 0) {
+            return -1;
+        }
+        uint32_t m = ((uint32_t)mask[0] << 24) | (mask[1] << 16) |
+                     (mask[2] << 8) | mask[3];
+        int plen = 0;
+        while (plen < 32 && (m & (0x80000000u >> plen))) ++plen;
+        if (plen < 32 && (m << plen) != 0) {
+            return -1;
+        }
+        return plen;
+    }
+
+    char *end;
+    long plen = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || plen < 0 || plen > max) {
+        return -1;
+    }
+    return (int)plen;
+}
+
+static int compile_rule(struct acl *acl, char *token) {
+    int action = ACTION_ALLOW;
+    if (strncmp(token, "allow:", 6) == 0) {
+        token += 6;
+    }
+    else if (strncmp(token, "deny:", 5) == 0) {
+        action = ACTION_DENY;
+        token += 5;
+    }
+
+    char *slash = strchr(token, '/');
+    if (slash) {
+        *slash = '\0';
+    }
+
+    unsigned char addr[16];
+    int is_v6 = strchr(token, ':') != NULL;
+    if (is_v6) {
+        if (inet_pton(AF_INET6, token, addr) != 1) return -1;
+    }
+    else if (parse_ipv4(token, addr) < 0) {
+        return -1;
+    }
+
+    int plen = slash ? parse_prefix(slash + 1, is_v6) : (is_v6 ? 128 : 32);
+    if (plen < 0) {
+        return -1;
+    }
+
+    // clear the host bits so the expansion starts at the network address
+    int bytes = is_v6 ? 16 : 4;
+    for (int i = 0; i < bytes; ++i) {
+        int keep = plen - 8 * i;
+        if (keep <= 0)     addr[i] = 0;
+        else if (keep < 8) addr[i] &= (unsigned char)(0xff << (8 - keep));
+    }
+
+    if (action == ACTION_ALLOW) {
+        acl->default_action = ACTION_DENY;
+    }
+    return insert(acl, is_v6 ? ROOT_V6 : ROOT_V4, addr, plen, action);
+}
+
+struct acl *acl_compile(const char *rules, char *err, size_t errlen) {
+    struct acl *acl = calloc(1, sizeof(*acl));
+    if (acl == NULL) {
+        snprintf(err, errlen, "out of memory");
+        return NULL;
+    }
+    acl->default_action = ACTION_ALLOW;
+    if (new_node(acl) != ROOT_V4 || new_node(acl) != ROOT_V6) {
+        snprintf(err, errlen, "out of memory");
+        acl_free(acl);
+        return NULL;
+    }
+
+    char *copy = strdup(rules ? rules : "");
+    char *save = NULL;
+    for (char *token = strtok_r(copy, " \t,;", &save); token != NULL;
+         token = strtok_r(NULL, " \t,;", &save)) {
+        char bad[64];
+        snprintf(bad, sizeof(bad), "%s", token);
+        if (compile_rule(acl, token) < 0) {
+            snprintf(err, errlen, "bad acl rule: %s", bad);
+            free(copy);
+            acl_free(acl);
+            return NULL;
+        }
+    }
+    free(copy);
+
+    return acl;
+}
+
+void acl_free(struct acl *acl) {
+    if (acl) {
+        free(acl->nodes);
+        free(acl);
+    }
+}
+
+static int lookup(const struct acl *acl, int root,
+                  const unsigned char *addr, int bytes) {
+    int verdict = acl->default_action;
+    const struct acl_node *node = &acl->nodes[root];
+    for (int b = 0; b < bytes; ++b) {
+        unsigned char v = addr[b];
+        if (node->action[v] != ACTION_NONE) {
+            verdict = node->action[v];
+        }
+        if (node->child[v] == 0) {
+            break;
+        }
+        node = &acl->nodes[node->child[v]];
+    }
+    return verdict;
+}
+
+int acl_check(const struct acl *acl, const struct sockaddr *addr) {
+    if (acl == NULL) {
+        return 1;
+    }
+
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        return lookup(acl, ROOT_V4,
+                      (const unsigned char *)&in->sin_addr.s_addr, 4);
+    }
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        const unsigned char *bytes = in6->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            return lookup(acl, ROOT_V4, bytes + 12, 4);
+        }
+        return lookup(acl, ROOT_V6, bytes, 16);
+    }
+    return acl->default_action;
+}
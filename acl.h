@@ -0,0 +1,35 @@
+#ifndef _ACL_H
+#define _ACL_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *  Compiled CIDR access control list, shared by twebs and the ss server.
+ *
+ *  rules: tokens separated by blanks, ',' or ';'
+ *      allow:192.168.0.0/16   deny:10.1.0.0/255.255.0.0   allow:::1/128
+ *      a bare cidr is an allow rule, a missing prefix length means one host,
+ *      "192.168.1/255.255.255.0" (the old config.ini mask form) is accepted.
+ *  the longest matching prefix decides; for the same prefix the first rule
+ *  wins. An address no rule matches is denied if the list has any allow
+ *  rule, otherwise allowed. IPv4-mapped IPv6 peers are matched as IPv4.
+ */
+struct acl;
+
+/* return NULL and describe the bad token in err on a syntax error */
+struct acl *acl_compile(const char *rules, char *err, size_t errlen);
+void acl_free(struct acl *acl);
+
+/* 1 -> allow, 0 -> deny */
+int acl_check(const struct acl *acl, const struct sockaddr *addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,247 @@
+#include "wrap.h"
+#include "parse.h"
+#include "binlog.h"
+
+/*
+ *  Binary access log writer (format in binlog.h)
+ *      a request costs one atomic add on the shared segment header and a
+ *      48 byte store into the mapping, no syscall. The kernel writes the
+ *      dirty pages back. A url is appended to the dictionary only the first
+ *      time this process sees its id.
+ *
+ *      A worker whose segment is full maps the newest one, creating it only
+ *      if nobody did yet. A new segment is built under a name private to the
+ *      process and link()ed into place, which fails if another worker got
+ *      there first, so exactly one worker writes each header and nobody maps
+ *      a segment before its header is complete. The workers inherit their
+ *      descriptors across fork, so a lock on one of them would not keep them
+ *      apart.
+ */
+
+#define SEEN_SLOTS 8192         /* power of 2 */
+
+static char *blog_path = NULL;
+static long  segment_records = 0;
+static int   url_fd = -1;
+
+static struct binlog_header *segment = NULL;
+static size_t segment_bytes = 0;
+
+static uint32_t seen[SEEN_SLOTS];   /* url ids already in the dictionary */
+static int      seen_count = 0;
+
+static void segment_name(char *name, size_t len, uint32_t seq) {
+    snprintf(name, len, "%s.%0*u", blog_path, BINLOG_SEQ_WIDTH, seq);
+}
+
+static uint32_t latest_seq(void) {
+    char name[MAXLINE];
+    uint32_t seq = 0;
+    for (;;) {
+        segment_name(name, sizeof(name), seq + 1);
+        if (access(name, F_OK) != 0) {
+            return seq;
+        }
+        ++seq;
+    }
+}
+
+/*
+ * create segment seq unless it exists; returns 0 when this or another
+ * worker created it
+ */
+static int create_segment(uint32_t seq) {
+    char name[MAXLINE], tmp[MAXLINE];
+    segment_name(name, sizeof(name), seq);
+    snprintf(tmp, sizeof(tmp), "%s.%ld", name, (long)getpid());
+
+    unlink(tmp);    /* left over by a crashed process with our pid */
+    int fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "binlog open %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+
+    size_t bytes = sizeof(struct binlog_header) +
+                   segment_records * sizeof(struct binlog_record);
+    int err = posix_fallocate(fd, 0, bytes);
+    if (err != 0) {
+        syslog(LOG_ERR, "binlog allocate %s: %s", name, strerror(err));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    struct binlog_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic       = BINLOG_MAGIC;
+    header.version     = BINLOG_VERSION;
+    header.record_size = sizeof(struct binlog_record);
+    header.seq         = seq;
+    header.capacity    = segment_records;
+    header.created     = time(NULL);
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    int ret = link(tmp, name);
+    err = errno;
+    unlink(tmp);
+    if (ret < 0 && err != EEXIST) {
+        syslog(LOG_ERR, "binlog link %s: %s", name, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * map segment seq, creating it when it does not exist
+ */
+static int map_segment(uint32_t seq) {
+    char name[MAXLINE];
+    segment_name(name, sizeof(name), seq);
+
+    int fd = open(name, O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && create_segment(seq) == 0) {
+        fd = open(name, O_RDWR | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        syslog(LOG_ERR, "binlog open %s: %s", name, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    size_t bytes = st.st_size;
+
+    void *addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        syslog(LOG_ERR, "binlog mmap %s: %s", name, strerror(errno));
+        return -1;
+    }
+
+    struct binlog_header *header = addr;
+    if (header->magic != BINLOG_MAGIC ||
+        header->record_size != sizeof(struct binlog_record) ||
+        bytes < sizeof(*header) + header->capacity * header->record_size) {
+        syslog(LOG_ERR, "binlog %s is not a segment", name);
+        munmap(addr, bytes);
+        return -1;
+    }
+
+    if (segment) {
+        munmap(segment, segment_bytes);
+    }
+    segment = header;
+    segment_bytes = bytes;
+    return 0;
+}
+
+/*
+ * switch to the newest segment, or start a new one if it is full as well
+ */
+static int roll(void) {
+    uint32_t seq = latest_seq();
+    int ret = 0;
+    if (seq == 0 || seq == segment->seq) {
+        ret = map_segment(segment->seq + 1);
+    }
+    else {
+        ret = map_segment(seq);
+        if (ret == 0 && __atomic_load_n(&segment->next, __ATOMIC_RELAXED) >=
+                        segment->capacity) {
+            ret = map_segment(seq + 1);
+        }
+    }
+    return ret;
+}
+
+static void intern_url(uint32_t id, const char *url) {
+    uint32_t key = id ? id : 1;     /* 0 marks an empty slot */
+    uint32_t i = key & (SEEN_SLOTS - 1);
+    while (seen[i] != 0) {
+        if (seen[i] == key) {
+            return;
+        }
+        i = (i + 1) & (SEEN_SLOTS - 1);
+    }
+
+    // keep the set sparse, forgetting only costs a duplicate line
+    if (seen_count >= SEEN_SLOTS / 2) {
+        memset(seen, 0, sizeof(seen));
+        seen_count = 0;
+        i = key & (SEEN_SLOTS - 1);
+    }
+    seen[i] = key;
+    ++seen_count;
+
+    char line[MAXLINE];
+    int len = snprintf(line, sizeof(line), "%u\t%s\n", id, url);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    if (write(url_fd, line, len) < 0) {
+        syslog(LOG_ERR, "binlog url dictionary: %s", strerror(errno));
+    }
+}
+
+void binlog_init(const char *path, long records) {
+    blog_path = strdup(path);
+    segment_records = records > 0 ? records : 262144;
+
+    char name[MAXLINE];
+    snprintf(name, sizeof(name), "%s.urls", blog_path);
+    url_fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (url_fd < 0) {
+        syslog(LOG_ERR, "binlog open %s: %s", name, strerror(errno));
+        return;
+    }
+
+    uint32_t seq = latest_seq();
+    if (map_segment(seq ? seq : 1) < 0) {
+        segment = NULL;
+    }
+}
+
+void binlog_write(uint64_t start_us, uint32_t latency_us,
+                  const struct sockaddr *addr, int method, int status,
+                  long bytes, const char *url) {
+    if (segment == NULL) {
+        return;
+    }
+
+    uint64_t slot;
+    while ((slot = __atomic_fetch_add(&segment->next, 1, __ATOMIC_RELAXED)) >=
+           segment->capacity) {
+        if (roll() < 0) {
+            return;
+        }
+    }
+
+    struct binlog_record *record =
+        (struct binlog_record *)(segment + 1) + slot;
+    record->time_us    = start_us;
+    record->url_id     = binlog_url_id(url);
+    record->latency_us = latency_us;
+    record->bytes      = bytes > 0 ? (uint32_t)bytes : 0;
+    record->status     = status;
+    record->method     = method;
+
+    memset(record->addr, 0, sizeof(record->addr));
+    if (addr->sa_family == AF_INET) {
+        record->addr[10] = record->addr[11] = 0xff;
+        memcpy(record->addr + 12,
+               &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    }
+    else if (addr->sa_family == AF_INET6) {
+        memcpy(record->addr,
+               &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+    }
+    __atomic_store_n(&record->flags, BINLOG_COMMITTED, __ATOMIC_RELEASE);
+
+    intern_url(record->url_id, url);
+}
@@ -0,0 +1,64 @@
+#ifndef _BINLOG_H
+#define _BINLOG_H
+
+#include <stdint.h>
+
+/*
+ *  Binary access log format, shared by the writer (binlog.c) and the decoder
+ *  (tools/blogdump.c).
+ *
+ *  <log>.000001, <log>.000002, ...  segments: a header followed by capacity
+ *                                   fixed-width records, preallocated and
+ *                                   mmap'd MAP_SHARED by every worker
+ *  <log>.urls                       url dictionary, "id<TAB>url\n" lines,
+ *                                   one per url a worker saw first (an id
+ *                                   may appear more than once)
+ *
+ *  Writers claim a slot with an atomic add on header.next, fill the record
+ *  and set BINLOG_COMMITTED last, so a reader skips slots that were claimed
+ *  but never finished. All fields are host byte order except addr.
+ */
+
+#define BINLOG_MAGIC     0x474c4254u    /* "TBLG" */
+#define BINLOG_VERSION   1
+#define BINLOG_SEQ_WIDTH 6
+
+#define BINLOG_COMMITTED 0x01
+
+enum binlog_method {
+    BINLOG_OTHER = 0, BINLOG_GET, BINLOG_POST, BINLOG_HEAD
+};
+
+struct binlog_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t seq;
+    uint64_t capacity;          /* record slots in this segment */
+    uint64_t next;              /* next free slot, may run past capacity */
+    int64_t  created;           /* unix time */
+    uint8_t  reserved[24];
+};
+
+struct binlog_record {
+    uint64_t time_us;           /* request start, unix time in microseconds */
+    uint8_t  addr[16];          /* client, IPv4 as ::ffff:a.b.c.d */
+    uint32_t url_id;            /* fnv-1a of the url, see <log>.urls */
+    uint32_t latency_us;
+    uint32_t bytes;             /* response body bytes, 0 if unknown */
+    uint16_t status;
+    uint8_t  method;            /* enum binlog_method */
+    uint8_t  flags;
+    uint8_t  reserved[8];
+};
+
+static inline uint32_t binlog_url_id(const char *url) {
+    uint32_t h = 2166136261u;
+    while (*url) {
+        h ^= (unsigned char)*url++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+#endif
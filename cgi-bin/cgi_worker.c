@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "cgipool.h"
+
+/*
+ *  Worker side of the CGI pool protocol (cgipool.h)
+ *      started by a pool, the program stays alive and runs its handler once
+ *      per request: the BEGIN strings become the environment, stdin reads
+ *      the request body and stdout is collected and sent back as STDOUT
+ *      frames. Requests whose frames interleave are kept apart by id and run
+ *      in the order their bodies complete.
+ *      Started any other way, the handler runs once as a plain CGI.
+ */
+
+#define PENDING_SLOTS 16
+
+struct pending {
+    int      used;
+    uint32_t id;
+    char    *env;               /* "NAME=value\0" strings */
+    size_t   env_len;
+    char    *body;
+    size_t   len;
+};
+
+static struct pending pending[PENDING_SLOTS];
+static int (*handler)(void);
+
+static struct pending *find_pending(uint32_t id, int create) {
+    struct pending *free_slot = NULL;
+    for (int i = 0; i < PENDING_SLOTS; ++i) {
+        if (pending[i].used && pending[i].id == id) {
+            return &pending[i];
+        }
+        if (!pending[i].used && free_slot == NULL) {
+            free_slot = &pending[i];
+        }
+    }
+    if (!create || free_slot == NULL) {
+        return NULL;
+    }
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->used = 1;
+    free_slot->id = id;
+    return free_slot;
+}
+
+static void drop_pending(struct pending *p) {
+    free(p->env);
+    free(p->body);
+    memset(p, 0, sizeof(*p));
+}
+
+/*
+ * apply (set != 0) or remove the request environment
+ */
+static void request_env(struct pending *p, int set) {
+    for (size_t off = 0; off < p->env_len; ) {
+        char *var = p->env + off;
+        off += strlen(var) + 1;
+
+        char *value = strchr(var, '=');
+        if (value == NULL) {
+            continue;
+        }
+        *value = '\0';
+        if (set) setenv(var, value + 1, 1);
+        else     unsetenv(var);
+        *value = '=';
+    }
+}
+
+static int run_request(int sock, struct pending *p, int last) {
+    FILE *in = p->len ? fmemopen(p->body, p->len, "r")
+                      : fopen("/dev/null", "r");
+    char  *out_buf = NULL;
+    size_t out_len = 0;
+    FILE  *out = open_memstream(&out_buf, &out_len);
+    if (in == NULL || out == NULL) {
+        return -1;
+    }
+
+    request_env(p, 1);
+    FILE *saved_in = stdin;
+    FILE *saved_out = stdout;
+    stdin = in;
+    stdout = out;
+    int32_t status = handler();
+    fflush(stdout);
+    stdin = saved_in;
+    stdout = saved_out;
+    fclose(in);
+    fclose(out);
+    request_env(p, 0);
+
+    int ret = 0;
+    for (size_t off = 0; off < out_len && ret == 0; off += CGI_FRAME_MAX) {
+        size_t n = out_len - off < CGI_FRAME_MAX ? out_len - off : CGI_FRAME_MAX;
+        ret = cgi_write_frame(sock, p->id, CGI_STDOUT, 0, out_buf + off, n);
+    }
+    free(out_buf);
+    if (ret == 0) {
+        ret = cgi_write_frame(sock, p->id, CGI_STDOUT, 0, NULL, 0);
+    }
+    if (ret == 0) {
+        ret = cgi_write_frame(sock, p->id, CGI_END, last ? CGI_LAST : 0,
+                              &status, sizeof(status));
+    }
+    return ret;
+}
+
+int cgi_worker_main(int (*run)(void)) {
+    const char *requests = getenv("CGI_WORKER_REQUESTS");
+    if (requests == NULL) {
+        return run();
+    }
+    long limit = atol(requests);
+    unsetenv("CGI_WORKER_REQUESTS");
+    handler = run;
+
+    int sock = STDIN_FILENO;
+    signal(SIGPIPE, SIG_IGN);
+    if (cgi_write_frame(sock, 0, CGI_READY, 0, NULL, 0) < 0) {
+        return 1;
+    }
+
+    long served = 0;
+    while (limit <= 0 || served < limit) {
+        struct cgi_frame frame;
+        if (cgi_read_full(sock, &frame, sizeof(frame)) < 0) {
+            break;      /* the server closed the pool */
+        }
+        char *payload = NULL;
+        if (frame.length > 0) {
+            if (frame.length > CGI_FRAME_MAX ||
+                (payload = malloc(frame.length)) == NULL ||
+                cgi_read_full(sock, payload, frame.length) < 0) {
+                break;
+            }
+        }
+
+        struct pending *p = find_pending(frame.id, frame.type == CGI_BEGIN);
+        if (p == NULL) {
+            free(payload);
+            continue;
+        }
+
+        if (frame.type == CGI_BEGIN) {
+            free(p->env);
+            p->env = payload;
+            p->env_len = frame.length;
+            continue;
+        }
+        if (frame.type == CGI_STDIN && frame.length > 0) {
+            char *body = realloc(p->body, p->len + frame.length);
+            if (body != NULL) {
+                memcpy(body + p->len, payload, frame.length);
+                p->body = body;
+                p->len += frame.length;
+            }
+            free(payload);
+            continue;
+        }
+        free(payload);
+
+        if (frame.type == CGI_STDIN) {
+            ++served;
+            int ret = run_request(sock, p, limit > 0 && served >= limit);
+            drop_pending(p);
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
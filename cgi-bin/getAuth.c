@@ -1,16 +1,18 @@
 #include "wrap.h"
 #include "parse.h"
+#include "cgipool.h"
 
-int main(void) {
+static int auth(void) {
     char *buf, *p;
-    char name[MAXLINE], passwd[MAXLINE],content[MAXLINE];
+    char name[MAXLINE] = "", passwd[MAXLINE] = "", content[MAXLINE];
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
+    if ((buf = getenv("QUERY_STRING")) != NULL &&
+        (p = strchr(buf, '&')) != NULL) {
 	*p = '\0';
 	strcpy(name, buf);
 	strcpy(passwd, p+1);
+	*p = '&';
     }
 
 
@@ -25,5 +27,10 @@ int main(void) {
     printf("Content-type: text/html\r\n\r\n");
     printf("%s", content);
     fflush(stdout);
-    exit(0);
+    return 0;
+}
+
+/* a plain CGI, or a persistent worker when started by a pool */
+int main(void) {
+    return cgi_worker_main(auth);
 }
@@ -1,7 +1,8 @@
 #include "wrap.h"
 #include "parse.h"
+#include "cgipool.h"
 
-int main(void) {
+static int auth(void) {
     char *buf,*p;
     int length=0;
     char content[MAXLINE],data[MAXLINE];
@@ -11,6 +12,9 @@ int main(void) {
     {
     	length=atol(buf);
     }
+    if (length >= MAXLINE) {
+    	length = MAXLINE - 1;
+    }
     
     p=fgets(data,length+1,stdin);
     if(p==NULL)
@@ -22,6 +26,11 @@ int main(void) {
     printf("Content-type: text/html\r\n\r\n");
     printf("%s", content);
     fflush(stdout);
-    exit(0);
+    return 0;
 
 }
+
+/* a plain CGI, or a persistent worker when started by a pool */
+int main(void) {
+    return cgi_worker_main(auth);
+}
@@ -0,0 +1,403 @@
+#include "wrap.h"
+#include "parse.h"
+#include <stdint.h>
+
+/*
+ *  Shared cache of CGI GET responses
+ *      a response is stored when the program allows it: status 200, no
+ *      Set-Cookie, and a lifetime from Cache-Control s-maxage / max-age or
+ *      Expires (no-store, no-cache and private are never stored); without
+ *      any of those cgi_cache_ttl applies, 0 -> not stored. The key is the
+ *      program, the query string and the request headers named in
+ *      cgi_cache_vary; a response that varies on other headers is not
+ *      stored, and requests with Cookie or Authorization (unless listed)
+ *      bypass the cache.
+ *
+ *      All processes share one MAP_SHARED region of cgi_cache_size KB made
+ *      by cgicache_init() before the listener forks:
+ *
+ *      - an arena written as a ring: records (key + raw CGI output) are
+ *        appended at write_pos, a byte counter that never wraps; arena
+ *        offset = pos % arena size, a record that does not fit before the
+ *        end starts over at offset 0. A record is still intact while
+ *        write_pos <= its pos + arena size, so the oldest records are
+ *        evicted just by writing over them
+ *      - an index of slots, CACHE_WAYS per set, replacing the empty,
+ *        expired or overwritten slot first and the oldest otherwise
+ *
+ *      A robust process-shared mutex guards both; a record is indexed only
+ *      after it is copied, so a process killed meanwhile loses nothing.
+ */
+
+#define CACHE_WAYS      4
+#define CACHE_VARY_MAX  8
+#define CACHE_KEY_MAX   (MAXLINE * 3)
+
+struct cache_slot {
+    uint64_t hash;                  /* 0 -> empty */
+    uint64_t pos;                   /* record start in the write stream */
+    uint32_t key_len;
+    uint32_t len;                   /* key + response */
+    time_t   stored;
+    time_t   expires;
+};
+
+struct cache_shared {
+    pthread_mutex_t lock;
+    uint64_t write_pos;
+    size_t   arena_size;
+    char    *arena;
+    long     set_count;
+    struct cache_slot slots[];
+};
+
+static struct cache_shared *shared = NULL;
+static size_t entry_max = 0;
+static long   default_ttl = 0;
+
+// request headers that are part of the key, from cgi_cache_vary
+static char vary_names[CACHE_VARY_MAX][64];
+static int  vary_count = 0;
+
+// the request being read: its vary headers, and whether the cache is used
+static char vary_key[CACHE_KEY_MAX];
+static int  vary_len = 0;
+static int  bypass_lookup = 0;      /* no-cache from the client */
+static int  uncacheable = 0;        /* private credentials */
+
+static char *capture_buf = NULL;
+
+static void lock_shared(void) {
+    if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+        // the holder died before indexing its record, nothing is torn
+        pthread_mutex_consistent(&shared->lock);
+    }
+}
+
+static void unlock_shared(void) {
+    pthread_mutex_unlock(&shared->lock);
+}
+
+void cgicache_init(void) {
+    long size_kb = Getconfig_int("cgi_cache_size", 0);
+    if (size_kb <= 0) {
+        return;
+    }
+    default_ttl = Getconfig_int("cgi_cache_ttl", 0);
+    entry_max = (size_t)Getconfig_int("cgi_cache_entry_max", 256) << 10;
+
+    char names[MAXLINE];
+    snprintf(names, sizeof(names), "%s", Getconfig_default("cgi_cache_vary", ""));
+    for (char *p = strtok(names, ", \t"); p && vary_count < CACHE_VARY_MAX;
+         p = strtok(NULL, ", \t")) {
+        snprintf(vary_names[vary_count++], sizeof(vary_names[0]), "%s", p);
+    }
+
+    // about one index slot per 4 KB of responses
+    size_t bytes = (size_t)size_kb << 10;
+    long set_count = bytes / (4096 * CACHE_WAYS);
+    if (set_count < 1) {
+        set_count = 1;
+    }
+    size_t index = sizeof(struct cache_shared) +
+                   set_count * CACHE_WAYS * sizeof(struct cache_slot);
+    if (bytes < index + 2 * MAXBUF) {
+        bytes = index + 2 * MAXBUF;
+    }
+    // the budget wins over the entry limit, at least two entries must fit
+    if (entry_max > (bytes - index) / 2) {
+        entry_max = (bytes - index) / 2;
+    }
+
+    shared = Mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memset(shared, 0, index);
+    shared->set_count = set_count;
+    shared->arena = (char *)shared + index;
+    shared->arena_size = bytes - index;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static int vary_index(const char *name, size_t len) {
+    for (int i = 0; i < vary_count; ++i) {
+        if (strlen(vary_names[i]) == len &&
+            strncasecmp(vary_names[i], name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void cgicache_request_begin(void) {
+    vary_len = 0;
+    bypass_lookup = 0;
+    uncacheable = 0;
+}
+
+/*
+ * see one request header line ("Name: value\r\n")
+ */
+void cgicache_request_header(const char *line) {
+    if (shared == NULL) {
+        return;
+    }
+    const char *colon = strchr(line, ':');
+    if (colon == NULL) {
+        return;
+    }
+    size_t name_len = colon - line;
+    const char *value = colon + 1 + strspn(colon + 1, " \t");
+    int value_len = strcspn(value, "\r\n");
+
+    if (vary_index(line, name_len) >= 0) {
+        int n = snprintf(vary_key + vary_len, sizeof(vary_key) - vary_len,
+                         "%.*s:%.*s\n", (int)name_len, line, value_len, value);
+        if (n < 0 || n >= (int)sizeof(vary_key) - vary_len) {
+            uncacheable = 1;
+        }
+        else {
+            vary_len += n;
+        }
+        return;
+    }
+    if ((name_len == 13 && strncasecmp(line, "Authorization", 13) == 0) ||
+        (name_len == 6 && strncasecmp(line, "Cookie", 6) == 0)) {
+        uncacheable = 1;
+    }
+    else if ((name_len == 13 && strncasecmp(line, "Cache-Control", 13) == 0) ||
+             (name_len == 6 && strncasecmp(line, "Pragma", 6) == 0)) {
+        char directives[MAXLINE];
+        snprintf(directives, sizeof(directives), "%.*s", value_len, value);
+        if (strcasestr(directives, "no-cache")) {
+            bypass_lookup = 1;
+        }
+    }
+}
+
+static size_t make_key(char *key, const char *program, const char *query) {
+    int n = snprintf(key, CACHE_KEY_MAX, "%s\n%s\n%.*s",
+                     program, query, vary_len, vary_key);
+    return n < CACHE_KEY_MAX ? (size_t)n : 0;
+}
+
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t h = 14695981039346656037ULL;          /* FNV-1a */
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+/*
+ * called with the lock held
+ */
+static int slot_live(const struct cache_slot *slot, time_t now) {
+    return slot->hash != 0 && slot->expires > now &&
+           shared->write_pos <= slot->pos + shared->arena_size;
+}
+
+int cgicache_lookup(const char *program, const char *query,
+                    char **data, size_t *len, long *age) {
+    if (shared == NULL || uncacheable || bypass_lookup) {
+        return 0;
+    }
+    char key[CACHE_KEY_MAX];
+    size_t key_len = make_key(key, program, query);
+    if (key_len == 0) {
+        return 0;
+    }
+    uint64_t hash = hash_key(key, key_len);
+    struct cache_slot *set = &shared->slots[(hash % shared->set_count) *
+                                            CACHE_WAYS];
+    time_t now = time(NULL);
+    int hit = 0;
+
+    lock_shared();
+    for (int i = 0; i < CACHE_WAYS; ++i) {
+        struct cache_slot *slot = &set[i];
+        if (slot->hash != hash || slot->key_len != key_len ||
+            !slot_live(slot, now)) {
+            continue;
+        }
+        const char *record = shared->arena + slot->pos % shared->arena_size;
+        if (memcmp(record, key, key_len) != 0) {
+            continue;
+        }
+        *len = slot->len - key_len;
+        *data = malloc(*len ? *len : 1);
+        if (*data) {
+            memcpy(*data, record + key_len, *len);
+            *age = now - slot->stored;
+            hit = 1;
+        }
+        break;
+    }
+    unlock_shared();
+    return hit;
+}
+
+char *cgicache_capture(size_t *max) {
+    if (shared == NULL || uncacheable) {
+        return NULL;
+    }
+    if (capture_buf == NULL && (capture_buf = malloc(entry_max)) == NULL) {
+        return NULL;
+    }
+    *max = entry_max;
+    return capture_buf;
+}
+
+/*
+ * seconds the response may be cached, from the CGI header block; sets
+ * *head_len to its size and *length to its Content-Length (-1 -> none)
+ */
+static long response_ttl(const char *data, size_t len, size_t *head_len,
+                         long *length) {
+    long ttl = default_ttl;
+    long max_age = -1, s_maxage = -1;
+    time_t expires = 0;
+    int has_expires = 0;
+    *length = -1;
+
+    const char *p = data, *end = data + len;
+    while (1) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            return 0;               /* no complete header block */
+        }
+        int line_len = nl - p;
+        if (line_len > 0 && p[line_len - 1] == '\r') {
+            --line_len;
+        }
+        if (line_len == 0) {
+            *head_len = nl + 1 - data;
+            break;
+        }
+
+        char line[MAXLINE];
+        snprintf(line, sizeof(line), "%.*s", line_len, p);
+        p = nl + 1;
+        char *value = strchr(line, ':');
+        if (value == NULL) {
+            return 0;
+        }
+        *value++ = '\0';
+        value += strspn(value, " \t");
+
+        if (strcasecmp(line, "Status") == 0) {
+            if (atoi(value) != 200) return 0;
+        }
+        else if (strcasecmp(line, "Set-Cookie") == 0) {
+            return 0;
+        }
+        else if (strcasecmp(line, "Content-Length") == 0) {
+            *length = atol(value);
+        }
+        else if (strcasecmp(line, "Vary") == 0) {
+            for (char *v = strtok(value, ", \t"); v; v = strtok(NULL, ", \t")) {
+                if (strcmp(v, "*") == 0 || vary_index(v, strlen(v)) < 0) {
+                    return 0;
+                }
+            }
+        }
+        else if (strcasecmp(line, "Cache-Control") == 0) {
+            for (char *v = strtok(value, ", \t"); v; v = strtok(NULL, ", \t")) {
+                if (strcasecmp(v, "no-store") == 0 ||
+                    strcasecmp(v, "no-cache") == 0 ||
+                    strcasecmp(v, "private") == 0) {
+                    return 0;
+                }
+                if (strncasecmp(v, "s-maxage=", 9) == 0) s_maxage = atol(v + 9);
+                if (strncasecmp(v, "max-age=", 8) == 0)  max_age = atol(v + 8);
+            }
+        }
+        else if (strcasecmp(line, "Expires") == 0) {
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            has_expires = 1;
+            if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+                expires = timegm(&tm);
+            }
+        }
+    }
+
+    if (s_maxage >= 0)    ttl = s_maxage;
+    else if (max_age >= 0) ttl = max_age;
+    else if (has_expires)  ttl = expires - time(NULL);  /* bad date -> past */
+    return ttl;
+}
+
+void cgicache_store(const char *program, const char *query,
+                    const char *data, size_t len, int at_eof) {
+    if (shared == NULL || uncacheable || data == NULL) {
+        return;
+    }
+    size_t head_len;
+    long length;
+    long ttl = response_ttl(data, len, &head_len, &length);
+    if (ttl <= 0) {
+        return;
+    }
+    // the whole response: Content-Length bytes of body, or all up to EOF
+    if (length >= 0) {
+        if (len - head_len < (size_t)length) {
+            return;
+        }
+        len = head_len + length;
+    }
+    else if (!at_eof) {
+        return;
+    }
+
+    char key[CACHE_KEY_MAX];
+    size_t key_len = make_key(key, program, query);
+    size_t total = key_len + len;
+    if (key_len == 0 || total > shared->arena_size / 2) {
+        return;
+    }
+    uint64_t hash = hash_key(key, key_len);
+    struct cache_slot *set = &shared->slots[(hash % shared->set_count) *
+                                            CACHE_WAYS];
+    time_t now = time(NULL);
+
+    lock_shared();
+    struct cache_slot *victim = &set[0];
+    for (int i = 0; i < CACHE_WAYS; ++i) {
+        struct cache_slot *slot = &set[i];
+        if (slot->hash == hash && slot->key_len == key_len) {
+            victim = slot;          /* a fresher copy of the same key */
+            break;
+        }
+        if (!slot_live(slot, now)) {
+            victim = slot;
+        }
+        else if (slot_live(victim, now) && slot->pos < victim->pos) {
+            victim = slot;
+        }
+    }
+    victim->hash = 0;
+
+    uint64_t pos = shared->write_pos;
+    if (pos % shared->arena_size + total > shared->arena_size) {
+        pos += shared->arena_size - pos % shared->arena_size;
+    }
+    shared->write_pos = pos + total;
+    char *record = shared->arena + pos % shared->arena_size;
+    memcpy(record, key, key_len);
+    memcpy(record + key_len, data, len);
+
+    victim->pos = pos;
+    victim->key_len = key_len;
+    victim->len = total;
+    victim->stored = now;
+    victim->expires = now + ttl;
+    victim->hash = hash;
+    unlock_shared();
+}
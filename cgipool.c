@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "cgipool.h"
+
+/*
+ *  Per-process CGI worker pool (protocol in cgipool.h)
+ *      a serving process handles one request at a time, so it keeps at most
+ *      one worker per cgi-bin program, started on the first request for it.
+ *      A worker that quits (CGI_LAST, after its request limit), dies, or
+ *      misses the timeout is dropped and the next request starts a new one.
+ *      Programs that never say READY are remembered and spawned per request.
+ */
+
+#define POOL_SLOTS  16
+#define READY_WAIT  2           /* seconds a new worker has to say READY */
+
+struct cgi_worker {
+    char  *program;             /* NULL -> free slot */
+    pid_t  pid;
+    int    fd;                  /* -1 -> not running */
+    int    classic;             /* not a worker program, always spawn it */
+    long   used;                /* LRU tick */
+};
+
+static struct cgi_worker pool[POOL_SLOTS];
+static long     worker_requests = 0;
+static int      worker_timeout = 30;
+static long     tick = 0;
+static uint32_t next_id = 0;
+
+void cgipool_init(long requests_per_worker, int timeout) {
+    worker_requests = requests_per_worker;
+    worker_timeout = timeout > 0 ? timeout : 30;
+    for (int i = 0; i < POOL_SLOTS; ++i) {
+        pool[i].fd = -1;
+    }
+}
+
+static void set_timeout(int fd, int seconds) {
+    struct timeval tv = { seconds, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * stop using a worker, closing the socket makes an idle one exit
+ */
+static void retire(struct cgi_worker *w, int kill_it) {
+    if (w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    if (kill_it && w->pid > 0) {
+        kill(w->pid, SIGKILL);
+    }
+    w->pid = -1;
+}
+
+pid_t cgi_spawn(const char *program, char *const envp[],
+                int in_fd, int out_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    if (in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                    POSIX_SPAWN_SETSIGDEF |
+                                    POSIX_SPAWN_SETPGROUP);
+
+    char *argv[] = { (char *)program, NULL };
+    pid_t pid;
+    int err = posix_spawn(&pid, program, &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+extern char **environ;
+
+static int spawn(struct cgi_worker *w) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        return -1;
+    }
+
+    // the server's environment plus the request limit
+    size_t count = 0;
+    while (environ[count]) {
+        ++count;
+    }
+    char **envp = malloc((count + 2) * sizeof(char *));
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (envp == NULL || null_fd < 0) {
+        free(envp);
+        if (null_fd >= 0) {
+            close(null_fd);
+        }
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    char requests[64];
+    snprintf(requests, sizeof(requests), "CGI_WORKER_REQUESTS=%ld",
+             worker_requests);
+    memcpy(envp, environ, count * sizeof(char *));
+    envp[count] = requests;
+    envp[count + 1] = NULL;
+
+    // the socket is stdin, nothing of the server leaks into the worker
+    pid_t pid = cgi_spawn(w->program, envp, sv[1], null_fd);
+    free(envp);
+    close(null_fd);
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return -1;
+    }
+
+    set_timeout(sv[0], READY_WAIT);
+    struct cgi_frame frame;
+    if (cgi_read_full(sv[0], &frame, sizeof(frame)) < 0 ||
+        frame.type != CGI_READY) {
+        // a classic CGI reads the socket as its stdin and never answers
+        syslog(LOG_INFO, "%s is not a CGI worker, spawning it per request",
+               w->program);
+        close(sv[0]);
+        kill(pid, SIGKILL);
+        w->classic = 1;
+        return -1;
+    }
+    set_timeout(sv[0], worker_timeout);
+
+    w->pid = pid;
+    w->fd = sv[0];
+    return 0;
+}
+
+static struct cgi_worker *find_worker(const char *program) {
+    struct cgi_worker *victim = &pool[0];
+    for (int i = 0; i < POOL_SLOTS; ++i) {
+        struct cgi_worker *w = &pool[i];
+        if (w->program && strcmp(w->program, program) == 0) {
+            return w;
+        }
+        if (victim->program && (w->program == NULL || w->used < victim->used)) {
+            victim = w;
+        }
+    }
+
+    retire(victim, 0);
+    free(victim->program);
+    victim->program = strdup(program);
+    victim->classic = 0;
+    return victim->program ? victim : NULL;
+}
+
+static int send_stdin(int fd, uint32_t id, const char *body, size_t len) {
+    while (len > 0) {
+        size_t n = len < CGI_FRAME_MAX ? len : CGI_FRAME_MAX;
+        if (cgi_write_frame(fd, id, CGI_STDIN, 0, body, n) < 0) {
+            return -1;
+        }
+        body += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * send the BEGIN frame and, unless the caller streams it, the whole body
+ */
+static int send_request(struct cgi_worker *w, uint32_t id,
+                        char *const params[], const char *body, size_t len,
+                        int streamed) {
+    char env[CGI_FRAME_MAX];
+    size_t used = 0;
+    for (int i = 0; params && params[i]; ++i) {
+        size_t n = strlen(params[i]) + 1;
+        if (used + n > sizeof(env)) {
+            break;
+        }
+        memcpy(env + used, params[i], n);
+        used += n;
+    }
+    if (cgi_write_frame(w->fd, id, CGI_BEGIN, 0, env, used) < 0) {
+        return -1;
+    }
+
+    if (streamed) {
+        return 0;
+    }
+    if (send_stdin(w->fd, id, body, len) < 0) {
+        return -1;
+    }
+    return cgi_write_frame(w->fd, id, CGI_STDIN, 0, NULL, 0);
+}
+
+int cgipool_enabled(const char *program) {
+    if (worker_requests <= 0) {
+        return 0;
+    }
+    for (int i = 0; i < POOL_SLOTS; ++i) {
+        if (pool[i].program && strcmp(pool[i].program, program) == 0) {
+            return !pool[i].classic;
+        }
+    }
+    return 1;
+}
+
+static int begin_request(const char *program, char *const params[],
+                         const char *body, size_t len, int streamed,
+                         struct cgi_stream *s) {
+    if (worker_requests <= 0) {
+        return -1;
+    }
+    struct cgi_worker *w = find_worker(program);
+    if (w == NULL || w->classic) {
+        return -1;
+    }
+    w->used = ++tick;
+
+    uint32_t id = ++next_id;
+    // a worker that went away since the last request costs one retry
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (w->fd < 0 && spawn(w) < 0) {
+            return -1;
+        }
+        if (send_request(w, id, params, body, len, streamed) == 0) {
+            memset(s, 0, offsetof(struct cgi_stream, buf));
+            s->fd = w->fd;
+            s->worker = w;
+            s->id = id;
+            s->stdin_open = streamed;
+            return 0;
+        }
+        retire(w, 1);
+    }
+    return -1;
+}
+
+int cgipool_begin(const char *program, char *const params[],
+                  const char *body, size_t len, struct cgi_stream *s) {
+    return begin_request(program, params, body, len, 0, s);
+}
+
+int cgipool_open(const char *program, char *const params[],
+                 struct cgi_stream *s) {
+    // only the start is retried, a body already sent cannot be sent again
+    return begin_request(program, params, NULL, 0, 1, s);
+}
+
+int cgipool_write(struct cgi_stream *s, const void *data, size_t n) {
+    if (!s->stdin_open) {
+        return -1;
+    }
+    int ret = n > 0 ? send_stdin(s->fd, s->id, data, n)
+                    : cgi_write_frame(s->fd, s->id, CGI_STDIN, 0, NULL, 0);
+    if (ret < 0) {
+        syslog(LOG_WARNING, "CGI worker %s failed, dropping it",
+               s->worker->program);
+        retire(s->worker, 1);
+        s->done = 1;
+    }
+    if (ret < 0 || n == 0) {
+        s->stdin_open = 0;
+    }
+    return ret;
+}
+
+void cgi_stream_pipe(struct cgi_stream *s, int fd) {
+    memset(s, 0, offsetof(struct cgi_stream, buf));
+    s->fd = fd;
+}
+
+void cgi_stream_memory(struct cgi_stream *s, char *data, size_t len) {
+    memset(s, 0, offsetof(struct cgi_stream, buf));
+    s->fd = -1;
+    s->ptr = data;
+    s->cnt = len;
+    s->done = 1;
+}
+
+void cgi_stream_capture(struct cgi_stream *s, char *buf, size_t max) {
+    s->capture = buf;
+    s->capture_len = 0;
+    s->capture_max = max;
+    s->capture_overflow = 0;
+}
+
+static int skip(int fd, uint32_t n) {
+    char buf[512];
+    while (n > 0) {
+        uint32_t len = n < sizeof(buf) ? n : sizeof(buf);
+        if (cgi_read_full(fd, buf, len) < 0) {
+            return -1;
+        }
+        n -= len;
+    }
+    return 0;
+}
+
+/*
+ * read the next frame header of our request, skipping anything else;
+ * 0 at the end of the output, -1 if the worker is unusable
+ */
+static int next_frame(struct cgi_stream *s) {
+    struct cgi_frame frame;
+    while (s->frame_left == 0) {
+        if (cgi_read_full(s->fd, &frame, sizeof(frame)) < 0) {
+            return -1;
+        }
+
+        if (frame.id == s->id && frame.type == CGI_STDOUT) {
+            s->frame_left = frame.length;
+            continue;
+        }
+        if (frame.id == s->id && frame.type == CGI_END) {
+            int32_t status = 0;
+            if (frame.length >= sizeof(status)) {
+                if (cgi_read_full(s->fd, &status, sizeof(status)) < 0) {
+                    return -1;
+                }
+                frame.length -= sizeof(status);
+            }
+            if (skip(s->fd, frame.length) < 0) {
+                return -1;
+            }
+            s->status = status;
+            s->done = 1;
+            if (frame.flags & CGI_LAST) {
+                retire(s->worker, 0);
+            }
+            return 0;
+        }
+
+        // leftovers of a request we gave up on
+        if (skip(s->fd, frame.length) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+static ssize_t fill(struct cgi_stream *s) {
+    if (s->done) {
+        return 0;
+    }
+
+    size_t want = sizeof(s->buf);
+    if (s->worker) {
+        int ret = next_frame(s);
+        if (ret <= 0) {
+            if (ret < 0) {
+                syslog(LOG_WARNING, "CGI worker %s failed, dropping it",
+                       s->worker->program);
+                retire(s->worker, 1);
+                s->done = 1;
+            }
+            return ret;
+        }
+        if (want > s->frame_left) {
+            want = s->frame_left;
+        }
+    }
+
+    ssize_t n;
+    do {
+        n = read(s->fd, s->buf, want);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        if (s->worker) {
+            retire(s->worker, 1);
+        }
+        s->done = 1;
+        return n;
+    }
+    if (s->worker) {
+        s->frame_left -= n;
+    }
+    s->ptr = s->buf;
+    s->cnt = n;
+    if (s->capture) {
+        if (s->capture_len + n <= s->capture_max) {
+            memcpy(s->capture + s->capture_len, s->buf, n);
+            s->capture_len += n;
+        }
+        else {
+            s->capture_overflow = 1;
+        }
+    }
+    return n;
+}
+
+/*
+ * read up to n bytes of output, returning what is there without waiting
+ * for more; 0 at the end
+ */
+ssize_t cgi_stream_read(struct cgi_stream *s, void *buf, size_t n) {
+    if (s->cnt == 0) {
+        ssize_t ret = fill(s);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+    if (n > s->cnt) {
+        n = s->cnt;
+    }
+    memcpy(buf, s->ptr, n);
+    s->ptr += n;
+    s->cnt -= n;
+    return n;
+}
+
+ssize_t cgi_stream_readline(struct cgi_stream *s, char *buf, size_t maxlen) {
+    size_t n = 0;
+    while (n + 1 < maxlen) {
+        if (s->cnt == 0 && fill(s) <= 0) {
+            break;
+        }
+        char c = *s->ptr++;
+        --s->cnt;
+        buf[n++] = c;
+        if (c == '\n') {
+            break;
+        }
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+void cgipool_end(struct cgi_stream *s) {
+    if (s->worker == NULL) {
+        return;
+    }
+    // it would wait for the rest of the body forever
+    if (s->stdin_open) {
+        s->stdin_open = 0;
+        s->done = 1;
+        retire(s->worker, 1);
+        return;
+    }
+    // the caller may stop early (a short Content-Length), the output left
+    // must not be taken for the next request's
+    s->cnt = 0;
+    while (!s->done) {
+        if (skip(s->fd, s->frame_left) < 0) {
+            s->done = 1;
+            retire(s->worker, 1);
+            return;
+        }
+        s->frame_left = 0;
+        if (next_frame(s) < 0) {
+            s->done = 1;
+            retire(s->worker, 1);
+        }
+    }
+}
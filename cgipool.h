@@ -0,0 +1,193 @@
+#ifndef _CGIPOOL_H
+#define _CGIPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *  Persistent CGI workers, shared by twebs, the ss cgi server and the
+ *  cgi-bin programs.
+ *
+ *  A worker is a cgi-bin program started with the connected end of a unix
+ *  socketpair as fd 0 and CGI_WORKER_REQUESTS=<n> in its environment. It
+ *  announces itself with a READY frame and then answers requests until it
+ *  has served n of them (0 -> no limit) or the socket is closed.
+ *
+ *  Every frame is a struct cgi_frame followed by length payload bytes:
+ *
+ *      READY   worker -> server  once at startup, id 0
+ *      BEGIN   server -> worker  "NAME=value\0" environment strings
+ *      STDIN   server -> worker  request body, an empty frame ends it
+ *      STDOUT  worker -> server  CGI output, an empty frame ends it
+ *      END     worker -> server  int32 exit status, CGI_LAST when the worker
+ *                                exits after this request
+ *
+ *  Frames of different requests may interleave on one socket, the id tells
+ *  them apart; a worker runs a request once its body is complete. A program
+ *  that does not send READY is treated as a classic CGI and spawned per
+ *  request. All fields are host byte order, the socket never leaves the host.
+ */
+
+#define CGI_LAST        0x01
+#define CGI_FRAME_MAX   65536       /* largest payload the sender produces */
+
+enum cgi_frame_type {
+    CGI_READY = 1, CGI_BEGIN, CGI_STDIN, CGI_STDOUT, CGI_END
+};
+
+struct cgi_frame {
+    uint32_t id;
+    uint8_t  type;
+    uint8_t  flags;
+    uint16_t reserved;
+    uint32_t length;
+};
+
+/*
+ * the output of one CGI request, read the same way from a worker socket or
+ * from the pipe of a spawned program
+ */
+struct cgi_worker;
+
+struct cgi_stream {
+    int                fd;
+    struct cgi_worker *worker;      /* NULL: fd is a pipe */
+    uint32_t           id;
+    uint32_t           frame_left;  /* STDOUT payload not read yet */
+    int                done;
+    int                stdin_open;  /* streamed body not ended yet */
+    int                status;      /* exit status from END */
+    size_t             cnt;         /* unread bytes in buf */
+    char              *ptr;
+    char              *capture;     /* copy of everything read, or NULL */
+    size_t             capture_len;
+    size_t             capture_max;
+    int                capture_overflow;
+    char               buf[8192];
+};
+
+/* server side (cgipool.c) */
+
+/* requests per worker before it is replaced, 0 -> always spawn */
+void cgipool_init(long requests_per_worker, int timeout);
+
+/* whether program may run in a worker, the others are always spawned */
+int  cgipool_enabled(const char *program);
+
+/*
+ * send a request to the worker running program, starting it if needed;
+ * return -1 if the program has to be spawned instead
+ */
+int  cgipool_begin(const char *program, char *const params[],
+                   const char *body, size_t len, struct cgi_stream *s);
+
+/*
+ * like cgipool_begin, but the body is sent afterwards with cgipool_write as
+ * it arrives, so it is never held in memory whole
+ */
+int  cgipool_open(const char *program, char *const params[],
+                  struct cgi_stream *s);
+
+/*
+ * send n bytes of the body of an opened request, n == 0 ends it;
+ * -1 if the worker went away, it is dropped and the output is empty
+ */
+int  cgipool_write(struct cgi_stream *s, const void *data, size_t n);
+
+/*
+ * finish a request: read what is left and retire the worker if it quit;
+ * a worker still waiting for the rest of a streamed body is killed
+ */
+void cgipool_end(struct cgi_stream *s);
+
+void    cgi_stream_pipe(struct cgi_stream *s, int fd);
+ssize_t cgi_stream_read(struct cgi_stream *s, void *buf, size_t n);
+ssize_t cgi_stream_readline(struct cgi_stream *s, char *buf, size_t maxlen);
+
+/* read output kept in memory (a cached response) instead of a program's */
+void    cgi_stream_memory(struct cgi_stream *s, char *data, size_t len);
+
+/*
+ * also copy the output read from now on into buf, up to max bytes;
+ * capture_overflow is set when it did not fit
+ */
+void    cgi_stream_capture(struct cgi_stream *s, char *buf, size_t max);
+
+/*
+ * start program with posix_spawn, which does not copy the caller's page
+ * tables: in_fd and out_fd (-1 -> inherit) become stdin and stdout, all other
+ * descriptors are closed, SIGPIPE is reset and the program leads its own
+ * process group; envp is the complete environment.
+ *     return the pid, or -1 with errno set, also when the exec failed
+ */
+pid_t cgi_spawn(const char *program, char *const envp[], int in_fd, int out_fd);
+
+/* worker side (cgi-bin/cgi_worker.c) */
+
+/*
+ * run handler once as a classic CGI, or as a worker when started by a pool;
+ * handler reads stdin, writes stdout and must return instead of exit()
+ */
+int cgi_worker_main(int (*handler)(void));
+
+/* frame I/O used by both sides */
+
+static inline int cgi_read_full(int fd, void *buf, size_t n) {
+    char *p = (char *)buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static inline int cgi_write_full(int fd, const void *buf, size_t n) {
+    const char *p = (const char *)buf;
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static inline int cgi_write_frame(int fd, uint32_t id, int type, int flags,
+                                  const void *data, uint32_t len) {
+    struct cgi_frame frame;
+    frame.id = id;
+    frame.type = type;
+    frame.flags = flags;
+    frame.reserved = 0;
+    frame.length = len;
+    if (cgi_write_full(fd, &frame, sizeof(frame)) < 0) {
+        return -1;
+    }
+    return len ? cgi_write_full(fd, data, len) : 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
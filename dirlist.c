@@ -0,0 +1,587 @@
+#include "wrap.h"
+#include "parse.h"
+#include <stdarg.h>
+
+/*
+ *  Directory listings
+ *      a directory is read once (readdir + fstatat, no path building) into an
+ *      array of entries kept per process and reused while the directory's
+ *      mtime and inode stay the same and it is younger than dir_cache_ttl
+ *      seconds. Sorting and pagination work on that array, so only the
+ *      requested page is rendered.
+ *
+ *      Rendered pages up to dir_cache_max bytes are cached too, keyed by the
+ *      directory and the normalized query. A page that grows past that limit
+ *      is streamed in DIR_FLUSH sized writes instead, without Content-Length:
+ *      as chunks to HTTP/1.1 clients, otherwise ended by closing the connection.
+ *
+ *      query: sort=name|size|mtime  order=asc|desc  page=N  per=N (0 -> all)
+ *             format=html|json
+ */
+
+#define DIR_FLUSH   16384
+#define SCAN_SLOTS  16
+#define PAGE_SLOTS  32
+#define UID_SLOTS   64      /* power of 2 */
+#define PER_MAX     10000
+
+enum { SORT_NAME = 0, SORT_SIZE, SORT_MTIME };
+
+struct dir_entry {
+    char  *name;
+    mode_t mode;
+    off_t  size;
+    time_t mtime;
+    uid_t  uid;
+};
+
+struct dir_scan {
+    char   path[MAXLINE];
+    dev_t  dev;
+    ino_t  ino;
+    struct timespec mtim;
+    time_t scanned;
+    unsigned long used;         /* lru tick, 0 -> free slot */
+    struct dir_entry *entries;
+    int    count;
+    int    sort;                /* current order of entries */
+    int    desc;
+};
+
+struct dir_page {
+    char   key[MAXLINE];
+    dev_t  dev;
+    ino_t  ino;
+    struct timespec mtim;
+    time_t rendered;
+    unsigned long used;
+    char  *body;
+    size_t len;
+};
+
+struct dir_query {
+    int sort;
+    int desc;
+    int page;                   /* 1 based */
+    int per;
+    int json;
+};
+
+struct dir_out {
+    int    fd;
+    int    json;
+    int    streaming;           /* header sent without Content-Length */
+    int    chunked;             /* client accepts Transfer-Encoding: chunked */
+    int   *keep_alive;          /* connection persists after the response */
+    size_t limit;               /* start streaming past this many bytes */
+    size_t sent;
+    char  *data;
+    size_t len;
+    size_t cap;
+};
+
+struct uid_name {
+    int   used;
+    uid_t uid;
+    char  name[32];
+};
+
+static struct dir_scan scans[SCAN_SLOTS];
+static struct dir_page pages[PAGE_SLOTS];
+static struct uid_name uid_names[UID_SLOTS];
+static int uid_count = 0;
+static unsigned long tick = 0;
+
+static const char *owner_of(uid_t uid) {
+    unsigned int i = uid & (UID_SLOTS - 1);
+    while (uid_names[i].used) {
+        if (uid_names[i].uid == uid) {
+            return uid_names[i].name;
+        }
+        i = (i + 1) & (UID_SLOTS - 1);
+    }
+
+    if (uid_count >= UID_SLOTS / 2) {
+        memset(uid_names, 0, sizeof(uid_names));
+        uid_count = 0;
+        i = uid & (UID_SLOTS - 1);
+    }
+
+    struct passwd *pw = getpwuid(uid);
+    uid_names[i].used = 1;
+    uid_names[i].uid = uid;
+    if (pw) {
+        snprintf(uid_names[i].name, sizeof(uid_names[i].name), "%s", pw->pw_name);
+    }
+    else {
+        snprintf(uid_names[i].name, sizeof(uid_names[i].name), "%u", (unsigned)uid);
+    }
+    ++uid_count;
+    return uid_names[i].name;
+}
+
+static int same_version(dev_t dev, ino_t ino, struct timespec mtim,
+                        const struct stat *st) {
+    return dev == st->st_dev && ino == st->st_ino &&
+           mtim.tv_sec == st->st_mtim.tv_sec &&
+           mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void free_scan(struct dir_scan *scan) {
+    for (int i = 0; i < scan->count; ++i) {
+        free(scan->entries[i].name);
+    }
+    free(scan->entries);
+    memset(scan, 0, sizeof(*scan));
+}
+
+/* ---- reading and sorting ---- */
+
+static int read_dir(struct dir_scan *scan, const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        syslog(LOG_ERR, "cannot open dir:%s", path);
+        return -1;
+    }
+
+    int dfd = dirfd(dir);
+    int cap = 0;
+    struct dirent *dirent_ptr;
+    while ((dirent_ptr = readdir(dir)) != NULL) {
+        if (strcmp(dirent_ptr->d_name, ".") == 0 ||
+            strcmp(dirent_ptr->d_name, "..") == 0) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dfd, dirent_ptr->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+
+        if (scan->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct dir_entry *entries =
+                realloc(scan->entries, cap * sizeof(*entries));
+            if (entries == NULL) {
+                break;
+            }
+            scan->entries = entries;
+        }
+
+        struct dir_entry *entry = &scan->entries[scan->count];
+        if ((entry->name = strdup(dirent_ptr->d_name)) == NULL) {
+            break;
+        }
+        entry->mode  = st.st_mode;
+        entry->size  = st.st_size;
+        entry->mtime = st.st_mtime;
+        entry->uid   = st.st_uid;
+        ++scan->count;
+    }
+    closedir(dir);
+
+    scan->sort = -1;
+    return 0;
+}
+
+static struct dir_scan *get_scan(const char *path, const struct stat *st,
+                                 long ttl) {
+    time_t now = time(NULL);
+    struct dir_scan *victim = &scans[0];
+    for (int i = 0; i < SCAN_SLOTS; ++i) {
+        struct dir_scan *scan = &scans[i];
+        if (scan->used && strcmp(scan->path, path) == 0) {
+            if (same_version(scan->dev, scan->ino, scan->mtim, st) &&
+                now - scan->scanned < ttl) {
+                scan->used = ++tick;
+                return scan;
+            }
+            victim = scan;
+            break;
+        }
+        if (scan->used < victim->used) {
+            victim = scan;
+        }
+    }
+
+    free_scan(victim);
+    if (read_dir(victim, path) < 0) {
+        free_scan(victim);
+        return NULL;
+    }
+    snprintf(victim->path, sizeof(victim->path), "%s", path);
+    victim->dev = st->st_dev;
+    victim->ino = st->st_ino;
+    victim->mtim = st->st_mtim;
+    victim->scanned = now;
+    victim->used = ++tick;
+    return victim;
+}
+
+static int sort_key;
+static int sort_desc;
+
+static int compare_entry(const void *a, const void *b) {
+    const struct dir_entry *x = a, *y = b;
+    int r = 0;
+    if (sort_key == SORT_SIZE && x->size != y->size) {
+        r = x->size < y->size ? -1 : 1;
+    }
+    else if (sort_key == SORT_MTIME && x->mtime != y->mtime) {
+        r = x->mtime < y->mtime ? -1 : 1;
+    }
+    else {
+        r = strcmp(x->name, y->name);
+    }
+    return sort_desc ? -r : r;
+}
+
+static void sort_scan(struct dir_scan *scan, int sort, int desc) {
+    if (scan->sort == sort && scan->desc == desc) {
+        return;
+    }
+    sort_key = sort;
+    sort_desc = desc;
+    qsort(scan->entries, scan->count, sizeof(*scan->entries), compare_entry);
+    scan->sort = sort;
+    scan->desc = desc;
+}
+
+/* ---- output ---- */
+
+static void send_header(struct dir_out *out, long length) {
+    char buf[MAXLINE];
+    int n = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Server: Tiny Web Server\r\n");
+    if (length >= 0) {
+        n += snprintf(buf + n, sizeof(buf) - n,
+                      "Content-Length: %ld\r\n", length);
+    }
+    else if (out->chunked) {
+        n += snprintf(buf + n, sizeof(buf) - n,
+                      "Transfer-Encoding: chunked\r\n");
+    }
+    else {
+        *out->keep_alive = 0;
+    }
+    n += snprintf(buf + n, sizeof(buf) - n, "Connection: %s\r\n",
+                  *out->keep_alive ? "keep-alive" : "close");
+    n += snprintf(buf + n, sizeof(buf) - n, "Content-Type: %s\r\n\r\n",
+                  out->json ? "application/json" : "text/html");
+    Rio_writen(out->fd, buf, n);
+}
+
+static void out_flush(struct dir_out *out) {
+    if (out->chunked) {
+        if (out->len == 0) {
+            return;     /* an empty chunk would end the body */
+        }
+        char size[32];
+        sprintf(size, "%lx\r\n", (unsigned long)out->len);
+        Rio_writen(out->fd, size, strlen(size));
+        Rio_writen(out->fd, out->data, out->len);
+        Rio_writen(out->fd, "\r\n", 2);
+        out->sent += out->len;
+        out->len = 0;
+        return;
+    }
+    Rio_writen(out->fd, out->data, out->len);
+    out->sent += out->len;
+    out->len = 0;
+}
+
+static void out_append(struct dir_out *out, const char *data, size_t len) {
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : DIR_FLUSH;
+        while (cap < out->len + len) cap *= 2;
+        char *p = realloc(out->data, cap);
+        if (p == NULL) {
+            return;
+        }
+        out->data = p;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+
+    if (!out->streaming && out->len > out->limit) {
+        // too big to cache, send what we have and go on in chunks
+        out->streaming = 1;
+        send_header(out, -1);
+        out_flush(out);
+    }
+    else if (out->streaming && out->len >= DIR_FLUSH) {
+        out_flush(out);
+    }
+}
+
+static void out_printf(struct dir_out *out, const char *fmt, ...) {
+    char line[MAXLINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    out_append(out, line, len);
+}
+
+static void html_escape(const char *s, char *out, size_t len) {
+    size_t n = 0;
+    for (; *s && n + 7 < len; ++s) {
+        switch (*s) {
+        case '<':  n += sprintf(out + n, "&lt;");   break;
+        case '>':  n += sprintf(out + n, "&gt;");   break;
+        case '&':  n += sprintf(out + n, "&amp;");  break;
+        case '"':  n += sprintf(out + n, "&quot;"); break;
+        default:   out[n++] = *s;
+        }
+    }
+    out[n] = '\0';
+}
+
+static void url_escape(const char *s, char *out, size_t len) {
+    size_t n = 0;
+    for (; *s && n + 4 < len; ++s) {
+        unsigned char c = *s;
+        if (isalnum(c) || strchr("-_.~", c)) {
+            out[n++] = c;
+        }
+        else {
+            n += sprintf(out + n, "%%%02X", c);
+        }
+    }
+    out[n] = '\0';
+}
+
+static void json_escape(const char *s, char *out, size_t len) {
+    size_t n = 0;
+    for (; *s && n + 7 < len; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        }
+        else if (c < 0x20) {
+            n += sprintf(out + n, "\\u%04x", c);
+        }
+        else {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+}
+
+static const char *type_of(mode_t mode) {
+    if (S_ISDIR(mode))  return "dir";
+    if (S_ISFIFO(mode)) return "fifo";
+    if (S_ISLNK(mode))  return "link";
+    if (S_ISSOCK(mode)) return "socket";
+    return "file";
+}
+
+/* ---- rendering ---- */
+
+static const char *sort_names[] = { "name", "size", "mtime" };
+
+static void render_json(struct dir_out *out, struct dir_scan *scan,
+                        const struct dir_query *q, int first, int last) {
+    char name[4 * NAME_MAX + 8];
+    json_escape(strrchr(scan->path, '/') + 1, name, sizeof(name));
+    out_printf(out, "{\"dir\":\"%s\",\"total\":%d,\"page\":%d,\"per\":%d,"
+                    "\"sort\":\"%s\",\"order\":\"%s\",\"entries\":[",
+               name, scan->count, q->page, q->per, sort_names[q->sort],
+               q->desc ? "desc" : "asc");
+
+    for (int i = first; i < last; ++i) {
+        struct dir_entry *entry = &scan->entries[i];
+        json_escape(entry->name, name, sizeof(name));
+        out_printf(out, "%s{\"name\":\"%s\",\"type\":\"%s\",\"size\":%lld,"
+                        "\"mtime\":%lld,\"owner\":\"%s\"}",
+                   i == first ? "" : ",", name, type_of(entry->mode),
+                   (long long)entry->size, (long long)entry->mtime,
+                   owner_of(entry->uid));
+    }
+    out_printf(out, "]}\n");
+}
+
+static void render_html(struct dir_out *out, struct dir_scan *scan,
+                        const struct dir_query *q, int first, int last,
+                        int page_count) {
+    // links are relative to the directory itself
+    char dir_name[4 * NAME_MAX + 8];
+    url_escape(strrchr(scan->path, '/') + 1, dir_name, sizeof(dir_name));
+
+    out_printf(out, "<html><title>Dir Browser</title>"
+                    "<style type=\"text/css\"> a:link{text-decoration:none;} "
+                    "</style><body bgcolor=\"ffffff\" font-family=Arial "
+                    "color=#fff font-size=14px>\r\n");
+    out_printf(out, "<p><pre>   sort by <a href=\"?sort=name\">name</a> "
+                    "<a href=\"?sort=size&order=desc\">size</a> "
+                    "<a href=\"?sort=mtime&order=desc\">time</a>"
+                    "   %d entries</pre></p>\r\n", scan->count);
+
+    for (int i = first; i < last; ++i) {
+        struct dir_entry *entry = &scan->entries[i];
+        char href[3 * NAME_MAX + 8];
+        char name[6 * NAME_MAX + 8];
+        url_escape(entry->name, href, sizeof(href));
+        html_escape(entry->name, name, sizeof(name));
+
+        char modify_time[32];
+        struct tm local;
+        strftime(modify_time, sizeof(modify_time), "%Y/%m/%d %H:%M:%S",
+                 localtime_r(&entry->mtime, &local));
+
+        out_printf(out, "<p><pre>%-2d <img src=\"/%s.png\" width=\"24px\" "
+                        "height=\"24px\"> <a href=\"%s/%s\">%-15s</a>%-10s"
+                        "%10lld %24s</pre></p>\r\n",
+                   i + 1, type_of(entry->mode), dir_name, href, name,
+                   owner_of(entry->uid), (long long)entry->size, modify_time);
+    }
+
+    if (page_count > 1) {
+        char nav[MAXLINE];
+        int len = sprintf(nav, "<p><pre>   page %d of %d ", q->page, page_count);
+        const char *order = q->desc ? "desc" : "asc";
+        if (q->page > 1) {
+            len += sprintf(nav + len, "<a href=\"?sort=%s&order=%s&per=%d&page=%d\">"
+                           "prev</a> ", sort_names[q->sort], order, q->per,
+                           q->page - 1);
+        }
+        if (q->page < page_count) {
+            len += sprintf(nav + len, "<a href=\"?sort=%s&order=%s&per=%d&page=%d\">"
+                           "next</a>", sort_names[q->sort], order, q->per,
+                           q->page + 1);
+        }
+        out_printf(out, "%s</pre></p>\r\n", nav);
+    }
+    out_printf(out, "</body></html>");
+}
+
+static void parse_query(const char *query, struct dir_query *q) {
+    q->sort = SORT_NAME;
+    q->desc = 0;
+    q->page = 1;
+    q->per  = Getconfig_int("dir_per_page", 0);
+    q->json = 0;
+
+    char copy[MAXLINE];
+    snprintf(copy, sizeof(copy), "%s", query ? query : "");
+    char *save = NULL;
+    for (char *pair = strtok_r(copy, "&", &save); pair != NULL;
+         pair = strtok_r(NULL, "&", &save)) {
+        char *value = strchr(pair, '=');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+
+        if (strcmp(pair, "sort") == 0) {
+            if      (strcmp(value, "size") == 0)  q->sort = SORT_SIZE;
+            else if (strcmp(value, "mtime") == 0) q->sort = SORT_MTIME;
+            else                                  q->sort = SORT_NAME;
+        }
+        else if (strcmp(pair, "order") == 0) q->desc = strcmp(value, "desc") == 0;
+        else if (strcmp(pair, "page") == 0)  q->page = atoi(value);
+        else if (strcmp(pair, "per") == 0)   q->per  = atoi(value);
+        else if (strcmp(pair, "format") == 0) q->json = strcmp(value, "json") == 0;
+    }
+
+    if (q->page < 1)      q->page = 1;
+    if (q->per < 0)       q->per = 0;
+    if (q->per > PER_MAX) q->per = PER_MAX;
+}
+
+/*
+ * send the listing of directory path, return the body size or -1 if the
+ * directory cannot be read (nothing is sent then)
+ *     chunked: the client speaks HTTP/1.1; *keep_alive is cleared when a
+ *     streamed listing can only be ended by closing the connection
+ */
+long dirlist_serve(int fd, const char *path, const struct stat *st,
+                   const char *query, int chunked, int *keep_alive) {
+    struct dir_query q;
+    parse_query(query, &q);
+
+    long ttl = Getconfig_int("dir_cache_ttl", 5);
+    long limit = Getconfig_int("dir_cache_max", 262144);
+    time_t now = time(NULL);
+
+    char key[MAXLINE];
+    snprintf(key, sizeof(key), "%s?%d&%d&%d&%d&%d",
+             path, q.sort, q.desc, q.page, q.per, q.json);
+
+    struct dir_out out;
+    memset(&out, 0, sizeof(out));
+    out.fd = fd;
+    out.json = q.json;
+    out.limit = limit;
+    out.chunked = chunked && *keep_alive;
+    out.keep_alive = keep_alive;
+
+    struct dir_page *victim = &pages[0];
+    for (int i = 0; i < PAGE_SLOTS; ++i) {
+        struct dir_page *page = &pages[i];
+        if (page->used && strcmp(page->key, key) == 0) {
+            if (same_version(page->dev, page->ino, page->mtim, st) &&
+                now - page->rendered < ttl) {
+                page->used = ++tick;
+                send_header(&out, page->len);
+                Rio_writen(fd, page->body, page->len);
+                return page->len;
+            }
+            victim = page;
+            break;
+        }
+        if (page->used < victim->used) {
+            victim = page;
+        }
+    }
+
+    struct dir_scan *scan = get_scan(path, st, ttl);
+    if (scan == NULL) {
+        return -1;
+    }
+    sort_scan(scan, q.sort, q.desc);
+
+    int per = q.per ? q.per : (scan->count ? scan->count : 1);
+    int page_count = (scan->count + per - 1) / per;
+    // page is anything up to INT_MAX, a page past the end is empty
+    long first = (long)(q.page - 1) * per;
+    long last = first + per;
+    if (first > scan->count) first = scan->count;
+    if (last > scan->count)  last = scan->count;
+
+    if (q.json) {
+        render_json(&out, scan, &q, first, last);
+    }
+    else {
+        render_html(&out, scan, &q, first, last, page_count);
+    }
+
+    if (out.streaming) {
+        out_flush(&out);
+        if (out.chunked) {
+            Rio_writen(fd, "0\r\n\r\n", 5);
+        }
+        free(out.data);
+        return out.sent;
+    }
+
+    send_header(&out, out.len);
+    Rio_writen(fd, out.data, out.len);
+
+    free(victim->body);
+    snprintf(victim->key, sizeof(victim->key), "%s", key);
+    victim->dev = st->st_dev;
+    victim->ino = st->st_ino;
+    victim->mtim = st->st_mtim;
+    victim->rendered = now;
+    victim->used = ++tick;
+    victim->body = out.data;
+    victim->len = out.len;
+    return out.len;
+}
@@ -1,26 +1,80 @@
 #include "wrap.h"
 #include "parse.h"
+#include "binlog.h"
+#include "cgipool.h"
+#include "ratelimit.h"
+#include <netinet/tcp.h>
+#include <stdarg.h>
 
 #define PID_FILE "./pid.file"
 
-static void doit(int fd);
+static void doit(int fd, struct sockaddr_in *cli_addr);
+static int  serve_one(int fd, rio_t *rp, struct sockaddr_in *cli_addr);
+static void serve_request(int fd, rio_t *rp, char *line,
+                          char *method, char *uri,
+                          struct sockaddr_in *cli_addr);
 static void write_pid(int option);
-static void get_requesthdrs(rio_t *rp);
-static void post_requesthdrs(rio_t *rp,int *length);
+static int  read_requesthdrs(rio_t *rp, long *length);
+static long parse_length(const char *value);
+static int  discard_body(rio_t *rp, long length);
 static int  parse_uri(char *uri, char *filename, char *cgiargs);
 static void serve_static(int fd, char *filename, int filesize);
-static void serve_dir(int fd,char *filename);
+static void serve_dir(int fd, char *filename, struct stat *status,
+                      char *query);
 static void get_filetype(const char *filename, char *filetype);
 static void get_dynamic(int fd, char *filename, char *cgiargs);
-static void post_dynamic(int fd, char *filename, int contentLength,rio_t *rp);
+static void post_dynamic(int fd, char *filename, char *cgi_args,
+                         long content_length, rio_t *rp);
+static void relay_cgi(int fd, struct cgi_stream *in, long age);
+static void *feed_cgi(void *arg);
+struct cgi_feed;
+static int  splice_body(struct cgi_feed *feed);
+static void join_feed(int fd, pthread_t tid, pid_t pid);
+static void end_headers(char *buf);
 static void client_error(int fd, const char *cause, const char *errnum,
                          const char *shortmsg, const char *longmsg);
+static void too_many_requests(int fd, long retry_after);
+static void serve_conn(int connfd, struct sockaddr_in *cli_addr);
 static void sig_chld_handler(int signo);
 
 
-static int is_show_dir = 1;
 char *cwd = NULL;
 
+// status and body size of the response being sent, for the binary log
+static int  resp_status = 0;
+static long resp_bytes = 0;
+
+// framing of the connection: the request was HTTP/1.1 (chunked bodies are
+// understood), the connection stays open after this response, and the
+// request body bytes nobody has read yet
+static int  http11 = 0;
+static int  keep_alive = 0;
+static long body_left = 0;
+
+enum { CONN_DEFAULT = 0, CONN_CLOSE, CONN_KEEP_ALIVE };
+
+// the environment of a CGI request, built once and handed as it is to a
+// pooled worker or to posix_spawn; PATH comes first because a worker keeps
+// its own and gets vars + 1
+#define CGI_ENV_VARS 12
+
+struct cgi_env {
+    char *vars[CGI_ENV_VARS + 1];
+    int   count;
+    char  buf[MAXBUF];
+    int   used;
+};
+
+// a request body on its way from the client connection behind rp into the
+// stdin of a CGI program
+struct cgi_feed {
+    int    fd;
+    rio_t *rp;
+    long   length;
+    long   taken;           /* bytes taken from the client */
+    int    client_gone;     /* the client closed or timed out */
+};
+
 int main(int argc, char *argv[]) {
 
     openlog(argv[0], LOG_NDELAY | LOG_PID, LOG_DAEMON);
@@ -38,33 +92,59 @@ int main(int argc, char *argv[]) {
     int port = (port_ptr == NULL) ? atoi(Getconfig("http")) : atoi(port_ptr);
 
     Signal(SIGCHLD, sig_chld_handler);
+    Signal(SIGHUP, config_sig_hup);
 
     if (log_ptr == NULL) {
         log_ptr = Getconfig("log");
     }
     initlog(strcat(temp_cwd, log_ptr));
 
-    // whether show dir
-    if (strcmp(Getconfig("dir"), "no") == 0) {
-        is_show_dir = 0;
+    // optional binary access log, mapped before forking so workers share it
+    const char *binlog_ptr = Getconfig_default("binlog", "");
+    if (*binlog_ptr != '\0') {
+        char binlog_path[MAXLINE];
+        snprintf(binlog_path, sizeof(binlog_path), "%s/%s", cwd, binlog_ptr);
+        binlog_init(binlog_path, Getconfig_int("binlog_segment", 262144));
     }
 
     struct sockaddr_in cli_addr;
     socklen_t cli_addr_len = sizeof(cli_addr);
 
-    if (is_daemon == 1 || strcmp(Getconfig("daemon"), "yes") == 0) {
+    if (is_daemon == 1 || Getconfig_bool("daemon", 0)) {
         Daemon(1, 1);
     }
     write_pid(1);
 
     int listenfd = Open_listenfd(port);
+    // keep the listen socket out of the CGI programs
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+    // shared by every process serving connections
+    cgicache_init();
+    rate_limit_init();
+
+    int worker_num = Getconfig_int("workers", 0);
+    if (worker_num > 0) {
+        // every worker keeps its own persistent CGI processes, a process
+        // forked per connection would not live long enough to reuse them
+        cgipool_init(Getconfig_int("cgi_worker_requests", 1000),
+                     Getconfig_int("cgi_timeout", 30));
+        prefork_run(listenfd, worker_num, serve_conn);
+    }
+
     while (1) {
         int connfd = Accept(listenfd, (SA *)&cli_addr, &cli_addr_len);
-        if (access_ornot(inet_ntoa(cli_addr.sin_addr)) == 0) {
+        if (access_ornot((SA *)&cli_addr) == 0) {
             client_error(connfd, "maybe this web server not open to you !",
                          "403", "Forbidden", "Tiny couldn`t read the file`");
             continue;
         }
+        // refused before a process is forked for the connection
+        long wait = rate_limit((SA *)&cli_addr, RATELIMIT_CONN);
+        if (wait > 0) {
+            too_many_requests(connfd, wait);
+            Close(connfd);
+            continue;
+        }
 
         int pid;
         if ((pid = Fork()) > 0) {
@@ -72,32 +152,165 @@ int main(int argc, char *argv[]) {
             continue;
         }
         else if (pid == 0) {
-            doit(connfd);
+            doit(connfd, &cli_addr);
             exit(1);
         }
     }
 }
 
+/*
+ * serve every request of an accepted connection inside a preforked worker
+ */
+static void serve_conn(int connfd, struct sockaddr_in *cli_addr) {
+    if (access_ornot((SA *)cli_addr) == 0) {
+        client_error(connfd, "maybe this web server not open to you !",
+                     "403", "Forbidden", "Tiny couldn`t read the file`");
+        return;
+    }
+    long wait = rate_limit((SA *)cli_addr, RATELIMIT_CONN);
+    if (wait > 0) {
+        keep_alive = 0;
+        too_many_requests(connfd, wait);
+        return;
+    }
+    doit(connfd, cli_addr);
+}
+
+/*
+ * several children may exit before the handler runs, reap all of them
+ */
 static void sig_chld_handler(int signo) {
-    Waitpid(-1, NULL, WNOHANG);
+    int save_errno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        continue;
+    }
+    errno = save_errno;
 }
 
 /*
- *  handle one HTTP request/response transaction
+ *  serve the requests of one connection until the client closes it, the
+ *  keep-alive timeout expires or keepalive_requests have been answered
  */
-static void doit(int fd) {
-    char buf[MAXLINE];
-    memset(buf, '\0', MAXLINE);
+static void doit(int fd, struct sockaddr_in *cli_addr) {
+    // looked up per connection so SIGHUP can change them
+    long timeout = Getconfig_int("keepalive_timeout", 5);
+    long max_requests = Getconfig_int("keepalive_requests", 100);
+    if (timeout > 0) {
+        struct timeval tv = { timeout, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        // a response head and body are separate writes, on a connection
+        // that stays open Nagle would hold the body for the delayed ack
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
 
-    // read request line and headers
     rio_t rio;
     Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXBUF);
+    rio_peer_gone = 0;
+    for (long n = 1; ; ++n) {
+        keep_alive = timeout > 0 && (max_requests <= 0 || n < max_requests);
+        // a response write that hit EPIPE/ECONNRESET ends the connection
+        if (serve_one(fd, &rio, cli_addr) < 0 || !keep_alive ||
+            rio_peer_gone) {
+            break;
+        }
+    }
+}
+
+/*
+ *  handle one HTTP request/response transaction and record it
+ *      return -1 if the client closed or went idle before a request came
+ */
+static int serve_one(int fd, rio_t *rp, struct sockaddr_in *cli_addr) {
+    char line[MAXLINE];
+    if (rio_readlineb(rp, line, MAXLINE) <= 0) {
+        return -1;
+    }
+
+    struct timespec start, end;
+    struct timeval  now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    gettimeofday(&now, NULL);
+
+    char method[MAXLINE] = "";
+    char uri[MAXLINE] = "";
+    resp_status = 0;
+    resp_bytes = 0;
+    body_left = 0;
+    serve_request(fd, rp, line, method, uri, cli_addr);
+
+    // a body the handler did not want must not be parsed as the next request
+    if (body_left > 0 && keep_alive && discard_body(rp, body_left) < 0) {
+        keep_alive = 0;
+    }
+    if (resp_status == 0) {
+        keep_alive = 0;
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long latency = (end.tv_sec - start.tv_sec) * 1000000L +
+                   (end.tv_nsec - start.tv_nsec) / 1000;
+
+    int method_id = BINLOG_OTHER;
+    if      (strcasecmp(method, "GET") == 0)  method_id = BINLOG_GET;
+    else if (strcasecmp(method, "POST") == 0) method_id = BINLOG_POST;
+    else if (strcasecmp(method, "HEAD") == 0) method_id = BINLOG_HEAD;
 
-    char method[MAXLINE];
-    char uri[MAXLINE];
-    char version[MAXLINE];
-    sscanf(buf, "%s %s %s", method, uri, version);
+    binlog_write((uint64_t)now.tv_sec * 1000000 + now.tv_usec, latency,
+                 (SA *)cli_addr, method_id, resp_status, resp_bytes, uri);
+    return 0;
+}
+
+static void serve_request(int fd, rio_t *rp, char *line,
+                          char *method, char *uri,
+                          struct sockaddr_in *cli_addr) {
+    char version[MAXLINE] = "";
+    int fields = sscanf(line, "%s %s %s", method, uri, version);
+    http11 = fields == 3 && strcasecmp(version, "HTTP/1.0") != 0;
+
+    // read all headers first, whatever the answer is the next request
+    // starts after them
+    long content_length = 0;
+    int connection = read_requesthdrs(rp, &content_length);
+    if (connection < 0) {
+        keep_alive = 0;
+        return;
+    }
+    if (connection == CONN_CLOSE ||
+        (!http11 && connection != CONN_KEEP_ALIVE)) {
+        keep_alive = 0;
+    }
+    // without a sure length the body cannot be told from the next request,
+    // and a body over max_body_size is refused before anything reads it
+    long max_body = Getconfig_int("max_body_size", 1024) * 1024;
+    if (content_length < 0) {
+        keep_alive = 0;
+        client_error(fd, "Content-Length", "400", "Bad Request",
+                     "Tiny couldn`t parse the request");
+        return;
+    }
+    if (max_body > 0 && content_length > max_body) {
+        keep_alive = 0;
+        client_error(fd, uri, "413", "Request Entity Too Large",
+                     "Tiny couldn`t take the request body");
+        return;
+    }
+    body_left = content_length;
+
+    // the headers are read, so the connection can go on after the refusal
+    long wait = rate_limit((SA *)cli_addr, RATELIMIT_REQUEST);
+    if (wait > 0) {
+        too_many_requests(fd, wait);
+        return;
+    }
+
+    if (fields < 2) {
+        keep_alive = 0;
+        client_error(fd, line, "400", "Bad Request",
+                     "Tiny couldn`t parse the request");
+        return;
+    }
 
     if (strcasecmp(method, "GET") != 0 && strcasecmp(method, "POST") != 0) {
         client_error(fd, method, "501", "Not Inplemented",
@@ -117,8 +330,10 @@ static void doit(int fd) {
                      "Tiny couldn`t find this file");
         return;
     }
-    if (S_ISDIR(status.st_mode) && is_show_dir) {
-        serve_dir(fd, filename);
+    // whether show dir, looked up per request so SIGHUP can change it
+    if (S_ISDIR(status.st_mode) && Getconfig_bool("dir", 1)) {
+        serve_dir(fd, filename, &status, cgi_args);
+        return;
     }
 
     int is_get = 1;
@@ -127,8 +342,6 @@ static void doit(int fd) {
     }
 
     if (is_static) {
-        get_requesthdrs(&rio);
-
         if (!(S_ISREG(status.st_mode)) || !(S_IRUSR & status.st_mode)) {
             client_error(fd, filename, "403", "Forbidden",
                          "Tiny couldn`t read the file");
@@ -144,169 +357,326 @@ static void doit(int fd) {
         }
 
         if (is_get) {
-            get_requesthdrs(&rio);
             get_dynamic(fd, filename, cgi_args);
         }
         else {
-            int content_length = 0;
-            post_requesthdrs(&rio, &content_length);
-            post_dynamic(fd, filename, content_length, &rio);
+            post_dynamic(fd, filename, cgi_args, content_length, rp);
         }
     }
 }
 
 /*
  * read_requesthdrs - read and parse HTTP request headers
+ *     return the Connection header (CONN_*), -1 if the client went away;
+ *     *length is -1 if Content-Length is not a number or repeated with
+ *     another value
  */
-static void get_requesthdrs(rio_t *rp) {
+static int read_requesthdrs(rio_t *rp, long *length) {
+    int connection = CONN_DEFAULT;
+    int has_length = 0;
     char buf[MAXLINE];
-    Rio_readlineb(rp, buf, MAXLINE);
-    writetime();  // write access tiem in log file
+    writetime();  // write access time in log file
+    cgicache_request_begin();
 
-    while (strcmp(buf, "\r\n")) {
-        Rio_readlineb(rp, buf, MAXLINE);
+    for (;;) {
+        if (rio_readlineb(rp, buf, MAXLINE) <= 0) {
+            return -1;
+        }
+        if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0) {
+            return connection;
+        }
         writelog(buf);
-    }
-}
-
-static void post_requesthdrs(rio_t *rp, int *length) {
-    char buf[MAXLINE];
-    Rio_readlineb(rp, buf, MAXLINE);
-    writetime();  // write access time in log file
+        cgicache_request_header(buf);
 
-    while (strcmp(buf, "\r\n")) {
-        Rio_readlineb(rp, buf, MAXLINE);
         if (strncasecmp(buf, "Content-Length:", 15) == 0) {
-            char *ptr = &buf[15];
-            ptr += strspn(ptr, " \t");
-            *length = atoi(ptr);
+            long n = parse_length(&buf[15]);
+            if (n < 0 || *length < 0 || (has_length && n != *length)) {
+                n = -1;
+            }
+            *length = n;
+            has_length = 1;
+        }
+        else if (strncasecmp(buf, "Connection:", 11) == 0) {
+            if (strcasestr(buf + 11, "close")) {
+                connection = CONN_CLOSE;
+            }
+            else if (strcasestr(buf + 11, "keep-alive")) {
+                connection = CONN_KEEP_ALIVE;
+            }
         }
-        writelog(buf);
     }
 }
 
-static void serve_dir(int fd, char *filename) {
-    char *ptr = strrchr(filename, '/');
-    ++ptr;
-    char dir_name[MAXLINE];
-    strcpy(dir_name, ptr);
-    strcat(dir_name, "/");
-
-    DIR *dir = opendir(filename);
-    if (dir == NULL) {
-        syslog(LOG_ERR, "cannot open dir:%s", filename);
-    }
-
-    char files[MAXLINE];
-    sprintf(files, "<html><title>Dir Browser</title>");
-    sprintf(files, "%s<style type=""text/css""> a:link{text-decoration:none;} \
-            </style>", files);
-    sprintf(files, "%s<body bgcolor=""ffffff"" font-family=Arial color=#fff \
-            font-size=14px>\r\n", files);
-
-    struct dirent *dirent_ptr;
-    while ((dirent_ptr = readdir(dir)) != NULL) {
-        if (strcmp(dirent_ptr->d_name, ".") == 0 ||
-            strcmp(dirent_ptr->d_name, "..") == 0) {
-            continue;
-        }
-
-        char name[MAXLINE];
-        sprintf(name, "%s/%s", filename, dirent_ptr->d_name);
-        struct stat status;
-        Stat(name, &status);
-        struct passwd *file_passwd = getpwuid(status.st_uid);
+/*
+ * the value of a Content-Length header: decimal digits only, -1 for a sign,
+ * garbage or a number that does not fit
+ */
+static long parse_length(const char *value) {
+    value += strspn(value, " \t");
+    if (!isdigit((unsigned char)*value)) {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    long n = strtol(value, &end, 10);
+    if (errno == ERANGE) {
+        return -1;
+    }
+    end += strspn(end, " \t\r\n");
+    return *end == '\0' ? n : -1;
+}
 
-        char img[MAXLINE];
-        if (S_ISDIR(status.st_mode)) {
-            sprintf(img,
-                    "<img src=""dir.png"" width=""24px"" height=""24px"">");
-        }
-        else if (S_ISFIFO(status.st_mode)) {
-            sprintf(img,
-                    "<img src=""fifo.png"" width=""24px"" height=""24px"">");
-        }
-        else if (S_ISLNK(status.st_mode)) {
-            sprintf(img,
-                    "<img src=""link.png"" width=""24px"" height=""24px"">");
-        }
-        else if (S_ISSOCK(status.st_mode)) {
-            sprintf(img,
-                    "<img src=""sock.png"" width=""24px"" height=""24px"">");
-        }
-        else {
-            sprintf(img,
-                    "<img src=""file.png"" width=""24px"" height=""24px"">");
+/*
+ * skip a request body nobody reads, -1 if the client went away
+ */
+static int discard_body(rio_t *rp, long length) {
+    char buf[MAXBUF];
+    while (length > 0) {
+        size_t n = length < (long)sizeof(buf) ? (size_t)length : sizeof(buf);
+        if (rio_readnb(rp, buf, n) != (ssize_t)n) {
+            return -1;
         }
+        length -= n;
+    }
+    body_left = 0;
+    return 0;
+}
 
-        int num = 1;
-        char modify_time[MAXLINE];
-        sprintf(files, "%s<p><pre>%-2d %s ""<a href=%s%s"">%-15s</a>%-10s%10d %24s</pre></p>\r\n",
-                files, ++num, img, dir_name, dirent_ptr->d_name,
-                dirent_ptr->d_name, file_passwd->pw_name, (int)status.st_size,
-                timeModify(status.st_mtime, modify_time));
+/*
+ * list a directory, the query selects sorting, paging and json (dirlist.c)
+ */
+static void serve_dir(int fd, char *filename, struct stat *status,
+                      char *query) {
+    long bytes = dirlist_serve(fd, filename, status, query,
+                               http11, &keep_alive);
+    if (bytes < 0) {
+        client_error(fd, filename, "403", "Forbidden",
+                     "Tiny couldn`t read the directory");
+        return;
     }
-    closedir(dir);
-    sprintf(files, "%s</body></html>", files);
+    resp_status = 200;
+    resp_bytes = bytes;
+}
 
-    // send response headers to client
-    char buf[MAXLINE];
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sContent-Length: %lu\r\n", buf, strlen(files));
-    sprintf(buf, "%sContent-Type: %s\r\n\r\n", buf, "text/html");
+static void cgi_env_add(struct cgi_env *env, const char *format, ...) {
+    int room = sizeof(env->buf) - env->used;
+    if (env->count >= CGI_ENV_VARS) {
+        return;
+    }
 
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, files, strlen(files));
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(env->buf + env->used, room, format, ap);
+    va_end(ap);
+    if (n < 0 || n >= room) {
+        return;
+    }
+    env->vars[env->count++] = env->buf + env->used;
+    env->vars[env->count] = NULL;
+    env->used += n + 1;
+}
 
-    exit(0);
+/*
+ * the CGI/1.1 variables of a request, content_length < 0 -> no body
+ */
+static void cgi_env_init(struct cgi_env *env, int fd, const char *method,
+                         const char *filename, const char *query,
+                         long content_length) {
+    env->count = 0;
+    env->used = 0;
+    env->vars[0] = NULL;
+
+    const char *path = getenv("PATH");
+    cgi_env_add(env, "PATH=%s", path ? path : "/usr/bin:/bin");
+    cgi_env_add(env, "GATEWAY_INTERFACE=CGI/1.1");
+    cgi_env_add(env, "SERVER_SOFTWARE=Tiny Web Server");
+    cgi_env_add(env, "SERVER_PROTOCOL=HTTP/1.%d", http11);
+    cgi_env_add(env, "REQUEST_METHOD=%s", method);
+    cgi_env_add(env, "SCRIPT_NAME=%s", filename + strlen(cwd));
+    cgi_env_add(env, "QUERY_STRING=%s", query);
+
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    char addr[INET_ADDRSTRLEN];
+    if (getpeername(fd, (SA *)&peer, &peer_len) == 0 &&
+        inet_ntop(AF_INET, &peer.sin_addr, addr, sizeof(addr))) {
+        cgi_env_add(env, "REMOTE_ADDR=%s", addr);
+    }
+    if (content_length >= 0) {
+        cgi_env_add(env, "CONTENT_LENGTH=%ld", content_length);
+        // the name the cgi-bin programs read
+        cgi_env_add(env, "CONTENT-LENGTH=%ld", content_length);
+    }
 }
 
-static void post_dynamic(int fd, char *filename,
-                         int content_length, rio_t *rp) {
-    char length[32];
-    sprintf(length, "%d", content_length);
+/*
+ * write a request body into the CGI's stdin; SIGPIPE is blocked meanwhile,
+ * so a CGI that stops reading gives EPIPE instead of killing twebs
+ */
+static void *feed_cgi(void *arg) {
+    struct cgi_feed *feed = arg;
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    int ret = splice_body(feed);
+    if (ret < 0 && errno == EPIPE) {
+        // consume the pending SIGPIPE before the mask is restored
+        struct timespec no_wait = { 0, 0 };
+        sigtimedwait(&mask, NULL, &no_wait);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    close(feed->fd);
+    return NULL;
+}
 
-    char data[MAXLINE];
-    memset(data, 0, MAXLINE);
+/*
+ * move the request body from the client into the pipe: the bytes rio has
+ * buffered already are written, the rest is spliced from the socket and
+ * never copied through this process
+ *     return -1 with errno set if the program or the client went away
+ */
+static int splice_body(struct cgi_feed *feed) {
+    rio_t *rp = feed->rp;
+    long left = feed->length;
+
+    long n = rp->rio_cnt < left ? rp->rio_cnt : left;
+    if (n > 0) {
+        if (rio_writen(feed->fd, rp->rio_bufptr, n) < 0) {
+            return -1;
+        }
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        feed->taken += n;
+        left -= n;
+    }
 
-    int pipefd[2];
-    Pipe(pipefd);
+    while (left > 0) {
+        ssize_t moved = splice(rp->rio_fd, NULL, feed->fd, NULL, left,
+                               SPLICE_F_MOVE);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            // EPIPE: the program stopped reading, the rest stays unread
+            if (moved == 0 || errno != EPIPE) {
+                feed->client_gone = 1;
+            }
+            return -1;
+        }
+        feed->taken += moved;
+        left -= moved;
+    }
+    return 0;
+}
 
-    if (Fork() == 0) {
-        Close(pipefd[0]);
-        Rio_readnb(rp, data, content_length);
-        Rio_writen(pipefd[1], data, content_length);
-        exit(0);
+/*
+ * wait for the thread feeding a CGI program; a program that closed its
+ * output but neither reads the rest of the body nor exits is killed after
+ * cgi_timeout seconds
+ */
+static void join_feed(int fd, pthread_t tid, pid_t pid) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += Getconfig_int("cgi_timeout", 30);
+    if (pthread_timedjoin_np(tid, NULL, &deadline) != 0) {
+        shutdown(fd, SHUT_RD);
+        kill(-pid, SIGKILL);
+        pthread_join(tid, NULL);
+        keep_alive = 0;
     }
+}
 
-    // send response headers to client
-    char buf[MAXLINE];
-    sprintf(buf, "HTTP/1.9 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
+/*
+ * run a CGI program with the request body as its stdin
+ *     a pooled worker gets the body in STDIN frames as it arrives, a spawned
+ *     program reads it from a pipe the body is spliced into
+ */
+static void post_dynamic(int fd, char *filename, char *cgi_args,
+                         long content_length, rio_t *rp) {
+    struct cgi_env env;
+    cgi_env_init(&env, fd, "POST", filename, cgi_args, content_length);
+
+    struct cgi_feed feed = { -1, rp, content_length, 0, 0 };
+    struct cgi_stream cgi;
+    if (cgipool_enabled(filename) &&
+        cgipool_open(filename, env.vars + 1, &cgi) == 0) {
+        // one buffer at a time, whatever the body size
+        char buf[MAXBUF];
+        while (body_left > 0) {
+            size_t n = body_left < (long)sizeof(buf) ? (size_t)body_left
+                                                     : sizeof(buf);
+            if (rio_readnb(rp, buf, n) != (ssize_t)n) {
+                keep_alive = 0;
+                cgipool_end(&cgi);
+                return;
+            }
+            body_left -= n;
+            if (cgipool_write(&cgi, buf, n) < 0) {
+                break;      // the rest stays unread, the answer is a 500
+            }
+        }
+        cgipool_write(&cgi, NULL, 0);
+        relay_cgi(fd, &cgi, -1);
+        cgipool_end(&cgi);
+        return;
+    }
 
-    Rio_writen(fd, buf, strlen(buf));
+    int in[2], out[2];
+    Pipe(in);
+    Pipe(out);
+    pid_t pid = cgi_spawn(filename, env.vars, in[0], out[1]);
+    Close(in[0]);
+    Close(out[1]);
+    if (pid < 0) {
+        Close(in[1]);
+        Close(out[0]);
+        client_error(fd, filename, "500", "Internal Server Error",
+                     "Tiny couldn`t run the CGI program");
+        return;
+    }
 
-    Dup2(pipefd[0], STDIN_FILENO);
-    Close(pipefd[0]);
+    // a body bigger than the pipe is fed by a thread, the CGI may answer
+    // before it has read everything; a smaller one is fed right away
+    feed.fd = in[1];
+    pthread_t tid;
+    int threaded = content_length > fcntl(in[1], F_GETPIPE_SZ) &&
+                   pthread_create(&tid, NULL, feed_cgi, &feed) == 0;
+    if (!threaded) {
+        feed_cgi(&feed);
+    }
 
-    Close(pipefd[1]);
-    setenv("CONTENT-LENGTH", length, 1);
+    cgi_stream_pipe(&cgi, out[0]);
+    relay_cgi(fd, &cgi, -1);
+    Close(out[0]);
+    if (threaded) {
+        join_feed(fd, tid, pid);
+    }
 
-    Dup2(fd, STDOUT_FILENO);
-    char *empty_list[] = { NULL };
-    Execve(filename, empty_list, environ);
+    // what the program left unread is still on the connection
+    body_left = content_length - feed.taken;
+    if (feed.client_gone) {
+        keep_alive = 0;
+    }
 }
 
 /*
- * parse URI into filename and CGI args
+ * parse URI into filename and CGI args (the query of a static uri, which
+ * only directory listings use)
  *     return 0 if dynamic content, 1 if static
  */
 static int parse_uri(char *uri, char *filename, char *cgi_args) {
-    if (!strstr(uri, "cig-bin")) {
-        strcpy(cgi_args, "");
-        char temp_cwd[MAXLINE];
-        strcpy(filename, strcat(temp_cwd, Getconfig("root")));
+    if (!strstr(uri, "cgi-bin")) {
+        char *ptr = index(uri, '?');
+        if (ptr) {
+            strcpy(cgi_args, ptr + 1);
+            *ptr = '\0';
+        }
+        else {
+            strcpy(cgi_args, "");
+        }
+        sprintf(filename, "%s/%s", cwd, Getconfig("root"));
         strcat(filename, uri);
 
         if (uri[strlen(uri) - 1] == '/') {
@@ -339,20 +709,25 @@ static void serve_static(int fd, char *filename, int filesize) {
     char filetype[MAXLINE];
     get_filetype(filename, filetype);
     char buf[MAXLINE];
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
+    sprintf(buf, "HTTP/1.1 200 OK\r\n");
     sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
     sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-Type: %s\r\n\r\n", buf, filetype);
+    sprintf(buf, "%sContent-Type: %s\r\n", buf, filetype);
+    end_headers(buf);
+    Rio_writen(fd, buf, strlen(buf));
 
     // send response body to client
-    int src_fd = Open(filename, O_RDONLY, 0);
-    char *src_ptr =
-        (char *)Mmap(0, filesize, PROT_READ, MAP_PRIVATE, src_fd, 0);
-    Close(src_fd);
-
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, src_ptr, filesize);
-    Munmap(src_ptr, filesize);
+    if (filesize > 0) {
+        int src_fd = Open(filename, O_RDONLY, 0);
+        char *src_ptr =
+            (char *)Mmap(0, filesize, PROT_READ, MAP_PRIVATE, src_fd, 0);
+        Close(src_fd);
+
+        Rio_writen(fd, src_ptr, filesize);
+        Munmap(src_ptr, filesize);
+    }
+    resp_status = 200;
+    resp_bytes = filesize;
 }
 
 /*
@@ -370,19 +745,161 @@ static void get_filetype(const char *filename, char *filetype) {
  * run a CGI program on behalf of the client
  */
 void get_dynamic(int fd, char *filename, char *cgi_args) {
-    // return first part of HTTP response
-    char buf[MAXLINE];
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
+    // a response the program allowed to be reused needs no run at all
+    char *cached;
+    size_t cached_len;
+    long age;
+    struct cgi_stream cgi;
+    if (cgicache_lookup(filename, cgi_args, &cached, &cached_len, &age)) {
+        cgi_stream_memory(&cgi, cached, cached_len);
+        relay_cgi(fd, &cgi, age);
+        free(cached);
+        return;
+    }
+    size_t capture_max;
+    char *capture = cgicache_capture(&capture_max);
+
+    struct cgi_env env;
+    cgi_env_init(&env, fd, "GET", filename, cgi_args, -1);
+
+    // a persistent worker answers without a spawn
+    if (cgipool_begin(filename, env.vars + 1, NULL, 0, &cgi) == 0) {
+        if (capture) cgi_stream_capture(&cgi, capture, capture_max);
+        relay_cgi(fd, &cgi, -1);
+        cgipool_end(&cgi);
+        if (capture && !cgi.capture_overflow) {
+            cgicache_store(filename, cgi_args, capture, cgi.capture_len,
+                           cgi.done);
+        }
+        return;
+    }
+
+    // posix_spawn does not copy the page tables of this process like fork
+    int out[2];
+    Pipe(out);
+    pid_t pid = cgi_spawn(filename, env.vars, -1, out[1]);
+    Close(out[1]);
+    if (pid < 0) {
+        Close(out[0]);
+        client_error(fd, filename, "500", "Internal Server Error",
+                     "Tiny couldn`t run the CGI program");
+        return;
+    }
+
+    cgi_stream_pipe(&cgi, out[0]);
+    if (capture) cgi_stream_capture(&cgi, capture, capture_max);
+    relay_cgi(fd, &cgi, -1);
+    Close(out[0]);
+    if (capture && !cgi.capture_overflow) {
+        cgicache_store(filename, cgi_args, capture, cgi.capture_len, cgi.done);
+    }
+}
+
+/*
+ * send the output of a CGI program as one response
+ *     its header lines are kept and a Status: line becomes the status line.
+ *     A body without Content-Length is sent chunked to HTTP/1.1 clients,
+ *     otherwise it ends when the connection is closed. age >= 0 marks a
+ *     response from the CGI cache stored that many seconds ago.
+ */
+static void relay_cgi(int fd, struct cgi_stream *in, long age) {
+    char status[MAXLINE] = "200 OK";
+    char headers[MAXBUF] = "";
+    long length = -1;
+    int  complete = 0;
+
+    char line[MAXLINE];
+    while (cgi_stream_readline(in, line, MAXLINE) > 0) {
+        if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+            complete = 1;
+            break;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (strncasecmp(line, "Status:", 7) == 0) {
+            char *ptr = line + 7;
+            ptr += strspn(ptr, " \t");
+            snprintf(status, sizeof(status), "%s", ptr);
+            continue;
+        }
+        // the framing is ours
+        if (strncasecmp(line, "Connection:", 11) == 0 ||
+            strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            continue;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            length = atol(line + 15);
+        }
+        if (strlen(headers) + strlen(line) + 3 < sizeof(headers)) {
+            strcat(headers, line);
+            strcat(headers, "\r\n");
+        }
+    }
+    if (!complete) {
+        client_error(fd, "", "500", "Internal Server Error",
+                     "the CGI program sent no response");
+        return;
+    }
+
+    int chunked = 0;
+    if (length < 0) {
+        if (http11 && keep_alive) chunked = 1;
+        else                      keep_alive = 0;
+    }
+
+    char buf[MAXBUF + MAXLINE];
+    sprintf(buf, "HTTP/1.1 %s\r\n", status);
     sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
+    strcat(buf, headers);
+    if (age >= 0) {
+        sprintf(buf, "%sAge: %ld\r\n", buf, age);
+    }
+    if (chunked) {
+        sprintf(buf, "%sTransfer-Encoding: chunked\r\n", buf);
+    }
+    end_headers(buf);
     Rio_writen(fd, buf, strlen(buf));
-
-    if (Fork() == 0) {
-        // real server would set all CGI vars here
-        setenv("QUERY_STRING", cgi_args, 1);
-        Dup2(fd, STDOUT_FILENO);
-        char *empty_list[] = { NULL };
-        Execve(filename, empty_list, environ);
+    resp_status = atoi(status);
+
+    char data[MAXBUF];
+    long sent = 0;
+    while (length < 0 || sent < length) {
+        size_t want = sizeof(data);
+        if (length >= 0 && length - sent < (long)want) {
+            want = length - sent;
+        }
+        ssize_t n = cgi_stream_read(in, data, want);
+        if (n <= 0) {
+            break;
+        }
+        if (chunked) {
+            char size[32];
+            sprintf(size, "%lx\r\n", (unsigned long)n);
+            Rio_writen(fd, size, strlen(size));
+            Rio_writen(fd, data, n);
+            Rio_writen(fd, "\r\n", 2);
+        }
+        else {
+            Rio_writen(fd, data, n);
+        }
+        sent += n;
+    }
+    if (chunked) {
+        Rio_writen(fd, "0\r\n\r\n", 5);
     }
+    else if (length >= 0 && sent < length) {
+        keep_alive = 0;     // the client waits for bytes that never come
+    }
+    resp_bytes = sent;
+}
+
+/*
+ * finish a response head with the Connection header, keep_alive is final
+ * by then
+ */
+static void end_headers(char *buf) {
+    sprintf(buf, "%sConnection: %s\r\n\r\n", buf,
+            keep_alive ? "keep-alive" : "close");
 }
 
 /*
@@ -400,12 +917,35 @@ static void client_error(int fd, const char *cause, const char *err_num,
 
     // print the HTTP response
     char buf[MAXLINE];
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", err_num, short_msg);
+    sprintf(buf, "HTTP/1.1 %s %s\r\n", err_num, short_msg);
     sprintf(buf, "%sContent-Type: text/html\r\n", buf);
-    sprintf(buf, "%sContent-Length: %lu\r\n\r\n", buf, strlen(body));
+    sprintf(buf, "%sContent-Length: %lu\r\n", buf, strlen(body));
+    end_headers(buf);
 
     Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(buf));
+    Rio_writen(fd, body, strlen(body));
+    resp_status = atoi(err_num);
+    resp_bytes = strlen(body);
+}
+
+/*
+ * refuse a client over its rate limit, before any work is done for it
+ */
+static void too_many_requests(int fd, long retry_after) {
+    const char *body = "Too Many Requests\r\n";
+    char buf[MAXLINE];
+    sprintf(buf, "HTTP/1.1 429 Too Many Requests\r\n");
+    sprintf(buf, "%sContent-Type: text/plain\r\n", buf);
+    sprintf(buf, "%sContent-Length: %lu\r\n", buf, strlen(body));
+    sprintf(buf, "%sRetry-After: %ld\r\n", buf, retry_after);
+    end_headers(buf);
+
+    // the client may be gone already, nothing to do about it
+    if (rio_writen(fd, buf, strlen(buf)) >= 0) {
+        rio_writen(fd, (void *)body, strlen(body));
+    }
+    resp_status = 429;
+    resp_bytes = strlen(body);
 }
 
 /*
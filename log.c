@@ -1,73 +1,343 @@
 #include "parse.h"
 #include "wrap.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/uio.h>
 
-FILE* logfp=NULL;
+/*
+ *  Asynchronous access log
+ *      writelog()/writetime() only copy the line into a per-process ring
+ *      buffer (single producer: the request path, single consumer: a flusher
+ *      thread), no lock and no syscall on the request path. The flusher wakes
+ *      every log_flush_ms, or early once the ring is half full, and writes
+ *      everything pending with one writev().
+ *
+ *      A full ring drops the whole line and counts it; the flusher writes a
+ *      "dropped" note into the log when the counter moves, so memory stays
+ *      bounded under bursts. The file is rotated by size (log_rotate_size)
+ *      and/or time (log_rotate_interval), workers of one server cooperate
+ *      through flock() on <log>.lock and notice a rotation done by another
+ *      process by comparing inodes. Each process opens the lock file itself:
+ *      a descriptor inherited across fork shares its lock with the parent.
+ *
+ *      The ring is per process: a forked child starts with an empty ring and
+ *      its own flusher, created on its first log line. exit() drains it.
+ */
+
+#define LOG_RING_MIN   4096
+#define LOG_TIME_LEN   64
+
+static char  *log_path = NULL;
+static int    log_fd = -1;
+static int    lock_fd = -1;         /* opened by this process, see atfork */
+static ino_t  log_ino;
+static long   log_bucket;           /* rotate interval bucket of log_fd */
+
+static long   rotate_size = 0;
+static long   rotate_interval = 0;
+static int    flush_ms = 200;
+
+static char          *ring = NULL;
+static unsigned long  ring_size = 0;  /* power of 2 */
+static unsigned long  ring_head = 0;  /* written by the producer only */
+static unsigned long  ring_tail = 0;  /* written by the consumer only */
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t flusher;
+static int flusher_running = 0;
+static int wake_fd = -1;
+
+static struct log_stats stats;
+static unsigned long dropped_reported = 0;
+
+static void open_log(void) {
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "cannot open log %s: %s", log_path, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    if (log_fd >= 0) {
+        close(log_fd);
+    }
+    log_fd = fd;
+    log_ino = st.st_ino;
+    log_bucket = rotate_interval ? time(NULL) / rotate_interval : 0;
+}
+
+static void lock_rotation(void) {
+    if (lock_fd < 0) {
+        char name[MAXLINE];
+        snprintf(name, sizeof(name), "%s.lock", log_path);
+        lock_fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock_fd < 0) {
+            syslog(LOG_ERR, "cannot open %s: %s", name, strerror(errno));
+            return;
+        }
+    }
+    flock(lock_fd, LOCK_EX);
+}
+
+/*
+ * called with drain_lock held, before every batch
+ */
+static void rotate_if_needed(void) {
+    struct stat st;
+    if (stat(log_path, &st) < 0 || st.st_ino != log_ino) {
+        // another worker rotated (or someone removed) the file
+        open_log();
+        return;
+    }
+
+    int by_size = rotate_size > 0 && st.st_size >= rotate_size;
+    int by_time = rotate_interval > 0 &&
+                  time(NULL) / rotate_interval != log_bucket;
+    if (!by_size && !by_time) {
+        return;
+    }
+
+    lock_rotation();
+    if (stat(log_path, &st) == 0 && st.st_ino == log_ino) {
+        char stamp[32];
+        char rotated[MAXLINE];
+        time_t now = time(NULL);
+        struct tm local;
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S",
+                 localtime_r(&now, &local));
+        snprintf(rotated, sizeof(rotated), "%s.%s", log_path, stamp);
+        for (int seq = 1; access(rotated, F_OK) == 0; ++seq) {
+            snprintf(rotated, sizeof(rotated), "%s.%s.%d",
+                     log_path, stamp, seq);
+        }
+        if (rename(log_path, rotated) == 0) {
+            __atomic_fetch_add(&stats.rotations, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (lock_fd >= 0) {
+        flock(lock_fd, LOCK_UN);
+    }
+    open_log();
+}
+
+/*
+ * write out everything the producer has published so far
+ */
+static void drain(void) {
+    pthread_mutex_lock(&drain_lock);
+
+    unsigned long head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    unsigned long tail = ring_tail;
+    unsigned long dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+    if (head == tail && dropped == dropped_reported) {
+        pthread_mutex_unlock(&drain_lock);
+        return;
+    }
+
+    rotate_if_needed();
+
+    struct iovec iov[3];
+    int iov_count = 0;
+    unsigned long pending = head - tail;
+    unsigned long start = tail & (ring_size - 1);
+    unsigned long first = ring_size - start;
+    if (first > pending) first = pending;
+    if (first > 0) {
+        iov[iov_count].iov_base = ring + start;
+        iov[iov_count++].iov_len = first;
+    }
+    if (pending > first) {
+        iov[iov_count].iov_base = ring;
+        iov[iov_count++].iov_len = pending - first;
+    }
+
+    char note[96];
+    if (dropped != dropped_reported) {
+        int len = snprintf(note, sizeof(note),
+                           "log: %lu lines dropped, ring buffer full\r\n",
+                           dropped - dropped_reported);
+        iov[iov_count].iov_base = note;
+        iov[iov_count++].iov_len = len;
+        dropped_reported = dropped;
+    }
+
+    // O_APPEND keeps batches of different workers whole
+    for (int i = 0; i < iov_count; ) {
+        ssize_t n = writev(log_fd, iov + i, iov_count - i);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        __atomic_fetch_add(&stats.bytes, n, __ATOMIC_RELAXED);
+        while (i < iov_count && (size_t)n >= iov[i].iov_len) {
+            n -= iov[i++].iov_len;
+        }
+        if (i < iov_count) {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+    __atomic_fetch_add(&stats.flushes, 1, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&ring_tail, head, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void *flusher_main(void *arg) {
+    struct pollfd pfd = { wake_fd, POLLIN, 0 };
+    while (1) {
+        if (poll(&pfd, 1, flush_ms) > 0) {
+            uint64_t value;
+            if (read(wake_fd, &value, sizeof(value)) < 0) {
+                ;
+            }
+        }
+        drain();
+    }
+    return NULL;
+}
+
+static void start_flusher(void) {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0 ||
+        pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        syslog(LOG_ERR, "cannot start log flusher: %s", strerror(errno));
+        return;
+    }
+    pthread_detach(flusher);
+    flusher_running = 1;
+}
+
+static void atfork_prepare(void) { pthread_mutex_lock(&drain_lock); }
+static void atfork_parent(void)  { pthread_mutex_unlock(&drain_lock); }
+
+static void atfork_child(void) {
+    pthread_mutex_unlock(&drain_lock);
+    // pending lines belong to the parent, which writes them itself
+    ring_tail = ring_head;
+    dropped_reported = stats.dropped;
+    flusher_running = 0;
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    if (lock_fd >= 0) {
+        close(lock_fd);
+        lock_fd = -1;
+    }
+}
+
+static void flush_at_exit(void) {
+    if (ring != NULL) {
+        drain();
+    }
+}
+
+static void log_append(const char *data, size_t len) {
+    if (!flusher_running) {
+        start_flusher();
+    }
+
+    unsigned long head = ring_head;
+    unsigned long tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    unsigned long used = head - tail;
+    if (len > ring_size - used) {
+        __atomic_fetch_add(&stats.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    unsigned long start = head & (ring_size - 1);
+    unsigned long first = ring_size - start;
+    if (first > len) first = len;
+    memcpy(ring + start, data, first);
+    memcpy(ring, data + first, len - first);
+    __atomic_store_n(&ring_head, head + len, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&stats.records, 1, __ATOMIC_RELAXED);
+
+    // wake the flusher early only when crossing the half-full mark
+    if (used < ring_size / 2 && used + len >= ring_size / 2 && wake_fd >= 0) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            ;
+        }
+    }
+}
 
 void initlog(const char* logp)
 {
-    logfp=Fopen(logp,"a+");
+    log_path = strdup(logp);
+    rotate_size = Getconfig_int("log_rotate_size", 0);
+    rotate_interval = Getconfig_int("log_rotate_interval", 0);
+    flush_ms = Getconfig_int("log_flush_ms", 200);
+
+    long size = Getconfig_int("log_buffer", 65536);
+    for (ring_size = LOG_RING_MIN; ring_size < (unsigned long)size; ) {
+        ring_size <<= 1;
+    }
+    ring = Mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    open_log();
+    if (log_fd < 0) {
+        unix_error("initlog error");
+    }
+
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+    atexit(flush_at_exit);
 }
 
-static int getmonth(struct tm* local)   // return month index ,eg. Oct->10
+void log_flush(void)
 {
-    char buf[8];
-    int i;
-    static const char *months[] = {
-        "Jan","Feb","Mar","Apr","May","Jun","Jul","Aug","Sept","Oct","Nov","Dec"
-    };
-
-    strftime(buf,127,"%b",local);
-    for(i=0;i<12;++i)
-    {
-        if(!strcmp(buf,months[i]))
-            return i+1;
-    }
-    return 0;
+    drain();
 }
 
-void writetime()
+void log_get_stats(struct log_stats *out)
 {
-    time_t timeval;
-    char other[24];
-    char year[8];
-    char together[64];
-    int month;
+    out->records   = __atomic_load_n(&stats.records, __ATOMIC_RELAXED);
+    out->dropped   = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+    out->bytes     = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+    out->flushes   = __atomic_load_n(&stats.flushes, __ATOMIC_RELAXED);
+    out->rotations = __atomic_load_n(&stats.rotations, __ATOMIC_RELAXED);
+}
 
-    (void)time(&timeval);
-    struct tm *local=localtime(&timeval);
+/*
+ * "2024/10/08 09:05:01", formatted only when the second changes
+ */
+void writetime()
+{
+    static time_t cached_sec = -1;
+    static char   cached[LOG_TIME_LEN];
+    static size_t cached_len = 0;
 
-    /* get year */
-    strftime(year,7,"%Y",local);
-    /*get month */
-    month=getmonth(local);
-    /*get other */
-    strftime(other,23,"%d %H:%M:%S",local);
-    /*together all */
-    sprintf(together,"%s/%d/%s\r\n",year,month,other);
-    fwrite(together,strlen(together),1,logfp);
+    time_t now = time(NULL);
+    if (now != cached_sec) {
+        cached_sec = now;
+        timeModify(now, cached);
+        cached_len = strlen(cached);
+    }
+    log_append(cached, cached_len);
 }
 
 char* timeModify(time_t timeval,char *time)
 {
     char other[24];
     char year[8];
-    int month;
+    struct tm local;
 
-    struct tm *local=localtime(&timeval);
+    localtime_r(&timeval, &local);
 
     /* get year */
-    strftime(year,7,"%Y",local);
-    /*get month */
-    month=getmonth(local);
+    strftime(year,7,"%Y",&local);
     /*get other */
-    strftime(other,23,"%d %H:%M:%S",local);
+    strftime(other,23,"%d %H:%M:%S",&local);
     /*together all */
-    sprintf(time,"%s/%d/%s\r\n",year,month,other);
+    sprintf(time,"%s/%d/%s\r\n",year,local.tm_mon+1,other);
     return time;
 }
 
 void writelog(const char* buf)
 {
-    fwrite(buf,strlen(buf),1,logfp);
-    fflush(logfp);
+    log_append(buf, strlen(buf));
 }
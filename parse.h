@@ -7,6 +7,7 @@
 #include <signal.h>
 #include <sys/param.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/stat.h>
@@ -14,6 +15,8 @@
 #include <pwd.h>
 #include <syslog.h>
 #include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #ifdef HTTPS
 #include <openssl/ssl.h>
@@ -26,8 +29,13 @@
 void init_daemon(void);
 
 /* parse_config.c */
-char* Getconfig(const char*);
-extern FILE *configfp;
+char* Getconfig(const char*);       // exit if name is not configured
+const char *Getconfig_default(const char *name, const char *def);
+long Getconfig_int(const char *name, long def);
+int  Getconfig_bool(const char *name, int def);   // yes/no, on/off, numbers
+void config_sig_hup(int signo);     // SIGHUP handler, reload on next lookup
+void config_reload(void);
+unsigned long config_generation(void);  // changes whenever a reload succeeds
 
 /*parse_option.c */
 #ifdef HTTPS
@@ -36,16 +44,71 @@ void parse_option(int argc,char **argv,char* d,char** portp,char** logp,char** s
 void parse_option(int argc,char **argv,char* d,char** portp,char** logp);
 #endif
 
+/* dirlist.c */
+long dirlist_serve(int fd, const char *path, const struct stat *st,
+                   const char *query, int chunked, int *keep_alive);
+                                        // body bytes sent, -1 if unreadable
+
 /* log.c */
 #define MAXLINELEN 8192
-extern FILE *logfp;
+struct log_stats {
+    unsigned long records;      /* lines queued */
+    unsigned long dropped;      /* lines dropped because the ring was full */
+    unsigned long bytes;        /* bytes written to the file */
+    unsigned long flushes;      /* batched writes */
+    unsigned long rotations;    /* files rotated by this process */
+};
 void initlog(const char* logp);
 void writetime();
 void writelog(const char* buf);
+void log_flush(void);           // write out pending lines now
+void log_get_stats(struct log_stats *stats);
 char* timeModify(time_t timeval,char *time);
 
+/* binlog.c */
+void binlog_init(const char *path, long segment_records);
+void binlog_write(uint64_t start_us, uint32_t latency_us,
+                  const struct sockaddr *addr, int method, int status,
+                  long bytes, const char *url);
+
+/* prefork.c */
+typedef void prefork_handler_t(int connfd, struct sockaddr_in *cli_addr);
+void prefork_run(int listenfd, int nworkers, prefork_handler_t *handler);
+
 /* secure_access.c */
-int access_ornot(const char *destip); // 0 -> not 1 -> ok
+int access_ornot(const struct sockaddr *addr); // 0 -> not 1 -> ok
+void rate_limit_init(void);                    // before forking the connections
+// kind is RATELIMIT_CONN or RATELIMIT_REQUEST, 0 -> ok, else Retry-After
+long rate_limit(const struct sockaddr *addr, int kind);
+
+/* tls_session.c */
+#ifdef HTTPS
+struct tls_stats {
+    unsigned long handshakes;
+    unsigned long resumed;          /* by ticket or by session id */
+    unsigned long tickets_issued;
+    unsigned long tickets_renewed;  /* accepted under an older key */
+    unsigned long tickets_unknown;  /* key rotated out or not ours */
+    unsigned long cache_stores;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long key_rotations;
+};
+void tls_session_init(SSL_CTX *ctx);     // before forking the connections
+void tls_session_account(SSL *ssl);      // after each SSL_accept
+void tls_session_get_stats(struct tls_stats *stats);
+#endif
+
+/* cgicache.c */
+void  cgicache_init(void);                  // before forking the connections
+void  cgicache_request_begin(void);         // before the request headers
+void  cgicache_request_header(const char *line);
+// 1 -> *data (free it) is the output of program, stored *age seconds ago
+int   cgicache_lookup(const char *program, const char *query,
+                      char **data, size_t *len, long *age);
+char *cgicache_capture(size_t *max);        // NULL -> do not capture
+void  cgicache_store(const char *program, const char *query,
+                     const char *data, size_t len, int at_eof);
 
 /* main.c */
 
@@ -2,97 +2,229 @@
 #include "wrap.h"
 extern char *cwd;
 
-FILE *configfp=NULL;
-static FILE *getfp(char *path)
-{
-	configfp=Fopen(path,"r");
-	return configfp;
+/*
+ *  config.ini is parsed once into an in-memory table (a snapshot), lookups
+ *  are a hash probe into the current snapshot and never touch the file.
+ *
+ *  SIGHUP only raises a flag, the next lookup (made at a safe point of the
+ *  request path, never inside the handler) parses the file into a fresh
+ *  snapshot and swaps it in. The previous snapshot is kept alive for one more
+ *  reload so the strings handed out from it stay valid; a broken file keeps
+ *  the old snapshot.
+ */
+
+#define CONFIG_SLOTS    64      /* power of 2, > number of keys */
+#define CONFIG_NAMELEN  32
+#define CONFIG_VALUELEN 512
+
+enum config_type { CONFIG_STRING = 0, CONFIG_INT, CONFIG_BOOL };
+
+struct config_entry {
+    int  used;
+    enum config_type type;
+    long int_value;                 /* valid for CONFIG_INT and CONFIG_BOOL */
+    char name[CONFIG_NAMELEN];
+    char value[CONFIG_VALUELEN];
+};
+
+struct config_table {
+    int count;
+    struct config_entry slots[CONFIG_SLOTS];
+};
+
+static struct config_table *current = NULL;
+static struct config_table *retired = NULL;
+static unsigned long generation = 0;
+static volatile sig_atomic_t reload_pending = 0;
+
+static unsigned int hash_name(const char *name) {
+    unsigned int h = 2166136261u;   /* FNV-1a */
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct config_entry *lookup(struct config_table *table,
+                                   const char *name, int insert) {
+    unsigned int i = hash_name(name) & (CONFIG_SLOTS - 1);
+    for (int n = 0; n < CONFIG_SLOTS; ++n) {
+        struct config_entry *entry = &table->slots[i];
+        if (!entry->used) {
+            return insert ? entry : NULL;
+        }
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+        i = (i + 1) & (CONFIG_SLOTS - 1);
+    }
+    return NULL;
 }
 
+/*
+ * decide the type of a value once, so that callers get it ready to use
+ */
+static void type_value(struct config_entry *entry) {
+    char *end;
+    if (strcasecmp(entry->value, "yes") == 0 ||
+        strcasecmp(entry->value, "on") == 0) {
+        entry->type = CONFIG_BOOL;
+        entry->int_value = 1;
+    }
+    else if (strcasecmp(entry->value, "no") == 0 ||
+             strcasecmp(entry->value, "off") == 0) {
+        entry->type = CONFIG_BOOL;
+        entry->int_value = 0;
+    }
+    else if (entry->value[0] != '\0' &&
+             (entry->int_value = strtol(entry->value, &end, 10), *end == '\0')) {
+        entry->type = CONFIG_INT;
+    }
+    else {
+        entry->type = CONFIG_STRING;
+        entry->int_value = 0;
+    }
+}
 
-static char* getconfig(const char* name)
-{
 /*
-pointer meaning:
-
-...port...=...8000...
-   |  |   |   |  |
-  *fs |   |   |  *be    f->forward  b-> back
-      *fe |   *bs       s->start    e-> end
-          *equal
-*/
-	static char info[64];
-	int find=0;
-	char tmp[256],fore[64],back[64],tmpcwd[MAXLINE];
-	char *fs,*fe,*equal,*bs,*be,*start;
-
-	strcpy(tmpcwd,cwd);
-	strcat(tmpcwd,"/");
-	FILE *fp=getfp(strcat(tmpcwd,"config.ini"));
-	while(fgets(tmp,255,fp)!=NULL)
-	{
-		start=tmp;
-		equal=strchr(tmp,'=');
-
-		while(isblank(*start))
-			++start;
-		fs=start;
-
-		if(*fs=='#')
-			continue;
-		while(isalpha(*start))
-			++start;
-		fe=start-1;
-
-		strncpy(fore,fs,fe-fs+1);
-		fore[fe-fs+1]='\0';
-		if(strcmp(fore,name)!=0)
-			continue;
-		find=1;
-
-		start=equal+1;
-		while(isblank(*start))
-			++start;
-		bs=start;
-
-		while(!isblank(*start)&&*start!='\n')
-			++start;
-		be=start-1;
-
-		strncpy(back,bs,be-bs+1);
-		back[be-bs+1]='\0';
-		strcpy(info,back);
-		break;
-	}
-	if(find)
-		return info;
-	else
-		return NULL;
+ * parse "name = value" lines, '#' starts a comment line,
+ * the value is the rest of the line without surrounding blanks
+ */
+static struct config_table *parse_file(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        syslog(LOG_ERR, "cannot open config file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct config_table *table = calloc(1, sizeof(*table));
+    if (table == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    char line[MAXLINE];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *start = line;
+        while (isblank(*start)) ++start;
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+
+        char *equal = strchr(start, '=');
+        if (equal == NULL) {
+            continue;
+        }
+
+        char *name_end = start;
+        while (isalnum(*name_end) || *name_end == '_') ++name_end;
+        int name_len = name_end - start;
+        if (name_len == 0 || name_len >= CONFIG_NAMELEN) {
+            continue;
+        }
+
+        char *value = equal + 1;
+        while (isblank(*value)) ++value;
+        char *value_end = value + strlen(value);
+        while (value_end > value && isspace(value_end[-1])) --value_end;
+        if (value_end - value >= CONFIG_VALUELEN) {
+            syslog(LOG_ERR, "config value of %.*s too long", name_len, start);
+            continue;
+        }
+
+        char name[CONFIG_NAMELEN];
+        memcpy(name, start, name_len);
+        name[name_len] = '\0';
+
+        struct config_entry *entry = lookup(table, name, 1);
+        if (entry == NULL) {
+            syslog(LOG_ERR, "too many config entries, %s ignored", name);
+            continue;
+        }
+        if (!entry->used) {
+            entry->used = 1;
+            ++table->count;
+            strcpy(entry->name, name);
+        }
+        memcpy(entry->value, value, value_end - value);
+        entry->value[value_end - value] = '\0';
+        type_value(entry);
+    }
+
+    fclose(fp);
+    return table;
+}
+
+static int load(void) {
+    char path[MAXLINE];
+    snprintf(path, sizeof(path), "%s/config.ini", cwd);
+
+    struct config_table *table = parse_file(path);
+    if (table == NULL) {
+        return -1;
+    }
+
+    free(retired);
+    retired = current;
+    current = table;
+    ++generation;
+    return 0;
+}
+
+static struct config_table *snapshot(void) {
+    if (reload_pending) {
+        reload_pending = 0;
+        if (load() == 0) {
+            syslog(LOG_INFO, "configuration reloaded");
+        }
+    }
+    if (current == NULL && load() < 0) {
+        exit(0);
+    }
+    return current;
 }
 
-char* Getconfig(const char* name)
-{
-	char *p=getconfig(name);
-	if(p==NULL)
-	{
-		syslog(LOG_ERR,"there is no %s in the configure",name);
-		exit(0);
-	}
-	else
-		return p;
+void config_sig_hup(int signo) {
+    reload_pending = 1;
 }
 
-/* parse_config test
+void config_reload(void) {
+    reload_pending = 1;
+    snapshot();
+}
 
-int main()
-{
-	char *s=getconfig("port");
-	printf("%s\n",s);
+unsigned long config_generation(void) {
+    snapshot();
+    return generation;
+}
 
-	s=getconfig("root");
-	printf("%s\n",s);
+char* Getconfig(const char* name) {
+    struct config_entry *entry = lookup(snapshot(), name, 0);
+    if (entry == NULL) {
+        syslog(LOG_ERR, "there is no %s in the configure", name);
+        exit(0);
+    }
+    return entry->value;
 }
 
-*/
+const char *Getconfig_default(const char *name, const char *def) {
+    struct config_entry *entry = lookup(snapshot(), name, 0);
+    return entry ? entry->value : def;
+}
 
+long Getconfig_int(const char *name, long def) {
+    struct config_entry *entry = lookup(snapshot(), name, 0);
+    if (entry == NULL || entry->type == CONFIG_STRING) {
+        return def;
+    }
+    return entry->int_value;
+}
 
+int Getconfig_bool(const char *name, int def) {
+    struct config_entry *entry = lookup(snapshot(), name, 0);
+    if (entry == NULL || entry->type == CONFIG_STRING) {
+        return def;
+    }
+    return entry->int_value != 0;
+}
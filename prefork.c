@@ -0,0 +1,254 @@
+#include "wrap.h"
+#include "parse.h"
+
+/*
+ *  Preforked worker pool
+ *      the master forks a fixed set of long-lived workers which all block in
+ *      accept() on the shared listen socket, so the kernel hands each new
+ *      connection to exactly one idle worker. The master never touches a
+ *      connection: it only reaps and respawns workers, forwards SIGHUP (config
+ *      reload) to them, and stops them all on SIGTERM/SIGINT.
+ *      (the same layout as ProcessPool in ss/ww, minus the parent-side
+ *      dispatch)
+ */
+
+#define MAX_WORKER_NUMBER 64
+
+// a worker that dies sooner than RESPAWN_STABLE seconds after its start
+// counts as a crash; its slot is refilled after 1, 2, 4 ... seconds, at most
+// RESPAWN_MAX_DELAY, so a worker that cannot start does not fork in a loop
+#define RESPAWN_STABLE    5
+#define RESPAWN_MAX_DELAY 32
+
+struct worker {
+    pid_t  pid;         /* -1 if the slot is empty */
+    time_t started;     /* when the worker was forked */
+    int    crashes;     /* fast exits or fork errors in a row */
+    time_t respawn_at;  /* an empty slot is refilled from then on */
+};
+
+static struct worker workers[MAX_WORKER_NUMBER];
+static int worker_number = 0;
+
+static volatile sig_atomic_t child_exited = 0;
+static volatile sig_atomic_t reload_config = 0;
+static volatile sig_atomic_t stop_master = 0;
+static volatile sig_atomic_t stop_worker = 0;
+
+static void master_sig_handler(int signo) {
+    if      (signo == SIGCHLD) child_exited = 1;
+    else if (signo == SIGHUP)  reload_config = 1;
+    else if (signo == SIGALRM) return;      /* a respawn delay is over */
+    else                       stop_master = 1;
+}
+
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void worker_sig_term_handler(int signo) {
+    stop_worker = 1;
+}
+
+static void worker_sig_chld_handler(int signo) {
+    int save_errno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        continue;
+    }
+    errno = save_errno;
+}
+
+/*
+ * worker main loop, never returns
+ *     SIGTERM interrupts accept() (no SA_RESTART) and the worker exits after
+ *     the connection in hand, so exit() handlers such as the log flush run
+ */
+static void run_worker(int listenfd, prefork_handler_t *handler) {
+    Signal(SIGCHLD, worker_sig_chld_handler);
+    Signal(SIGHUP,  config_sig_hup);
+    Signal(SIGINT,  SIG_DFL);
+    Signal(SIGALRM, SIG_DFL);
+    // a client that goes away shows up as EPIPE on the next write
+    Signal(SIGPIPE, SIG_IGN);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = worker_sig_term_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+
+    sigset_t mask;
+    Sigemptyset(&mask);
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    while (!stop_worker) {
+        struct sockaddr_in cli_addr;
+        socklen_t cli_addr_len = sizeof(cli_addr);
+        int connfd = accept(listenfd, (SA *)&cli_addr, &cli_addr_len);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            syslog(LOG_ERR, "worker %d accept error: %s",
+                   (int)getpid(), strerror(errno));
+            exit(1);
+        }
+
+        handler(connfd, &cli_addr);
+        Close(connfd);
+    }
+    exit(0);
+}
+
+/*
+ * leave a slot empty for a while, longer after every crash in a row
+ */
+static void delay_respawn(int idx, time_t now) {
+    struct worker *w = &workers[idx];
+    int delay = 1;
+    for (int i = 1; i < w->crashes && delay < RESPAWN_MAX_DELAY; ++i) {
+        delay *= 2;
+    }
+    w->respawn_at = now + delay;
+}
+
+static pid_t spawn_worker(int idx, int listenfd, prefork_handler_t *handler) {
+    time_t now = now_sec();
+    pid_t pid = fork();
+    if (pid < 0) {
+        syslog(LOG_ERR, "fork worker %d error: %s", idx, strerror(errno));
+        workers[idx].crashes++;
+        delay_respawn(idx, now);
+        return -1;
+    }
+    if (pid == 0) {
+        run_worker(listenfd, handler);
+    }
+
+    workers[idx].pid = pid;
+    workers[idx].started = now;
+    return pid;
+}
+
+/*
+ * reap every exited worker, its slot is refilled by refill_workers
+ */
+static void reap_workers(void) {
+    time_t now = now_sec();
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < worker_number; ++i) {
+            struct worker *w = &workers[i];
+            if (w->pid != pid) {
+                continue;
+            }
+            w->pid = -1;
+            if (now - w->started < RESPAWN_STABLE) {
+                w->crashes++;
+                delay_respawn(i, now);
+            }
+            else {
+                w->crashes = 0;
+                w->respawn_at = now;
+            }
+            if (!stop_master) {
+                syslog(LOG_WARNING, "worker %d (pid %d) exited, respawn in "
+                       "%lds", i, (int)pid, (long)(w->respawn_at - now));
+            }
+        }
+    }
+}
+
+/*
+ * fork a worker into every empty slot whose delay is over, whether the last
+ * one exited or the fork itself failed, and set an alarm for the next one
+ */
+static void refill_workers(int listenfd, prefork_handler_t *handler) {
+    time_t now = now_sec();
+    time_t next = 0;
+    for (int i = 0; i < worker_number; ++i) {
+        if (workers[i].pid != -1) {
+            continue;
+        }
+        if (workers[i].respawn_at <= now) {
+            spawn_worker(i, listenfd, handler);
+        }
+        if (workers[i].pid == -1 &&
+            (next == 0 || workers[i].respawn_at < next)) {
+            next = workers[i].respawn_at;
+        }
+    }
+    alarm(next == 0 ? 0 : (unsigned)(next > now ? next - now : 1));
+}
+
+void prefork_run(int listenfd, int nworkers, prefork_handler_t *handler) {
+    if (nworkers > MAX_WORKER_NUMBER) {
+        nworkers = MAX_WORKER_NUMBER;
+    }
+    worker_number = nworkers;
+
+    // block the master signals until we are waiting for them
+    sigset_t mask, old_mask;
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigaddset(&mask, SIGHUP);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGALRM);
+    Sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+    Signal(SIGCHLD, master_sig_handler);
+    Signal(SIGHUP,  master_sig_handler);
+    Signal(SIGTERM, master_sig_handler);
+    Signal(SIGINT,  master_sig_handler);
+    Signal(SIGALRM, master_sig_handler);
+
+    for (int i = 0; i < worker_number; ++i) {
+        workers[i].pid = -1;
+        workers[i].crashes = 0;
+        workers[i].respawn_at = 0;
+    }
+    refill_workers(listenfd, handler);
+
+    sigset_t wait_mask = old_mask;
+    Sigdelset(&wait_mask, SIGCHLD);
+    Sigdelset(&wait_mask, SIGHUP);
+    Sigdelset(&wait_mask, SIGTERM);
+    Sigdelset(&wait_mask, SIGINT);
+    Sigdelset(&wait_mask, SIGALRM);
+
+    while (!stop_master) {
+        sigsuspend(&wait_mask);
+        if (child_exited) {
+            child_exited = 0;
+            reap_workers();
+        }
+        if (!stop_master) {
+            refill_workers(listenfd, handler);
+        }
+        if (reload_config) {
+            // reload here so respawned workers inherit the new snapshot
+            reload_config = 0;
+            config_reload();
+            for (int i = 0; i < worker_number; ++i) {
+                if (workers[i].pid != -1) {
+                    kill(workers[i].pid, SIGHUP);
+                }
+            }
+        }
+    }
+
+    // stop all workers and wait for them
+    alarm(0);
+    for (int i = 0; i < worker_number; ++i) {
+        if (workers[i].pid != -1) {
+            kill(workers[i].pid, SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0) {
+        continue;
+    }
+    exit(0);
+}
@@ -0,0 +1,212 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "ratelimit.h"
+
+/*
+ *  The buckets live in one MAP_SHARED region, split into RL_SHARDS shards
+ *  that each have their own robust process-shared mutex, so processes and
+ *  threads checking different clients rarely wait for each other. Inside a
+ *  shard the entries are grouped in sets of RL_WAYS: a client hashes to one
+ *  set, and when it is not there it takes the free entry or the one seen
+ *  least recently (an approximate LRU over the whole table).
+ *
+ *  Nothing runs in the background: an entry remembers when it was last
+ *  seen and its buckets are refilled for the time since then when the
+ *  client comes back.
+ */
+
+#define RL_SHARDS   64
+#define RL_WAYS     8
+
+struct rl_entry {
+    uint64_t key[2];            /* IPv4 mapped into IPv6, IPv6 /64 */
+    uint64_t seen;              /* ns of the last visit, 0 -> free */
+    float    tokens[RATELIMIT_KINDS];
+};
+
+union rl_shard {
+    pthread_mutex_t lock;
+    char            pad[64];    /* one cache line per lock */
+};
+
+struct ratelimit {
+    size_t   bytes;
+    long     sets;              /* per shard */
+    uint64_t seed;
+    // written without the locks, a check that sees the old value is fine
+    double   rate[RATELIMIT_KINDS];
+    double   burst[RATELIMIT_KINDS];
+    union rl_shard  shards[RL_SHARDS];
+    struct rl_entry entries[];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+struct ratelimit *ratelimit_create(size_t max_clients) {
+    long sets = (max_clients + RL_SHARDS * RL_WAYS - 1) / (RL_SHARDS * RL_WAYS);
+    if (sets < 1) {
+        sets = 1;
+    }
+    size_t bytes = sizeof(struct ratelimit) +
+                   sets * RL_SHARDS * RL_WAYS * sizeof(struct rl_entry);
+    struct ratelimit *rl = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rl == MAP_FAILED) {
+        return NULL;
+    }
+
+    // the pages are zero: every entry is free and every kind unlimited
+    rl->bytes = bytes;
+    rl->sets = sets;
+    // a per-run seed, clients cannot pick addresses that share one set
+    rl->seed = mix(now_ns() ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)rl);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (int i = 0; i < RL_SHARDS; ++i) {
+        pthread_mutex_init(&rl->shards[i].lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return rl;
+}
+
+void ratelimit_free(struct ratelimit *rl) {
+    if (rl) {
+        munmap(rl, rl->bytes);
+    }
+}
+
+void ratelimit_set(struct ratelimit *rl, int kind, double rate, double burst) {
+    if (rl == NULL || kind < 0 || kind >= RATELIMIT_KINDS) {
+        return;
+    }
+    rl->burst[kind] = burst < 1 ? 1 : burst;
+    rl->rate[kind] = rate > 0 ? rate : 0;
+}
+
+int ratelimit_parse(const char *spec, double *rate, double *burst) {
+    char *end;
+    *rate = strtod(spec, &end);
+    *burst = *rate;
+    if (end == spec || *rate < 0) {
+        return -1;
+    }
+    if (*end == '/') {
+        const char *p = end + 1;
+        *burst = strtod(p, &end);
+        if (end == p || *burst < 0) {
+            return -1;
+        }
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+/* return 0 if addr is not an internet address */
+static int make_key(const struct sockaddr *addr, uint64_t key[2]) {
+    unsigned char bytes[16];
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        memset(bytes, 0, 10);
+        bytes[10] = bytes[11] = 0xff;
+        memcpy(bytes + 12, &in->sin_addr, 4);
+    }
+    else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(bytes, &in6->sin6_addr, 16);
+        // one host may own a whole /64, a mapped IPv4 peer is one address
+        if (!IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            memset(bytes + 8, 0, 8);
+        }
+    }
+    else {
+        return 0;
+    }
+    memcpy(key, bytes, 16);
+    return 1;
+}
+
+long ratelimit_take(struct ratelimit *rl, int kind,
+                    const struct sockaddr *addr) {
+    if (rl == NULL || kind < 0 || kind >= RATELIMIT_KINDS ||
+        rl->rate[kind] <= 0) {
+        return 0;
+    }
+    uint64_t key[2];
+    if (!make_key(addr, key)) {
+        return 0;
+    }
+
+    uint64_t h = mix(key[0] ^ rl->seed) ^ mix(key[1] + rl->seed);
+    union rl_shard *shard = &rl->shards[h % RL_SHARDS];
+    struct rl_entry *set = &rl->entries[((h % RL_SHARDS) * rl->sets +
+                                         (h / RL_SHARDS) % rl->sets) * RL_WAYS];
+
+    if (pthread_mutex_lock(&shard->lock) == EOWNERDEAD) {
+        // the holder died between two plain stores, the entry is usable
+        pthread_mutex_consistent(&shard->lock);
+    }
+
+    uint64_t now = now_ns();
+    struct rl_entry *entry = NULL;
+    struct rl_entry *victim = &set[0];
+    for (int i = 0; i < RL_WAYS; ++i) {
+        struct rl_entry *e = &set[i];
+        if (e->seen && e->key[0] == key[0] && e->key[1] == key[1]) {
+            entry = e;
+            break;
+        }
+        if (e->seen < victim->seen) {
+            victim = e;
+        }
+    }
+
+    if (entry == NULL) {
+        entry = victim;
+        entry->key[0] = key[0];
+        entry->key[1] = key[1];
+        for (int k = 0; k < RATELIMIT_KINDS; ++k) {
+            entry->tokens[k] = rl->burst[k];
+        }
+    }
+    else {
+        double elapsed = (now - entry->seen) / 1e9;
+        for (int k = 0; k < RATELIMIT_KINDS; ++k) {
+            double tokens = entry->tokens[k] + elapsed * rl->rate[k];
+            entry->tokens[k] = tokens < rl->burst[k] ? tokens : rl->burst[k];
+        }
+    }
+    entry->seen = now;
+
+    long wait = 0;
+    if (entry->tokens[kind] >= 1) {
+        entry->tokens[kind] -= 1;
+    }
+    else {
+        wait = (long)((1 - entry->tokens[kind]) / rl->rate[kind]) + 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return wait;
+}
@@ -0,0 +1,47 @@
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *  Per-client token buckets, shared by twebs and the ss server.
+ *
+ *  every client address has one bucket per kind: new connections, checked
+ *  right after accept, and requests. A bucket holds at most burst tokens
+ *  and refills at rate tokens per second; each connection or request takes
+ *  one. IPv4 clients are keyed by address, IPv6 clients by their /64.
+ *  The table has room for a fixed number of clients, a new client replaces
+ *  the one seen least recently among a few candidates, so a flood of
+ *  addresses costs no memory and only forgets the quietest clients.
+ */
+enum { RATELIMIT_CONN = 0, RATELIMIT_REQUEST, RATELIMIT_KINDS };
+
+struct ratelimit;
+
+/* the table is in shared memory, create it before forking the children */
+struct ratelimit *ratelimit_create(size_t max_clients);
+void ratelimit_free(struct ratelimit *rl);
+
+/* rate <= 0 -> kind is not limited, burst < 1 -> one token */
+void ratelimit_set(struct ratelimit *rl, int kind, double rate, double burst);
+
+/* "rate[/burst]" in tokens per second, burst defaults to rate; -1 if bad */
+int ratelimit_parse(const char *spec, double *rate, double *burst);
+
+/*
+ * take a token of kind for addr; return 0 if there was one, otherwise the
+ * seconds until there is (for Retry-After). A NULL rl never limits.
+ */
+long ratelimit_take(struct ratelimit *rl, int kind,
+                    const struct sockaddr *addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
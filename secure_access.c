@@ -1,106 +1,102 @@
 #include "parse.h"
+#include "acl.h"
+#include "ratelimit.h"
 
 /*
  *  Function: can accesser access this web or not
- *	     e.g. the seg ip address: 192.168.1.0/255.255.255.0
- *                 accesser ip: 192.168.1.2 & 255.255.255.0 ?= 192.168.1.0
+ *      the rules come from "acl" in config.ini, e.g.
+ *          acl = allow:192.168.1.0/24 deny:192.168.1.13 allow:::1
+ *      or, if there is no "acl", from the old single "mask" rule
+ *          mask = 192.168.1.0/255.255.255.0
+ *      they are compiled once per configuration snapshot (see acl.c), a
+ *      check is a trie walk over the raw peer address.
  */
 
+static struct acl *acl = NULL;
+static unsigned long acl_generation = 0;
 
-/*
- *  Function:  a ip address effective or not
- *  return value :  -1 error
- */
-
-
-/*
- *   Function: convert ip to long long
- */
-static long long ipadd_to_longlong(const char *ip)
-{
-    const char *p=ip;
-    int ge,shi,bai,qian;
-    qian=atoi(p);
-
-    p=strchr(p,'.')+1;
-    bai=atoi(p);
-
-    p=strchr(p,'.')+1;
-    shi=atoi(p);
+static void compile_acl(void) {
+    char rules[MAXLINELEN];
+    const char *source = Getconfig_default("acl", NULL);
+    if (source == NULL) {
+        const char *mask = Getconfig_default("mask", "");
+        snprintf(rules, sizeof(rules), "%s%s", mask[0] ? "allow:" : "", mask);
+    }
+    else {
+        snprintf(rules, sizeof(rules), "%s", source);
+    }
 
-    p=strchr(p,'.')+1;
-    ge=atoi(p);
+    char err[128];
+    struct acl *compiled = acl_compile(rules, err, sizeof(err));
+    if (compiled == NULL) {
+        // keep the previous list rather than opening the server up
+        syslog(LOG_ERR, "%s", err);
+        if (acl == NULL) {
+            exit(1);
+        }
+        return;
+    }
 
-    return (qian<<24)+(bai<<16)+(shi<<8)+ge;
+    acl_free(acl);
+    acl = compiled;
 }
 
-
-int access_ornot(const char *destip) // 0 -> not 1 -> ok
+int access_ornot(const struct sockaddr *addr) // 0 -> not 1 -> ok
 {
-    //192.168.1/255.255.255.0
-
-    char ipinfo[16],maskinfo[16];
-    char *p,*ip=ipinfo,*mask=maskinfo;
-    char count=0;
-    char *maskget=Getconfig("mask");
-    const char *destipconst,*ipinfoconst,*maskinfoconst;
-    if(maskget=="")
-    {
-        printf("ok:%s\n",maskget);
-        return 1;
+    unsigned long generation = config_generation();
+    if (acl == NULL || generation != acl_generation) {
+        acl_generation = generation;
+        compile_acl();
     }
-    p=maskget;
+    return acl_check(acl, addr);
+}
 
-    /* get ipinfo[] start */
+/*
+ *  Function: has a client used up its connections or requests
+ *      rate_limit_clients buckets are shared by all processes (see
+ *      ratelimit.c), rate_limit_conn and rate_limit_request give
+ *      "rate[/burst]" per second and may change on SIGHUP; empty -> off
+ */
 
-    while(*p!='/')
-    {
-        if(*p=='.')
-            ++count;
-        *ip++=*p++;
-    }
+static struct ratelimit *limits = NULL;
+static unsigned long limits_generation = 0;
 
-    while(count<3)
-    {
-        *ip++='.';
-        *ip++='0';
-        ++count;
+static void set_limit(int kind, const char *name) {
+    double rate = 0, burst = 0;
+    const char *spec = Getconfig_default(name, "");
+    if (*spec != '\0' && ratelimit_parse(spec, &rate, &burst) < 0) {
+        syslog(LOG_ERR, "bad %s: %s", name, spec);
+        return;
     }
-    *ip='\0';
-
-    /* get ipinfo[] end */
+    ratelimit_set(limits, kind, rate, burst);
+}
 
-    /* get maskinfo[] start */
+static void set_limits(void) {
+    limits_generation = config_generation();
+    set_limit(RATELIMIT_CONN, "rate_limit_conn");
+    set_limit(RATELIMIT_REQUEST, "rate_limit_request");
+}
 
-    ++p;
-    while(*p!='\0')
-    {
-        if(*p=='.')
-            ++count;
-        *mask++=*p++;
+void rate_limit_init(void) {
+    long clients = Getconfig_int("rate_limit_clients", 65536);
+    if (clients <= 0) {
+        return;
     }
-
-    while(count<3)
-    {
-        *mask++='.';
-        *mask++='0';
-        ++count;
+    limits = ratelimit_create(clients);
+    if (limits == NULL) {
+        syslog(LOG_ERR, "rate limit table: %m");
+        return;
     }
-    *mask='\0';
-
-    /* get maskinfo[] end */
-    destipconst=destip;
-    ipinfoconst=ipinfo;
-    maskinfoconst=maskinfo;
-
-    return ipadd_to_longlong(ipinfoconst)==(ipadd_to_longlong(maskinfoconst)&ipadd_to_longlong(destipconst));
+    set_limits();
 }
 
-/* access_ornot test
-
-   int main()
-   {
-   printf("%d\n",access_ornot("127.0.0.1"));
-   }
-
-*/
+long rate_limit(const struct sockaddr *addr, int kind) // 0 -> ok
+{
+    if (limits == NULL) {
+        return 0;
+    }
+    if (config_generation() != limits_generation) {
+        set_limits();
+    }
+    return ratelimit_take(limits, kind, addr);
+}
@@ -0,0 +1,108 @@
+#ifndef AFFINITY_HPP_
+#define AFFINITY_HPP_
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+/*
+ * CPU 亲和性辅助函数
+ *   反应堆线程，工作线程以及进程池子进程都可以被绑定到指定的 CPU 上，
+ *   避免内核把它们在不同的 socket 之间来回迁移。
+ *   内存采用 "first touch" 策略：在线程/进程绑定之后再分配并首次写入的缓冲，
+ *   会落在该 CPU 所在的 NUMA 节点上。
+ */
+
+/*
+ * 解析形如 "0-3,8,10-11" 的 CPU 列表，结果按出现顺序保存在 cpus 中，
+ * 格式错误或 CPU 编号超出 CPU_SETSIZE 时返回 false
+ */
+static inline bool ParseCpuList(const char *list, std::vector<int> &cpus) {
+    cpus.clear();
+    if (!list || *list == '\0') {
+        return false;
+    }
+
+    const char *ptr = list;
+    while (*ptr != '\0') {
+        char *end = nullptr;
+        long first = strtol(ptr, &end, 10);
+        if (end == ptr || first < 0 || first >= CPU_SETSIZE) {
+            return false;
+        }
+
+        long last = first;
+        ptr = end;
+        if (*ptr == '-') {
+            ++ptr;
+            last = strtol(ptr, &end, 10);
+            if (end == ptr || last < first || last >= CPU_SETSIZE) {
+                return false;
+            }
+            ptr = end;
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+
+        if (*ptr == ',') {
+            ++ptr;
+        }
+        else if (*ptr != '\0') {
+            return false;
+        }
+    }
+
+    return !cpus.empty();
+}
+
+/*
+ * 将线程 tid 绑定到单个 CPU 上
+ */
+static inline bool PinThreadToCpu(pthread_t tid, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(tid, sizeof(set), &set);
+    if (ret != 0) {
+        fprintf(stderr, "pin thread to cpu %d error: %s\n", cpu, strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 将当前进程（调用线程）绑定到单个 CPU 上，之后创建的线程会继承该掩码
+ */
+static inline bool PinSelfToCpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 按 idx 轮流从 cpus 中选出一个 CPU，cpus 为空时返回 -1 表示不绑定
+ */
+static inline int PickCpu(const std::vector<int> &cpus, int idx) {
+    if (cpus.empty()) {
+        return -1;
+    }
+    return cpus[idx % cpus.size()];
+}
+
+#endif  // AFFINITY_HPP_
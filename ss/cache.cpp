@@ -0,0 +1,624 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <functional>
+
+#include "cache.hpp"
+#include "timer.hpp"
+
+namespace {
+
+// 不可缓存的标记保留的时间（毫秒）和最多保留的数量
+const int64_t PASS_TIME = 10000;
+const size_t  MAX_PASS = 10000;
+// 记住 Vary 头部名的基础键的数量上限
+const size_t  MAX_VARY = 100000;
+
+int64_t NowMs() {
+    return TimerHeap<CachedResponse>::NowMs();
+}
+
+std::string Trim(const std::string &s) {
+    size_t begin = s.find_first_not_of(" \t");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = s.find_last_not_of(" \t");
+    return s.substr(begin, end - begin + 1);
+}
+
+std::string Lower(std::string s) {
+    for (char &c : s) {
+        c = tolower((unsigned char)c);
+    }
+    return s;
+}
+
+/*
+ * 按逗号拆分头部的值，去掉两端的空白
+ */
+std::vector<std::string> SplitList(const std::string &value) {
+    std::vector<std::string> items;
+    size_t pos = 0;
+    while (pos <= value.size()) {
+        size_t comma = value.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = value.size();
+        }
+        std::string item = Trim(value.substr(pos, comma - pos));
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+        pos = comma + 1;
+    }
+    return items;
+}
+
+/*
+ * HTTP 日期（RFC 7231 的 IMF-fixdate），出错时返回 -1
+ */
+time_t ParseDate(const char *value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S", &tm);
+    if (!end) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+}  // namespace
+
+ProxyCache *ProxyCache::Create(size_t memory, const std::string &dir,
+                               size_t disk) {
+    ProxyCache *cache = new ProxyCache(memory, dir, disk);
+    if (!dir.empty() && !cache->OpenDir()) {
+        delete cache;
+        return nullptr;
+    }
+    if (!dir.empty()) {
+        if (pthread_create(&cache->writer_, NULL, Writer, cache) != 0) {
+            printf("proxy cache: cannot start the disk writer\n");
+            delete cache;
+            return nullptr;
+        }
+        cache->writer_started_ = true;
+    }
+    return cache;
+}
+
+ProxyCache::~ProxyCache() {
+    // 写线程做完队列中的任务后退出，不再写入新的文件
+    if (writer_started_) {
+        locker_.MutexLock();
+        stop_ = true;
+        locker_.MutexUnlock();
+        jobs_stat_.Add();
+        pthread_join(writer_, NULL);
+    }
+    for (const auto &entry : disk_entries_) {
+        unlink(Path(entry.first).c_str());
+    }
+}
+
+/*
+ * 创建磁盘层的目录，清除以前留下的缓存文件（只删除本模块命名的文件）
+ */
+bool ProxyCache::OpenDir() {
+    if (mkdir(dir_.c_str(), 0700) < 0 && errno != EEXIST) {
+        printf("proxy cache: mkdir %s: %s\n", dir_.c_str(), strerror(errno));
+        return false;
+    }
+    DIR *d = opendir(dir_.c_str());
+    if (!d) {
+        printf("proxy cache: %s: %s\n", dir_.c_str(), strerror(errno));
+        return false;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        const char *name = ent->d_name;
+        if (strlen(name) == 22 && strcmp(name + 16, ".cache") == 0 &&
+            strspn(name, "0123456789abcdef") == 16) {
+            unlink((dir_ + "/" + name).c_str());
+        }
+    }
+    closedir(d);
+    return true;
+}
+
+std::string ProxyCache::Path(const std::string &key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.cache",
+             (unsigned long long)std::hash<std::string>()(key));
+    return dir_ + "/" + name;
+}
+
+std::string ProxyCache::VariantKey(const std::string &base,
+                                   const std::vector<std::string> &vary,
+                                   const char *const *headers,
+                                   int header_count) {
+    std::string key = base;
+    for (const std::string &name : vary) {
+        key.append("\n").append(name).append(":");
+        bool first = true;
+        for (int i = 0; i < header_count; ++i) {
+            const char *h = headers[i];
+            if (strncasecmp(h, name.c_str(), name.size()) == 0 &&
+                h[name.size()] == ':') {
+                if (!first) {
+                    key.append(",");
+                }
+                key.append(Trim(h + name.size() + 1));
+                first = false;
+            }
+        }
+    }
+    return key;
+}
+
+ProxyCache::Result ProxyCache::Lookup(
+    const std::string &base, const char *const *headers, int header_count,
+    bool refresh, bool fill, HttpConn *conn, std::string *key,
+    std::shared_ptr<const CachedResponse> *obj) {
+    static const std::vector<std::string> no_vary;
+    int64_t now = NowMs();
+    Result result;
+
+    obj->reset();
+    locker_.MutexLock();
+    auto vary = vary_.find(base);
+    *key = VariantKey(base, vary != vary_.end() ? vary->second : no_vary,
+                      headers, header_count);
+
+    std::shared_ptr<const CachedResponse> found = Find(*key, now);
+    if (!found && TakeDisk(*key)) {
+        // 在锁外读取文件，期间其他请求可能已经放入了新的应答
+        locker_.MutexUnlock();
+        std::shared_ptr<const CachedResponse> loaded = Load(*key);
+        locker_.MutexLock();
+        found = Find(*key, now);
+        if (!found && loaded && now < loaded->stale_until) {
+            Insert(loaded);
+            found = loaded;
+        }
+    }
+
+    auto pass = pass_.find(*key);
+    if (pass != pass_.end() && now >= pass->second) {
+        pass_.erase(pass);
+        pass = pass_.end();
+    }
+    if (pass != pass_.end()) {
+        result = PASS;
+    }
+    else if (found && !refresh && now < found->fresh_until) {
+        *obj = found;
+        result = HIT;
+    }
+    else if (!fill) {
+        result = MISS;
+    }
+    else {
+        auto filling = fills_.find(*key);
+        if (filling == fills_.end()) {
+            fills_[*key];
+            *obj = found;
+            result = MISS;
+        }
+        else if (found && !refresh) {
+            *obj = found;
+            result = STALE;
+        }
+        else {
+            filling->second.push_back(conn);
+            result = WAIT;
+        }
+    }
+    locker_.MutexUnlock();
+    return result;
+}
+
+std::vector<HttpConn *> ProxyCache::Complete(
+    const std::string &key, std::shared_ptr<CachedResponse> obj,
+    bool uncacheable) {
+    std::vector<HttpConn *> waiters;
+    locker_.MutexLock();
+    auto filling = fills_.find(key);
+    if (filling != fills_.end()) {
+        waiters.swap(filling->second);
+        fills_.erase(filling);
+    }
+    if (obj) {
+        // 填充时还不知道应答有 Vary，键只是基础键，以后按新的变体键查找
+        std::string base = key.substr(0, key.find('\n'));
+        if (obj->key != key) {
+            Erase(key);
+        }
+        if (obj->vary.empty()) {
+            vary_.erase(base);
+        }
+        else {
+            if (vary_.size() >= MAX_VARY) {
+                vary_.clear();
+            }
+            vary_[base] = obj->vary;
+        }
+        Insert(obj);
+    }
+    else if (uncacheable) {
+        if (pass_.size() >= MAX_PASS) {
+            pass_.clear();
+        }
+        pass_[key] = NowMs() + PASS_TIME;
+    }
+    locker_.MutexUnlock();
+    return waiters;
+}
+
+/*
+ * 查找内存层和等待写入的应答，磁盘层由 Lookup 在锁外读取；
+ * 超过 stale_until 的应答被删除
+ */
+std::shared_ptr<const CachedResponse> ProxyCache::Find(const std::string &key,
+                                                       int64_t now) {
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        std::shared_ptr<const CachedResponse> obj = it->second.obj;
+        if (now >= obj->stale_until) {
+            Erase(key);
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return obj;
+    }
+    auto spill = spilling_.find(key);
+    if (spill == spilling_.end()) {
+        return nullptr;
+    }
+    // 还没有写入，取回内存层，写线程见到后放弃写入
+    std::shared_ptr<const CachedResponse> obj = spill->second;
+    spilling_size_ -= obj->Size();
+    spilling_.erase(spill);
+    if (now >= obj->stale_until) {
+        return nullptr;
+    }
+    Insert(obj);
+    return obj;
+}
+
+void ProxyCache::Insert(std::shared_ptr<const CachedResponse> obj) {
+    if (obj->Size() > MaxObject()) {
+        return;
+    }
+    Erase(obj->key);
+    lru_.push_front(obj->key);
+    entries_[obj->key] = Entry{obj, lru_.begin()};
+    size_ += obj->Size();
+
+    while (size_ > memory_) {
+        auto victim = entries_.find(lru_.back());
+        if (!dir_.empty()) {
+            Spill(victim->second.obj);
+        }
+        size_ -= victim->second.obj->Size();
+        entries_.erase(victim);
+        lru_.pop_back();
+    }
+}
+
+void ProxyCache::Erase(const std::string &key) {
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        size_ -= it->second.obj->Size();
+        lru_.erase(it->second.lru);
+        entries_.erase(it);
+    }
+    auto spill = spilling_.find(key);
+    if (spill != spilling_.end()) {
+        spilling_size_ -= spill->second->Size();
+        spilling_.erase(spill);
+    }
+    Unlink(key);
+}
+
+/*
+ * 把淘汰的应答交给写线程；写线程跟不上、等待写入的应答超过内存容量时
+ * 直接丢弃，不让它们占用更多内存
+ */
+void ProxyCache::Spill(std::shared_ptr<const CachedResponse> obj) {
+    if (obj->Size() > disk_ || spilling_size_ + obj->Size() > memory_) {
+        return;
+    }
+    auto it = spilling_.find(obj->key);
+    if (it != spilling_.end()) {
+        spilling_size_ -= it->second->Size();
+    }
+    spilling_size_ += obj->Size();
+    spilling_[obj->key] = obj;
+    jobs_.push_back(DiskJob{obj, std::string()});
+    jobs_stat_.Add();
+}
+
+/*
+ * 从磁盘层的记录中取出 key，文件留给调用者；没有记录时返回 false
+ */
+bool ProxyCache::TakeDisk(const std::string &key) {
+    auto it = disk_entries_.find(key);
+    if (it == disk_entries_.end()) {
+        return false;
+    }
+    disk_size_ -= it->second.size;
+    disk_lru_.erase(it->second.lru);
+    disk_entries_.erase(it);
+    return true;
+}
+
+void ProxyCache::Unlink(const std::string &key) {
+    if (TakeDisk(key)) {
+        jobs_.push_back(DiskJob{nullptr, Path(key)});
+        jobs_stat_.Add();
+    }
+}
+
+void *ProxyCache::Writer(void *arg) {
+    static_cast<ProxyCache *>(arg)->RunWriter();
+    return nullptr;
+}
+
+/*
+ * 写线程按顺序执行任务，同一个文件的删除和写入不会颠倒
+ */
+void ProxyCache::RunWriter() {
+    while (true) {
+        jobs_stat_.Wait();
+        locker_.MutexLock();
+        if (jobs_.empty()) {
+            bool stop = stop_;
+            locker_.MutexUnlock();
+            if (stop) {
+                return;
+            }
+            continue;
+        }
+        DiskJob job = std::move(jobs_.front());
+        jobs_.pop_front();
+        bool wanted = false;
+        if (job.obj && !stop_) {
+            auto it = spilling_.find(job.obj->key);
+            wanted = it != spilling_.end() && it->second == job.obj;
+        }
+        locker_.MutexUnlock();
+
+        if (!job.obj) {
+            unlink(job.path.c_str());
+        }
+        else if (wanted) {
+            Spilled(job.obj, WriteFile(*job.obj));
+        }
+    }
+}
+
+/*
+ * 写入结束：应答仍在等待写入时登记到磁盘层，
+ * 写入期间被取回或被新的应答代替时删除刚写的文件
+ */
+void ProxyCache::Spilled(std::shared_ptr<const CachedResponse> obj,
+                         bool written) {
+    locker_.MutexLock();
+    auto it = spilling_.find(obj->key);
+    bool current = it != spilling_.end() && it->second == obj;
+    if (current) {
+        spilling_size_ -= obj->Size();
+        spilling_.erase(it);
+    }
+    if (current && written) {
+        TakeDisk(obj->key);
+        disk_lru_.push_front(obj->key);
+        disk_entries_[obj->key] = DiskEntry{obj->Size(), disk_lru_.begin()};
+        disk_size_ += obj->Size();
+        while (disk_size_ > disk_) {
+            Unlink(disk_lru_.back());
+        }
+    }
+    locker_.MutexUnlock();
+    if (written && !current) {
+        unlink(Path(obj->key).c_str());
+    }
+}
+
+/*
+ * 磁盘文件：一行固定字段，然后依次是键、Vary（逗号分隔）、原因短语、
+ * 头部和应答体。先写临时文件再改名，不会读到写了一半的文件
+ */
+bool ProxyCache::WriteFile(const CachedResponse &obj) const {
+    std::string vary;
+    for (const std::string &name : obj.vary) {
+        vary.append(vary.empty() ? "" : ",").append(name);
+    }
+    std::string path = Path(obj.key);
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        return false;
+    }
+    fprintf(fp, "SSCACHE1 %zu %zu %zu %zu %zu %d %ld %lld %lld %lld\n",
+            obj.key.size(), vary.size(), obj.title.size(),
+            obj.headers.size(), obj.body.size(), obj.status, obj.age,
+            (long long)obj.stored, (long long)obj.fresh_until,
+            (long long)obj.stale_until);
+    fwrite(obj.key.data(), 1, obj.key.size(), fp);
+    fwrite(vary.data(), 1, vary.size(), fp);
+    fwrite(obj.title.data(), 1, obj.title.size(), fp);
+    fwrite(obj.headers.data(), 1, obj.headers.size(), fp);
+    fwrite(obj.body.data(), 1, obj.body.size(), fp);
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+ * 打开后立即删除文件，读回内存的应答再被淘汰时重新写入；
+ * 哈希相同的另一个键的文件因键不符而被忽略
+ */
+std::shared_ptr<const CachedResponse> ProxyCache::Load(
+        const std::string &key) const {
+    std::string path = Path(key);
+    FILE *fp = fopen(path.c_str(), "r");
+    std::shared_ptr<CachedResponse> obj;
+    if (!fp) {
+        return obj;
+    }
+    unlink(path.c_str());
+
+    size_t key_len, vary_len, title_len, headers_len, body_len;
+    int status;
+    long age;
+    long long stored, fresh_until, stale_until;
+    if (fscanf(fp, "SSCACHE1 %zu %zu %zu %zu %zu %d %ld %lld %lld %lld",
+               &key_len, &vary_len, &title_len, &headers_len, &body_len,
+               &status, &age, &stored, &fresh_until, &stale_until) == 10 &&
+        fgetc(fp) == '\n') {
+        std::string data(key_len + vary_len + title_len + headers_len +
+                         body_len, '\0');
+        if (fread(&data[0], 1, data.size(), fp) == data.size() &&
+            data.compare(0, key_len, key) == 0 && key_len == key.size()) {
+            obj = std::make_shared<CachedResponse>();
+            obj->key = key;
+            size_t pos = key_len;
+            for (const std::string &name :
+                 SplitList(data.substr(pos, vary_len))) {
+                obj->vary.push_back(name);
+            }
+            pos += vary_len;
+            obj->title = data.substr(pos, title_len);
+            pos += title_len;
+            obj->headers = data.substr(pos, headers_len);
+            pos += headers_len;
+            obj->body = data.substr(pos, body_len);
+            obj->status = status;
+            obj->age = age;
+            obj->stored = stored;
+            obj->fresh_until = fresh_until;
+            obj->stale_until = stale_until;
+        }
+    }
+    fclose(fp);
+    return obj;
+}
+
+std::shared_ptr<CachedResponse> ProxyCache::Admit(int status,
+                                                  const char *title,
+                                                  const std::string &headers) {
+    switch (status) {
+    case 200: case 203: case 300: case 301: case 308: case 404: case 410:
+        break;
+    default:
+        return nullptr;
+    }
+
+    std::shared_ptr<CachedResponse> obj = std::make_shared<CachedResponse>();
+    long s_maxage = -1, max_age = -1, swr = 0;
+    bool revalidate = false;
+    time_t expires = -1, date = -1;
+    bool has_expires = false;
+
+    size_t pos = 0;
+    while (pos < headers.size()) {
+        size_t end = headers.find("\r\n", pos);
+        if (end == std::string::npos) {
+            end = headers.size();
+        }
+        std::string line = headers.substr(pos, end - pos);
+        pos = end + 2;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = Lower(line.substr(0, colon));
+        std::string value = Trim(line.substr(colon + 1));
+
+        if (name == "cache-control") {
+            for (const std::string &item : SplitList(value)) {
+                std::string d = Lower(item);
+                if (d == "no-store" || d == "private" ||
+                    d.compare(0, 8, "no-cache") == 0 ||
+                    d.compare(0, 8, "private=") == 0) {
+                    return nullptr;
+                }
+                if (d.compare(0, 9, "s-maxage=") == 0) {
+                    s_maxage = atol(d.c_str() + 9);
+                }
+                else if (d.compare(0, 8, "max-age=") == 0) {
+                    max_age = atol(d.c_str() + 8);
+                }
+                else if (d.compare(0, 23, "stale-while-revalidate=") == 0) {
+                    swr = atol(d.c_str() + 23);
+                }
+                else if (d == "must-revalidate" || d == "proxy-revalidate") {
+                    revalidate = true;
+                }
+            }
+        }
+        else if (name == "expires") {
+            has_expires = true;
+            expires = ParseDate(value.c_str());
+        }
+        else if (name == "date") {
+            date = ParseDate(value.c_str());
+        }
+        else if (name == "set-cookie") {
+            return nullptr;
+        }
+        else if (name == "vary") {
+            for (const std::string &item : SplitList(value)) {
+                if (item == "*") {
+                    return nullptr;
+                }
+                obj->vary.push_back(Lower(item));
+            }
+        }
+        else if (name == "age") {
+            obj->age = atol(value.c_str());
+            continue;
+        }
+        obj->headers.append(line).append("\r\n");
+    }
+
+    // 没有明确有效期的应答不缓存；无法解析的 Expires 视为已过期
+    long lifetime = s_maxage >= 0 ? s_maxage : max_age;
+    if (lifetime < 0 && has_expires) {
+        lifetime = expires < 0 ? 0
+                               : (long)(expires - (date >= 0 ? date
+                                                             : time(nullptr)));
+    }
+    if (lifetime < 0) {
+        return nullptr;
+    }
+    long remaining = lifetime - obj->age;
+    if (revalidate) {
+        swr = 0;
+    }
+    if (remaining <= 0 && swr <= 0) {
+        return nullptr;
+    }
+
+    int64_t now = NowMs();
+    obj->status = status;
+    obj->title = title;
+    obj->stored = now;
+    obj->fresh_until = now + (remaining > 0 ? remaining : 0) * 1000;
+    obj->stale_until = obj->fresh_until + swr * 1000;
+    return obj;
+}
@@ -0,0 +1,162 @@
+#ifndef CACHE_HPP_
+#define CACHE_HPP_
+
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "locker.hpp"
+
+class HttpConn;
+
+/*
+ * 缓存的一个应答，存入后不再修改，发送期间由 shared_ptr 保持有效
+ */
+struct CachedResponse {
+    // 变体的键：请求的基础键加上 Vary 列出的请求头部的值
+    std::string              key;
+    // Vary 列出的头部名（小写）
+    std::vector<std::string> vary;
+    int                      status = 200;
+    std::string              title;
+    // 端到端头部，"名字: 值\r\n" 形式，不含 Age 和界定应答体的头部
+    std::string              headers;
+    std::string              body;
+    // 存入的时刻（CLOCK_MONOTONIC 毫秒）和当时上游给出的 Age（秒）
+    int64_t                  stored = 0;
+    long                     age = 0;
+    // 在 fresh_until 之前是新鲜的；过期后到 stale_until 之前，
+    // 更新期间仍可使用（stale-while-revalidate）
+    int64_t                  fresh_until = 0;
+    int64_t                  stale_until = 0;
+
+    size_t Size() const {
+        return key.size() + title.size() + headers.size() + body.size();
+    }
+};
+
+/*
+ * 反向代理的应答缓存，路由表中一个 proxy 路由的所有请求共用
+ *   只缓存 GET（HEAD 使用 GET 的缓存），键为 "GET host目标" 加上 Vary 列出的
+ *   请求头部；应答必须有明确的有效期（s-maxage、max-age 或 Expires），
+ *   no-store、private、no-cache、Set-Cookie 和 Vary: * 的应答不缓存。
+ *   同一个键同时只有一个请求去上游取（填充），其余的请求挂起等它完成；
+ *   过期不久的应答在填充期间直接使用，不让客户等待。
+ *   内存层按最近最少使用淘汰，配置了目录时被淘汰的应答写入磁盘层，
+ *   再次命中时读回内存，对象不超过内存容量的 1/8。文件的写入和删除
+ *   交给缓存自己的写线程，读取由查找的工作线程在锁外进行，锁内和反应堆
+ *   线程中都不做磁盘 I/O；磁盘层不跨重启保留，启动时清除目录中以前的缓存文件。
+ *   Lookup 由工作线程调用，Complete 由反应堆线程调用，由互斥锁保护
+ */
+class ProxyCache {
+public:
+    enum Result {
+        MISS = 0,   // 本请求负责填充（fill 为 false 时只表示没有命中）
+        HIT,        // 新鲜的应答
+        STALE,      // 过期的应答，另一个请求正在更新它
+        WAIT,       // 另一个请求正在填充，本请求已挂起，由 Complete 唤醒
+        PASS        // 最近的应答不可缓存，直接转发，不挂起也不填充
+    };
+
+    // memory 和 disk 为字节数，dir 为空表示没有磁盘层；出错时打印原因并返回 nullptr
+    static ProxyCache *Create(size_t memory, const std::string &dir,
+                              size_t disk);
+    ~ProxyCache();
+
+    // base 为基础键；refresh 表示客户要求不用缓存（no-cache），仍然填充；
+    // fill 为 false 时只查找新鲜的应答（HEAD 请求）。返回 MISS 时 *obj 可能
+    // 是仍在 stale-while-revalidate 期限内的过期应答，上游出错时可以代替错误
+    Result Lookup(const std::string &base, const char *const *headers,
+                  int header_count, bool refresh, bool fill, HttpConn *conn,
+                  std::string *key,
+                  std::shared_ptr<const CachedResponse> *obj);
+    // 填充结束：obj 为 nullptr 表示失败，uncacheable 表示应答不可缓存，
+    // 此后一段时间内同一个键的请求直接转发。返回等待的请求，由调用者唤醒
+    std::vector<HttpConn *> Complete(const std::string &key,
+                                     std::shared_ptr<CachedResponse> obj,
+                                     bool uncacheable);
+    size_t MaxObject() const { return memory_ / 8; }
+
+    // 由应答头部判断是否可以缓存，可以时返回填好状态、头部和有效期的对象
+    static std::shared_ptr<CachedResponse> Admit(int status, const char *title,
+                                                 const std::string &headers);
+    // 按 Vary 列出的头部计算变体的键
+    static std::string VariantKey(const std::string &base,
+                                  const std::vector<std::string> &vary,
+                                  const char *const *headers,
+                                  int header_count);
+
+private:
+    struct Entry {
+        std::shared_ptr<const CachedResponse> obj;
+        std::list<std::string>::iterator      lru;
+    };
+    struct DiskEntry {
+        size_t                           size;
+        std::list<std::string>::iterator lru;
+    };
+    // 写线程的任务：obj 不为空时把它写入文件，否则删除文件 path
+    struct DiskJob {
+        std::shared_ptr<const CachedResponse> obj;
+        std::string                           path;
+    };
+
+    ProxyCache(size_t memory, const std::string &dir, size_t disk)
+        : memory_(memory), dir_(dir), disk_(disk) { }
+    bool OpenDir();
+    std::shared_ptr<const CachedResponse> Find(const std::string &key,
+                                               int64_t now);
+    void Insert(std::shared_ptr<const CachedResponse> obj);
+    void Erase(const std::string &key);
+    // 以下在锁内调用，只修改记录，文件操作交给写线程
+    void Spill(std::shared_ptr<const CachedResponse> obj);
+    bool TakeDisk(const std::string &key);
+    void Unlink(const std::string &key);
+    // 写线程：写入文件后在锁内登记到磁盘层
+    static void *Writer(void *arg);
+    void RunWriter();
+    void Spilled(std::shared_ptr<const CachedResponse> obj, bool written);
+    // 不加锁的文件读写
+    bool WriteFile(const CachedResponse &obj) const;
+    std::shared_ptr<const CachedResponse> Load(const std::string &key) const;
+    std::string Path(const std::string &key) const;
+
+private:
+    size_t      memory_;
+    std::string dir_;
+    size_t      disk_;
+    MutexLocker locker_;
+
+    // 内存层，lru_ 的头部是最近使用的
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string>                 lru_;
+    size_t                                 size_ = 0;
+    // 磁盘层
+    std::unordered_map<std::string, DiskEntry> disk_entries_;
+    std::list<std::string>                     disk_lru_;
+    size_t                                     disk_size_ = 0;
+    // 已从内存层淘汰、等待写入的应答，写入前再次命中时直接取回；
+    // 写线程的任务队列，队列中的任务数由信号量计数
+    std::unordered_map<std::string,
+                       std::shared_ptr<const CachedResponse>> spilling_;
+    size_t                                     spilling_size_ = 0;
+    std::list<DiskJob>                         jobs_;
+    SemLocker                                  jobs_stat_;
+    pthread_t                                  writer_;
+    bool                                       writer_started_ = false;
+    bool                                       stop_ = false;
+
+    // 基础键对应的 Vary 头部名，正在填充的键及等待它的请求，
+    // 以及最近不可缓存的键（到期时刻）
+    std::unordered_map<std::string, std::vector<std::string>> vary_;
+    std::unordered_map<std::string, std::vector<HttpConn *>>  fills_;
+    std::unordered_map<std::string, int64_t>                  pass_;
+};
+
+#endif  // CACHE_HPP_
@@ -0,0 +1,86 @@
+#ifndef HANDLER_HPP_
+#define HANDLER_HPP_
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+
+/*
+ * 进程内处理模块（插件）接口
+ *   插件是导出 CreateHandler/DestroyHandler/HandlerApiVersion 的共享库，
+ *   serv 启动时按路由表 dlopen 加载，匹配到 URL 前缀的请求在线程池的工作
+ *   线程中直接调用 Handle，不再 fork CGI 进程。
+ *   同一个 Handler 对象会被多个工作线程并发调用，必须自己保证线程安全。
+ *   插件与 serv 必须用同一个编译器编译（C++ 虚函数表跨越了共享库边界）。
+ */
+
+#define HANDLER_API_VERSION 1
+
+/*
+ * 解析好的请求的只读视图，所有指针只在 Handle 调用期间有效
+ */
+struct RequestView {
+    const char               *method;
+    const char               *path;        // 不含查询串
+    const char               *path_info;   // path 中路由前缀之后的部分
+    const char               *query;       // '?' 之后的部分，没有则为 ""
+    const char               *version;
+    const char               *body;        // 没有消息体时为 nullptr
+    int                       body_len;
+    const struct sockaddr_in *peer;
+    const char *const        *headers;     // "Name: value" 形式的头部行
+    int                       header_count;
+
+    // 按名字（不区分大小写）查找头部，返回值的起始位置
+    const char *Header(const char *name) const {
+        size_t len = strlen(name);
+        for (int i = 0; i < header_count; ++i) {
+            const char *h = headers[i];
+            if (strncasecmp(h, name, len) == 0 && h[len] == ':') {
+                h += len + 1;
+                while (*h == ' ' || *h == '\t') {
+                    ++h;
+                }
+                return h;
+            }
+        }
+        return nullptr;
+    }
+};
+
+/*
+ * 应答写入器，不调用 Status 时为 200 OK；
+ * Content-Length 和 Connection 头部由 serv 添加
+ */
+class ResponseWriter {
+public:
+    virtual ~ResponseWriter() { }
+    virtual void Status(int code, const char *title) = 0;
+    virtual void Header(const char *name, const char *value) = 0;
+    virtual void Write(const void *data, size_t len) = 0;
+};
+
+class Handler {
+public:
+    virtual ~Handler() { }
+    // 返回 0 表示应答已写好，其他值或抛出异常时 serv 返回 500
+    virtual int Handle(const RequestView &req, ResponseWriter &resp) = 0;
+};
+
+// 插件的导出函数，arg 是路由表中该行剩余的文本（可能为空串）
+extern "C" {
+typedef int      (*HandlerApiVersionFn)();
+typedef Handler *(*CreateHandlerFn)(const char *arg);
+typedef void     (*DestroyHandlerFn)(Handler *handler);
+}
+
+// 在插件的一个源文件中使用，Type 需要有 Type(const char *arg) 构造函数
+#define SS_EXPORT_HANDLER(Type)                                         \
+    extern "C" int HandlerApiVersion() { return HANDLER_API_VERSION; }  \
+    extern "C" Handler *CreateHandler(const char *arg) {                \
+        return new Type(arg);                                           \
+    }                                                                   \
+    extern "C" void DestroyHandler(Handler *handler) { delete handler; }
+
+#endif  // HANDLER_HPP_
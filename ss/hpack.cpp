@@ -0,0 +1,443 @@
+#include "hpack.hpp"
+
+namespace {
+
+const HpackHeader kStaticTable[HpackTable::STATIC_SIZE] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Huffman 编码表（RFC 7541 附录 B），第 256 项是 EOS
+struct HuffmanCode {
+    uint32_t code;
+    uint8_t  bits;
+};
+
+const HuffmanCode kHuffman[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+/*
+ * 由编码表生成的二叉树，按位解码；内部节点 256 个，叶子的子节点存
+ * -(符号 + 1)。函数内的静态对象在首次使用时构造，多个工作线程同时
+ * 首次解码也只构造一次
+ */
+class HuffmanTree {
+public:
+    HuffmanTree() {
+        nodes_.push_back({0, 0});
+        for (int sym = 0; sym < 257; ++sym) {
+            int node = 0;
+            for (int i = kHuffman[sym].bits - 1; i > 0; --i) {
+                int bit = (kHuffman[sym].code >> i) & 1;
+                if (nodes_[node].child[bit] == 0) {
+                    nodes_[node].child[bit] = nodes_.size();
+                    nodes_.push_back({0, 0});
+                }
+                node = nodes_[node].child[bit];
+            }
+            nodes_[node].child[kHuffman[sym].code & 1] = -(sym + 1);
+        }
+    }
+
+    bool Decode(const uint8_t *data, size_t len, std::string &out) const {
+        int node = 0;
+        // 当前未完成的码字的位数，以及它是否全是 1（只有 EOS 的前缀可以
+        // 作为填充，且不超过 7 位）
+        int depth = 0;
+        bool ones = true;
+        for (size_t i = 0; i < len; ++i) {
+            for (int shift = 7; shift >= 0; --shift) {
+                int bit = (data[i] >> shift) & 1;
+                int next = nodes_[node].child[bit];
+                ++depth;
+                ones = ones && bit;
+                if (next < 0) {
+                    if (next == -257) {
+                        return false;
+                    }
+                    out.push_back((char)(-next - 1));
+                    node = 0;
+                    depth = 0;
+                    ones = true;
+                }
+                else {
+                    node = next;
+                }
+            }
+        }
+        return depth < 8 && ones;
+    }
+
+private:
+    struct Node {
+        int child[2];
+    };
+    std::vector<Node> nodes_;
+};
+
+const HuffmanTree &Huffman() {
+    static const HuffmanTree tree;
+    return tree;
+}
+
+/*
+ * 读取前缀为 prefix 位的整数，返回 false 表示数据不完整或溢出
+ */
+bool ReadInt(const uint8_t *&p, const uint8_t *end, int prefix,
+             size_t *value) {
+    if (p == end) {
+        return false;
+    }
+    size_t max = (1u << prefix) - 1;
+    *value = *p++ & max;
+    if (*value < max) {
+        return true;
+    }
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (p == end) {
+            return false;
+        }
+        uint8_t b = *p++;
+        *value += (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ReadString(const uint8_t *&p, const uint8_t *end, std::string &out) {
+    if (p == end) {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    size_t len;
+    if (!ReadInt(p, end, 7, &len) || len > (size_t)(end - p)) {
+        return false;
+    }
+    out.clear();
+    if (huffman) {
+        if (!Huffman().Decode(p, len, out)) {
+            return false;
+        }
+    }
+    else {
+        out.assign((const char *)p, len);
+    }
+    p += len;
+    return true;
+}
+
+void WriteInt(std::string &out, uint8_t flags, int prefix, size_t value) {
+    size_t max = (1u << prefix) - 1;
+    if (value < max) {
+        out.push_back((char)(flags | value));
+        return;
+    }
+    out.push_back((char)(flags | max));
+    value -= max;
+    while (value >= 0x80) {
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+void WriteString(std::string &out, const std::string &s) {
+    WriteInt(out, 0, 7, s.size());
+    out.append(s);
+}
+
+}  // namespace
+
+void HpackTable::SetMaxSize(size_t max_size) {
+    max_size_ = max_size;
+    Evict(0);
+}
+
+void HpackTable::Evict(size_t room) {
+    while (!entries_.empty() && size_ + room > max_size_) {
+        const HpackHeader &last = entries_.back();
+        size_ -= last.first.size() + last.second.size() + ENTRY_OVERHEAD;
+        entries_.pop_back();
+    }
+}
+
+void HpackTable::Add(const std::string &name, const std::string &value) {
+    size_t size = name.size() + value.size() + ENTRY_OVERHEAD;
+    if (size > max_size_) {
+        entries_.clear();
+        size_ = 0;
+        return;
+    }
+    Evict(size);
+    entries_.emplace_front(name, value);
+    size_ += size;
+}
+
+const HpackHeader *HpackTable::Get(size_t index) const {
+    if (index == 0) {
+        return nullptr;
+    }
+    if (index <= STATIC_SIZE) {
+        return &kStaticTable[index - 1];
+    }
+    index -= STATIC_SIZE + 1;
+    return index < entries_.size() ? &entries_[index] : nullptr;
+}
+
+size_t HpackTable::Find(const std::string &name, const std::string &value,
+                        size_t *name_index) const {
+    *name_index = 0;
+    for (size_t i = 0; i < STATIC_SIZE; ++i) {
+        if (kStaticTable[i].first == name) {
+            if (kStaticTable[i].second == value) {
+                return i + 1;
+            }
+            if (*name_index == 0) {
+                *name_index = i + 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        if (entries_[i].first == name) {
+            if (entries_[i].second == value) {
+                return STATIC_SIZE + 1 + i;
+            }
+            if (*name_index == 0) {
+                *name_index = STATIC_SIZE + 1 + i;
+            }
+        }
+    }
+    return 0;
+}
+
+bool HpackDecoder::Decode(const uint8_t *data, size_t len,
+                          std::vector<HpackHeader> &headers, size_t max_list,
+                          bool *oversize) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    bool first = true;
+    size_t list = 0;
+    *oversize = false;
+    while (p < end) {
+        uint8_t b = *p;
+        size_t index;
+        if (b & 0x80) {
+            // 索引表示
+            const HpackHeader *h;
+            if (!ReadInt(p, end, 7, &index) || !(h = table_.Get(index))) {
+                return false;
+            }
+            list += h->first.size() + h->second.size() + 32;
+            if (list > max_list) {
+                *oversize = true;
+            }
+            else {
+                headers.push_back(*h);
+            }
+        }
+        else if ((b & 0xe0) == 0x20) {
+            // 动态表大小更新只能出现在头部块的开头
+            if (!first || !ReadInt(p, end, 5, &index) || index > limit_) {
+                return false;
+            }
+            table_.SetMaxSize(index);
+            continue;
+        }
+        else {
+            // 字面值：01 加入动态表，0000 不加入，0001 永不加入
+            bool indexing = (b & 0xc0) == 0x40;
+            HpackHeader h;
+            if (!ReadInt(p, end, indexing ? 6 : 4, &index)) {
+                return false;
+            }
+            if (index) {
+                const HpackHeader *name = table_.Get(index);
+                if (!name) {
+                    return false;
+                }
+                h.first = name->first;
+            }
+            else if (!ReadString(p, end, h.first)) {
+                return false;
+            }
+            if (!ReadString(p, end, h.second)) {
+                return false;
+            }
+            if (indexing) {
+                table_.Add(h.first, h.second);
+            }
+            list += h.first.size() + h.second.size() + 32;
+            if (list > max_list) {
+                *oversize = true;
+            }
+            else {
+                headers.push_back(std::move(h));
+            }
+        }
+        first = false;
+    }
+    return true;
+}
+
+void HpackEncoder::SetMaxSize(size_t max_size) {
+    // 编码器的表不超过 4096 字节，对端允许更大时也不用
+    if (max_size > 4096) {
+        max_size = 4096;
+    }
+    if (max_size != table_.MaxSize()) {
+        table_.SetMaxSize(max_size);
+        size_changed_ = true;
+    }
+}
+
+void HpackEncoder::Encode(const std::vector<HpackHeader> &headers,
+                          std::string &out) {
+    if (size_changed_) {
+        WriteInt(out, 0x20, 5, table_.MaxSize());
+        size_changed_ = false;
+    }
+    for (const HpackHeader &h : headers) {
+        size_t name_index;
+        size_t index = table_.Find(h.first, h.second, &name_index);
+        if (index) {
+            WriteInt(out, 0x80, 7, index);
+            continue;
+        }
+        // 每个应答都不同的值不值得占用动态表
+        bool indexing = h.first != "content-length" && h.first != "date";
+        WriteInt(out, indexing ? 0x40 : 0x00, indexing ? 6 : 4, name_index);
+        if (!name_index) {
+            WriteString(out, h.first);
+        }
+        WriteString(out, h.second);
+        if (indexing) {
+            table_.Add(h.first, h.second);
+        }
+    }
+}
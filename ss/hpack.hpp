@@ -0,0 +1,80 @@
+#ifndef HPACK_HPP_
+#define HPACK_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * HTTP/2 头部压缩（RFC 7541）
+ *   每个方向各有一张动态表：解码器的表跟随对端编码器，编码器的表必须与
+ *   对端解码器保持一致，所以一个连接上的头部块必须按收发顺序依次处理。
+ *   编码器不做 Huffman 编码，只用静态表和动态表索引。
+ */
+
+using HpackHeader = std::pair<std::string, std::string>;
+
+class HpackTable {
+public:
+    // 静态表有 61 项，动态表的索引从 62 开始，最新加入的项索引最小
+    static const size_t STATIC_SIZE = 61;
+    // 每项的大小是名字与值的长度之和再加 32
+    static const size_t ENTRY_OVERHEAD = 32;
+
+    explicit HpackTable(size_t max_size = 4096) : max_size_(max_size) { }
+
+    void SetMaxSize(size_t max_size);
+    size_t MaxSize() const { return max_size_; }
+    // 超过表大小的项会清空整张表且不被加入
+    void Add(const std::string &name, const std::string &value);
+    // index 从 1 开始，不存在时返回 nullptr
+    const HpackHeader *Get(size_t index) const;
+    // 返回名字和值都相同的项的索引，没有时 *name_index 为同名项的索引（或 0）
+    size_t Find(const std::string &name, const std::string &value,
+                size_t *name_index) const;
+
+private:
+    void Evict(size_t room);
+
+private:
+    std::deque<HpackHeader> entries_;
+    size_t                  size_ = 0;
+    size_t                  max_size_;
+};
+
+class HpackDecoder {
+public:
+    // max_size 是本端 SETTINGS_HEADER_TABLE_SIZE，对端的表大小更新不能超过它
+    explicit HpackDecoder(size_t max_size = 4096)
+        : table_(max_size), limit_(max_size) { }
+
+    // 解码一个完整的头部块，追加到 headers；出错（COMPRESSION_ERROR）
+    // 时返回 false，此后动态表已不可信，连接必须关闭。
+    // 头部列表的大小（每个头部的名字、值加 32 字节）超过 max_list 时
+    // *oversize 置为 true，其余的头部照常解码以维护动态表，但不再追加：
+    // 引用动态表的一个字节就能展开成 4KB，不能把展开的结果都留在内存里
+    bool Decode(const uint8_t *data, size_t len,
+                std::vector<HpackHeader> &headers, size_t max_list,
+                bool *oversize);
+
+private:
+    HpackTable table_;
+    size_t     limit_;
+};
+
+class HpackEncoder {
+public:
+    // 对端 SETTINGS_HEADER_TABLE_SIZE 改变时调用，下一个头部块先通知对端
+    void SetMaxSize(size_t max_size);
+    void Encode(const std::vector<HpackHeader> &headers, std::string &out);
+
+private:
+    HpackTable table_;
+    bool       size_changed_ = false;
+};
+
+#endif  // HPACK_HPP_
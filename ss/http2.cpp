@@ -0,0 +1,844 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "http2.hpp"
+#include "http_conn.hpp"
+#include "router.hpp"
+
+extern const char *doc_root;
+extern const char *err_400_form;
+extern const char *err_403_form;
+extern const char *err_404_form;
+extern const char *err_500_form;
+
+namespace {
+
+const char kPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t kPrefaceLen = sizeof(kPreface) - 1;
+const int64_t kMaxWindow = 0x7fffffff;
+
+uint32_t Get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+void Put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/*
+ * HTTP2-Settings 头部是不带填充的 base64url，非法字符返回 false
+ */
+bool Base64UrlDecode(const char *in, std::string &out) {
+    unsigned int bits = 0;
+    int count = 0;
+    for ( ; *in && *in != '='; ++in) {
+        int c = *in, v;
+        if (c >= 'A' && c <= 'Z')      v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-' || c == '+') v = 62;
+        else if (c == '_' || c == '/') v = 63;
+        else return false;
+        bits = (bits << 6) | v;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out.push_back((char)(bits >> count));
+        }
+    }
+    return true;
+}
+
+// 只对单个连接有意义的头部，不能出现在 HTTP/2 中
+bool ConnectionHeader(const std::string &name) {
+    return name == "connection" || name == "keep-alive" ||
+           name == "proxy-connection" || name == "transfer-encoding" ||
+           name == "upgrade" || name == "content-length";
+}
+
+}  // namespace
+
+Http2Session::Stream::~Stream() {
+    if (map) {
+        munmap(map, len);
+    }
+}
+
+Http2Session::Http2Session(const struct sockaddr_in *peer) : peer_(peer) {
+}
+
+Http2Session::~Http2Session() {
+}
+
+void Http2Session::Start() {
+    // 本端的 SETTINGS：限制并发流数和头部列表大小，其余用默认值
+    uint8_t settings[12] = {0, 3, 0, 0, 0, 0, 0, 6};
+    Put32(settings + 2, MAX_STREAMS);
+    Put32(settings + 8, MAX_HEADER_LIST);
+    Frame(FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+void Http2Session::Upgrade(const char *method, const char *url,
+                           const char *host, const char *const *headers,
+                           int header_count, const char *settings) {
+    out_.append("HTTP/1.1 101 Switching Protocols\r\n"
+                "Connection: Upgrade\r\n"
+                "Upgrade: h2c\r\n\r\n");
+    Start();
+
+    // 升级请求中的设置视为对端的第一个 SETTINGS，不需要确认
+    std::string payload;
+    if (!Base64UrlDecode(settings, payload) ||
+        ApplySettings((const uint8_t *)payload.data(),
+                      payload.size()) != ERR_NO_ERROR) {
+        ConnError(ERR_PROTOCOL);
+        return;
+    }
+
+    std::vector<HpackHeader> fields;
+    fields.emplace_back(":method", method);
+    fields.emplace_back(":path", url);
+    fields.emplace_back(":scheme", "http");
+    if (host) {
+        fields.emplace_back(":authority", host);
+    }
+    Stream *s = OpenStream(1, fields);
+    last_stream_id_ = 1;
+    for (int i = 0; i < header_count; ++i) {
+        s->headers.push_back(headers[i]);
+    }
+    s->remote_closed = true;
+    Dispatch(*s);
+}
+
+void Http2Session::Feed(const char *data, size_t len) {
+    if (goaway_sent_) {
+        return;
+    }
+    in_.append(data, len);
+
+    size_t pos = 0;
+    if (!preface_done_) {
+        size_t n = in_.size() < kPrefaceLen ? in_.size() : kPrefaceLen;
+        if (memcmp(in_.data(), kPreface, n) != 0) {
+            ConnError(ERR_PROTOCOL);
+            return;
+        }
+        if (n < kPrefaceLen) {
+            return;
+        }
+        preface_done_ = true;
+        pos = kPrefaceLen;
+    }
+
+    // 每个帧有 9 字节的帧头：长度（24 位）、类型、标志、流 id（31 位）
+    while (!goaway_sent_ && in_.size() - pos >= 9) {
+        const uint8_t *head = (const uint8_t *)in_.data() + pos;
+        size_t length = (size_t)head[0] << 16 | head[1] << 8 | head[2];
+        if (length > MAX_FRAME) {
+            ConnError(ERR_FRAME_SIZE);
+            break;
+        }
+        if (in_.size() - pos - 9 < length) {
+            break;
+        }
+        HandleFrame(head[3], head[4], Get32(head + 5) & 0x7fffffff,
+                    head + 9, length);
+        pos += 9 + length;
+    }
+    in_.erase(0, pos);
+}
+
+bool Http2Session::Output(const char **data, size_t *len) {
+    if (sent_ == out_.size()) {
+        out_.clear();
+        sent_ = 0;
+    }
+    else if (sent_ >= OUTPUT_BATCH) {
+        out_.erase(0, sent_);
+        sent_ = 0;
+    }
+    Produce();
+    if (sent_ == out_.size()) {
+        return false;
+    }
+    *data = out_.data() + sent_;
+    *len = out_.size() - sent_;
+    return true;
+}
+
+void Http2Session::Sent(size_t len) {
+    sent_ += len;
+}
+
+bool Http2Session::Finished() const {
+    return goaway_sent_ || (goaway_received_ && streams_.empty());
+}
+
+void Http2Session::HandleFrame(uint8_t type, uint8_t flags, uint32_t id,
+                               const uint8_t *payload, size_t len) {
+    // 头部块必须连续，中间不能插入其他帧
+    if (in_header_block_ && type != FRAME_CONTINUATION) {
+        ConnError(ERR_PROTOCOL);
+        return;
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+        OnData(flags, id, payload, len);
+        break;
+    case FRAME_HEADERS:
+        OnHeaders(flags, id, payload, len);
+        break;
+    case FRAME_CONTINUATION:
+        OnContinuation(flags, id, payload, len);
+        break;
+    case FRAME_PRIORITY:
+        // 不按优先级调度，所有流轮转发送
+        if (id == 0) {
+            ConnError(ERR_PROTOCOL);
+        }
+        else if (len != 5) {
+            ResetStream(id, ERR_FRAME_SIZE);
+        }
+        break;
+    case FRAME_RST_STREAM:
+        if (id == 0 || id > last_stream_id_) {
+            ConnError(ERR_PROTOCOL);
+        }
+        else if (len != 4) {
+            ConnError(ERR_FRAME_SIZE);
+        }
+        else {
+            streams_.erase(id);
+        }
+        break;
+    case FRAME_SETTINGS:
+        OnSettings(flags, id, payload, len);
+        break;
+    case FRAME_PING:
+        if (id != 0) {
+            ConnError(ERR_PROTOCOL);
+        }
+        else if (len != 8) {
+            ConnError(ERR_FRAME_SIZE);
+        }
+        else if (!(flags & FLAG_ACK)) {
+            Frame(FRAME_PING, FLAG_ACK, 0, payload, len);
+        }
+        break;
+    case FRAME_GOAWAY:
+        // 已经开始的流继续完成，之后关闭连接
+        if (id != 0) {
+            ConnError(ERR_PROTOCOL);
+        }
+        goaway_received_ = true;
+        break;
+    case FRAME_WINDOW_UPDATE:
+        OnWindowUpdate(id, payload, len);
+        break;
+    case FRAME_PUSH_PROMISE:
+        // 客户端不能推送
+        ConnError(ERR_PROTOCOL);
+        break;
+    default:
+        // 未知类型的帧必须忽略
+        break;
+    }
+}
+
+void Http2Session::OnData(uint8_t flags, uint32_t id, const uint8_t *payload,
+                          size_t len) {
+    if (id == 0 || id > last_stream_id_) {
+        ConnError(ERR_PROTOCOL);
+        return;
+    }
+    // 请求体立即被取走，整帧（含填充）马上还给连接窗口
+    if (len > 0) {
+        WindowUpdate(0, len);
+    }
+
+    auto it = streams_.find(id);
+    if (it == streams_.end() || it->second->remote_closed) {
+        ResetStream(id, ERR_STREAM_CLOSED);
+        return;
+    }
+    Stream &s = *it->second;
+    if ((int64_t)len > s.recv_window) {
+        ResetStream(id, ERR_FLOW_CONTROL);
+        return;
+    }
+
+    size_t pad = 0;
+    if (flags & FLAG_PADDED) {
+        if (len == 0 || payload[0] >= len) {
+            ConnError(ERR_PROTOCOL);
+            return;
+        }
+        pad = payload[0];
+        ++payload;
+        --len;
+    }
+    len -= pad;
+
+    if (!s.body_refused) {
+        if (s.body.size() + len > MAX_BODY) {
+            // 与 HTTP/1.1 一样以 400 拒绝，不再接收的部分在应答后重置
+            s.body_refused = true;
+            RespondError(s, 400, err_400_form);
+        }
+        else {
+            s.body.append((const char *)payload, len);
+        }
+    }
+    if (flags & FLAG_END_STREAM) {
+        s.remote_closed = true;
+        if (!s.body_refused) {
+            Dispatch(s);
+        }
+    }
+    else if (len + pad > 0) {
+        WindowUpdate(id, len + pad + (flags & FLAG_PADDED ? 1 : 0));
+    }
+}
+
+void Http2Session::OnHeaders(uint8_t flags, uint32_t id,
+                             const uint8_t *payload, size_t len) {
+    if (id == 0 || id % 2 == 0) {
+        ConnError(ERR_PROTOCOL);
+        return;
+    }
+
+    size_t off = 0, pad = 0;
+    if (flags & FLAG_PADDED) {
+        if (len < 1) {
+            ConnError(ERR_FRAME_SIZE);
+            return;
+        }
+        pad = payload[0];
+        off = 1;
+    }
+    if (flags & FLAG_PRIORITY) {
+        off += 5;
+    }
+    if (off + pad > len) {
+        ConnError(ERR_PROTOCOL);
+        return;
+    }
+
+    header_block_.assign((const char *)payload + off, len - off - pad);
+    header_stream_ = id;
+    header_flags_ = flags;
+    if (flags & FLAG_END_HEADERS) {
+        EndHeaders();
+    }
+    else {
+        in_header_block_ = true;
+    }
+}
+
+void Http2Session::OnContinuation(uint8_t flags, uint32_t id,
+                                  const uint8_t *payload, size_t len) {
+    if (!in_header_block_ || id != header_stream_) {
+        ConnError(ERR_PROTOCOL);
+        return;
+    }
+    if (header_block_.size() + len > MAX_HEADER_BLOCK) {
+        ConnError(ERR_ENHANCE_YOUR_CALM);
+        return;
+    }
+    header_block_.append((const char *)payload, len);
+    if (flags & FLAG_END_HEADERS) {
+        in_header_block_ = false;
+        EndHeaders();
+    }
+}
+
+void Http2Session::EndHeaders() {
+    // 被拒绝的流的头部也要解码，动态表才能与对端保持一致
+    std::vector<HpackHeader> fields;
+    bool oversize;
+    if (!decoder_.Decode((const uint8_t *)header_block_.data(),
+                         header_block_.size(), fields, MAX_HEADER_LIST,
+                         &oversize)) {
+        ConnError(ERR_COMPRESSION);
+        return;
+    }
+    header_block_.clear();
+
+    uint32_t id = header_stream_;
+    bool end_stream = header_flags_ & FLAG_END_STREAM;
+    auto it = streams_.find(id);
+    if (oversize) {
+        // 超过了通告的头部列表上限，只重置这个流
+        if (it == streams_.end()) {
+            if (id <= last_stream_id_) {
+                ConnError(ERR_STREAM_CLOSED);
+                return;
+            }
+            last_stream_id_ = id;
+        }
+        ResetStream(id, ERR_ENHANCE_YOUR_CALM);
+        return;
+    }
+    if (it != streams_.end()) {
+        // 请求体之后的尾部头部，必须结束流
+        Stream &s = *it->second;
+        if (s.remote_closed) {
+            ResetStream(id, ERR_STREAM_CLOSED);
+        }
+        else if (!end_stream) {
+            ResetStream(id, ERR_PROTOCOL);
+        }
+        else {
+            s.remote_closed = true;
+            if (!s.body_refused) {
+                Dispatch(s);
+            }
+        }
+        return;
+    }
+    if (id <= last_stream_id_) {
+        ConnError(ERR_STREAM_CLOSED);
+        return;
+    }
+    last_stream_id_ = id;
+    if (goaway_received_) {
+        return;
+    }
+    if (streams_.size() >= MAX_STREAMS) {
+        ResetStream(id, ERR_REFUSED_STREAM);
+        return;
+    }
+
+    Stream *s = OpenStream(id, fields);
+    if (!s) {
+        ResetStream(id, ERR_PROTOCOL);
+        return;
+    }
+    if (end_stream) {
+        s->remote_closed = true;
+        Dispatch(*s);
+    }
+}
+
+Http2Session::Stream *Http2Session::OpenStream(
+        uint32_t id, std::vector<HpackHeader> &fields) {
+    std::unique_ptr<Stream> s(new Stream);
+    s->id = id;
+    s->send_window = peer_initial_window_;
+    s->recv_window = 65535;
+    bool scheme = false;
+    for (HpackHeader &h : fields) {
+        if (h.first.empty()) {
+            return nullptr;
+        }
+        if (h.first[0] != ':') {
+            s->headers.push_back(h.first + ": " + h.second);
+        }
+        else if (h.first == ":method") {
+            s->method = std::move(h.second);
+        }
+        else if (h.first == ":path") {
+            s->path = std::move(h.second);
+        }
+        else if (h.first == ":authority") {
+            s->authority = std::move(h.second);
+        }
+        else if (h.first == ":scheme") {
+            scheme = true;
+        }
+        else {
+            return nullptr;
+        }
+    }
+    if (s->method.empty() || !scheme || s->path.empty() ||
+        s->path[0] != '/') {
+        return nullptr;
+    }
+    Stream *stream = s.get();
+    streams_[id] = std::move(s);
+    return stream;
+}
+
+void Http2Session::OnSettings(uint8_t flags, uint32_t id,
+                              const uint8_t *payload, size_t len) {
+    if (id != 0) {
+        ConnError(ERR_PROTOCOL);
+        return;
+    }
+    if (flags & FLAG_ACK) {
+        if (len != 0) {
+            ConnError(ERR_FRAME_SIZE);
+        }
+        return;
+    }
+    ErrorCode code = ApplySettings(payload, len);
+    if (code != ERR_NO_ERROR) {
+        ConnError(code);
+        return;
+    }
+    Frame(FRAME_SETTINGS, FLAG_ACK, 0, nullptr, 0);
+}
+
+Http2Session::ErrorCode Http2Session::ApplySettings(const uint8_t *payload,
+                                                    size_t len) {
+    if (len % 6 != 0) {
+        return ERR_FRAME_SIZE;
+    }
+    for (size_t i = 0; i < len; i += 6) {
+        unsigned int key = payload[i] << 8 | payload[i + 1];
+        uint32_t value = Get32(payload + i + 2);
+        switch (key) {
+        case 1:     // HEADER_TABLE_SIZE
+            encoder_.SetMaxSize(value);
+            break;
+        case 2:     // ENABLE_PUSH，本端从不推送
+            if (value > 1) {
+                return ERR_PROTOCOL;
+            }
+            break;
+        case 4: {   // INITIAL_WINDOW_SIZE，已打开的流按差值调整
+            if (value > kMaxWindow) {
+                return ERR_FLOW_CONTROL;
+            }
+            int64_t delta = (int64_t)value - peer_initial_window_;
+            peer_initial_window_ = value;
+            for (auto &it : streams_) {
+                it.second->send_window += delta;
+                Queue(*it.second);
+            }
+            break;
+        }
+        case 5:     // MAX_FRAME_SIZE
+            if (value < 16384 || value > 16777215) {
+                return ERR_PROTOCOL;
+            }
+            peer_max_frame_ = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return ERR_NO_ERROR;
+}
+
+void Http2Session::OnWindowUpdate(uint32_t id, const uint8_t *payload,
+                                  size_t len) {
+    if (len != 4) {
+        ConnError(ERR_FRAME_SIZE);
+        return;
+    }
+    int64_t increment = Get32(payload) & 0x7fffffff;
+    if (id == 0) {
+        if (increment == 0) {
+            ConnError(ERR_PROTOCOL);
+        }
+        else if (conn_send_window_ + increment > kMaxWindow) {
+            ConnError(ERR_FLOW_CONTROL);
+        }
+        else {
+            conn_send_window_ += increment;
+        }
+        return;
+    }
+
+    if (id > last_stream_id_) {
+        ConnError(ERR_PROTOCOL);
+        return;
+    }
+    auto it = streams_.find(id);
+    if (it == streams_.end()) {
+        // 已经结束的流
+        return;
+    }
+    Stream &s = *it->second;
+    if (increment == 0) {
+        ResetStream(id, ERR_PROTOCOL);
+    }
+    else if (s.send_window + increment > kMaxWindow) {
+        ResetStream(id, ERR_FLOW_CONTROL);
+    }
+    else {
+        s.send_window += increment;
+        Queue(s);
+    }
+}
+
+/*
+ * 请求已收齐，选择插件、静态文件或错误应答；与 HttpConn::DoRequest 的
+ * 规则相同
+ */
+void Http2Session::Dispatch(Stream &s) {
+    std::string path = s.path;
+    std::string query;
+    size_t mark = path.find('?');
+    if (mark != std::string::npos) {
+        query = path.substr(mark + 1);
+        path.erase(mark);
+    }
+
+    const Route *route = Router::Match(path.c_str());
+    if ((route && route->upstream) ||
+        (HttpConn::CgiEnabled() && path.compare(0, 9, "/cgi-bin/") == 0)) {
+        // CGI 和代理的执行与连接绑定在一起，让客户端用 HTTP/1.1 重发
+        ResetStream(s.id, ERR_HTTP_1_1_REQUIRED);
+        return;
+    }
+    if (route) {
+        ServeHandler(s, route, path, query);
+        return;
+    }
+    if (s.method != "GET") {
+        RespondError(s, 400, err_400_form);
+        return;
+    }
+    ServeFile(s, path);
+}
+
+void Http2Session::ServeHandler(Stream &s, const Route *route,
+                                const std::string &path,
+                                const std::string &query) {
+    std::vector<const char *> headers;
+    for (const std::string &h : s.headers) {
+        if (headers.size() == HttpConn::MAX_HEADERS) {
+            break;
+        }
+        headers.push_back(h.c_str());
+    }
+
+    RequestView req;
+    req.method       = s.method.c_str();
+    req.path         = path.c_str();
+    req.path_info    = req.path + (route->prefix.size() > 1 ?
+                                   route->prefix.size() : 0);
+    req.query        = query.c_str();
+    req.version      = "HTTP/2.0";
+    req.body         = s.body.empty() ? nullptr : s.body.c_str();
+    req.body_len     = s.body.size();
+    req.peer         = peer_;
+    req.headers      = headers.data();
+    req.header_count = headers.size();
+
+    HandlerResponse response;
+    int ret = -1;
+    try {
+        ret = route->handler->Handle(req, response);
+    }
+    catch (...) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        RespondError(s, 500, err_500_form);
+        return;
+    }
+
+    // 插件的头部是 "Name: value\r\n" 形式，HTTP/2 的名字必须是小写
+    std::vector<HpackHeader> extra;
+    const std::string &lines = response.headers_;
+    for (size_t pos = 0; pos < lines.size(); ) {
+        size_t end = lines.find("\r\n", pos);
+        if (end == std::string::npos) {
+            end = lines.size();
+        }
+        size_t colon = lines.find(':', pos);
+        if (colon < end) {
+            std::string name = lines.substr(pos, colon - pos);
+            for (char &c : name) {
+                c = tolower((unsigned char)c);
+            }
+            size_t value = lines.find_first_not_of(" \t", colon + 1);
+            if (!ConnectionHeader(name)) {
+                extra.emplace_back(name, value < end ?
+                                   lines.substr(value, end - value) : "");
+            }
+        }
+        pos = end + 2;
+    }
+
+    s.owned = std::move(response.body_);
+    s.data = s.owned.data();
+    s.len = s.owned.size();
+    Respond(s, response.status_, extra);
+}
+
+void Http2Session::ServeFile(Stream &s, const std::string &path) {
+    std::string file = std::string(doc_root) + path;
+    struct stat st;
+    if (stat(file.c_str(), &st) < 0) {
+        RespondError(s, 404, err_404_form);
+        return;
+    }
+    if (!(st.st_mode & S_IROTH) || S_ISDIR(st.st_mode)) {
+        RespondError(s, 400, err_400_form);
+        return;
+    }
+    if (st.st_size == 0) {
+        s.owned = "<html><body></body></html>";
+        s.data = s.owned.data();
+        s.len = s.owned.size();
+        Respond(s, 200, {});
+        return;
+    }
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        RespondError(s, 403, err_403_form);
+        return;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        RespondError(s, 500, err_500_form);
+        return;
+    }
+    s.map = (char *)map;
+    s.data = s.map;
+    s.len = st.st_size;
+    Respond(s, 200, {});
+}
+
+void Http2Session::RespondError(Stream &s, int status, const char *form) {
+    s.owned = form;
+    s.data = s.owned.data();
+    s.len = s.owned.size();
+    Respond(s, status, {});
+}
+
+/*
+ * 发送应答头部；应答体由 Produce 按流量控制分帧发送
+ */
+void Http2Session::Respond(Stream &s, int status,
+                           const std::vector<HpackHeader> &extra) {
+    std::vector<HpackHeader> fields;
+    fields.emplace_back(":status", std::to_string(status));
+    fields.emplace_back("content-length", std::to_string(s.len));
+    fields.insert(fields.end(), extra.begin(), extra.end());
+    std::string block;
+    encoder_.Encode(fields, block);
+
+    // 头部块超过对端的帧大小时拆成 HEADERS + CONTINUATION
+    size_t n = block.size() < peer_max_frame_ ? block.size() : peer_max_frame_;
+    uint8_t flags = (n == block.size() ? FLAG_END_HEADERS : 0) |
+                    (s.len == 0 ? FLAG_END_STREAM : 0);
+    Frame(FRAME_HEADERS, flags, s.id, block.data(), n);
+    for (size_t pos = n; pos < block.size(); pos += n) {
+        n = block.size() - pos < peer_max_frame_ ? block.size() - pos
+                                                 : peer_max_frame_;
+        Frame(FRAME_CONTINUATION,
+              pos + n == block.size() ? FLAG_END_HEADERS : 0,
+              s.id, block.data() + pos, n);
+    }
+
+    s.responded = true;
+    if (s.len == 0) {
+        FinishStream(s.id);
+    }
+    else {
+        Queue(s);
+    }
+}
+
+void Http2Session::Queue(Stream &s) {
+    if (!s.queued && s.responded && s.sent < s.len && s.send_window > 0) {
+        s.queued = true;
+        ready_.push_back(s.id);
+    }
+}
+
+void Http2Session::FinishStream(uint32_t id) {
+    auto it = streams_.find(id);
+    if (it == streams_.end()) {
+        return;
+    }
+    if (it->second->body_refused && !it->second->remote_closed) {
+        Frame(FRAME_RST_STREAM, 0, id, "\0\0\0\0", 4);
+    }
+    streams_.erase(it);
+}
+
+/*
+ * 轮转各流，每次取一帧，直到输出缓冲攒够、没有流可发或连接窗口用完
+ */
+void Http2Session::Produce() {
+    // 升级时流 1 的应答体等到客户端的连接序言和 SETTINGS 之后再发送
+    if (!preface_done_) {
+        return;
+    }
+    while (out_.size() - sent_ < OUTPUT_BATCH && !ready_.empty() &&
+           conn_send_window_ > 0) {
+        uint32_t id = ready_.front();
+        ready_.pop_front();
+        auto it = streams_.find(id);
+        if (it == streams_.end()) {
+            continue;
+        }
+        Stream &s = *it->second;
+        s.queued = false;
+        if (s.send_window <= 0) {
+            // 等待该流的 WINDOW_UPDATE
+            continue;
+        }
+
+        int64_t n = s.len - s.sent;
+        n = n < peer_max_frame_ ? n : peer_max_frame_;
+        n = n < s.send_window ? n : s.send_window;
+        n = n < conn_send_window_ ? n : conn_send_window_;
+        bool last = s.sent + n == s.len;
+        Frame(FRAME_DATA, last ? FLAG_END_STREAM : 0, id, s.data + s.sent, n);
+        s.sent += n;
+        s.send_window -= n;
+        conn_send_window_ -= n;
+        if (last) {
+            FinishStream(id);
+        }
+        else {
+            Queue(s);
+        }
+    }
+}
+
+void Http2Session::Frame(uint8_t type, uint8_t flags, uint32_t id,
+                         const void *payload, size_t len) {
+    uint8_t head[9];
+    head[0] = len >> 16;
+    head[1] = len >> 8;
+    head[2] = len;
+    head[3] = type;
+    head[4] = flags;
+    Put32(head + 5, id);
+    out_.append((const char *)head, sizeof(head));
+    out_.append((const char *)payload, len);
+}
+
+void Http2Session::WindowUpdate(uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+    Put32(payload, increment);
+    Frame(FRAME_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+void Http2Session::ResetStream(uint32_t id, ErrorCode code) {
+    uint8_t payload[4];
+    Put32(payload, code);
+    Frame(FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+    streams_.erase(id);
+}
+
+/*
+ * 连接错误：发送 GOAWAY，不再处理对端的任何数据
+ */
+void Http2Session::ConnError(ErrorCode code) {
+    uint8_t payload[8];
+    Put32(payload, last_stream_id_);
+    Put32(payload + 4, code);
+    Frame(FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    goaway_sent_ = true;
+}
@@ -0,0 +1,164 @@
+#ifndef HTTP2_HPP_
+#define HTTP2_HPP_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "hpack.hpp"
+
+struct Route;
+
+/*
+ * HTTP/2 连接（RFC 7540）的协议层，只处理字节：Feed 收下对端的数据，
+ * Output/Sent 取走待发送的帧，socket 和 TLS 的读写仍由 HttpConn 完成。
+ *   连接的 socket 是 EPOLLONESHOT 的，同一时刻只有一个工作线程处理它，
+ *   会话内部不加锁。
+ *   请求收齐后立即处理：静态文件被 mmap，插件的应答收集在内存中；应答的
+ *   DATA 帧在有数据可发的流之间轮转，每轮每个流一帧，同时受连接和流两级
+ *   发送窗口限制，所以一个连接上的多个文件交错发送，大文件不会阻塞小文件。
+ *   CGI 和代理的请求以 HTTP_1_1_REQUIRED 重置，客户端会改用 HTTP/1.1 重发。
+ */
+class Http2Session {
+public:
+    // 同时打开的流的上限，超过的流被 REFUSED_STREAM 拒绝
+    static const uint32_t MAX_STREAMS = 100;
+    // 本端接受的最大帧和头部块，以及插件请求体的上限
+    static const uint32_t MAX_FRAME = 16384;
+    static const size_t   MAX_HEADER_BLOCK = 65536;
+    // 解码后的头部列表上限，以 SETTINGS_MAX_HEADER_LIST_SIZE 通告
+    static const uint32_t MAX_HEADER_LIST = 65536;
+    static const size_t   MAX_BODY = 65536;
+    // 输出缓冲中最多攒这么多字节再交给 socket
+    static const size_t   OUTPUT_BATCH = 65536;
+
+    explicit Http2Session(const struct sockaddr_in *peer);
+    ~Http2Session();
+
+    // 客户端直接以连接序言开始（h2c 先验知识，或 TLS 上 ALPN 协商了 h2）
+    void Start();
+    // HTTP/1.1 的 Upgrade: h2c 请求：应答 101，该请求成为流 1，
+    // settings 是 HTTP2-Settings 头部的值（base64url 编码的 SETTINGS 载荷）
+    void Upgrade(const char *method, const char *url, const char *host,
+                 const char *const *headers, int header_count,
+                 const char *settings);
+
+    void Feed(const char *data, size_t len);
+    // 待发送的数据，没有时返回 false；发出 len 字节后调用 Sent
+    bool Output(const char **data, size_t *len);
+    void Sent(size_t len);
+    // 会话已结束（发送或收到了 GOAWAY），输出发完后关闭连接
+    bool Finished() const;
+
+private:
+    enum FrameType {
+        FRAME_DATA = 0, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM,
+        FRAME_SETTINGS, FRAME_PUSH_PROMISE, FRAME_PING, FRAME_GOAWAY,
+        FRAME_WINDOW_UPDATE, FRAME_CONTINUATION
+    };
+    enum FrameFlag {
+        FLAG_END_STREAM = 0x1, FLAG_ACK = 0x1, FLAG_END_HEADERS = 0x4,
+        FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20
+    };
+    enum ErrorCode {
+        ERR_NO_ERROR = 0, ERR_PROTOCOL, ERR_INTERNAL, ERR_FLOW_CONTROL,
+        ERR_SETTINGS_TIMEOUT, ERR_STREAM_CLOSED, ERR_FRAME_SIZE,
+        ERR_REFUSED_STREAM, ERR_CANCEL, ERR_COMPRESSION, ERR_CONNECT,
+        ERR_ENHANCE_YOUR_CALM, ERR_INADEQUATE_SECURITY, ERR_HTTP_1_1_REQUIRED
+    };
+
+    struct Stream {
+        uint32_t    id;
+        // 对端已发送 END_STREAM
+        bool        remote_closed = false;
+        // 请求体超过上限，应答后以 NO_ERROR 重置
+        bool        body_refused = false;
+        bool        responded = false;
+        // 在 ready_ 中等待发送
+        bool        queued = false;
+        std::string method;
+        std::string path;
+        std::string authority;
+        // "name: value" 形式的普通头部，供插件使用
+        std::vector<std::string> headers;
+        std::string body;
+        int64_t     send_window;
+        int64_t     recv_window;
+        // 应答体：指向 mmap 的文件或 owned
+        const char *data = nullptr;
+        size_t      len = 0;
+        size_t      sent = 0;
+        char       *map = nullptr;
+        std::string owned;
+
+        ~Stream();
+    };
+
+    void HandleFrame(uint8_t type, uint8_t flags, uint32_t id,
+                     const uint8_t *payload, size_t len);
+    void OnData(uint8_t flags, uint32_t id, const uint8_t *payload,
+                size_t len);
+    void OnHeaders(uint8_t flags, uint32_t id, const uint8_t *payload,
+                   size_t len);
+    void OnContinuation(uint8_t flags, uint32_t id, const uint8_t *payload,
+                        size_t len);
+    void EndHeaders();
+    void OnSettings(uint8_t flags, uint32_t id, const uint8_t *payload,
+                    size_t len);
+    ErrorCode ApplySettings(const uint8_t *payload, size_t len);
+    void OnWindowUpdate(uint32_t id, const uint8_t *payload, size_t len);
+
+    Stream *OpenStream(uint32_t id, std::vector<HpackHeader> &headers);
+    void Dispatch(Stream &s);
+    void ServeHandler(Stream &s, const Route *route,
+                      const std::string &path, const std::string &query);
+    void ServeFile(Stream &s, const std::string &path);
+    void RespondError(Stream &s, int status, const char *form);
+    void Respond(Stream &s, int status,
+                 const std::vector<HpackHeader> &extra);
+    void Queue(Stream &s);
+    void FinishStream(uint32_t id);
+    void Produce();
+
+    void Frame(uint8_t type, uint8_t flags, uint32_t id,
+               const void *payload, size_t len);
+    void WindowUpdate(uint32_t id, uint32_t increment);
+    void ResetStream(uint32_t id, ErrorCode code);
+    void ConnError(ErrorCode code);
+
+private:
+    const struct sockaddr_in *peer_;
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+
+    std::string in_;
+    bool        preface_done_ = false;
+    std::string out_;
+    size_t      sent_ = 0;
+
+    std::map<uint32_t, std::unique_ptr<Stream>> streams_;
+    // 有数据且有流窗口的流，按轮转顺序发送
+    std::deque<uint32_t> ready_;
+    uint32_t last_stream_id_ = 0;
+
+    // 正在接收的头部块（HEADERS 之后跟 CONTINUATION）
+    std::string header_block_;
+    uint32_t    header_stream_ = 0;
+    uint8_t     header_flags_ = 0;
+    bool        in_header_block_ = false;
+
+    // 对端的设置和连接级发送窗口
+    int64_t  peer_initial_window_ = 65535;
+    uint32_t peer_max_frame_ = 16384;
+    int64_t  conn_send_window_ = 65535;
+
+    bool goaway_sent_ = false;
+    bool goaway_received_ = false;
+};
+
+#endif  // HTTP2_HPP_
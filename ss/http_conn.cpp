@@ -1,4 +1,11 @@
+#include <sys/wait.h>
+
 #include "http_conn.hpp"
+#include "router.hpp"
+#include "http2.hpp"
+#include "cache.hpp"
+#include "upstream.hpp"
+#include "cgipool.h"
 
 // HTTP 响应状态信息
 const char *ok_200_title  = "OK";
@@ -15,10 +22,36 @@ const char *err_404_title = "Not Found";
 const char *err_404_form  =
     "The requested file was not found on this server.\n";
 
+const char *err_429_title = "Too Many Requests";
+const char *err_429_form  =
+    "You have sent too many requests, please try again later.\n";
+
 const char *err_500_title = "Internal Error";
 const char *err_500_form  =
     "There was an unusual problem serving the requested file.\n";
 
+const char *err_501_title = "Not Implemented";
+const char *err_501_form  =
+    "The server does not support the request's Transfer-Encoding.\n";
+
+const char *err_502_title = "Bad Gateway";
+const char *err_502_form  =
+    "The CGI program did not send a valid response.\n";
+
+const char *err_504_title = "Gateway Timeout";
+const char *err_504_form  =
+    "The CGI program did not respond in time.\n";
+
+const char *err_502_proxy_form =
+    "The upstream server did not send a valid response.\n";
+const char *err_504_proxy_form =
+    "The upstream server did not respond in time.\n";
+
+const char *method_names[] = {
+    "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS",
+    "CONNECT", "PATCH"
+};
+
 const char *doc_root = "/www/html";
 
 int SetNonblocking(int fd) {
@@ -54,18 +87,112 @@ void ModFD(int epollfd, int fd, int ev) {
 
 int HttpConn::epollfd_ = -1;
 int HttpConn::user_count_ = 0;
+const char *HttpConn::cgi_dir_ = nullptr;
+int HttpConn::cgi_timeout_ = 30;
+HttpConn *HttpConn::owner_[MAX_FD];
+TimerHeap<HttpConn> HttpConn::timers_;
+std::vector<pid_t> HttpConn::cgi_zombies_;
+#ifdef HTTPS
+SSL_CTX *HttpConn::ssl_ctx_ = nullptr;
+
+bool HttpConn::KernelTlsAvailable() {
+    FILE *fp = fopen("/proc/sys/net/ipv4/tcp_available_ulp", "r");
+    if (!fp) {
+        return false;
+    }
+    char ulp[256] = "";
+    if (!fgets(ulp, sizeof(ulp), fp)) {
+        ulp[0] = '\0';
+    }
+    fclose(fp);
+    for (char *p = strtok(ulp, " \n"); p; p = strtok(nullptr, " \n")) {
+        if (strcmp(p, "tls") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * ALPN：客户端同时支持时优先选择 h2
+ */
+static int SelectAlpn(SSL *, const unsigned char **out, unsigned char *outlen,
+                      const unsigned char *in, unsigned int inlen, void *) {
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos,
+                              sizeof(protos) - 1, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+bool HttpConn::InitTls(const char *cert_file, const char *key_file,
+                       bool ktls) {
+    ssl_ctx_ = SSL_CTX_new(TLS_server_method());
+    if (!ssl_ctx_) {
+        return false;
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    // 内核不支持或协商出的加密套件内核不支持时，OpenSSL 自动退回用户态加密，
+    // 每个连接握手后用 BIO_get_ktls_send 检查实际结果
+    if (ktls) {
+        SSL_CTX_set_options(ssl_ctx_, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+    SSL_CTX_set_min_proto_version(ssl_ctx_, TLS1_2_VERSION);
+    // 非阻塞写：允许部分写入，重试时缓冲区地址可以变化（iovec 会前移）
+    SSL_CTX_set_mode(ssl_ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                               SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                               SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_alpn_select_cb(ssl_ctx_, SelectAlpn, nullptr);
+    if (SSL_CTX_use_certificate_chain_file(ssl_ctx_, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ssl_ctx_, key_file,
+                                    SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ssl_ctx_) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ssl_ctx_);
+        ssl_ctx_ = nullptr;
+        return false;
+    }
+    return true;
+}
+#endif
 
 void HttpConn::CloseConn(bool read_close) {
     if (read_close && (sockfd_ != -1)) {
+        StopCgi(true);
+        StopProxy(false);
+#ifdef HTTPS
+        if (ssl_) {
+            // 非阻塞 socket 上只尽力发送一次 close_notify
+            SSL_shutdown(ssl_);
+            SSL_free(ssl_);
+            ssl_ = nullptr;
+        }
+#endif
+        handshaking_ = false;
+        ktls_send_ = false;
+        delete h2_;
+        h2_ = nullptr;
+        Unmap();
         RemoveFD(epollfd_, sockfd_);
         sockfd_ = -1;
         --user_count_;
     }
 }
 
-void HttpConn::Init(int sockfd, const struct sockaddr_in &addr) {
+void HttpConn::Init(int sockfd, const struct sockaddr_in &addr, bool tls) {
     sockfd_ = sockfd;
     addr_   = addr;
+#ifdef HTTPS
+    if (tls && ssl_ctx_) {
+        ssl_ = SSL_new(ssl_ctx_);
+        SSL_set_fd(ssl_, sockfd_);
+        SSL_set_accept_state(ssl_);
+        handshaking_ = true;
+    }
+#endif
     // 避免 TIME_WAIT 状态，仅用于调试，实际使用时应去掉
     int reuse = 1;
     setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
@@ -78,18 +205,33 @@ void HttpConn::Init(int sockfd, const struct sockaddr_in &addr) {
 void HttpConn::Init() {
     check_state_    = CHECK_STATE_REQUESTLINE;
     linger_         = false;
+    upgrade_h2c_    = false;
+    h2_settings_    = nullptr;
     method_         = GET;
     url_            = nullptr;
     version_        = nullptr;
     content_length_ = 0;
+    has_length_     = false;
+    transfer_encoding_ = false;
     host_           = nullptr;
+    body_           = nullptr;
+    header_count_   = 0;
     start_line_     = 0;
     checked_idx_    = 0;
     read_idx_       = 0;
     write_idx_      = 0;
+    bytes_to_send_  = 0;
+    file_addr_      = nullptr;
+    file_fd_        = -1;
+    file_offset_    = 0;
     memset(read_buf_, '\0', READ_BUF_SIZE);
     memset(write_buf_, '\0', WRITE_BUF_SIZE);
     memset(real_file_, '\0', FILENAME_LEN);
+    response_.Reset();
+    cache_ = nullptr;
+    cache_fill_ = false;
+    cache_new_.reset();
+    cache_obj_.reset();
 }
 
 /*
@@ -124,6 +266,133 @@ HttpConn::LineStatus HttpConn::ParseLine() {
     return LINE_OPEN;
 }
 
+/*
+ * 推进 TLS 握手，返回 false 表示握手失败，需要关闭连接；
+ * 未完成时按 SSL 的需要重新注册读或写事件
+ */
+bool HttpConn::Handshake() {
+#ifdef HTTPS
+    int ret = SSL_do_handshake(ssl_);
+    if (ret == 1) {
+        handshaking_ = false;
+        ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+        return true;
+    }
+
+    switch (SSL_get_error(ssl_, ret)) {
+    case SSL_ERROR_WANT_READ:
+        ModFD(epollfd_, sockfd_, EPOLLIN);
+        return true;
+    case SSL_ERROR_WANT_WRITE:
+        ModFD(epollfd_, sockfd_, EPOLLOUT);
+        return true;
+    default:
+        ERR_clear_error();
+        return false;
+    }
+#else
+    return false;
+#endif
+}
+
+/*
+ * 与 recv 语义相同：数据读完时返回 -1 且 errno 为 EAGAIN，对端关闭返回 0
+ */
+int HttpConn::Recv(char *buf, int len) {
+#ifdef HTTPS
+    if (ssl_) {
+        int ret = SSL_read(ssl_, buf, len);
+        if (ret > 0) {
+            return ret;
+        }
+        switch (SSL_get_error(ssl_, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            ERR_clear_error();
+            errno = EIO;
+            return -1;
+        }
+    }
+#endif
+    return recv(sockfd_, buf, len, 0);
+}
+
+bool HttpConn::ReadWantsWrite() const {
+#ifdef HTTPS
+    return ssl_ && SSL_want_write(ssl_);
+#else
+    return false;
+#endif
+}
+
+/*
+ * SSL_read 可能需要先发送数据（例如回应对端的密钥更新），
+ * 这时只等可读事件会让连接永远挂起
+ */
+uint32_t HttpConn::ReadEvents() const {
+    return ReadWantsWrite() ? EPOLLIN | EPOLLOUT : EPOLLIN;
+}
+
+/*
+ * 与 writev 语义相同，TLS 连接每次加密一个 iovec 中的数据；
+ * iovec 发完后，kTLS 连接再用 SSL_sendfile 发送文件
+ */
+int HttpConn::Send() {
+#ifdef HTTPS
+    if (ssl_) {
+        int i = 0;
+        while (i < iv_count_ && iv_[i].iov_len == 0) {
+            ++i;
+        }
+        int ret = 0;
+        if (i < iv_count_) {
+            ret = SSL_write(ssl_, iv_[i].iov_base, iv_[i].iov_len);
+        }
+        else if (file_fd_ >= 0) {
+            ret = SSL_sendfile(ssl_, file_fd_, file_offset_,
+                               file_stat_.st_size - file_offset_, 0);
+            if (ret > 0) {
+                file_offset_ += ret;
+            }
+        }
+        if (ret > 0) {
+            return ret;
+        }
+        if (i == iv_count_ && file_fd_ < 0) {
+            return 0;
+        }
+        switch (SSL_get_error(ssl_, ret)) {
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_WANT_READ:
+            errno = EAGAIN;
+            return -1;
+        default:
+            ERR_clear_error();
+            errno = EIO;
+            return -1;
+        }
+    }
+#endif
+    return writev(sockfd_, iv_, iv_count_);
+}
+
+/*
+ * 跳过 iovec 中已经发送的字节
+ */
+void HttpConn::Advance(int bytes) {
+    for (int i = 0; i < iv_count_ && bytes > 0; ++i) {
+        int n = bytes < (int)iv_[i].iov_len ? bytes : (int)iv_[i].iov_len;
+        iv_[i].iov_base = (char *)iv_[i].iov_base + n;
+        iv_[i].iov_len -= n;
+        bytes -= n;
+    }
+}
+
 /*
  * 读取客户端数据，直到无数据刻度或客户端关闭连接
  */
@@ -132,9 +401,9 @@ bool HttpConn::Read() {
         return false;
     }
 
-    while (true) {
-        int bytes_read = recv(sockfd_, read_buf_ + read_idx_,
-                              READ_BUF_SIZE - read_idx_, 0);
+    while (read_idx_ < READ_BUF_SIZE) {
+        int bytes_read = Recv(read_buf_ + read_idx_,
+                              READ_BUF_SIZE - read_idx_);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
@@ -161,17 +430,26 @@ HttpConn::HttpCode HttpConn::ParseRequestLine(char *text) {
     }
     *url_++ = '\0';
 
+    // 只有转发给上游的请求接受 GET 和 POST 之外的方法，不支持 TRACE 和 CONNECT
     char *method = text;
-    if (strcasecmp(method, "GET") == 0) {
-        method_ = GET;
+    int i = GET;
+    while (i <= PATCK && strcasecmp(method, method_names[i]) != 0) {
+        ++i;
     }
-    else {
+    if (i > PATCK || i == TRACE || i == CONNECT) {
         return BAD_REQEUST;
     }
+    method_ = (Method)i;
 
     url_ += strspn(url_, " \t");
     version_ = strpbrk(url_, " \t");
-    if (strcasecmp(version_, "HTTP/1.1") != 0) {
+    if (!version_) {
+        return BAD_REQEUST;
+    }
+    *version_++ = '\0';
+    version_ += strspn(version_, " \t");
+    if (strcasecmp(version_, "HTTP/1.1") != 0 &&
+        strcasecmp(version_, "HTTP/1.0") != 0) {
         return BAD_REQEUST;
     }
     if (strncasecmp(url_, "http://", 7) == 0) {
@@ -183,7 +461,7 @@ HttpConn::HttpCode HttpConn::ParseRequestLine(char *text) {
         return BAD_REQEUST;
     }
 
-    check_state_ = CHECK_STATE_REQUESTLINE;
+    check_state_ = CHECK_STATE_HEADER;
     return NO_REQUEST;
 }
 
@@ -193,8 +471,25 @@ HttpConn::HttpCode HttpConn::ParseRequestLine(char *text) {
 HttpConn::HttpCode HttpConn::ParseHeaders(char *text) {
     // 遇到空行，表示头部字段解析完毕
     if (text[0] == '\0') {
+        // 不知道消息体在哪里结束，也就不能把它之后的数据当作下一个请求解析：
+        // 无效的长度回复 400，不支持的分块请求体回复 501，然后关闭连接
+        if (content_length_ < 0) {
+            linger_ = false;
+            return BAD_REQEUST;
+        }
+        if (transfer_encoding_) {
+            linger_ = false;
+            return NOT_IMPLEMENTED;
+        }
+        // 转发给上游的消息体边读边发，不必放进读缓冲
+        if (content_length_ != 0 && Router::HasProxy() && Proxied()) {
+            return GET_REQUEST;
+        }
         // 如果 HTTP 请求有消息体，则还需要读取 content_length_ 字节的消息体，
-        // 状态转移到 CHECK_STATE_CONTENT 状态
+        // 状态转移到 CHECK_STATE_CONTENT 状态；消息体必须能放进读缓冲
+        if (content_length_ >= READ_BUF_SIZE - checked_idx_) {
+            return BAD_REQEUST;
+        }
         if (content_length_ != 0) {
             check_state_ = CHECK_STATE_CONTENT;
             return NO_REQUEST;
@@ -202,19 +497,41 @@ HttpConn::HttpCode HttpConn::ParseHeaders(char *text) {
         // 否则说明已经得到一个完整的 HTTP 请求
         return GET_REQUEST;
     }
+
+    if (header_count_ < MAX_HEADERS) {
+        headers_[header_count_++] = text;
+    }
+
     // 处理 Connetion 头部字段
-    else if (strncasecmp(text, "Connection:", 11) == 0) {
+    if (strncasecmp(text, "Connection:", 11) == 0) {
         text += 11;
         text += strspn(text, " \t");
         if (strcasecmp(text, "keep-alive") == 0) {
             linger_ = true;
         }
     }
-    // 处理 Content-Length 头部字段
+    // 处理 Content-Length 头部字段：只能是十进制数字，重复时必须一致
     else if (strncasecmp(text, "Content-Length:", 15) == 0) {
         text += 15;
         text += strspn(text, " \t");
-        content_length_ = atol(text);
+        long length = -1;
+        if (isdigit((unsigned char)*text)) {
+            char *end;
+            errno = 0;
+            length = strtol(text, &end, 10);
+            end += strspn(end, " \t");
+            if (errno == ERANGE || *end != '\0') {
+                length = -1;
+            }
+        }
+        if (content_length_ < 0 || (has_length_ && length != content_length_)) {
+            length = -1;
+        }
+        content_length_ = length;
+        has_length_ = true;
+    }
+    else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0) {
+        transfer_encoding_ = true;
     }
     // 处理 Host 头部字段
     else if (strncasecmp(text, "Host:", 5) == 0) {
@@ -222,8 +539,17 @@ HttpConn::HttpCode HttpConn::ParseHeaders(char *text) {
         text += strspn(text, " \t");
         host_ = text;
     }
-    else {
-        printf("oop ! unknow header %s\n", text);
+    // 明文连接上升级到 HTTP/2
+    else if (strncasecmp(text, "Upgrade:", 8) == 0) {
+        text += 8;
+        text += strspn(text, " \t");
+        upgrade_h2c_ = strncasecmp(text, "h2c", 3) == 0 &&
+                       (text[3] == '\0' || text[3] == ',' || text[3] == ' ');
+    }
+    else if (strncasecmp(text, "HTTP2-Settings:", 15) == 0) {
+        text += 15;
+        text += strspn(text, " \t");
+        h2_settings_ = text;
     }
 
     return NO_REQUEST;
@@ -235,6 +561,7 @@ HttpConn::HttpCode HttpConn::ParseHeaders(char *text) {
 HttpConn::HttpCode HttpConn::ParseContent(char *text) {
     if (read_idx_ >= (content_length_ + checked_idx_)) {
         text[content_length_] = '\0';
+        body_ = text;
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -252,7 +579,6 @@ HttpConn::HttpCode HttpConn::ProcessRead() {
            ((line_status = ParseLine()) == LINE_OK)) {
         char *text = GetLine();
         start_line_ = checked_idx_;
-        printf("got 1 http line: %s\n", text);
 
         switch (check_state_) {
         case CHECK_STATE_REQUESTLINE:
@@ -263,10 +589,18 @@ HttpConn::HttpCode HttpConn::ProcessRead() {
             break;
         case CHECK_STATE_HEADER:
             ret = ParseHeaders(text);
-            if (ret == BAD_REQEUST) {
-                return BAD_REQEUST;
+            if (ret == BAD_REQEUST || ret == NOT_IMPLEMENTED) {
+                return ret;
             }
             else if (ret == GET_REQUEST) {
+                // 有消息体的请求不升级，TLS 上只能用 ALPN 协商 h2
+                bool tls = false;
+#ifdef HTTPS
+                tls = ssl_ != nullptr;
+#endif
+                if (upgrade_h2c_ && h2_settings_ && !tls) {
+                    return UPGRADE_REQUEST;
+                }
                 return DoRequest();
             }
             break;
@@ -291,6 +625,28 @@ HttpConn::HttpCode HttpConn::ProcessRead() {
  * 并通知调用者获取文件成功
  */
 HttpConn::HttpCode HttpConn::DoRequest() {
+    char *query = strchr(url_, '?');
+    if (query) {
+        *query++ = '\0';
+    }
+    // 路由表中的前缀交给插件处理或转发给上游，其余的是静态文件
+    const Route *route = Router::Match(url_);
+    if (route && route->upstream) {
+        return DoProxy(route, query);
+    }
+    if (method_ != GET && method_ != POST) {
+        return BAD_REQEUST;
+    }
+    if (route) {
+        return DoHandler(route, query ? query : "");
+    }
+    if (cgi_dir_ && strncmp(url_, "/cgi-bin/", 9) == 0) {
+        return DoCgi(query ? query : "");
+    }
+    if (method_ != GET) {
+        return BAD_REQEUST;
+    }
+
     strcpy(real_file_, doc_root);
     int len = strlen(doc_root);
     strncpy(real_file_ + len, url_, FILENAME_LEN - len - 1);
@@ -307,164 +663,1692 @@ HttpConn::HttpCode HttpConn::DoRequest() {
         return BAD_REQEUST;
     }
 
+    if (file_stat_.st_size == 0) {
+        return FILE_REQUEST;
+    }
+
     int fd = open(real_file_, O_RDONLY);
+    if (fd < 0) {
+        return FORBIDDEN_REQUEST;
+    }
+    // kTLS 连接由内核加密，文件直接从页缓存发送，不必映射
+    if (ktls_send_) {
+        file_fd_ = fd;
+        file_offset_ = 0;
+        return FILE_REQUEST;
+    }
     file_addr_ = (char *)mmap(0, file_stat_.st_size, PROT_READ,
                               MAP_PRIVATE, fd, 0);
     close(fd);
+    if (file_addr_ == MAP_FAILED) {
+        file_addr_ = nullptr;
+        return INTERNAL_ERROR;
+    }
 
     return FILE_REQUEST;
 }
 
 /*
- * 对内存映射区执行 munmap 操作
+ * 在当前工作线程中直接调用插件
  */
-void HttpConn::Unmap() {
-    if (file_addr_) {
-        munmap(file_addr_, file_stat_.st_size);
-        file_addr_ = nullptr;
+HttpConn::HttpCode HttpConn::DoHandler(const Route *route, const char *query) {
+    RequestView req;
+    req.method       = method_names[method_];
+    req.path         = url_;
+    // 前缀为 "/" 时整个路径都是 path_info
+    req.path_info    = url_ + (route->prefix.size() > 1 ?
+                               route->prefix.size() : 0);
+    req.query        = query;
+    req.version      = version_;
+    req.body         = body_;
+    req.body_len     = body_ ? content_length_ : 0;
+    req.peer         = &addr_;
+    req.headers      = headers_;
+    req.header_count = header_count_;
+
+    int ret = -1;
+    try {
+        ret = route->handler->Handle(req, response_);
+    }
+    catch (...) {
+        ret = -1;
     }
+    if (ret != 0) {
+        response_.Reset();
+        return INTERNAL_ERROR;
+    }
+    return HANDLER_REQUEST;
 }
 
-/*
- * 写 HTTP 响应
- */
-bool HttpConn::Write() {
-    int bytes_have_send = 0;
-    int bytes_to_send = write_idx_;
-    if (bytes_to_send == 0) {
-        ModFD(epollfd_, sockfd_, EPOLLIN);
-        Init();
-        return true;
+void HttpConn::InitCgi(const char *cgi_dir, int timeout) {
+    cgi_dir_ = cgi_dir;
+    cgi_timeout_ = timeout > 0 ? timeout : 30;
+}
+
+int HttpConn::WaitTime() {
+    // 挂住不输出的 CGI 或上游不会产生任何事件，反应堆至少每秒醒来检查一次定时器；
+    // 上游的健康探测也由反应堆按时发出
+    if (!cgi_dir_ && !Router::HasProxy()) {
+        return -1;
     }
+    return Upstream::NextTimeout(timers_.NextTimeout(1000));
+}
 
-    while (1) {
-        int temp = writev(sockfd_, iv_, iv_count_);
-        if (temp <= -1) {
-            // 如果 tcp 写缓冲没有空间，则等待下次的 EPOLLOUT 事件，虽然在此期间
-            // 服务器无法立即接收到同一客户的下一请求，但可以保证连接的完整性
-            if (errno == EAGAIN) {
-                ModFD(epollfd_, sockfd_, EPOLLOUT);
-                return true;
-            }
-            Unmap();
+void HttpConn::Tick() {
+    if (!cgi_dir_ && !Router::HasProxy()) {
+        return;
+    }
+    Upstream::Tick();
 
-            return false;
+    HttpConn *conn;
+    unsigned long id;
+    while (timers_.PopExpired(&conn, &id)) {
+        if (!conn->Timeout(id)) {
+            conn->CloseConn();
         }
+    }
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if (bytes_to_send <= bytes_have_send) {
-            // 发送 HTTP 响应成功，
-            // 根据 HTTP 请求中的 Connection 字段决定是否立即关闭连接
-            Unmap();
-            if (linger_) {
-                Init();
-                ModFD(epollfd_, sockfd_, EPOLLIN);
-                return true;
-            }
-            else {
-                ModFD(epollfd_, sockfd_, EPOLLIN);
-                return false;
-            }
+    for (size_t i = 0; i < cgi_zombies_.size(); ) {
+        if (waitpid(cgi_zombies_[i], nullptr, WNOHANG) != 0) {
+            cgi_zombies_[i] = cgi_zombies_.back();
+            cgi_zombies_.pop_back();
+        }
+        else {
+            ++i;
         }
     }
 }
 
 /*
- * 向写缓冲中写入待发送的数据
+ * /cgi-bin/name/path_info：在工作线程中准备环境变量并启动 CGI 子进程
  */
-bool HttpConn::AddResponse(const char *format, ...) {
-    if (write_idx_ >= WRITE_BUF_SIZE) {
-        return false;
+HttpConn::HttpCode HttpConn::DoCgi(const char *query) {
+    const char *name = url_ + 9;
+    const char *path_info = strchr(name, '/');
+    int name_len = path_info ? path_info - name : strlen(name);
+    // 不允许 "."、".." 和隐藏文件
+    if (name_len == 0 || name[0] == '.') {
+        return NO_RESOURCE;
+    }
+    if (snprintf(real_file_, FILENAME_LEN, "%s/%.*s",
+                 cgi_dir_, name_len, name) >= FILENAME_LEN) {
+        return BAD_REQEUST;
+    }
+    if (stat(real_file_, &file_stat_) < 0) {
+        return NO_RESOURCE;
+    }
+    if (!S_ISREG(file_stat_.st_mode) || access(real_file_, X_OK) < 0) {
+        return FORBIDDEN_REQUEST;
     }
 
-    va_list arg_list;
-    va_start(arg_list, format);
-    int len = vsnprintf(write_buf_ + write_idx_,
-                        WRITE_BUF_SIZE - 1 - write_idx_, format, arg_list);
-    if (len >= (WRITE_BUF_SIZE - 1 - write_idx_)) {
-        return false;
+    // 环境变量块一次准备好，直接交给 posix_spawn
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr_.sin_addr, addr, sizeof(addr));
+    std::vector<std::string> env;
+    env.push_back("GATEWAY_INTERFACE=CGI/1.1");
+    env.push_back("SERVER_SOFTWARE=ss");
+    env.push_back("PATH=/usr/local/bin:/usr/bin:/bin");
+    env.push_back(std::string("SERVER_PROTOCOL=") + version_);
+    env.push_back(std::string("REQUEST_METHOD=") + method_names[method_]);
+    env.push_back("SCRIPT_NAME=" + std::string(url_, name + name_len - url_));
+    env.push_back(std::string("PATH_INFO=") + (path_info ? path_info : ""));
+    env.push_back(std::string("QUERY_STRING=") + query);
+    env.push_back(std::string("REMOTE_ADDR=") + addr);
+    env.push_back("REMOTE_PORT=" + std::to_string(ntohs(addr_.sin_port)));
+    if (body_) {
+        env.push_back("CONTENT_LENGTH=" + std::to_string(content_length_));
+        // cgi-bin 中的程序沿用 twebs 的变量名
+        env.push_back("CONTENT-LENGTH=" + std::to_string(content_length_));
     }
-    write_idx_ += len;
-    va_end(arg_list);
+    for (int i = 0; i < header_count_; ++i) {
+        const char *colon = strchr(headers_[i], ':');
+        if (!colon) {
+            continue;
+        }
+        std::string var(headers_[i], colon - headers_[i]);
+        for (char &c : var) {
+            c = c == '-' ? '_' : toupper((unsigned char)c);
+        }
+        // Proxy 头部会变成 HTTP_PROXY，被 CGI 中的 HTTP 库当作代理（httpoxy）
+        if (var == "CONTENT_LENGTH" || var == "PROXY") {
+            continue;
+        }
+        if (var != "CONTENT_TYPE") {
+            var = "HTTP_" + var;
+        }
+        env.push_back(var + "=" + (colon + 1 + strspn(colon + 1, " \t")));
+    }
+    std::vector<char *> envp;
+    for (std::string &var : env) {
+        envp.push_back(&var[0]);
+    }
+    envp.push_back(nullptr);
 
-    return true;
+    cgi_pid_ = SpawnCgi(real_file_, envp.data());
+    if (cgi_pid_ < 0) {
+        return INTERNAL_ERROR;
+    }
+    ++task_id_;
+    cgi_body_      = body_;
+    cgi_body_left_ = body_ ? content_length_ : 0;
+    cgi_head_done_ = false;
+    cgi_chunked_   = false;
+    cgi_left_      = -1;
+    cgi_eof_       = false;
+    cgi_http11_    = strcasecmp(version_, "HTTP/1.1") == 0;
+    cgi_sent_      = 0;
+    cgi_active_    = TimerHeap<HttpConn>::NowMs();
+    cgi_head_.clear();
+    cgi_send_.clear();
+    return CGI_REQUEST;
 }
 
-bool HttpConn::AddStatusLine(int status, const char *title) {
-    return AddResponse("%s %d %s\r\n", "HTTP/1.1", status, title);
-}
+/*
+ * 启动 CGI 子进程，stdin 和 stdout 是两条管道，父进程的一端是非阻塞的；
+ * 程序无法执行时返回 -1
+ */
+pid_t HttpConn::SpawnCgi(const char *path, char *const envp[]) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    // 管道要能放进 fd 归属表
+    if (in[1] >= MAX_FD || out[0] >= MAX_FD) {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
 
-bool HttpConn::AddHeaders(int content_len) {
-    return AddContentLength(content_len) && AddLinger() && AddBlankLine();
-}
+    // posix_spawn 不复制 HttpConn 数组所在的页表，fork 的开销随 RSS 增长；
+    // 客户 socket 等其他 fd 不会留给 CGI，反应堆忽略的 SIGPIPE 恢复默认，
+    // CGI 自成一个进程组，超时时连同它启动的进程一起杀死
+    pid_t pid = cgi_spawn(path, envp, in[0], out[1]);
+    close(in[0]);
+    close(out[1]);
+    if (pid < 0) {
+        close(in[1]);
+        close(out[0]);
+        return -1;
+    }
 
-bool HttpConn::AddContentLength(int content_len) {
-    return AddResponse("Content-Length: %d\r\n", content_len);
+    SetNonblocking(in[1]);
+    SetNonblocking(out[0]);
+    cgi_stdin_ = in[1];
+    cgi_stdout_ = out[0];
+    return pid;
 }
 
-bool HttpConn::AddLinger() {
-    return AddResponse("Connection: %s\r\n",
-                        (linger_ == true) ? "keep-alive" : "close");
-}
+/*
+ * 由工作线程在 DoCgi 成功后调用，把连接交给反应堆：
+ * 注册管道之后反应堆随时可能处理这个连接，工作线程不能再访问成员
+ */
+void HttpConn::StartCgi() {
+    bool fed = FeedCgi();
+    int stdin_fd = cgi_stdin_;
+    int stdout_fd = cgi_stdout_;
+    unsigned long id = task_id_;
 
-bool HttpConn::AddBlankLine() {
-    return AddResponse("%s", "\r\n");
-}
+    owner_[sockfd_] = this;
+    owner_[stdout_fd] = this;
+    if (!fed) {
+        owner_[stdin_fd] = this;
+    }
 
-bool HttpConn::AddContent(const char *content) {
-    return AddResponse("%s", content);
-}
+    struct epoll_event event;
+    if (!fed) {
+        // stdin 上的事件不会结束 CGI，先于 stdout 注册是安全的
+        event.data.fd = stdin_fd;
+        event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+        epoll_ctl(epollfd_, EPOLL_CTL_ADD, stdin_fd, &event);
+    }
+    event.data.fd = stdout_fd;
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    epoll_ctl(epollfd_, EPOLL_CTL_ADD, stdout_fd, &event);
 
-bool HttpConn::ProcessWriteCommon(int num, const char *title,
-                                  const char *form) {
-    AddStatusLine(num, title);
-    AddHeaders(strlen(form));
-    return AddContent(form);
+    // 定时器只带 id，CGI 已经结束时到期的定时器被忽略
+    timers_.Add(cgi_timeout_ * 1000, this, id);
 }
 
 /*
- * 根据服务器处理 HTTP 请求的结果，决定返回给客户端的内容
+ * 把请求的消息体写入 CGI 的 stdin，写完（或 CGI 不再读）后关闭 stdin；
+ * 返回 false 表示管道已满，需要等待可写
  */
-bool HttpConn::ProcessWrite(HttpCode ret) {
-    switch (static_cast<int>(ret)) {
-    case INTERNAL_ERROR:
-        if (!ProcessWriteCommon(500, err_500_title, err_500_form)) return false;
-        break;
-    case BAD_REQEUST:
-        if (!ProcessWriteCommon(400, err_400_title, err_400_form)) return false;
-        break;
-    case NO_RESOURCE:
-        if (!ProcessWriteCommon(404, err_404_title, err_404_form)) return false;
-        break;
-    case FORBIDDEN_REQUEST:
-        if (!ProcessWriteCommon(403, err_403_title, err_403_form)) return false;
-        break;
-    case FILE_REQUEST:
-        AddStatusLine(200, ok_200_title);
-        if (file_stat_.st_size != 0) {
-            AddHeaders(file_stat_.st_size);
-            iv_[0].iov_base = write_buf_;
-            iv_[0].iov_len  = write_idx_;
-            iv_[1].iov_base = file_addr_;
-            iv_[1].iov_len  = file_stat_.st_size;
-            iv_count_ = 2;
-            return true;
-        }
-        else {
-            const char *ok_string = "<html><body></body></html>";
-            AddHeaders(strlen(ok_string));
-            if (!AddContent(ok_string)) return false;
+bool HttpConn::FeedCgi() {
+    while (cgi_body_left_ > 0) {
+        int n = write(cgi_stdin_, cgi_body_, cgi_body_left_);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            break;
         }
-        break;
-    default:
-        return false;
-        break;
+        cgi_body_ += n;
+        cgi_body_left_ -= n;
     }
 
-    iv_[0].iov_base = write_buf_;
+    owner_[cgi_stdin_] = nullptr;
+    RemoveFD(epollfd_, cgi_stdin_);
+    cgi_stdin_ = -1;
+    cgi_body_left_ = 0;
+    return true;
+}
+
+bool HttpConn::FdEvent(int fd, uint32_t events) {
+    if (proxy_fd_ >= 0) {
+        return ProxyEvent(fd, events);
+    }
+    return CgiEvent(fd, events);
+}
+
+bool HttpConn::CgiEvent(int fd, uint32_t events) {
+    if (fd == sockfd_) {
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            StopCgi(true);
+            return false;
+        }
+        return PumpCgi();
+    }
+    if (fd == cgi_stdin_) {
+        if (!FeedCgi()) {
+            ModFD(epollfd_, cgi_stdin_, EPOLLOUT);
+        }
+        return true;
+    }
+    // stdout 可读，或者 CGI 关闭了输出（EPOLLHUP）
+    return PumpCgi();
+}
+
+/*
+ * 在 CGI 的 stdout 和客户 socket 之间搬运数据：积压的数据发完之前不再读
+ * CGI 的输出，管道写满后 CGI 自然阻塞，客户端的速度限制了 CGI 的速度
+ */
+bool HttpConn::PumpCgi() {
+    char buf[16384];
+
+    while (true) {
+        while (cgi_sent_ < cgi_send_.size()) {
+            iv_[0].iov_base = &cgi_send_[cgi_sent_];
+            iv_[0].iov_len  = cgi_send_.size() - cgi_sent_;
+            iv_count_ = 1;
+            int n = Send();
+            if (n < 0) {
+                if (errno != EAGAIN) {
+                    StopCgi(true);
+                    return false;
+                }
+#ifdef HTTPS
+                if (ssl_ && SSL_want_read(ssl_)) {
+                    ModFD(epollfd_, sockfd_, EPOLLIN);
+                    return true;
+                }
+#endif
+                ModFD(epollfd_, sockfd_, EPOLLOUT);
+                return true;
+            }
+            cgi_sent_ += n;
+        }
+        cgi_send_.clear();
+        cgi_sent_ = 0;
+
+        if (cgi_eof_) {
+            break;
+        }
+
+        int n = read(cgi_stdout_, buf, sizeof(buf));
+        if (n > 0) {
+            cgi_active_ = TimerHeap<HttpConn>::NowMs();
+            if (cgi_head_done_) {
+                AppendCgiBody(buf, n);
+            }
+            else {
+                cgi_head_.append(buf, n);
+                if (!ParseCgiHead()) {
+                    return FailCgi(502, err_502_title, err_502_form);
+                }
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            ModFD(epollfd_, cgi_stdout_, EPOLLIN);
+            return true;
+        }
+
+        // CGI 关闭了输出
+        if (!cgi_head_done_) {
+            return FailCgi(502, err_502_title, err_502_form);
+        }
+        cgi_eof_ = true;
+        if (cgi_chunked_) {
+            cgi_send_.append("0\r\n\r\n");
+        }
+    }
+
+    // 应答已全部发出；输出比 Content-Length 短时客户端只能靠关闭连接判断结束
+    bool keep_alive = linger_ && (cgi_chunked_ || cgi_left_ == 0);
+    StopCgi(false);
+    if (!keep_alive) {
+        return false;
+    }
+    Init();
+    ModFD(epollfd_, sockfd_, EPOLLIN);
+    return true;
+}
+
+/*
+ * 在 cgi_head_ 中寻找 CGI 输出的头部块，找到后生成 HTTP 应答的头部；
+ * 返回 false 表示头部块格式错误或过长
+ */
+bool HttpConn::ParseCgiHead() {
+    std::vector<std::string> lines;
+    size_t pos = 0;
+    while (true) {
+        size_t nl = cgi_head_.find('\n', pos);
+        if (nl == std::string::npos) {
+            // 头部块还没有读完
+            return cgi_head_.size() <= (size_t)CGI_HEAD_SIZE;
+        }
+        size_t end = (nl > pos && cgi_head_[nl - 1] == '\r') ? nl - 1 : nl;
+        std::string line = cgi_head_.substr(pos, end - pos);
+        pos = nl + 1;
+        if (line.empty()) {
+            break;
+        }
+        lines.push_back(line);
+    }
+    if (pos > (size_t)CGI_HEAD_SIZE) {
+        return false;
+    }
+
+    int status = 200;
+    std::string title = ok_200_title;
+    bool has_status = false;
+    bool has_location = false;
+    long length = -1;
+    std::string headers;
+    for (const std::string &line : lines) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            return false;
+        }
+        std::string name = line.substr(0, colon);
+        const char *value = line.c_str() + colon + 1;
+        value += strspn(value, " \t");
+
+        if (strcasecmp(name.c_str(), "Status") == 0) {
+            char *end;
+            status = strtol(value, &end, 10);
+            if (status < 100 || status > 999) {
+                return false;
+            }
+            title = end + strspn(end, " \t");
+            has_status = true;
+        }
+        else if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+            char *end;
+            length = strtol(value, &end, 10);
+            if (length < 0 || end == value) {
+                return false;
+            }
+        }
+        // 逐跳头部由服务器根据连接自己生成
+        else if (strcasecmp(name.c_str(), "Connection") == 0 ||
+                 strcasecmp(name.c_str(), "Keep-Alive") == 0 ||
+                 strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+            continue;
+        }
+        else {
+            if (strcasecmp(name.c_str(), "Location") == 0) {
+                has_location = true;
+            }
+            headers.append(name).append(": ").append(value).append("\r\n");
+        }
+    }
+    if (has_location && !has_status) {
+        status = 302;
+        title = "Found";
+    }
+
+    char line[64];
+    snprintf(line, sizeof(line), "HTTP/1.1 %d ", status);
+    cgi_send_.append(line).append(title).append("\r\n").append(headers);
+    if (length >= 0) {
+        cgi_left_ = length;
+        snprintf(line, sizeof(line), "Content-Length: %ld\r\n", length);
+        cgi_send_.append(line);
+    }
+    else if (cgi_http11_) {
+        cgi_chunked_ = true;
+        cgi_send_.append("Transfer-Encoding: chunked\r\n");
+    }
+    else {
+        // HTTP/1.0 客户端只能靠关闭连接判断应答体结束
+        linger_ = false;
+    }
+    cgi_send_.append(linger_ ? "Connection: keep-alive\r\n\r\n"
+                             : "Connection: close\r\n\r\n");
+    cgi_head_done_ = true;
+
+    std::string rest = cgi_head_.substr(pos);
+    cgi_head_.clear();
+    AppendCgiBody(rest.data(), rest.size());
+    return true;
+}
+
+/*
+ * 按应答体的界定方式追加 CGI 的输出，超出 Content-Length 的部分被丢弃
+ */
+void HttpConn::AppendCgiBody(const char *data, size_t len) {
+    if (cgi_left_ >= 0) {
+        if ((long)len > cgi_left_) {
+            len = cgi_left_;
+        }
+        cgi_left_ -= len;
+    }
+    if (len == 0) {
+        return;
+    }
+    if (cgi_chunked_) {
+        char size[32];
+        snprintf(size, sizeof(size), "%zx\r\n", len);
+        cgi_send_.append(size).append(data, len).append("\r\n");
+    }
+    else {
+        cgi_send_.append(data, len);
+    }
+}
+
+/*
+ * CGI 还没有输出任何应答时出错：结束 CGI，改为发送错误页面
+ */
+bool HttpConn::FailCgi(int status, const char *title, const char *form) {
+    StopCgi(true);
+    write_idx_ = 0;
+    if (!ProcessWriteCommon(status, title, form)) {
+        return false;
+    }
+    iv_[0].iov_base = write_buf_;
+    iv_[0].iov_len  = write_idx_;
+    iv_count_ = 1;
+    bytes_to_send_ = write_idx_;
+    return Write();
+}
+
+/*
+ * 请求可能只读到一部分，无法判断下一个请求从哪里开始，所以应答后关闭连接
+ */
+bool HttpConn::TooManyRequests(long retry_after) {
+    linger_ = false;
+    write_idx_ = 0;
+    if (!AddStatusLine(429, err_429_title) ||
+        !AddResponse("Retry-After: %ld\r\n", retry_after) ||
+        !AddHeaders(strlen(err_429_form)) || !AddContent(err_429_form)) {
+        return false;
+    }
+    iv_[0].iov_base = write_buf_;
+    iv_[0].iov_len  = write_idx_;
+    iv_count_ = 1;
+    bytes_to_send_ = write_idx_;
+    return Write();
+}
+
+/*
+ * 关闭管道，解除 fd 归属；abort 为 true 时杀死还在运行的 CGI。
+ * 子进程关闭输出后通常很快退出，没有退出的留给 Tick 回收
+ */
+void HttpConn::StopCgi(bool abort) {
+    if (cgi_pid_ < 0) {
+        return;
+    }
+    if (cgi_stdin_ >= 0) {
+        owner_[cgi_stdin_] = nullptr;
+        RemoveFD(epollfd_, cgi_stdin_);
+        cgi_stdin_ = -1;
+    }
+    if (cgi_stdout_ >= 0) {
+        owner_[cgi_stdout_] = nullptr;
+        RemoveFD(epollfd_, cgi_stdout_);
+        cgi_stdout_ = -1;
+    }
+    owner_[sockfd_] = nullptr;
+
+    if (waitpid(cgi_pid_, nullptr, WNOHANG) == 0) {
+        if (abort) {
+            kill(-cgi_pid_, SIGKILL);
+        }
+        cgi_zombies_.push_back(cgi_pid_);
+    }
+    cgi_pid_ = -1;
+    cgi_head_.clear();
+    cgi_send_.clear();
+    cgi_sent_ = 0;
+}
+
+/*
+ * 返回 false 表示需要关闭连接
+ */
+bool HttpConn::CgiTimeout(unsigned long id) {
+    if (cgi_pid_ < 0 || id != task_id_) {
+        return true;
+    }
+    // 正在等客户端接收（背压）或者 CGI 最近有输出，重新计时
+    int64_t now = TimerHeap<HttpConn>::NowMs();
+    int64_t idle = now - cgi_active_;
+    if (cgi_sent_ < cgi_send_.size()) {
+        cgi_active_ = now;
+        idle = 0;
+    }
+    if (idle < cgi_timeout_ * 1000) {
+        timers_.Add(cgi_timeout_ * 1000 - idle, this, id);
+        return true;
+    }
+    if (!cgi_head_done_) {
+        return FailCgi(504, err_504_title, err_504_form);
+    }
+    // 应答已经开始发送，只能断开连接
+    StopCgi(true);
+    return false;
+}
+
+bool HttpConn::Timeout(unsigned long id) {
+    if (proxy_fd_ >= 0) {
+        return ProxyTimeout(id);
+    }
+    return CgiTimeout(id);
+}
+
+/*
+ * 请求是否转发给上游，此时 url_ 中还带着查询串
+ */
+bool HttpConn::Proxied() {
+    char *query = strchr(url_, '?');
+    if (query) {
+        *query = '\0';
+    }
+    const Route *route = Router::Match(url_);
+    if (query) {
+        *query = '?';
+    }
+    return route && route->upstream;
+}
+
+/*
+ * 在工作线程中生成发给上游的请求，并取得（或开始建立）上游连接
+ */
+HttpConn::HttpCode HttpConn::DoProxy(const Route *route, const char *query,
+                                     bool lookup) {
+    ProxyCache *cache = route->upstream->Cache();
+    if (lookup && cache && (method_ == GET || method_ == HEAD) &&
+        content_length_ == 0) {
+        HttpCode ret = LookupCache(cache, route, query);
+        if (ret != NO_REQUEST) {
+            return ret;
+        }
+    }
+
+    // 逐跳头部不转发；X-Forwarded-For 追加客户地址，X-Forwarded-Proto 由
+    // 本服务器给出
+    static const char *const skipped[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+        "Transfer-Encoding", "Upgrade", "HTTP2-Settings", "Expect",
+        "Content-Length", "X-Forwarded-For", "X-Forwarded-Proto"
+    };
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr_.sin_addr, addr, sizeof(addr));
+    std::string forwarded;
+    bool expect_continue = false;
+    // 客户没有给出 Host 时用选中的服务器的地址，选定服务器后填入
+    size_t host_pos = 0;
+
+    std::string &req = proxy_req_;
+    req.clear();
+    std::string target = url_;
+    if (query) {
+        target.append("?").append(query);
+    }
+    req.append(method_names[method_]).append(" ").append(target)
+       .append(" HTTP/1.1\r\n");
+    for (int i = 0; i < header_count_; ++i) {
+        const char *h = headers_[i];
+        const char *colon = strchr(h, ':');
+        if (!colon) {
+            continue;
+        }
+        size_t len = colon - h;
+        const char *value = colon + 1 + strspn(colon + 1, " \t");
+        size_t j = 0;
+        while (j < sizeof(skipped) / sizeof(skipped[0]) &&
+               !(strlen(skipped[j]) == len &&
+                 strncasecmp(h, skipped[j], len) == 0)) {
+            ++j;
+        }
+        if (cache_fill_ && (strncasecmp(h, "If-None-Match:", 14) == 0 ||
+                            strncasecmp(h, "If-Modified-Since:", 18) == 0)) {
+            // 填充缓存要取完整的应答，不能是 304
+            continue;
+        }
+        if (j == sizeof(skipped) / sizeof(skipped[0])) {
+            req.append(h).append("\r\n");
+        }
+        else if (strncasecmp(h, "X-Forwarded-For", len) == 0) {
+            forwarded.append(value).append(", ");
+        }
+        else if (strncasecmp(h, "Expect", len) == 0) {
+            expect_continue = strcasecmp(value, "100-continue") == 0;
+        }
+    }
+    if (!host_) {
+        req.append("Host: ").append("\r\n");
+        host_pos = req.size() - 2;
+    }
+    req.append("X-Forwarded-For: ").append(forwarded).append(addr);
+#ifdef HTTPS
+    req.append(ssl_ ? "\r\nX-Forwarded-Proto: https\r\n"
+                    : "\r\nX-Forwarded-Proto: http\r\n");
+#else
+    req.append("\r\nX-Forwarded-Proto: http\r\n");
+#endif
+    if (content_length_ > 0) {
+        req.append("Content-Length: ")
+           .append(std::to_string(content_length_)).append("\r\n");
+    }
+    req.append("Connection: keep-alive\r\n\r\n");
+
+    // 读缓冲中已有的消息体随头部一起发送，其余的从 socket 中边读边发
+    long buffered = read_idx_ - checked_idx_;
+    if (buffered > content_length_) {
+        buffered = content_length_;
+    }
+    req.append(read_buf_ + checked_idx_, buffered);
+    proxy_body_left_ = content_length_ - buffered;
+
+    proxy_upstream_ = route->upstream;
+    proxy_hash_ = proxy_upstream_->KeyHash(addr_, target.c_str(), headers_,
+                                           header_count_);
+    proxy_tries_ = 1;
+    proxy_fd_ = proxy_upstream_->Connect(proxy_hash_, nullptr, &proxy_server_,
+                                         &proxy_reused_, &proxy_connecting_);
+    if (proxy_fd_ >= MAX_FD) {
+        proxy_server_->Release(proxy_fd_, false);
+        proxy_fd_ = -1;
+    }
+    if (proxy_fd_ < 0) {
+        linger_ = linger_ && proxy_body_left_ == 0;
+        EndFill(nullptr, false);
+        if (cache_obj_) {
+            cache_status_ = "STALE";
+            return CACHED_REQUEST;
+        }
+        return BAD_GATEWAY;
+    }
+    if (host_pos) {
+        req.insert(host_pos, proxy_server_->Host());
+    }
+
+    ++task_id_;
+    proxy_active_       = TimerHeap<HttpConn>::NowMs();
+    proxy_req_sent_     = 0;
+    proxy_body_.clear();
+    proxy_body_sent_    = 0;
+    proxy_streamed_     = false;
+    proxy_req_broken_   = false;
+    proxy_received_     = false;
+    proxy_head_done_    = false;
+    proxy_head_request_ = method_ == HEAD;
+    proxy_head_.clear();
+    proxy_framing_      = BODY_NONE;
+    proxy_left_         = 0;
+    proxy_chunk_state_  = CHUNK_SIZE;
+    proxy_line_.clear();
+    proxy_done_         = false;
+    proxy_reusable_     = false;
+    proxy_chunked_      = false;
+    proxy_send_.clear();
+    proxy_sent_         = 0;
+    // 客户在等 100 Continue 才发送消息体
+    if (expect_continue && proxy_body_left_ > 0 &&
+        strcasecmp(version_, "HTTP/1.1") == 0) {
+        proxy_send_.append("HTTP/1.1 100 Continue\r\n\r\n");
+    }
+    return PROXY_REQUEST;
+}
+
+/*
+ * 在工作线程中查找缓存，返回 NO_REQUEST 表示转发给上游（可能负责填充）
+ */
+HttpConn::HttpCode HttpConn::LookupCache(ProxyCache *cache,
+                                         const Route *route,
+                                         const char *query) {
+    bool refresh = false;
+    for (int i = 0; i < header_count_; ++i) {
+        const char *h = headers_[i];
+        if (strncasecmp(h, "Authorization:", 14) == 0 ||
+            strncasecmp(h, "Range:", 6) == 0) {
+            return NO_REQUEST;
+        }
+        if (strncasecmp(h, "Cache-Control:", 14) == 0) {
+            if (strcasestr(h, "no-store")) {
+                return NO_REQUEST;
+            }
+            refresh = refresh || strcasestr(h, "no-cache") ||
+                      strcasestr(h, "max-age=0");
+        }
+        else if (strncasecmp(h, "Pragma:", 7) == 0 &&
+                 strcasestr(h, "no-cache")) {
+            refresh = true;
+        }
+    }
+    // 基础键：方法、Host 和请求目标，HEAD 使用 GET 的缓存
+    cache_base_ = "GET ";
+    cache_base_.append(host_ ? host_ : "").append(url_);
+    if (query) {
+        cache_base_.append("?").append(query);
+    }
+    proxy_route_ = route;
+    proxy_query_ = query;
+
+    std::shared_ptr<const CachedResponse> obj;
+    switch (cache->Lookup(cache_base_, headers_, header_count_, refresh,
+                          method_ == GET, this, &cache_key_, &obj)) {
+    case ProxyCache::HIT:
+        cache_obj_ = obj;
+        cache_status_ = "HIT";
+        return CACHED_REQUEST;
+    case ProxyCache::STALE:
+        cache_obj_ = obj;
+        cache_status_ = "STALE";
+        return CACHED_REQUEST;
+    case ProxyCache::WAIT:
+        // 填充的请求随时可能在反应堆中唤醒本连接，工作线程不能再访问成员
+        return CACHE_WAIT;
+    case ProxyCache::MISS:
+        if (method_ == GET) {
+            cache_ = cache;
+            cache_fill_ = true;
+            cache_obj_ = obj;
+        }
+        return NO_REQUEST;
+    default:
+        return NO_REQUEST;
+    }
+}
+
+/*
+ * 由工作线程在 DoProxy 成功后调用，把连接交给反应堆：
+ * 注册上游 socket 之后反应堆随时可能处理这个连接，工作线程不能再访问成员
+ */
+void HttpConn::StartProxy() {
+    int fd = proxy_fd_;
+    unsigned long id = task_id_;
+    int timeout = proxy_upstream_->Timeout();
+
+    owner_[sockfd_] = this;
+    owner_[fd] = this;
+    // 连接建立（或池中的连接可写）后开始发送请求
+    WatchUpstream(EPOLL_CTL_ADD, EPOLLOUT);
+    timers_.Add(timeout * 1000, this, id);
+}
+
+/*
+ * 上游 socket 不关注 EPOLLRDHUP：上游关闭连接时应答可能还没读完，
+ * 等客户接收期间不能让它一直触发
+ */
+void HttpConn::WatchUpstream(int op, uint32_t events) {
+    struct epoll_event event;
+    event.data.fd = proxy_fd_;
+    event.events = events | EPOLLET | EPOLLONESHOT;
+    epoll_ctl(epollfd_, op, proxy_fd_, &event);
+}
+
+bool HttpConn::ProxyEvent(int fd, uint32_t events) {
+    if (fd == sockfd_) {
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            StopProxy(false);
+            return false;
+        }
+        return PumpProxy();
+    }
+    if (proxy_connecting_) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(proxy_fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == 0) {
+            proxy_connecting_ = false;
+        }
+        else if (!RetryProxy(true)) {
+            return FailProxy(502, err_502_title, err_502_proxy_form);
+        }
+    }
+    return PumpProxy();
+}
+
+/*
+ * 上游在应答任何数据之前就断开了，或者连接失败（failed）。池中取出的
+ * 连接可能刚被上游关闭，换一个新连接重发；新连接也失败说明服务器有问题，
+ * 记一次失败，请求还能完整重发时换组中的另一台服务器
+ */
+bool HttpConn::RetryProxy(bool failed) {
+    if (proxy_received_) {
+        return false;
+    }
+    if (failed || !proxy_reused_) {
+        proxy_upstream_->Failed(proxy_server_);
+        failed = true;
+    }
+    if (proxy_streamed_ ||
+        (failed && proxy_tries_ >= proxy_upstream_->Size())) {
+        return false;
+    }
+    owner_[proxy_fd_] = nullptr;
+    epoll_ctl(epollfd_, EPOLL_CTL_DEL, proxy_fd_, nullptr);
+    UpstreamServer *server = proxy_server_;
+    server->Release(proxy_fd_, false);
+
+    if (failed) {
+        ++proxy_tries_;
+        proxy_fd_ = proxy_upstream_->Connect(proxy_hash_, server,
+                                             &proxy_server_, &proxy_reused_,
+                                             &proxy_connecting_);
+    }
+    else {
+        proxy_fd_ = server->Connect(true, &proxy_reused_, &proxy_connecting_);
+    }
+    if (proxy_fd_ >= MAX_FD) {
+        proxy_server_->Release(proxy_fd_, false);
+        proxy_fd_ = -1;
+    }
+    if (proxy_fd_ < 0) {
+        return false;
+    }
+    owner_[proxy_fd_] = this;
+    WatchUpstream(EPOLL_CTL_ADD, 0);
+    proxy_req_sent_ = 0;
+    proxy_req_broken_ = false;
+    return true;
+}
+
+/*
+ * 在客户和上游之间双向搬运数据：请求方向上，发给上游的数据发完之前不再
+ * 读客户的消息体；应答方向上，发给客户的数据发完之前不再读上游的应答。
+ * 等待的一方由 epoll 通知，另一方的速度限制了这一方的速度
+ */
+bool HttpConn::PumpProxy() {
+    char buf[16384];
+    bool upstream_in = false, upstream_out = false;
+    bool client_in = false, client_out = false;
+    bool progress = true;
+
+    while (progress) {
+        progress = false;
+
+        // 请求方向
+        while (!proxy_connecting_ && !proxy_req_broken_ && !upstream_out) {
+            std::string &data = proxy_req_sent_ < proxy_req_.size() ?
+                                proxy_req_ : proxy_body_;
+            size_t &sent = &data == &proxy_req_ ? proxy_req_sent_
+                                                : proxy_body_sent_;
+            if (sent == data.size()) {
+                break;
+            }
+            ssize_t n = send(proxy_fd_, data.data() + sent, data.size() - sent,
+                             MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                upstream_out = true;
+                break;
+            }
+            if (n < 0) {
+                if (RetryProxy(false)) {
+                    progress = true;
+                    break;
+                }
+                // 上游可能已经给出了应答（例如拒绝过大的消息体），继续读应答
+                proxy_req_broken_ = true;
+                break;
+            }
+            sent += n;
+        }
+        if (!proxy_connecting_ && !proxy_req_broken_ && !upstream_out &&
+            proxy_req_sent_ == proxy_req_.size() &&
+            proxy_body_sent_ == proxy_body_.size() &&
+            proxy_body_left_ > 0 && !client_in) {
+            proxy_body_.clear();
+            proxy_body_sent_ = 0;
+            int n = Recv(buf, proxy_body_left_ < (long)sizeof(buf) ?
+                              proxy_body_left_ : sizeof(buf));
+            if (n > 0) {
+                proxy_body_.append(buf, n);
+                proxy_body_left_ -= n;
+                proxy_streamed_ = true;
+                proxy_active_ = TimerHeap<HttpConn>::NowMs();
+                progress = true;
+            }
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                client_in = true;
+            }
+            else {
+                StopProxy(false);
+                return false;
+            }
+        }
+
+        // 应答方向
+        while (!client_out && proxy_sent_ < proxy_send_.size()) {
+            iv_[0].iov_base = &proxy_send_[proxy_sent_];
+            iv_[0].iov_len  = proxy_send_.size() - proxy_sent_;
+            iv_count_ = 1;
+            int n = Send();
+            if (n < 0) {
+                if (errno != EAGAIN) {
+                    StopProxy(false);
+                    return false;
+                }
+                client_out = true;
+#ifdef HTTPS
+                // SSL_write 可能需要先读到对端的数据
+                if (ssl_ && SSL_want_read(ssl_)) {
+                    client_in = true;
+                }
+#endif
+                break;
+            }
+            proxy_sent_ += n;
+        }
+        if (client_out) {
+            continue;
+        }
+        proxy_send_.clear();
+        proxy_sent_ = 0;
+        if (proxy_done_) {
+            break;
+        }
+        if (proxy_connecting_ || upstream_in) {
+            continue;
+        }
+
+        ssize_t n = recv(proxy_fd_, buf, sizeof(buf), 0);
+        if (n > 0) {
+            proxy_received_ = true;
+            proxy_active_ = TimerHeap<HttpConn>::NowMs();
+            progress = true;
+            if (proxy_head_done_) {
+                if (!ProxyBody(buf, n)) {
+                    StopProxy(false);
+                    return false;
+                }
+            }
+            else {
+                proxy_head_.append(buf, n);
+                if (!ParseProxyHead()) {
+                    proxy_upstream_->Failed(proxy_server_);
+                    return FailProxy(502, err_502_title, err_502_proxy_form);
+                }
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            progress = true;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            upstream_in = true;
+            continue;
+        }
+
+        // 上游关闭了连接
+        if (RetryProxy(false)) {
+            progress = true;
+            continue;
+        }
+        if (!proxy_head_done_) {
+            return FailProxy(502, err_502_title, err_502_proxy_form);
+        }
+        if (proxy_framing_ != BODY_CLOSE) {
+            // 应答体不完整，客户只能靠连接断开发现
+            StopProxy(false);
+            return false;
+        }
+        EndProxyBody();
+        progress = true;
+    }
+
+    if (proxy_done_ && !client_out) {
+        // 请求没有发完时上游连接的状态不确定，客户剩下的消息体也没有读
+        bool sent = !proxy_req_broken_ && proxy_body_left_ == 0 &&
+                    proxy_req_sent_ == proxy_req_.size() &&
+                    proxy_body_sent_ == proxy_body_.size();
+        bool keep_alive = linger_ && proxy_body_left_ == 0;
+        StopProxy(proxy_reusable_ && sent);
+        if (!keep_alive) {
+            return false;
+        }
+        Init();
+        ModFD(epollfd_, sockfd_, EPOLLIN);
+        return true;
+    }
+
+    // 不等待上游时上游 socket 保持未注册状态，客户 socket 则总要注册，
+    // 以便发现客户断开
+    if (upstream_in || upstream_out || proxy_connecting_) {
+        bool out = upstream_out || proxy_connecting_;
+        WatchUpstream(EPOLL_CTL_MOD, (upstream_in ? (uint32_t)EPOLLIN : 0u) |
+                                     (out ? (uint32_t)EPOLLOUT : 0u));
+    }
+    ModFD(epollfd_, sockfd_, (client_in ? ReadEvents() : 0) |
+                             (client_out ? (uint32_t)EPOLLOUT : 0u));
+    return true;
+}
+
+/*
+ * 在 proxy_head_ 中寻找上游的应答头部，找到后生成给客户的应答头部；
+ * 跳过 1xx 临时应答，返回 false 表示应答格式错误或头部过长
+ */
+bool HttpConn::ParseProxyHead() {
+    std::vector<std::string> lines;
+    size_t pos = 0;
+    while (true) {
+        size_t nl = proxy_head_.find('\n', pos);
+        if (nl == std::string::npos) {
+            return proxy_head_.size() <= (size_t)CGI_HEAD_SIZE;
+        }
+        size_t end = (nl > pos && proxy_head_[nl - 1] == '\r') ? nl - 1 : nl;
+        std::string line = proxy_head_.substr(pos, end - pos);
+        pos = nl + 1;
+        if (line.empty()) {
+            if (lines.empty()) {
+                continue;
+            }
+            // 100 Continue 等临时应答，后面才是真正的应答
+            int code = atoi(lines[0].c_str() + 9);
+            if (code >= 100 && code < 200 && code != 101) {
+                lines.clear();
+                continue;
+            }
+            break;
+        }
+        lines.push_back(line);
+    }
+    if (pos > (size_t)CGI_HEAD_SIZE) {
+        return false;
+    }
+
+    // HTTP/1.x 状态码 原因短语
+    const std::string &status_line = lines[0];
+    if (status_line.size() < 12 || status_line.compare(0, 7, "HTTP/1.") != 0 ||
+        status_line[8] != ' ') {
+        return false;
+    }
+    char *end;
+    long status = strtol(status_line.c_str() + 9, &end, 10);
+    if (status < 200 || status > 999 || end != status_line.c_str() + 12) {
+        return false;
+    }
+    const char *title = end + strspn(end, " \t");
+    bool reusable = status_line[7] == '1';
+
+    long length = -1;
+    bool chunked = false, other_coding = false;
+    std::string headers;
+    for (size_t i = 1; i < lines.size(); ++i) {
+        const std::string &line = lines[i];
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            return false;
+        }
+        std::string name = line.substr(0, colon);
+        const char *value = line.c_str() + colon + 1;
+        value += strspn(value, " \t");
+
+        if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+            length = strtol(value, &end, 10);
+            if (length < 0 || end == value) {
+                return false;
+            }
+        }
+        else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+            // 最后一个编码是 chunked 时才能界定应答体
+            const char *last = strrchr(value, ',');
+            last = last ? last + 1 + strspn(last + 1, " \t") : value;
+            chunked = strncasecmp(last, "chunked", 7) == 0;
+            other_coding = !chunked;
+        }
+        else if (strcasecmp(name.c_str(), "Connection") == 0) {
+            if (strcasestr(value, "close")) {
+                reusable = false;
+            }
+        }
+        // 逐跳头部由服务器根据连接自己生成
+        else if (strcasecmp(name.c_str(), "Keep-Alive") == 0 ||
+                 strcasecmp(name.c_str(), "Proxy-Connection") == 0 ||
+                 strcasecmp(name.c_str(), "Upgrade") == 0 ||
+                 strcasecmp(name.c_str(), "Trailer") == 0) {
+            continue;
+        }
+        else {
+            headers.append(name).append(": ").append(value).append("\r\n");
+        }
+    }
+
+    if (cache_fill_) {
+        cache_new_ = ProxyCache::Admit(status, title, headers);
+        if (cache_new_) {
+            cache_new_->key = ProxyCache::VariantKey(cache_base_,
+                                                     cache_new_->vary,
+                                                     headers_, header_count_);
+            headers.append("X-Cache: MISS\r\n");
+        }
+        else {
+            EndFill(nullptr, true);
+        }
+    }
+
+    char line[64];
+    snprintf(line, sizeof(line), "HTTP/1.1 %ld ", status);
+    proxy_send_.append(line).append(title).append("\r\n").append(headers);
+    if (proxy_head_request_ || status == 204 || status == 304) {
+        // 没有应答体，HEAD 和 304 的 Content-Length 描述的是资源本身
+        proxy_framing_ = BODY_NONE;
+        if (length >= 0 && status != 204) {
+            snprintf(line, sizeof(line), "Content-Length: %ld\r\n", length);
+            proxy_send_.append(line);
+        }
+    }
+    else if (chunked || other_coding || length < 0) {
+        proxy_framing_ = chunked ? BODY_CHUNKED : BODY_CLOSE;
+        if (strcasecmp(version_, "HTTP/1.1") == 0) {
+            proxy_chunked_ = true;
+            proxy_send_.append("Transfer-Encoding: chunked\r\n");
+        }
+        else {
+            // HTTP/1.0 客户端只能靠关闭连接判断应答体结束
+            linger_ = false;
+        }
+    }
+    else {
+        proxy_framing_ = BODY_LENGTH;
+        proxy_left_ = length;
+        snprintf(line, sizeof(line), "Content-Length: %ld\r\n", length);
+        proxy_send_.append(line);
+    }
+    if (proxy_body_left_ > 0) {
+        // 上游不等消息体读完就应答了，剩下的消息体不再读取
+        linger_ = false;
+    }
+    proxy_send_.append(linger_ ? "Connection: keep-alive\r\n\r\n"
+                               : "Connection: close\r\n\r\n");
+    proxy_reusable_ = reusable && proxy_framing_ != BODY_CLOSE;
+    proxy_head_done_ = true;
+    proxy_server_->Succeeded();
+
+    std::string rest = proxy_head_.substr(pos);
+    proxy_head_.clear();
+    if (proxy_framing_ == BODY_NONE || (proxy_framing_ == BODY_LENGTH &&
+                                        proxy_left_ == 0)) {
+        EndProxyBody();
+    }
+    return ProxyBody(rest.data(), rest.size());
+}
+
+/*
+ * 按上游应答体的界定方式处理读到的数据，返回 false 表示 chunked 编码错误
+ */
+bool HttpConn::ProxyBody(const char *data, size_t len) {
+    if (proxy_done_) {
+        // 应答之后还有数据，这个连接不能再用了
+        if (len > 0) {
+            proxy_reusable_ = false;
+        }
+        return true;
+    }
+    switch (proxy_framing_) {
+    case BODY_LENGTH:
+        if ((long)len >= proxy_left_) {
+            AppendProxyBody(data, proxy_left_);
+            proxy_reusable_ = proxy_reusable_ && (long)len == proxy_left_;
+            proxy_left_ = 0;
+            EndProxyBody();
+        }
+        else {
+            AppendProxyBody(data, len);
+            proxy_left_ -= len;
+        }
+        return true;
+    case BODY_CHUNKED:
+        return DecodeChunked(data, len);
+    default:
+        AppendProxyBody(data, len);
+        return true;
+    }
+}
+
+/*
+ * 解码上游的 chunked 应答体：数据交给 AppendProxyBody，扩展和尾部被丢弃
+ */
+bool HttpConn::DecodeChunked(const char *data, size_t len) {
+    while (len > 0 && !proxy_done_) {
+        if (proxy_chunk_state_ == CHUNK_DATA) {
+            size_t n = (long)len < proxy_left_ ? len : proxy_left_;
+            AppendProxyBody(data, n);
+            data += n;
+            len -= n;
+            proxy_left_ -= n;
+            if (proxy_left_ == 0) {
+                proxy_chunk_state_ = CHUNK_DATA_END;
+            }
+            continue;
+        }
+
+        // 其余状态都按行处理
+        const char *nl = (const char *)memchr(data, '\n', len);
+        size_t n = nl ? nl - data + 1 : len;
+        proxy_line_.append(data, n);
+        data += n;
+        len -= n;
+        if (proxy_line_.size() > (size_t)CGI_HEAD_SIZE) {
+            return false;
+        }
+        if (!nl) {
+            break;
+        }
+        proxy_line_.erase(proxy_line_.find_last_not_of("\r\n") + 1);
+
+        if (proxy_chunk_state_ == CHUNK_SIZE) {
+            char *end;
+            long size = strtol(proxy_line_.c_str(), &end, 16);
+            if (end == proxy_line_.c_str() || size < 0) {
+                return false;
+            }
+            proxy_left_ = size;
+            proxy_chunk_state_ = size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        }
+        else if (proxy_chunk_state_ == CHUNK_DATA_END) {
+            if (!proxy_line_.empty()) {
+                return false;
+            }
+            proxy_chunk_state_ = CHUNK_SIZE;
+        }
+        else if (proxy_line_.empty()) {
+            EndProxyBody();
+        }
+        proxy_line_.clear();
+    }
+    if (len > 0) {
+        proxy_reusable_ = false;
+    }
+    return true;
+}
+
+/*
+ * 按给客户的应答体界定方式追加数据
+ */
+void HttpConn::AppendProxyBody(const char *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (cache_new_) {
+        if (cache_new_->body.size() + len > cache_->MaxObject()) {
+            EndFill(nullptr, true);
+        }
+        else {
+            cache_new_->body.append(data, len);
+        }
+    }
+    if (proxy_chunked_) {
+        char size[32];
+        snprintf(size, sizeof(size), "%zx\r\n", len);
+        proxy_send_.append(size).append(data, len).append("\r\n");
+    }
+    else {
+        proxy_send_.append(data, len);
+    }
+}
+
+void HttpConn::EndProxyBody() {
+    proxy_done_ = true;
+    if (cache_new_) {
+        std::shared_ptr<CachedResponse> obj = cache_new_;
+        EndFill(obj, false);
+    }
+    if (proxy_chunked_) {
+        proxy_send_.append("0\r\n\r\n");
+    }
+}
+
+/*
+ * 上游还没有应答时出错：放弃上游连接，改为发送错误页面
+ */
+bool HttpConn::FailProxy(int status, const char *title, const char *form) {
+    if (proxy_body_left_ > 0) {
+        linger_ = false;
+    }
+    StopProxy(false);
+    if (cache_obj_) {
+        // 上游出错时用过期的应答代替错误页面
+        cache_status_ = "STALE";
+        return ServeCached();
+    }
+    write_idx_ = 0;
+    if (!ProcessWriteCommon(status, title, form)) {
+        return false;
+    }
+    iv_[0].iov_base = write_buf_;
+    iv_[0].iov_len  = write_idx_;
+    iv_count_ = 1;
+    bytes_to_send_ = write_idx_;
+    return Write();
+}
+
+/*
+ * 解除 fd 归属，上游连接放回池中或关闭
+ */
+void HttpConn::StopProxy(bool reusable) {
+    EndFill(nullptr, false);
+    if (proxy_fd_ < 0) {
+        return;
+    }
+    owner_[proxy_fd_] = nullptr;
+    owner_[sockfd_] = nullptr;
+    epoll_ctl(epollfd_, EPOLL_CTL_DEL, proxy_fd_, nullptr);
+    proxy_server_->Release(proxy_fd_, reusable);
+    proxy_fd_ = -1;
+    proxy_req_.clear();
+    proxy_body_.clear();
+    proxy_head_.clear();
+    proxy_send_.clear();
+    proxy_sent_ = 0;
+}
+
+/*
+ * 返回 false 表示需要关闭连接
+ */
+bool HttpConn::ProxyTimeout(unsigned long id) {
+    if (id != task_id_) {
+        return true;
+    }
+    // 正在等客户端接收（背压），或者最近有数据往来，重新计时
+    int64_t now = TimerHeap<HttpConn>::NowMs();
+    int64_t idle = now - proxy_active_;
+    int timeout = proxy_upstream_->Timeout() * 1000;
+    if (proxy_sent_ < proxy_send_.size()) {
+        proxy_active_ = now;
+        idle = 0;
+    }
+    if (idle < timeout) {
+        timers_.Add(timeout - idle, this, id);
+        return true;
+    }
+    proxy_upstream_->Failed(proxy_server_);
+    if (!proxy_head_done_) {
+        return FailProxy(504, err_504_title, err_504_proxy_form);
+    }
+    StopProxy(false);
+    return false;
+}
+
+/*
+ * 填充结束，唤醒等待同一个键的请求：应答与它们的变体相同时直接发送，
+ * 否则（填充失败、不可缓存或者 Vary 不同）各自转发
+ */
+void HttpConn::EndFill(std::shared_ptr<CachedResponse> obj, bool uncacheable) {
+    if (!cache_fill_) {
+        return;
+    }
+    cache_fill_ = false;
+    cache_new_.reset();
+    for (HttpConn *conn : cache_->Complete(cache_key_, obj, uncacheable)) {
+        if (!conn->CacheWake(obj)) {
+            conn->CloseConn();
+        }
+    }
+}
+
+bool HttpConn::CacheWake(const std::shared_ptr<const CachedResponse> &obj) {
+    if (obj && obj->key == ProxyCache::VariantKey(cache_base_, obj->vary,
+                                                  headers_, header_count_)) {
+        cache_obj_ = obj;
+        cache_status_ = "HIT";
+        return ServeCached();
+    }
+    HttpCode ret = DoProxy(proxy_route_, proxy_query_, false);
+    if (ret == PROXY_REQUEST) {
+        StartProxy();
+        return true;
+    }
+    if (!ProcessWrite(ret)) {
+        return false;
+    }
+    return Write();
+}
+
+bool HttpConn::ServeCached() {
+    if (!ProcessWrite(CACHED_REQUEST)) {
+        return false;
+    }
+    return Write();
+}
+
+/*
+ * 对内存映射区执行 munmap 操作，sendfile 方式则关闭文件
+ */
+void HttpConn::Unmap() {
+    if (file_addr_) {
+        munmap(file_addr_, file_stat_.st_size);
+        file_addr_ = nullptr;
+    }
+    if (file_fd_ >= 0) {
+        close(file_fd_);
+        file_fd_ = -1;
+    }
+    cache_obj_.reset();
+}
+
+/*
+ * 写 HTTP 响应
+ */
+bool HttpConn::Write() {
+    if (bytes_to_send_ == 0) {
+        ModFD(epollfd_, sockfd_, EPOLLIN);
+        Init();
+        return true;
+    }
+
+    while (1) {
+        int temp = Send();
+        if (temp <= -1) {
+            // 如果 tcp 写缓冲没有空间，则等待下次的 EPOLLOUT 事件，虽然在此期间
+            // 服务器无法立即接收到同一客户的下一请求，但可以保证连接的完整性
+            if (errno == EAGAIN) {
+#ifdef HTTPS
+                // SSL_write 可能需要先读到对端的数据
+                if (ssl_ && SSL_want_read(ssl_)) {
+                    ModFD(epollfd_, sockfd_, EPOLLIN);
+                    return true;
+                }
+#endif
+                ModFD(epollfd_, sockfd_, EPOLLOUT);
+                return true;
+            }
+            Unmap();
+
+            return false;
+        }
+
+        bytes_to_send_ -= temp;
+        Advance(temp);
+        if (bytes_to_send_ <= 0) {
+            // 发送 HTTP 响应成功，
+            // 根据 HTTP 请求中的 Connection 字段决定是否立即关闭连接
+            Unmap();
+            if (linger_) {
+                Init();
+                ModFD(epollfd_, sockfd_, EPOLLIN);
+                return true;
+            }
+            else {
+                ModFD(epollfd_, sockfd_, EPOLLIN);
+                return false;
+            }
+        }
+    }
+}
+
+/*
+ * 向写缓冲中写入待发送的数据
+ */
+bool HttpConn::AddResponse(const char *format, ...) {
+    if (write_idx_ >= WRITE_BUF_SIZE) {
+        return false;
+    }
+
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(write_buf_ + write_idx_,
+                        WRITE_BUF_SIZE - 1 - write_idx_, format, arg_list);
+    if (len >= (WRITE_BUF_SIZE - 1 - write_idx_)) {
+        return false;
+    }
+    write_idx_ += len;
+    va_end(arg_list);
+
+    return true;
+}
+
+bool HttpConn::AddStatusLine(int status, const char *title) {
+    return AddResponse("%s %d %s\r\n", "HTTP/1.1", status, title);
+}
+
+bool HttpConn::AddHeaders(int content_len) {
+    return AddContentLength(content_len) && AddLinger() && AddBlankLine();
+}
+
+bool HttpConn::AddContentLength(int content_len) {
+    return AddResponse("Content-Length: %d\r\n", content_len);
+}
+
+bool HttpConn::AddLinger() {
+    return AddResponse("Connection: %s\r\n",
+                        (linger_ == true) ? "keep-alive" : "close");
+}
+
+bool HttpConn::AddBlankLine() {
+    return AddResponse("%s", "\r\n");
+}
+
+bool HttpConn::AddContent(const char *content) {
+    return AddResponse("%s", content);
+}
+
+bool HttpConn::ProcessWriteCommon(int num, const char *title,
+                                  const char *form) {
+    AddStatusLine(num, title);
+    AddHeaders(strlen(form));
+    return AddContent(form);
+}
+
+/*
+ * 根据服务器处理 HTTP 请求的结果，决定返回给客户端的内容
+ */
+bool HttpConn::ProcessWrite(HttpCode ret) {
+    switch (static_cast<int>(ret)) {
+    case INTERNAL_ERROR:
+        if (!ProcessWriteCommon(500, err_500_title, err_500_form)) return false;
+        break;
+    case BAD_REQEUST:
+        if (!ProcessWriteCommon(400, err_400_title, err_400_form)) return false;
+        break;
+    case NO_RESOURCE:
+        if (!ProcessWriteCommon(404, err_404_title, err_404_form)) return false;
+        break;
+    case FORBIDDEN_REQUEST:
+        if (!ProcessWriteCommon(403, err_403_title, err_403_form)) return false;
+        break;
+    case NOT_IMPLEMENTED:
+        if (!ProcessWriteCommon(501, err_501_title, err_501_form)) return false;
+        break;
+    case BAD_GATEWAY:
+        if (!ProcessWriteCommon(502, err_502_title, err_502_proxy_form)) return false;
+        break;
+    case FILE_REQUEST:
+        AddStatusLine(200, ok_200_title);
+        if (file_stat_.st_size != 0) {
+            AddHeaders(file_stat_.st_size);
+            iv_[0].iov_base = write_buf_;
+            iv_[0].iov_len  = write_idx_;
+            iv_[1].iov_base = file_addr_;
+            // sendfile 方式时文件不在 iovec 中，由 Send 在头部之后发送
+            iv_[1].iov_len  = file_fd_ >= 0 ? 0 : file_stat_.st_size;
+            iv_count_ = 2;
+            bytes_to_send_ = write_idx_ + file_stat_.st_size;
+            return true;
+        }
+        else {
+            const char *ok_string = "<html><body></body></html>";
+            AddHeaders(strlen(ok_string));
+            if (!AddContent(ok_string)) return false;
+        }
+        break;
+    case HANDLER_REQUEST:
+        // 插件的应答体可能很大，与 sendfile 一样放在第二个 iovec 中
+        if (!AddStatusLine(response_.status_, response_.title_.c_str()) ||
+            !AddResponse("%s", response_.headers_.c_str()) ||
+            !AddHeaders(response_.body_.size())) {
+            response_.Reset();
+            write_idx_ = 0;
+            if (!ProcessWriteCommon(500, err_500_title, err_500_form)) return false;
+            break;
+        }
+        iv_[0].iov_base = write_buf_;
+        iv_[0].iov_len  = write_idx_;
+        iv_[1].iov_base = (void *)response_.body_.data();
+        iv_[1].iov_len  = response_.body_.size();
+        iv_count_ = 2;
+        bytes_to_send_ = write_idx_ + response_.body_.size();
+        return true;
+    case CACHED_REQUEST: {
+        // 缓存的头部可能超过写缓冲，放在 cache_head_ 中
+        const CachedResponse &obj = *cache_obj_;
+        long age = obj.age + (TimerHeap<HttpConn>::NowMs() - obj.stored) / 1000;
+        char line[128];
+        snprintf(line, sizeof(line), "HTTP/1.1 %d ", obj.status);
+        cache_head_.assign(line).append(obj.title).append("\r\n")
+                   .append(obj.headers);
+        snprintf(line, sizeof(line),
+                 "Age: %ld\r\nX-Cache: %s\r\nContent-Length: %zu\r\n",
+                 age, cache_status_, obj.body.size());
+        cache_head_.append(line)
+                   .append(linger_ ? "Connection: keep-alive\r\n\r\n"
+                                   : "Connection: close\r\n\r\n");
+        iv_[0].iov_base = &cache_head_[0];
+        iv_[0].iov_len  = cache_head_.size();
+        iv_[1].iov_base = (void *)obj.body.data();
+        iv_[1].iov_len  = method_ == HEAD ? 0 : obj.body.size();
+        iv_count_ = 2;
+        bytes_to_send_ = iv_[0].iov_len + iv_[1].iov_len;
+        return true;
+    }
+    default:
+        return false;
+        break;
+    }
+
+    iv_[0].iov_base = write_buf_;
     iv_[0].iov_len  = write_idx_;
     iv_count_ = 1;
+    bytes_to_send_ = write_idx_;
 
     return true;
 }
@@ -473,15 +2357,112 @@ bool HttpConn::ProcessWrite(HttpCode ret) {
  * 处理 HTTP 请求的入口函数，由线程池中的工作线程调用，
  */
 void HttpConn::Process() {
+    if (h2_) {
+        ProcessHttp2();
+        return;
+    }
+    // 连接序言（h2c 先验知识或 ALPN 协商了 h2）
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    int n = read_idx_ < (int)sizeof(preface) - 1 ? read_idx_
+                                                 : sizeof(preface) - 1;
+    if (start_line_ == 0 && n > 0 && memcmp(read_buf_, preface, n) == 0) {
+        if (n < (int)sizeof(preface) - 1) {
+            ModFD(epollfd_, sockfd_, ReadEvents());
+            return;
+        }
+        StartHttp2(false);
+        ProcessHttp2();
+        return;
+    }
+
     HttpCode read_ret = ProcessRead();
+    if (read_ret == UPGRADE_REQUEST) {
+        StartHttp2(true);
+        ProcessHttp2();
+        return;
+    }
     if (read_ret == NO_REQUEST) {
-        ModFD(epollfd_, sockfd_, EPOLLIN);
+        ModFD(epollfd_, sockfd_, ReadEvents());
+        return;
+    }
+    if (read_ret == CGI_REQUEST) {
+        // 连接交给反应堆，CGI 结束后由反应堆重新注册 socket
+        StartCgi();
+        return;
+    }
+    if (read_ret == PROXY_REQUEST) {
+        StartProxy();
+        return;
+    }
+    if (read_ret == CACHE_WAIT) {
+        // 等待另一个请求填充缓存，由它在反应堆中唤醒
         return;
     }
 
     bool write_ret = ProcessWrite(read_ret);
     if (!write_ret) {
         CloseConn();
+        return;
     }
     ModFD(epollfd_, sockfd_, EPOLLOUT);
 }
+
+void HttpConn::StartHttp2(bool upgrade) {
+    h2_ = new Http2Session(&addr_);
+    if (upgrade) {
+        // 该请求成为流 1，读缓冲中请求之后的数据是客户端的连接序言
+        h2_->Upgrade(method_names[method_], url_, host_, headers_,
+                     header_count_, h2_settings_);
+        h2_->Feed(read_buf_ + checked_idx_, read_idx_ - checked_idx_);
+    }
+    else {
+        h2_->Start();
+        h2_->Feed(read_buf_, read_idx_);
+    }
+    read_idx_ = 0;
+}
+
+/*
+ * HTTP/2 连接的一次处理：读完 socket 中的帧，再尽量发送会话的输出；
+ * 输出没有发完时同时等待可写事件
+ */
+void HttpConn::ProcessHttp2() {
+    while (true) {
+        int bytes_read = Recv(read_buf_, READ_BUF_SIZE);
+        if (bytes_read > 0) {
+            h2_->Feed(read_buf_, bytes_read);
+            continue;
+        }
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        CloseConn();
+        return;
+    }
+
+    bool pending = false;
+    const char *data;
+    size_t len;
+    file_fd_ = -1;
+    while (h2_->Output(&data, &len)) {
+        iv_[0].iov_base = (void *)data;
+        iv_[0].iov_len = len;
+        iv_count_ = 1;
+        int bytes_sent = Send();
+        if (bytes_sent == -1 && errno == EAGAIN) {
+            pending = true;
+            break;
+        }
+        if (bytes_sent <= 0) {
+            CloseConn();
+            return;
+        }
+        h2_->Sent(bytes_sent);
+    }
+
+    if (!pending && h2_->Finished()) {
+        CloseConn();
+        return;
+    }
+    ModFD(epollfd_, sockfd_, ReadEvents() | (pending ? (uint32_t)EPOLLOUT : 0u));
+}
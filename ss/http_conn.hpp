@@ -16,16 +16,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <errno.h>
 
+#ifdef HTTPS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "locker.hpp"
+#include "handler.hpp"
+#include "timer.hpp"
+
+struct Route;
+class Http2Session;
+class Upstream;
+class UpstreamServer;
+class ProxyCache;
+struct CachedResponse;
+
+/*
+ * 插件的应答先收集在这里，由 ProcessWrite 组装成 HTTP 应答
+ */
+class HandlerResponse : public ResponseWriter {
+public:
+    void Status(int code, const char *title) override {
+        status_ = code;
+        title_ = title;
+    }
+    void Header(const char *name, const char *value) override {
+        headers_.append(name).append(": ").append(value).append("\r\n");
+    }
+    void Write(const void *data, size_t len) override {
+        body_.append((const char *)data, len);
+    }
+    void Reset() {
+        status_ = 200;
+        title_ = "OK";
+        headers_.clear();
+        body_.clear();
+    }
+
+public:
+    int         status_ = 200;
+    std::string title_ = "OK";
+    std::string headers_;
+    std::string body_;
+};
 
 class HttpConn {
 public:
     static const int FILENAME_LEN = 256;
     static const int READ_BUF_SIZE = 4096;
     static const int WRITE_BUF_SIZE = 2048;
+    static const int MAX_HEADERS = 64;
+    // CGI 管道与客户 socket 共用一张按 fd 索引的归属表
+    static const int MAX_FD = 65536;
+    // CGI 输出的头部块不能超过这个长度
+    static const int CGI_HEAD_SIZE = 8192;
 
     enum Method {
         GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCK
@@ -44,35 +97,137 @@ public:
         NO_RESOURCE,
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
+        HANDLER_REQUEST,
+        CGI_REQUEST,
         INTERNAL_ERROR,
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        UPGRADE_REQUEST,
+        PROXY_REQUEST,
+        BAD_GATEWAY,
+        CACHED_REQUEST,
+        CACHE_WAIT,
+        NOT_IMPLEMENTED
     };
     // 行读取状态
     enum LineStatus { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    // 上游应答体的界定方式，以及 chunked 应答体的解码状态
+    enum BodyFraming { BODY_NONE = 0, BODY_LENGTH, BODY_CHUNKED, BODY_CLOSE };
+    enum ChunkState {
+        CHUNK_SIZE = 0, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER
+    };
 
 public:
     HttpConn() = default;
     ~HttpConn() = default;
 
-    void Init(int sockfd, const struct sockaddr_in &addr);
+    void Init(int sockfd, const struct sockaddr_in &addr, bool tls = false);
     void CloseConn(bool real_close = true);
     void Process();
     bool Read();
     bool Write();
+    // 响应尚未发完（TLS 写可能要等可读事件）
+    bool Writing() const { return bytes_to_send_ > 0; }
+    // TLS 读取要先写出数据（SSL_read 返回 WANT_WRITE），可写事件也交给读取
+    bool ReadWantsWrite() const;
+    // TLS 握手尚未完成，此时读写事件都交给 Handshake()
+    bool Handshaking() const { return handshaking_; }
+    bool Handshake();
+    // 读缓冲为空，下一次读到的是一个新请求的开头
+    bool AtRequestStart() const { return read_idx_ == 0; }
+    const struct sockaddr_in &Addr() const { return addr_; }
+    // 客户超过限速时由反应堆调用：不处理请求，直接应答 429 后关闭连接，
+    // 返回 false 表示需要立即关闭连接
+    bool TooManyRequests(long retry_after);
+    // 连接已切换到 HTTP/2，此后所有事件都交给工作线程的 ProcessHttp2
+    bool Http2() const { return h2_ != nullptr; }
+
+#ifdef HTTPS
+    // 所有 TLS 连接共用反应堆的一个 SSL_CTX，ktls 为 true 时尝试把
+    // 记录层加密交给内核，静态文件改用 SSL_sendfile 零拷贝发送
+    static bool InitTls(const char *cert_file, const char *key_file,
+                        bool ktls = false);
+    // 内核是否加载了 tls 模块
+    static bool KernelTlsAvailable();
+#endif
+
+    // 开启 CGI：/cgi-bin/name 执行 cgi_dir/name；服务器等待 CGI 输出超过
+    // timeout 秒时杀死 CGI（等待客户端接收的时间不算在内）
+    static void InitCgi(const char *cgi_dir, int timeout);
+    static bool CgiEnabled() { return cgi_dir_ != nullptr; }
+    // fd 是正在运行 CGI 或代理的连接的 socket、CGI 管道或上游 socket 时
+    // 返回该连接，否则返回 nullptr；这些 fd 上的事件都由反应堆交给 FdEvent
+    static HttpConn *Owner(int fd) {
+        return (fd >= 0 && fd < MAX_FD) ? owner_[fd] : nullptr;
+    }
+    // 返回 false 表示需要关闭连接
+    bool FdEvent(int fd, uint32_t events);
+    // 反应堆 epoll_wait 的超时时间（毫秒），-1 表示没有开启 CGI 和代理
+    static int WaitTime();
+    // 由反应堆在每轮事件处理后调用：处理超时的 CGI 和代理，
+    // 回收已退出的 CGI 子进程
+    static void Tick();
 
 private:
     void     Init();
+    int      Recv(char *buf, int len);
+    // Recv 返回 EAGAIN 后等待的事件
+    uint32_t ReadEvents() const;
+    int      Send();
+    void     Advance(int bytes);
     bool     ProcessWrite(HttpCode ret);
     HttpCode ProcessRead();
+    // HTTP/2：以连接序言开始（upgrade 为 false）或 Upgrade: h2c 升级
+    void     StartHttp2(bool upgrade);
+    void     ProcessHttp2();
 
     // 供 ProcessWrite 调用，以解析 HTTP 请求
     HttpCode    ParseRequestLine(char *text);
     HttpCode    ParseHeaders(char *text);
     HttpCode    ParseContent(char *text);
     HttpCode    DoRequest();
+    HttpCode    DoHandler(const Route *route, const char *query);
+    HttpCode    DoCgi(const char *query);
+    HttpCode    DoProxy(const Route *route, const char *query,
+                        bool lookup = true);
+    HttpCode    LookupCache(ProxyCache *cache, const Route *route,
+                            const char *query);
+    bool        Proxied();
     char       *GetLine() { return read_buf_ + start_line_; }
     LineStatus  ParseLine();
 
+    // CGI 的执行，除 StartCgi 外都在反应堆线程中调用
+    pid_t SpawnCgi(const char *path, char *const envp[]);
+    void  StartCgi();
+    bool  PumpCgi();
+    bool  FeedCgi();
+    bool  ParseCgiHead();
+    void  AppendCgiBody(const char *data, size_t len);
+    bool  FailCgi(int status, const char *title, const char *form);
+    void  StopCgi(bool abort);
+    bool  CgiEvent(int fd, uint32_t events);
+    bool  CgiTimeout(unsigned long id);
+    bool  Timeout(unsigned long id);
+
+    // 反向代理，除 StartProxy 外都在反应堆线程中调用
+    void  StartProxy();
+    bool  ProxyEvent(int fd, uint32_t events);
+    bool  PumpProxy();
+    bool  RetryProxy(bool failed);
+    void  WatchUpstream(int op, uint32_t events);
+    bool  ParseProxyHead();
+    bool  ProxyBody(const char *data, size_t len);
+    bool  DecodeChunked(const char *data, size_t len);
+    void  AppendProxyBody(const char *data, size_t len);
+    void  EndProxyBody();
+    bool  FailProxy(int status, const char *title, const char *form);
+    void  StopProxy(bool reusable);
+    bool  ProxyTimeout(unsigned long id);
+
+    // 代理缓存的填充和唤醒，在反应堆线程中调用（DoProxy 连接失败时除外）
+    void  EndFill(std::shared_ptr<CachedResponse> obj, bool uncacheable);
+    bool  CacheWake(const std::shared_ptr<const CachedResponse> &obj);
+    bool  ServeCached();
+
     // 供 ProcessWrite 调用，以完成 HTTP 应答
     bool ProcessWriteCommon(int num, const char *title, const char *form);
     void Unmap();
@@ -88,11 +243,29 @@ public:
     // 所有 socket 上的事件都被注册到同一个 epoll 内核事件表中
     static int epollfd_;
     static int user_count_;
+#ifdef HTTPS
+    static SSL_CTX *ssl_ctx_;
+#endif
+
+private:
+    static const char         *cgi_dir_;
+    static int                 cgi_timeout_;
+    static HttpConn           *owner_[MAX_FD];
+    static TimerHeap<HttpConn> timers_;
+    // 已结束但还没有退出的 CGI 子进程，只由反应堆线程访问
+    static std::vector<pid_t>  cgi_zombies_;
 
 private:
     // 该 HTTP 连接的 socket 和对方的 socket 地址
-    int                sockfd_;
+    int                sockfd_ = -1;
     struct sockaddr_in addr_;
+#ifdef HTTPS
+    SSL               *ssl_ = nullptr;
+#endif
+    bool               handshaking_ = false;
+    // 握手后内核接管了发送方向的加密（kTLS），文件不再 mmap 而用 sendfile
+    bool               ktls_send_ = false;
+    Http2Session       *h2_ = nullptr;
 
     char               read_buf_[READ_BUF_SIZE];
     int                read_idx_;
@@ -109,15 +282,110 @@ private:
     char               *url_;
     char               *version_;
     char               *host_;
-    int                content_length_;
+    // 没有或无效的 Content-Length 时分别为 0 和 -1；请求带有
+    // Transfer-Encoding 时不知道消息体在哪里结束
+    long               content_length_;
+    bool               has_length_;
+    bool               transfer_encoding_;
     bool               linger_;
+    // 请求带有 Upgrade: h2c 和 HTTP2-Settings 头部
+    bool               upgrade_h2c_;
+    const char         *h2_settings_;
+    char               *body_;
+    // 头部行在 read_buf_ 中的位置，供插件的 RequestView 使用
+    const char         *headers_[MAX_HEADERS];
+    int                header_count_;
+    // 路由到插件的请求的应答
+    HandlerResponse    response_;
 
     // 客户请求的目标文件被 mmap 到内存中的其实位置
-    char               *file_addr_;
+    char               *file_addr_ = nullptr;
     struct stat        file_stat_;
+    // sendfile 方式发送时打开的文件及下一次发送的偏移
+    int                file_fd_ = -1;
+    off_t              file_offset_ = 0;
     // 用 writev 来执行写操作，iv_count_ 表示被写内存块的数量
     struct             iovec iv_[2];
     int                iv_count_;
+    int                bytes_to_send_ = 0;
+
+    // 正在运行的 CGI：子进程，stdin 管道的写端，stdout 管道的读端
+    pid_t              cgi_pid_ = -1;
+    int                cgi_stdin_ = -1;
+    int                cgi_stdout_ = -1;
+    // 每启动一次 CGI 或代理加一，用于识别过期的定时器
+    unsigned long      task_id_ = 0;
+    // 最近一次读到 CGI 输出的时间（毫秒）
+    int64_t            cgi_active_;
+    // 请求消息体中还没有写入 CGI stdin 的部分
+    const char        *cgi_body_;
+    int                cgi_body_left_;
+    // 应答头部是否已生成；之后按 chunked、Content-Length（cgi_left_ 为剩余
+    // 字节数）或关闭连接三种方式之一界定应答体
+    bool               cgi_head_done_;
+    bool               cgi_chunked_;
+    long               cgi_left_;
+    bool               cgi_eof_;
+    bool               cgi_http11_;
+    std::string        cgi_head_;
+    // 待发给客户的数据，只有发完后才继续读 CGI 的输出（背压）
+    std::string        cgi_send_;
+    size_t             cgi_sent_;
+
+    // 正在转发的上游组、选中的服务器和连接；上游没有任何应答前请求还能
+    // 重发：池中的连接断开时换一个新连接（可能刚被上游关闭），新连接失败时
+    // 换组中的另一台服务器，最多把每台服务器试一遍。proxy_hash_ 是哈希策略的键
+    Upstream          *proxy_upstream_ = nullptr;
+    UpstreamServer    *proxy_server_ = nullptr;
+    uint64_t           proxy_hash_;
+    size_t             proxy_tries_;
+    int                proxy_fd_ = -1;
+    bool               proxy_reused_;
+    bool               proxy_connecting_;
+    int64_t            proxy_active_;
+    // 请求头部和读缓冲中的消息体，重发时从头再发
+    std::string        proxy_req_;
+    size_t             proxy_req_sent_;
+    // 还要从客户 socket 读取的消息体，读到的先放在 proxy_body_ 中，
+    // 发给上游后才继续读（背压）；读过之后请求就不能再重发了
+    long               proxy_body_left_;
+    std::string        proxy_body_;
+    size_t             proxy_body_sent_;
+    bool               proxy_streamed_;
+    // 上游不再接收请求（写出错）
+    bool               proxy_req_broken_;
+    // 上游的应答：是否收到过数据，头部，应答体的界定方式及剩余字节数
+    bool               proxy_received_;
+    bool               proxy_head_done_;
+    bool               proxy_head_request_;
+    std::string        proxy_head_;
+    BodyFraming        proxy_framing_;
+    long               proxy_left_;
+    ChunkState         proxy_chunk_state_;
+    std::string        proxy_line_;
+    // 应答已完整收到，上游连接是否可以放回池中
+    bool               proxy_done_;
+    bool               proxy_reusable_;
+    // 给客户的应答体是否 chunked 编码
+    bool               proxy_chunked_;
+    // 待发给客户的数据，只有发完后才继续读上游的应答（背压）
+    std::string        proxy_send_;
+    size_t             proxy_sent_;
+
+    // 代理缓存：请求的路由和查询串（被唤醒后自己转发时使用），基础键和
+    // 变体键。cache_fill_ 表示本请求负责填充 cache_key_，其他请求可能在等它，
+    // cache_new_ 是正在收集的应答。cache_obj_ 是要发送的缓存应答，填充时是
+    // 可以在上游出错时代替错误页面的过期应答；cache_head_ 是它的应答头部
+    const Route       *proxy_route_ = nullptr;
+    const char        *proxy_query_ = nullptr;
+    ProxyCache        *cache_ = nullptr;
+    std::string        cache_base_;
+    std::string        cache_key_;
+    bool               cache_fill_ = false;
+    std::shared_ptr<CachedResponse>       cache_new_;
+    std::shared_ptr<const CachedResponse> cache_obj_;
+    const char        *cache_status_ = "HIT";
+    std::string        cache_head_;
 };
 
 
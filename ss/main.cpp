@@ -9,18 +9,30 @@
 #include <cassert>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <getopt.h>
+#include <libgen.h>
+
+#include <vector>
 
 #include "locker.hpp"
+#include "affinity.hpp"
+#include "acl.h"
+#include "ratelimit.h"
 #include "thread_pool.hpp"
 #include "http_conn.hpp"
+#include "router.hpp"
+#include "upstream.hpp"
 
 using SA = struct sockaddr;
 
 constexpr int max_fd = 65536;
 constexpr int max_event_num = 10000;
+// 限速表最多记住的客户数，更多的客户会挤掉最久没来的
+constexpr size_t rate_limit_clients = 65536;
 
 extern int AddFD(int epollfd, int fd, bool one_shot);
 extern int RemoveFD(int epollfd, int fd);
+extern const char *doc_root;
 
 void AddSig(int sig, void(* Handler)(int), bool restart = true) {
     struct sigaction sa;
@@ -40,20 +52,216 @@ void ShowError(int connfd, const char *info) {
 }
 
 
+void Usage(const char *prog) {
+    printf("usage: %s [-c cpu_list] [-t thread_number] [-a acl_rules] "
+           "[-l conn_rate[/burst]] [-q request_rate[/burst]] [-r doc_root] "
+           "[-s tls_port -k cert_file [-K key_file]] "
+           "[-m route_file] [-g cgi_dir [-G cgi_timeout]] "
+           "ip_address port_number\n"
+           "  -c  pin the reactor to the first cpu of the list and the\n"
+           "      worker threads to the list, e.g. 0-3,8\n"
+           "  -t  number of worker threads (default 8)\n"
+           "  -a  access control list, e.g. \"allow:10.0.0.0/8 deny:0.0.0.0/0\"\n"
+           "  -l  new connections per second each client address may open,\n"
+           "      and how many at once (default: the rate); refused with 429\n"
+           "  -q  requests per second each client address may send\n"
+           "  -r  document root (default %s)\n"
+           "  -s  also serve https on this port, with the pem certificate\n"
+           "      chain -k and private key -K (default: the -k file)\n"
+           "  -T  kernel TLS: let the kernel encrypt https responses and send\n"
+           "      static files with sendfile, falls back to SSL_write\n"
+           "  -m  route table of handler plugins and reverse proxies, lines of\n"
+           "      \"/url_prefix plugin.so [argument]\" or\n"
+           "      \"/url_prefix proxy http://host:port|unix:/path ...\n"
+           "      [keepalive=idle_connections] [idle=seconds] [timeout=seconds]\n"
+           "      [balance=least_requests|round_robin|hash]\n"
+           "      [hash_key=ip|uri|header:name] [max_fails=n]\n"
+           "      [fail_timeout=seconds] [check=/path] [check_interval=ms]\n"
+           "      [check_timeout=ms] [cache=MB [cache_dir=dir] [cache_disk=MB]]\"\n"
+           "  -g  run /cgi-bin/name as the CGI program cgi_dir/name\n"
+           "  -G  kill CGI programs that send no output for this many\n"
+           "      seconds (default 30)\n",
+           prog, doc_root);
+}
+
+/*
+ * 读取客户数据并交给工作线程；新请求的开头到达时先取一个请求令牌，
+ * 令牌用完时由反应堆直接应答 429。返回 false 表示需要关闭连接
+ */
+bool ReadRequest(HttpConn &conn, struct ratelimit *limits,
+                 ThreadPool<HttpConn> *pool) {
+    bool start = conn.AtRequestStart();
+    if (!conn.Read()) {
+        return false;
+    }
+    if (start) {
+        long wait = ratelimit_take(limits, RATELIMIT_REQUEST,
+                                   (SA *)&conn.Addr());
+        if (wait > 0) {
+            return conn.TooManyRequests(wait);
+        }
+    }
+    pool->Append(&conn);
+    return true;
+}
+
+/*
+ * 创建监听 socket，失败时直接退出
+ */
+int Listen(const char *ip, int port) {
+    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    assert(listenfd >= 0);
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    int ret = 0;
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    addr.sin_port = htons(port);
+
+    ret = bind(listenfd, (SA *)&addr, sizeof(addr));
+    assert(ret >= 0);
+
+    ret = listen(listenfd, SOMAXCONN);
+    assert(ret >= 0);
+    return listenfd;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc <= 2) {
-        printf("usage: %s ip address port number\n", basename(argv[0]));
+    std::vector<int> cpus;
+    int thread_number = 8;
+    struct acl *acl = nullptr;
+    char acl_err[128];
+    double rates[RATELIMIT_KINDS] = {0};
+    double bursts[RATELIMIT_KINDS] = {0};
+    int tls_port = 0;
+    const char *cert_file = nullptr;
+    const char *key_file = nullptr;
+    bool ktls = false;
+    const char *route_file = nullptr;
+    const char *cgi_dir = nullptr;
+    int cgi_timeout = 30;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:a:l:q:r:s:k:K:Tm:g:G:")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (!ParseCpuList(optarg, cpus)) {
+                printf("bad cpu list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            thread_number = atoi(optarg);
+            break;
+        case 'a':
+            acl_free(acl);
+            acl = acl_compile(optarg, acl_err, sizeof(acl_err));
+            if (!acl) {
+                printf("%s\n", acl_err);
+                return 1;
+            }
+            break;
+        case 'l':
+        case 'q': {
+            int kind = opt == 'l' ? RATELIMIT_CONN : RATELIMIT_REQUEST;
+            if (ratelimit_parse(optarg, &rates[kind], &bursts[kind]) < 0) {
+                printf("bad rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'r':
+            doc_root = optarg;
+            break;
+        case 's':
+            tls_port = atoi(optarg);
+            break;
+        case 'k':
+            cert_file = optarg;
+            break;
+        case 'K':
+            key_file = optarg;
+            break;
+        case 'T':
+            ktls = true;
+            break;
+        case 'm':
+            route_file = optarg;
+            break;
+        case 'g':
+            cgi_dir = optarg;
+            break;
+        case 'G':
+            cgi_timeout = atoi(optarg);
+            break;
+        default:
+            Usage(basename(argv[0]));
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        Usage(basename(argv[0]));
         return 1;
     }
 
-    const char *ip = argv[1];
-    int port = atoi(argv[2]);
+    const char *ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
 
     AddSig(SIGPIPE, SIG_IGN);
 
+    if (tls_port > 0) {
+#ifdef HTTPS
+        if (!cert_file ||
+            !HttpConn::InitTls(cert_file, key_file ? key_file : cert_file,
+                               ktls)) {
+            printf("cannot load the certificate for the tls port\n");
+            return 1;
+        }
+        if (ktls && !HttpConn::KernelTlsAvailable()) {
+            printf("kernel tls module not loaded (modprobe tls), "
+                   "https uses SSL_write\n");
+        }
+#else
+        printf("built without HTTPS\n");
+        return 1;
+#endif
+    }
+
+    if (cgi_dir) {
+        HttpConn::InitCgi(cgi_dir, cgi_timeout);
+    }
+
+    // 只在反应堆线程中检查，分片锁几乎没有竞争
+    struct ratelimit *limits = nullptr;
+    if (rates[RATELIMIT_CONN] > 0 || rates[RATELIMIT_REQUEST] > 0) {
+        limits = ratelimit_create(rate_limit_clients);
+        if (!limits) {
+            printf("cannot allocate the rate limit table\n");
+            return 1;
+        }
+        for (int kind = 0; kind < RATELIMIT_KINDS; ++kind) {
+            ratelimit_set(limits, kind, rates[kind], bursts[kind]);
+        }
+    }
+
+    // 插件在工作线程启动前加载，路由表之后只读
+    if (route_file && !Router::Load(route_file)) {
+        return 1;
+    }
+
+    // 先绑定反应堆（主线程），之后分配的连接对象由主线程首次写入，
+    // 因此落在反应堆所在的 NUMA 节点上
+    if (!cpus.empty()) {
+        PinSelfToCpu(cpus[0]);
+    }
+
     ThreadPool<HttpConn> *pool = nullptr;
     try {
-        pool = new ThreadPool<HttpConn>;
+        pool = new ThreadPool<HttpConn>(thread_number, 10000, cpus);
     }
     catch(...) {
         return 1;
@@ -64,32 +272,22 @@ int main(int argc, char *argv[]) {
     assert(users);
     int user_count = 0;
 
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listenfd >= 0);
-    struct linger temp = { 1, 0 };
-    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &temp, sizeof(temp));
-
-    int ret = 0;
-    struct sockaddr_in addr;
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    inet_pton(AF_INET, ip, &addr.sin_addr);
-    addr.sin_port = htons(port);
-
-    ret = bind(listenfd, (SA *)&addr, sizeof(addr));
-    assert(ret >= 0);
-
-    ret = listen(listenfd, 5);
-    assert(ret >= 0);
+    int listenfd = Listen(ip, port);
+    int tls_listenfd = tls_port > 0 ? Listen(ip, tls_port) : -1;
 
     struct epoll_event events[max_event_num];
     int epollfd = epoll_create(5);
     assert(epollfd != -1);
     AddFD(epollfd, listenfd, false);
+    if (tls_listenfd >= 0) {
+        AddFD(epollfd, tls_listenfd, false);
+    }
     HttpConn::epollfd_ = epollfd;
+    Upstream::Start(epollfd);
 
     while (true) {
-        int num = epoll_wait(epollfd, events, max_event_num, -1);
+        int num = epoll_wait(epollfd, events, max_event_num,
+                             HttpConn::WaitTime());
         if ((num < 0) && (errno != EINTR)) {
             printf("epoll failure\n");
             break;
@@ -97,33 +295,93 @@ int main(int argc, char *argv[]) {
 
         for (int i = 0; i < num; ++i) {
             int sockfd = events[i].data.fd;
-            if (sockfd == listenfd) {
+            if (sockfd == listenfd || sockfd == tls_listenfd) {
+                bool tls = sockfd == tls_listenfd;
                 struct sockaddr_in cli_addr;
-                socklen_t cli_addr_len = sizeof(cli_addr_len);
-                int connfd = accept(listenfd, (SA *)&cli_addr, &cli_addr_len);
+                // 监听 socket 是边沿触发的，必须一直 accept 到队列为空
+                while (true) {
+                    socklen_t cli_addr_len = sizeof(cli_addr);
+                    int connfd = accept(sockfd, (SA *)&cli_addr, &cli_addr_len);
 
-                if (connfd < 0) {
-                    perror("accpet error");
-                    continue;
+                    if (connfd < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            perror("accpet error");
+                        }
+                        break;
+                    }
+                    if (HttpConn::user_count_ >= max_fd) {
+                        ShowError(connfd, "Internal server busy");
+                        continue;
+                    }
+                    if (!acl_check(acl, (SA *)&cli_addr)) {
+                        if (tls) {
+                            close(connfd);
+                            continue;
+                        }
+                        ShowError(connfd, "HTTP/1.1 403 Forbidden\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "Connection: close\r\n\r\n");
+                        continue;
+                    }
+                    long wait = ratelimit_take(limits, RATELIMIT_CONN,
+                                               (SA *)&cli_addr);
+                    if (wait > 0) {
+                        if (tls) {
+                            close(connfd);
+                            continue;
+                        }
+                        char reply[128];
+                        snprintf(reply, sizeof(reply),
+                                 "HTTP/1.1 429 Too Many Requests\r\n"
+                                 "Retry-After: %ld\r\n"
+                                 "Content-Length: 0\r\n"
+                                 "Connection: close\r\n\r\n", wait);
+                        ShowError(connfd, reply);
+                        continue;
+                    }
+                    users[connfd].Init(connfd, cli_addr, tls);
                 }
-                if (HttpConn::user_count_ >= max_fd) {
-                    ShowError(connfd, "Internal server busy");
-                    continue;
+            }
+            else if (UpstreamServer *server = Upstream::ProbeOwner(sockfd)) {
+                // 上游的健康探测
+                Upstream::ProbeEvent(server, events[i].events);
+            }
+            else if (HttpConn *conn = HttpConn::Owner(sockfd)) {
+                // CGI 或代理运行期间，客户 socket、CGI 管道和上游 socket 上的
+                // 事件都交给连接的状态机
+                if (!conn->FdEvent(sockfd, events[i].events)) {
+                    conn->CloseConn();
                 }
-                users[connfd].Init(connfd, cli_addr);
             }
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
                 users[sockfd].CloseConn();
             }
-            else if (events[i].events & EPOLLIN) {
-                if (users[sockfd].Read()) {
-                    pool->Append(users + sockfd);
+            else if (users[sockfd].Http2()) {
+                // HTTP/2 连接的读写都在工作线程中完成
+                pool->Append(users + sockfd);
+            }
+            else if (users[sockfd].Handshaking()) {
+                // TLS 握手阶段，读写事件都交给握手状态机
+                if (!users[sockfd].Handshake()) {
+                    users[sockfd].CloseConn();
+                }
+                else if (!users[sockfd].Handshaking()) {
+                    // 握手完成，请求可能已随握手一起到达并被 SSL 缓存，
+                    // 边沿触发下不会再有可读事件，必须立即读取
+                    if (!ReadRequest(users[sockfd], limits, pool)) {
+                        users[sockfd].CloseConn();
+                    }
                 }
-                else {
+            }
+            else if (((events[i].events & EPOLLIN) ||
+                      ((events[i].events & EPOLLOUT) &&
+                       users[sockfd].ReadWantsWrite())) &&
+                     !users[sockfd].Writing()) {
+                if (!ReadRequest(users[sockfd], limits, pool)) {
                     users[sockfd].CloseConn();
                 }
             }
-            else if (events[i].events & EPOLLOUT) {
+            else if (events[i].events & (EPOLLOUT | EPOLLIN)) {
                 if (!users[sockfd].Write()) {
                     users[sockfd].CloseConn();
                 }
@@ -132,12 +390,19 @@ int main(int argc, char *argv[]) {
                 ;
             }
         }
+        HttpConn::Tick();
     }
 
     close(epollfd);
     close(listenfd);
+    if (tls_listenfd >= 0) {
+        close(tls_listenfd);
+    }
     delete[] users;
     delete pool;
+    Router::Unload();
+    acl_free(acl);
+    ratelimit_free(limits);
 
     return 0;
 }
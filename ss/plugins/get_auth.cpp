@@ -0,0 +1,36 @@
+#include <string>
+
+#include "handler.hpp"
+
+/*
+ * cgi-bin/get_auth 的插件版本：GET /auth/get?name&passwd
+ *   构造参数是页面上的站点名（路由表中的参数），默认为 auth.com
+ */
+class GetAuth : public Handler {
+public:
+    explicit GetAuth(const char *arg) : site_(*arg ? arg : "auth.com") { }
+
+    int Handle(const RequestView &req, ResponseWriter &resp) override {
+        std::string query = req.query;
+        size_t amp = query.find('&');
+        if (amp == std::string::npos) {
+            resp.Status(400, "Bad Request");
+            resp.Header("Content-Type", "text/plain");
+            resp.Write("usage: ?name&passwd\r\n", 21);
+            return 0;
+        }
+
+        std::string content = "Welcome to " + site_ + ":" +
+                              query.substr(0, amp) + " and " +
+                              query.substr(amp + 1) + "\r\n<p>\r\n" +
+                              "Thanks for visiting!\r\n";
+        resp.Header("Content-Type", "text/html");
+        resp.Write(content.data(), content.size());
+        return 0;
+    }
+
+private:
+    const std::string site_;    // 只读，多个工作线程可以同时使用
+};
+
+SS_EXPORT_HANDLER(GetAuth)
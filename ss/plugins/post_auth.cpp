@@ -0,0 +1,26 @@
+#include <string>
+
+#include "handler.hpp"
+
+/*
+ * cgi-bin/post_auth 的插件版本：POST /auth/post，回显消息体
+ */
+class PostAuth : public Handler {
+public:
+    explicit PostAuth(const char *) { }
+
+    int Handle(const RequestView &req, ResponseWriter &resp) override {
+        std::string content;
+        if (!req.body) {
+            content = "Something is wrong\r\n";
+        }
+        else {
+            content = "Info:" + std::string(req.body, req.body_len) + "\r\n";
+        }
+        resp.Header("Content-Type", "text/html");
+        resp.Write(content.data(), content.size());
+        return 0;
+    }
+};
+
+SS_EXPORT_HANDLER(PostAuth)
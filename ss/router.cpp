@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include <algorithm>
+
+#include "router.hpp"
+#include "upstream.hpp"
+
+std::vector<Route> Router::routes_;
+bool Router::has_proxy_ = false;
+
+void Router::AddRoute(Route &route, const char *prefix) {
+    route.prefix = prefix;
+    // 末尾的 / 不参与匹配，"/auth/" 与 "/auth" 等价
+    while (route.prefix.size() > 1 && route.prefix.back() == '/') {
+        route.prefix.pop_back();
+    }
+    routes_.push_back(route);
+}
+
+bool Router::LoadRoute(const char *prefix, const char *so_path,
+                       const char *arg) {
+    // RTLD_LOCAL：不同插件中的同名符号互不干扰
+    void *dl = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+    if (!dl) {
+        printf("load %s: %s\n", so_path, dlerror());
+        return false;
+    }
+
+    HandlerApiVersionFn version =
+        (HandlerApiVersionFn)dlsym(dl, "HandlerApiVersion");
+    CreateHandlerFn create = (CreateHandlerFn)dlsym(dl, "CreateHandler");
+    DestroyHandlerFn destroy = (DestroyHandlerFn)dlsym(dl, "DestroyHandler");
+    if (!version || !create || !destroy) {
+        printf("%s is not a handler plugin\n", so_path);
+        dlclose(dl);
+        return false;
+    }
+    if (version() != HANDLER_API_VERSION) {
+        printf("%s: handler api %d, serv has %d\n",
+               so_path, version(), HANDLER_API_VERSION);
+        dlclose(dl);
+        return false;
+    }
+
+    Handler *handler = nullptr;
+    try {
+        handler = create(arg);
+    }
+    catch (...) {
+        handler = nullptr;
+    }
+    if (!handler) {
+        printf("%s: CreateHandler(\"%s\") failed\n", so_path, arg);
+        dlclose(dl);
+        return false;
+    }
+
+    Route route;
+    route.handler = handler;
+    route.destroy = destroy;
+    route.dl = dl;
+    AddRoute(route, prefix);
+    return true;
+}
+
+bool Router::LoadProxy(const char *prefix, const char *spec) {
+    Upstream *upstream = Upstream::Create(spec);
+    if (!upstream) {
+        return false;
+    }
+    Route route;
+    route.upstream = upstream;
+    AddRoute(route, prefix);
+    has_proxy_ = true;
+    return true;
+}
+
+bool Router::Load(const char *file) {
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        perror(file);
+        return false;
+    }
+
+    char line[1024];
+    int line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        ++line_no;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+
+        char *prefix = strtok(p, " \t");
+        char *so_path = strtok(nullptr, " \t");
+        char *arg = strtok(nullptr, "");
+        if (!so_path || prefix[0] != '/') {
+            printf("%s:%d: expected \"/prefix plugin.so [arg]\"\n",
+                   file, line_no);
+            ok = false;
+            break;
+        }
+        if (arg) {
+            arg += strspn(arg, " \t");
+        }
+        if (strcmp(so_path, "proxy") == 0) {
+            ok = LoadProxy(prefix, arg ? arg : "");
+        }
+        else {
+            ok = LoadRoute(prefix, so_path, arg ? arg : "");
+        }
+    }
+    fclose(fp);
+
+    std::stable_sort(routes_.begin(), routes_.end(),
+                     [](const Route &a, const Route &b) {
+                         return a.prefix.size() > b.prefix.size();
+                     });
+    return ok;
+}
+
+const Route *Router::Match(const char *path) {
+    for (const Route &route : routes_) {
+        size_t len = route.prefix.size();
+        if (strncmp(path, route.prefix.c_str(), len) != 0) {
+            continue;
+        }
+        if (len == 1 || path[len] == '\0' || path[len] == '/') {
+            return &route;
+        }
+    }
+    return nullptr;
+}
+
+void Router::Unload() {
+    for (Route &route : routes_) {
+        if (route.upstream) {
+            delete route.upstream;
+            continue;
+        }
+        route.destroy(route.handler);
+        dlclose(route.dl);
+    }
+    routes_.clear();
+    has_proxy_ = false;
+}
@@ -0,0 +1,47 @@
+#ifndef ROUTER_HPP_
+#define ROUTER_HPP_
+
+#include <string>
+#include <vector>
+
+#include "handler.hpp"
+
+class Upstream;
+
+/*
+ * 路由表：URL 前缀 -> 插件中的 Handler 对象，或者反向代理的上游服务器
+ *   启动时在创建工作线程之前加载，之后只读，工作线程查找时无需加锁
+ */
+struct Route {
+    std::string      prefix;
+    Handler         *handler = nullptr;
+    DestroyHandlerFn destroy = nullptr;
+    void            *dl = nullptr;
+    // 不为 nullptr 时请求被转发给上游，handler 不使用
+    Upstream        *upstream = nullptr;
+};
+
+class Router {
+public:
+    // 路由表文件每行为 "前缀 插件.so [参数]" 或 "前缀 proxy 上游 [选项]"，
+    // 空行和 # 开头的行被忽略，出错时打印原因并返回 false
+    static bool Load(const char *file);
+    // 最长前缀匹配，前缀只在路径分隔处匹配（/auth 匹配 /auth/x，不匹配 /authx）
+    static const Route *Match(const char *path);
+    static void Unload();
+    // 路由表中有代理，反应堆需要定时检查上游的超时
+    static bool HasProxy() { return has_proxy_; }
+
+private:
+    static bool LoadRoute(const char *prefix, const char *so_path,
+                          const char *arg);
+    static bool LoadProxy(const char *prefix, const char *spec);
+    static void AddRoute(Route &route, const char *prefix);
+
+private:
+    // 按前缀长度降序排列，第一个匹配的就是最长的
+    static std::vector<Route> routes_;
+    static bool               has_proxy_;
+};
+
+#endif  // ROUTER_HPP_
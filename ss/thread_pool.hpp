@@ -2,11 +2,13 @@
 #define THREAD_POOL_HPP_
 
 #include <list>
+#include <vector>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
 
 #include "locker.hpp"
+#include "affinity.hpp"
 
 
 /*
@@ -17,8 +19,10 @@ template <typename T>
 class ThreadPool {
 public:
     // 参数 thread_number 是线程池中线程的数量，
-    // max_requests 是请求队列中最多允许的，等待处理的请求的数量
-    ThreadPool(int thread_number = 0, int max_requests = 10000);
+    // max_requests 是请求队列中最多允许的，等待处理的请求的数量，
+    // cpus 非空时第 i 个工作线程被绑定到 cpus[i % cpus.size()] 上
+    ThreadPool(int thread_number = 8, int max_requests = 10000,
+               const std::vector<int> &cpus = std::vector<int>());
     ~ThreadPool();
 
     bool Append(T *request);
@@ -39,7 +43,8 @@ private:
 };
 
 template <typename T>
-ThreadPool<T>::ThreadPool(int thread_number, int max_requests)
+ThreadPool<T>::ThreadPool(int thread_number, int max_requests,
+                          const std::vector<int> &cpus)
     : thread_number_(thread_number),
       max_requests_(max_requests),
       stop_(false),
@@ -59,6 +64,10 @@ ThreadPool<T>::ThreadPool(int thread_number, int max_requests)
             delete[] threads_;
             throw std::exception();
         }
+        int cpu = PickCpu(cpus, i);
+        if (cpu != -1) {
+            PinThreadToCpu(threads_[i], cpu);
+        }
         if (pthread_detach(threads_[i])) {
             delete[] threads_;
             throw std::exception();
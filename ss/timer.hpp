@@ -0,0 +1,79 @@
+#ifndef TIMER_HPP_
+#define TIMER_HPP_
+
+#include <time.h>
+#include <stdint.h>
+
+#include <queue>
+#include <functional>
+#include <vector>
+
+#include "locker.hpp"
+
+/*
+ * 时间堆：按到期时间排列的最小堆，堆顶是最早到期的定时器
+ *   工作线程添加定时器，反应堆线程取出到期的定时器，由互斥锁保护；
+ *   不支持删除，定时器失效由持有者比较 id 判断（惰性删除）
+ */
+template <typename T>
+class TimerHeap {
+public:
+    // 添加一个 timeout_ms 毫秒后到期的定时器
+    void Add(int timeout_ms, T *owner, unsigned long id) {
+        Timer timer = { NowMs() + timeout_ms, owner, id };
+        locker_.MutexLock();
+        heap_.push(timer);
+        locker_.MutexUnlock();
+    }
+
+    // 距最早的定时器到期还有多少毫秒，不超过 max_wait
+    int NextTimeout(int max_wait) {
+        int wait = max_wait;
+        locker_.MutexLock();
+        if (!heap_.empty()) {
+            int64_t left = heap_.top().expire - NowMs();
+            if (left < wait) {
+                wait = left > 0 ? (int)left : 0;
+            }
+        }
+        locker_.MutexUnlock();
+        return wait;
+    }
+
+    // 取出一个已到期的定时器，没有时返回 false
+    bool PopExpired(T **owner, unsigned long *id) {
+        bool expired = false;
+        locker_.MutexLock();
+        if (!heap_.empty() && heap_.top().expire <= NowMs()) {
+            *owner = heap_.top().owner;
+            *id = heap_.top().id;
+            heap_.pop();
+            expired = true;
+        }
+        locker_.MutexUnlock();
+        return expired;
+    }
+
+    static int64_t NowMs() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+private:
+    struct Timer {
+        int64_t       expire;   // CLOCK_MONOTONIC 毫秒
+        T            *owner;
+        unsigned long id;
+
+        bool operator>(const Timer &other) const {
+            return expire > other.expire;
+        }
+    };
+
+private:
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> heap_;
+    MutexLocker locker_;
+};
+
+#endif  // TIMER_HPP_
@@ -0,0 +1,651 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+
+#include "cache.hpp"
+#include "upstream.hpp"
+
+namespace {
+
+int64_t NowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * 池中的连接上不应有任何数据：可读说明上游已经关闭（或发来了垃圾）
+ */
+bool Alive(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * FNV-1a，再经过一次混合，使相近的键（如相邻的地址）也分散开
+ */
+uint64_t Hash(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * 轮转：从上次选中的下一台开始，找第一台可用的
+ */
+class RoundRobinBalancer : public Balancer {
+public:
+    UpstreamServer *Pick(const std::vector<UpstreamServer *> &servers,
+                         uint64_t, const UpstreamServer *exclude,
+                         int64_t now) override {
+        size_t n = servers.size();
+        size_t start = next_++;
+        for (size_t i = 0; i < n; ++i) {
+            UpstreamServer *server = servers[(start + i) % n];
+            if (server != exclude && server->Available(now)) {
+                return server;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    std::atomic<size_t> next_{0};
+};
+
+/*
+ * 最少请求：选择正在进行的请求最少的服务器。变慢的服务器上请求积压，
+ * 新请求随即流向其他服务器，不必等它超时或被摘除；
+ * 从上次选中的下一台开始比较，请求数相同时依次轮转
+ */
+class LeastRequestsBalancer : public Balancer {
+public:
+    UpstreamServer *Pick(const std::vector<UpstreamServer *> &servers,
+                         uint64_t, const UpstreamServer *exclude,
+                         int64_t now) override {
+        size_t n = servers.size();
+        size_t start = next_;
+        size_t best = n;
+        int least = 0;
+        for (size_t i = 0; i < n; ++i) {
+            size_t k = (start + i) % n;
+            UpstreamServer *server = servers[k];
+            if (server == exclude || !server->Available(now)) {
+                continue;
+            }
+            int outstanding = server->Outstanding();
+            if (best == n || outstanding < least) {
+                best = k;
+                least = outstanding;
+            }
+        }
+        if (best == n) {
+            return nullptr;
+        }
+        next_ = best + 1;
+        return servers[best];
+    }
+
+private:
+    std::atomic<size_t> next_{0};
+};
+
+/*
+ * 一致性哈希：每台服务器在环上占 POINTS 个点，键落在环上顺时针找第一个
+ * 可用的服务器。增减或摘除一台服务器只影响原来落在它上面的键
+ */
+class HashBalancer : public Balancer {
+public:
+    static const int POINTS = 160;
+
+    explicit HashBalancer(const std::vector<UpstreamServer *> &servers) {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            for (int j = 0; j < POINTS; ++j) {
+                std::string point = servers[i]->Name() + "#" +
+                                    std::to_string(j);
+                ring_.push_back(Point{Hash(point.data(), point.size()), i});
+            }
+        }
+        std::sort(ring_.begin(), ring_.end(),
+                  [](const Point &a, const Point &b) {
+                      return a.hash < b.hash;
+                  });
+    }
+
+    UpstreamServer *Pick(const std::vector<UpstreamServer *> &servers,
+                         uint64_t hash, const UpstreamServer *exclude,
+                         int64_t now) override {
+        size_t pos = std::lower_bound(ring_.begin(), ring_.end(), hash,
+                                      [](const Point &p, uint64_t h) {
+                                          return p.hash < h;
+                                      }) - ring_.begin();
+        for (size_t i = 0; i < ring_.size(); ++i) {
+            UpstreamServer *server =
+                servers[ring_[(pos + i) % ring_.size()].server];
+            if (server != exclude && server->Available(now)) {
+                return server;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    struct Point {
+        uint64_t hash;
+        size_t   server;
+    };
+    std::vector<Point> ring_;
+};
+
+}  // namespace
+
+std::vector<Upstream *>       Upstream::checked_;
+TimerHeap<UpstreamServer>     Upstream::probe_timers_;
+std::vector<UpstreamServer *> Upstream::probe_owner_;
+int                           Upstream::epollfd_ = -1;
+
+UpstreamServer::~UpstreamServer() {
+    for (const Idle &idle : pool_) {
+        close(idle.fd);
+    }
+    if (probe_fd_ >= 0) {
+        close(probe_fd_);
+    }
+}
+
+bool UpstreamServer::Parse(const char *addr) {
+    name_ = addr;
+
+    memset(&addr_, 0, sizeof(addr_));
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr_;
+        if (strlen(addr + 5) == 0 || strlen(addr + 5) >= sizeof(un->sun_path)) {
+            printf("proxy: bad unix socket path %s\n", addr);
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, addr + 5);
+        addr_len_ = sizeof(*un);
+        host_ = "localhost";
+    }
+    else if (strncmp(addr, "http://", 7) == 0) {
+        // host:port 或 [v6]:port，端口默认 80，路径部分被忽略
+        std::string host = addr + 7;
+        host = host.substr(0, host.find('/'));
+        host_ = host;
+        std::string port = "80";
+        size_t colon = host.rfind(':');
+        if (colon != std::string::npos &&
+            host.find(']', colon) == std::string::npos) {
+            port = host.substr(colon + 1);
+            host.erase(colon);
+        }
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (ret != 0) {
+            printf("proxy: %s: %s\n", addr, gai_strerror(ret));
+            return false;
+        }
+        memcpy(&addr_, res->ai_addr, res->ai_addrlen);
+        addr_len_ = res->ai_addrlen;
+        freeaddrinfo(res);
+    }
+    else {
+        printf("proxy: expected http://host:port or unix:/path, got %s\n",
+               addr);
+        return false;
+    }
+
+    return true;
+}
+
+int UpstreamServer::Connect(bool fresh, bool *reused, bool *connecting) {
+    *reused = false;
+    *connecting = false;
+
+    int64_t now = NowMs();
+    while (!fresh) {
+        locker_.MutexLock();
+        // 池底是最久没用的连接，超过空闲时间的一并关闭
+        size_t expired = 0;
+        while (expired < pool_.size() &&
+               now - pool_[expired].since > idle_ * 1000) {
+            close(pool_[expired++].fd);
+        }
+        pool_.erase(pool_.begin(), pool_.begin() + expired);
+        int fd = -1;
+        if (!pool_.empty()) {
+            fd = pool_.back().fd;
+            pool_.pop_back();
+        }
+        locker_.MutexUnlock();
+
+        if (fd < 0) {
+            break;
+        }
+        if (Alive(fd)) {
+            *reused = true;
+            ++outstanding_;
+            return fd;
+        }
+        close(fd);
+    }
+
+    int fd = Open(connecting);
+    if (fd >= 0) {
+        ++outstanding_;
+    }
+    return fd;
+}
+
+int UpstreamServer::Open(bool *connecting) {
+    *connecting = false;
+    int fd = socket(addr_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (addr_.ss_family != AF_UNIX) {
+        // 请求头部和应答头部都是小包，不等待 Nagle 合并
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if (connect(fd, (struct sockaddr *)&addr_, addr_len_) < 0) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        *connecting = true;
+    }
+    return fd;
+}
+
+void UpstreamServer::Release(int fd, bool reusable) {
+    --outstanding_;
+    if (reusable) {
+        locker_.MutexLock();
+        if (pool_.size() < keepalive_) {
+            pool_.push_back(Idle{fd, NowMs()});
+            fd = -1;
+        }
+        locker_.MutexUnlock();
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void UpstreamServer::Succeeded() {
+    fails_ = 0;
+}
+
+/*
+ * 连续失败 max_fails 次后摘除 fail_timeout 秒，期间不再分给它新请求；
+ * 到期后重新参与选择，再失败 max_fails 次又被摘除。max_fails 为 0 时不摘除
+ */
+void UpstreamServer::Failed(int max_fails, int fail_timeout) {
+    if (max_fails <= 0 || ++fails_ < max_fails) {
+        return;
+    }
+    fails_ = 0;
+    int64_t now = NowMs();
+    if (ejected_until_.exchange(now + fail_timeout * 1000) <= now) {
+        printf("proxy: %s failed %d times, ejected for %d s\n",
+               name_.c_str(), max_fails, fail_timeout);
+    }
+}
+
+Upstream *Upstream::Create(const char *spec) {
+    Upstream *upstream = new Upstream;
+    if (!upstream->Parse(spec)) {
+        delete upstream;
+        return nullptr;
+    }
+    if (!upstream->check_path_.empty()) {
+        checked_.push_back(upstream);
+    }
+    return upstream;
+}
+
+Upstream::~Upstream() {
+    checked_.erase(std::remove(checked_.begin(), checked_.end(), this),
+                   checked_.end());
+    for (UpstreamServer *server : servers_) {
+        if (server->probe_fd_ >= 0) {
+            probe_owner_[server->probe_fd_] = nullptr;
+        }
+        delete server;
+    }
+    delete balancer_;
+    delete cache_;
+}
+
+bool Upstream::Parse(const char *spec) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    std::vector<const char *> addrs;
+    size_t keepalive = DEFAULT_KEEPALIVE;
+    int idle = DEFAULT_IDLE;
+    std::string balance = "least_requests";
+    size_t cache_size = 0, cache_disk = 1024;
+    std::string cache_dir;
+
+    char *save = nullptr;
+    char *opt;
+    for (char *p = buf; (opt = strtok_r(p, " \t", &save)); p = nullptr) {
+        if (!strchr(opt, '=')) {
+            addrs.push_back(opt);
+            continue;
+        }
+        const char *value = strchr(opt, '=') + 1;
+        int n = atoi(value);
+        if (strncmp(opt, "keepalive=", 10) == 0 && n >= 0) {
+            keepalive = n;
+        }
+        else if (strncmp(opt, "idle=", 5) == 0 && n > 0) {
+            idle = n;
+        }
+        else if (strncmp(opt, "timeout=", 8) == 0 && n > 0) {
+            timeout_ = n;
+        }
+        else if (strncmp(opt, "balance=", 8) == 0) {
+            balance = value;
+        }
+        else if (strcmp(opt, "hash_key=ip") == 0) {
+            hash_key_ = KEY_IP;
+        }
+        else if (strcmp(opt, "hash_key=uri") == 0) {
+            hash_key_ = KEY_URI;
+        }
+        else if (strncmp(opt, "hash_key=header:", 16) == 0 && opt[16]) {
+            hash_key_ = KEY_HEADER;
+            hash_header_ = opt + 16;
+        }
+        else if (strncmp(opt, "max_fails=", 10) == 0 && n >= 0) {
+            max_fails_ = n;
+        }
+        else if (strncmp(opt, "fail_timeout=", 13) == 0 && n > 0) {
+            fail_timeout_ = n;
+        }
+        else if (strncmp(opt, "check=", 6) == 0 && value[0] == '/') {
+            check_path_ = value;
+        }
+        else if (strncmp(opt, "check_interval=", 15) == 0 && n > 0) {
+            check_interval_ = n;
+        }
+        else if (strncmp(opt, "check_timeout=", 14) == 0 && n > 0) {
+            check_timeout_ = n;
+        }
+        else if (strncmp(opt, "cache=", 6) == 0 && n > 0) {
+            cache_size = n;
+        }
+        else if (strncmp(opt, "cache_dir=", 10) == 0 && value[0]) {
+            cache_dir = value;
+        }
+        else if (strncmp(opt, "cache_disk=", 11) == 0 && n > 0) {
+            cache_disk = n;
+        }
+        else {
+            printf("proxy: unknown option %s\n", opt);
+            return false;
+        }
+    }
+    if (addrs.empty()) {
+        printf("proxy: missing upstream address\n");
+        return false;
+    }
+
+    for (const char *addr : addrs) {
+        UpstreamServer *server = new UpstreamServer(this, keepalive, idle);
+        servers_.push_back(server);
+        if (!server->Parse(addr)) {
+            return false;
+        }
+        server->probe_req_ = "GET " + check_path_ + " HTTP/1.0\r\nHost: " +
+                             server->host_ + "\r\n\r\n";
+    }
+
+    if (balance == "round_robin") {
+        balancer_ = new RoundRobinBalancer;
+    }
+    else if (balance == "least_requests") {
+        balancer_ = new LeastRequestsBalancer;
+    }
+    else if (balance == "hash") {
+        balancer_ = new HashBalancer(servers_);
+        hashed_ = true;
+    }
+    else {
+        printf("proxy: unknown balance %s\n", balance.c_str());
+        return false;
+    }
+
+    if (cache_size > 0) {
+        cache_ = ProxyCache::Create(cache_size << 20, cache_dir,
+                                    cache_disk << 20);
+        if (!cache_) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t Upstream::KeyHash(const struct sockaddr_in &peer, const char *url,
+                           const char *const *headers,
+                           int header_count) const {
+    if (!hashed_) {
+        return 0;
+    }
+    if (hash_key_ == KEY_URI) {
+        return Hash(url, strlen(url));
+    }
+    if (hash_key_ == KEY_HEADER) {
+        for (int i = 0; i < header_count; ++i) {
+            const char *h = headers[i];
+            if (strncasecmp(h, hash_header_.c_str(), hash_header_.size()) == 0 &&
+                h[hash_header_.size()] == ':') {
+                const char *value = h + hash_header_.size() + 1;
+                value += strspn(value, " \t");
+                return Hash(value, strlen(value));
+            }
+        }
+        // 没有这个头部的请求按客户地址分配
+    }
+    return Hash(&peer.sin_addr, sizeof(peer.sin_addr));
+}
+
+int Upstream::Connect(uint64_t hash, const UpstreamServer *exclude,
+                      UpstreamServer **server, bool *reused,
+                      bool *connecting) {
+    for (size_t tries = 0; tries < servers_.size(); ++tries) {
+        int64_t now = NowMs();
+        UpstreamServer *picked = balancer_->Pick(servers_, hash, exclude, now);
+        if (!picked) {
+            // 都不可用时仍然要试一台，选最早恢复的，而不是直接拒绝请求
+            for (UpstreamServer *s : servers_) {
+                if (s != exclude &&
+                    (!picked || s->EjectedUntil() < picked->EjectedUntil())) {
+                    picked = s;
+                }
+            }
+            if (!picked) {
+                return -1;
+            }
+        }
+        int fd = picked->Connect(false, reused, connecting);
+        if (fd >= 0) {
+            *server = picked;
+            return fd;
+        }
+        Failed(picked);
+        exclude = picked;
+    }
+    return -1;
+}
+
+void Upstream::Start(int epollfd) {
+    epollfd_ = epollfd;
+    for (Upstream *upstream : checked_) {
+        for (UpstreamServer *server : upstream->servers_) {
+            Schedule(server, 0);
+        }
+    }
+}
+
+UpstreamServer *Upstream::ProbeOwner(int fd) {
+    return (size_t)fd < probe_owner_.size() ? probe_owner_[fd] : nullptr;
+}
+
+int Upstream::NextTimeout(int max_wait) {
+    return checked_.empty() ? max_wait : probe_timers_.NextTimeout(max_wait);
+}
+
+void Upstream::Schedule(UpstreamServer *server, int timeout_ms) {
+    probe_timers_.Add(timeout_ms, server, ++server->timer_id_);
+}
+
+void Upstream::Tick() {
+    UpstreamServer *server;
+    unsigned long id;
+    while (probe_timers_.PopExpired(&server, &id)) {
+        if (id != server->timer_id_) {
+            continue;
+        }
+        if (server->probe_fd_ >= 0) {
+            server->group_->EndProbe(server, false);
+        }
+        else {
+            server->group_->StartProbe(server);
+        }
+    }
+}
+
+/*
+ * 探测是一个 HTTP/1.0 的 GET 请求，2xx 和 3xx 应答表示健康；
+ * 连接失败、应答出错或 check_timeout 毫秒内没有应答表示不健康
+ */
+void Upstream::StartProbe(UpstreamServer *server) {
+    int fd = server->Open(&server->probe_connecting_);
+    if (fd < 0) {
+        server->probe_fd_ = -1;
+        return EndProbe(server, false);
+    }
+    if ((size_t)fd >= probe_owner_.size()) {
+        probe_owner_.resize(fd + 1);
+    }
+    probe_owner_[fd] = server;
+    server->probe_fd_ = fd;
+    server->probe_sent_ = 0;
+    server->probe_resp_.clear();
+
+    struct epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    epoll_ctl(epollfd_, EPOLL_CTL_ADD, fd, &event);
+    Schedule(server, check_timeout_);
+}
+
+void Upstream::ProbeEvent(UpstreamServer *server, uint32_t events) {
+    Upstream *group = server->group_;
+    int fd = server->probe_fd_;
+    if (server->probe_connecting_) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            return group->EndProbe(server, false);
+        }
+        server->probe_connecting_ = false;
+    }
+
+    const std::string &req = server->probe_req_;
+    while (server->probe_sent_ < req.size()) {
+        ssize_t n = send(fd, req.data() + server->probe_sent_,
+                         req.size() - server->probe_sent_, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n < 0) {
+            return group->EndProbe(server, false);
+        }
+        server->probe_sent_ += n;
+    }
+
+    // 只需要状态行
+    char buf[512];
+    while (true) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+            !(events & (EPOLLHUP | EPOLLERR))) {
+            return;
+        }
+        if (n <= 0) {
+            return group->EndProbe(server, false);
+        }
+        server->probe_resp_.append(buf, n);
+        size_t nl = server->probe_resp_.find('\n');
+        if (nl != std::string::npos) {
+            int status = 0;
+            bool ok = sscanf(server->probe_resp_.c_str(), "HTTP/%*d.%*d %d",
+                             &status) == 1 && status >= 200 && status < 400;
+            return group->EndProbe(server, ok);
+        }
+        if (server->probe_resp_.size() > sizeof(buf)) {
+            return group->EndProbe(server, false);
+        }
+    }
+}
+
+/*
+ * 一次探测成功即恢复健康；此前探测失败过，说明服务器确实停止过服务，
+ * 被动检查的摘除也一并解除，服务器恢复后最多一个 check_interval 就重新
+ * 接收请求。探测一直成功时不解除摘除，以免掩盖只有真实请求才会出现的错误
+ */
+void Upstream::EndProbe(UpstreamServer *server, bool ok) {
+    if (server->probe_fd_ >= 0) {
+        probe_owner_[server->probe_fd_] = nullptr;
+        epoll_ctl(epollfd_, EPOLL_CTL_DEL, server->probe_fd_, nullptr);
+        close(server->probe_fd_);
+        server->probe_fd_ = -1;
+    }
+    if (ok && !server->healthy_) {
+        server->fails_ = 0;
+        server->ejected_until_ = 0;
+    }
+    if (server->healthy_.exchange(ok) != ok) {
+        printf("proxy: %s health check %s\n", server->name_.c_str(),
+               ok ? "passed, back in service" : "failed, out of service");
+    }
+    Schedule(server, check_interval_);
+}
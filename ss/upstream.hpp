@@ -0,0 +1,181 @@
+#ifndef UPSTREAM_HPP_
+#define UPSTREAM_HPP_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "locker.hpp"
+#include "timer.hpp"
+
+class Upstream;
+class ProxyCache;
+
+/*
+ * 上游组中的一台服务器：地址、空闲的长连接池和健康状态
+ *   工作线程取出连接，反应堆线程在应答结束后归还，连接池由互斥锁保护。
+ *   池中的连接不在 epoll 中，上游随时可能关闭它们，取出时先检查；
+ *   后进先出，最近用过的连接最可能还活着，久未使用的在池底超时关闭。
+ *   健康状态有两个来源：转发失败（被动检查，连续失败 max_fails 次后
+ *   摘除 fail_timeout 秒）和反应堆定时发出的探测请求（主动检查）。
+ */
+class UpstreamServer {
+    // 主动检查的状态由所属的组在反应堆线程中维护
+    friend class Upstream;
+
+public:
+    UpstreamServer(Upstream *group, size_t keepalive, int idle)
+        : group_(group), keepalive_(keepalive), idle_(idle) { }
+    ~UpstreamServer();
+
+    // "http://host:port" 或 "unix:/path"，出错时打印原因并返回 false
+    bool Parse(const char *addr);
+
+    // 返回一个非阻塞的 socket，失败时返回 -1；fresh 为 true 时不用池中的
+    // 连接。*reused 表示连接取自池中，*connecting 表示 connect 还在进行。
+    // 成功后该服务器上正在进行的请求数加一，Release 时减一
+    int  Connect(bool fresh, bool *reused, bool *connecting);
+    // 应答完整结束且上游允许保持连接时放回池中，否则关闭
+    void Release(int fd, bool reusable);
+
+    // 被动检查：收到了正常的应答头部，或者连接、应答出错
+    void Succeeded();
+    void Failed(int max_fails, int fail_timeout);
+    // 没有被摘除，且最近一次探测成功（或没有开启探测）
+    bool Available(int64_t now) const {
+        return healthy_ && now >= ejected_until_;
+    }
+    int  Outstanding() const { return outstanding_; }
+    int64_t EjectedUntil() const { return ejected_until_; }
+
+    const std::string &Name() const { return name_; }
+    // 客户没有给出 Host 时使用：host[:port]，unix socket 为 localhost
+    const std::string &Host() const { return host_; }
+
+private:
+    // 新建一个非阻塞连接，探测也使用它
+    int  Open(bool *connecting);
+
+private:
+    struct Idle {
+        int     fd;
+        int64_t since;
+    };
+
+    Upstream               *group_;
+    std::string             name_;
+    std::string             host_;
+    struct sockaddr_storage addr_;
+    socklen_t               addr_len_ = 0;
+    size_t                  keepalive_;
+    int                     idle_;
+
+    std::vector<Idle>       pool_;
+    MutexLocker             locker_;
+
+    std::atomic<int>        outstanding_{0};
+    std::atomic<int>        fails_{0};
+    std::atomic<int64_t>    ejected_until_{0};
+    std::atomic<bool>       healthy_{true};
+
+    // 探测请求；正在进行的探测：socket，connect 是否还在进行，已发送的
+    // 字节数，已收到的应答；timer_id_ 为最新的定时器（探测超时或下一次探测）
+    std::string             probe_req_;
+    int                     probe_fd_ = -1;
+    bool                    probe_connecting_ = false;
+    size_t                  probe_sent_ = 0;
+    std::string             probe_resp_;
+    unsigned long           timer_id_ = 0;
+};
+
+/*
+ * 选择服务器的策略，Pick 由工作线程并发调用；exclude 是刚刚失败的服务器，
+ * 没有可用的服务器时返回 nullptr
+ */
+class Balancer {
+public:
+    virtual ~Balancer() { }
+    virtual UpstreamServer *Pick(const std::vector<UpstreamServer *> &servers,
+                                 uint64_t hash, const UpstreamServer *exclude,
+                                 int64_t now) = 0;
+};
+
+/*
+ * 上游组：路由表中的一行 proxy，一台或多台服务器及其选择策略
+ */
+class Upstream {
+public:
+    // 哈希策略的键：客户地址、请求的 URL 或某个头部的值
+    enum HashKey { KEY_IP = 0, KEY_URI, KEY_HEADER };
+
+    // 池中的空闲连接数上限和空闲时间上限（秒），以及默认的应答超时（秒）
+    static const size_t DEFAULT_KEEPALIVE = 32;
+    static const int    DEFAULT_IDLE = 30;
+    static const int    DEFAULT_TIMEOUT = 60;
+
+    // spec 为路由表中 proxy 之后的文本：一个或多个
+    // "http://host:port" 或 "unix:/path"，然后是选项
+    //   keepalive=N idle=秒 timeout=秒
+    //   balance=round_robin|least_requests|hash hash_key=ip|uri|header:名字
+    //   max_fails=N fail_timeout=秒 check=/路径 check_interval=毫秒
+    //   check_timeout=毫秒 cache=MB cache_dir=目录 cache_disk=MB
+    // 出错时打印原因并返回 nullptr
+    static Upstream *Create(const char *spec);
+    ~Upstream();
+
+    // 按哈希策略的键计算哈希值，其他策略返回 0
+    uint64_t KeyHash(const struct sockaddr_in &peer, const char *url,
+                     const char *const *headers, int header_count) const;
+    // 选择一台服务器并取得连接，立即失败的服务器记为失败并换下一台；
+    // exclude 不为 nullptr 时不选它。所有服务器都失败时返回 -1
+    int  Connect(uint64_t hash, const UpstreamServer *exclude,
+                 UpstreamServer **server, bool *reused, bool *connecting);
+    void Failed(UpstreamServer *server) {
+        server->Failed(max_fails_, fail_timeout_);
+    }
+    size_t Size() const { return servers_.size(); }
+    int Timeout() const { return timeout_; }
+    // 应答缓存，没有配置 cache= 时为 nullptr
+    ProxyCache *Cache() const { return cache_; }
+
+    // 主动检查由反应堆驱动：Start 在进入事件循环前调用，
+    // ProbeOwner 找到探测 socket 所属的服务器，Tick 处理到期的定时器
+    static void Start(int epollfd);
+    static UpstreamServer *ProbeOwner(int fd);
+    static void ProbeEvent(UpstreamServer *server, uint32_t events);
+    // 距下一次探测或探测超时还有多少毫秒，不超过 max_wait
+    static int  NextTimeout(int max_wait);
+    static void Tick();
+
+private:
+    Upstream() = default;
+    bool Parse(const char *spec);
+    static void Schedule(UpstreamServer *server, int timeout_ms);
+    void StartProbe(UpstreamServer *server);
+    void EndProbe(UpstreamServer *server, bool ok);
+
+private:
+    std::vector<UpstreamServer *> servers_;
+    Balancer   *balancer_ = nullptr;
+    bool        hashed_ = false;
+    HashKey     hash_key_ = KEY_IP;
+    std::string hash_header_;
+    int         timeout_ = DEFAULT_TIMEOUT;
+    int         max_fails_ = 3;
+    int         fail_timeout_ = 10;
+    std::string check_path_;
+    int         check_interval_ = 1000;
+    int         check_timeout_ = 1000;
+    ProxyCache *cache_ = nullptr;
+
+    // 所有开启了主动检查的组，探测的定时器，以及探测 socket 所属的服务器
+    static std::vector<Upstream *>       checked_;
+    static TimerHeap<UpstreamServer>     probe_timers_;
+    static std::vector<UpstreamServer *> probe_owner_;
+    static int                           epollfd_;
+};
+
+#endif  // UPSTREAM_HPP_
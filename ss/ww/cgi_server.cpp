@@ -11,8 +11,14 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <poll.h>
+
+#include <vector>
 
 #include "process_pool.hpp"
+#include "cgipool.h"
 
 using SA = struct sockaddr;
 
@@ -28,7 +34,8 @@ public:
     void Process();
 
 private:
-    int CoreProcess(int ret, int idx);
+    int  CoreProcess(int ret, int idx);
+    bool SendAll(const char *buf, size_t len);
 
 private:
     static const int   BUF_SIZE = 1024;
@@ -42,6 +49,13 @@ private:
 
 int CgiConn::epollfd_ = -1;
 
+static int64_t ElapsedUs(const struct timespec &start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - start.tv_sec) * 1000000 +
+           (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
 void CgiConn::Init(int epollfd, int sockfd, const sockaddr_in &cli_addr) {
     epollfd_  = epollfd;
     sockfd_   = sockfd;
@@ -65,28 +79,62 @@ int CgiConn::CoreProcess(int ret, int idx) {
     }
     buf_[idx - 1] = '\0';
 
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     char *file_name = buf_;
     if (access(file_name, F_OK) == -1) {
         RemoveFD(epollfd_, sockfd_);
+        PoolCountRequest(ElapsedUs(start), true);
         return -1;
     }
-    // 创建子进程来执行 CGI 程序
-    int pid = fork();
-    if (pid == -1) {
-        RemoveFD(epollfd_, sockfd_);
-        return -1;
-    }
-    else if (pid > 0) {
-        // 父进程只需关闭连接
+    // 优先交给常驻的 CGI worker，一次 IPC 往返代替启动一个进程
+    struct cgi_stream out;
+    if (cgipool_begin(file_name, nullptr, nullptr, 0, &out) == 0) {
+        char data[4096];
+        ssize_t n;
+        bool failed = false;
+        while ((n = cgi_stream_read(&out, data, sizeof(data))) > 0) {
+            if (!SendAll(data, n)) {
+                failed = true;
+                break;
+            }
+        }
+        cgipool_end(&out);
         RemoveFD(epollfd_, sockfd_);
+        PoolCountRequest(ElapsedUs(start), failed || n < 0);
         return -1;
     }
-    else {
-        close(STDOUT_FILENO);
-        dup(sockfd_);
-        execl(buf_, buf_, NULL);
-        exit(0);
+    // 用 posix_spawn 执行 CGI 程序，socket 作为它的标准输出，
+    // 之后父进程只需关闭连接
+    pid_t pid = cgi_spawn(file_name, environ, -1, sockfd_);
+    RemoveFD(epollfd_, sockfd_);
+    PoolCountRequest(ElapsedUs(start), pid < 0);
+    return -1;
+}
+
+/*
+ * 客户 socket 是非阻塞的，发送缓冲区满时等它可写
+ */
+bool CgiConn::SendAll(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sockfd_, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return false;
+            }
+            struct pollfd pfd = { sockfd_, POLLOUT, 0 };
+            if (poll(&pfd, 1, 5000) <= 0) {
+                return false;
+            }
+            continue;
+        }
+        buf += n;
+        len -= n;
     }
+    return true;
 }
 
 void CgiConn::Process() {
@@ -113,15 +161,7 @@ void CgiConn::Process() {
     }
 }
 
-int main(int argc, char *argv[]) {
-
-    if (argc <= 2) {
-        printf("usage: %s ip address port number\n", basename(argv[0]));
-        return 1;
-    }
-    const char *ip = argv[1];
-    int port = atoi(argv[2]);
-
+static int OpenListenFD(const char *ip, int port, bool reuseport) {
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
     assert(listenfd >= 0);
 
@@ -131,14 +171,85 @@ int main(int argc, char *argv[]) {
     inet_pton(AF_INET, ip, &addr.sin_addr);
     addr.sin_port = htons(port);
 
+    // 每个子进程一个监听 socket 时，它们都要在 bind 之前设置 SO_REUSEPORT
+    if (reuseport) {
+        int on = 1;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+
     int ret = bind(listenfd, (SA *)&addr, sizeof(addr));
     assert(ret != -1);
 
     ret = listen(listenfd, 5);
     assert(ret != -1);
+    return listenfd;
+}
+
+/*
+ * 信号：SIGTERM/SIGINT 立即停止，SIGQUIT 处理完已有连接后停止，
+ * SIGUSR1 输出各子进程的连接、请求、错误计数和耗时分布，
+ * SIGUSR2 以同样的命令行启动新的程序文件并把监听 socket 交给它（热升级）；
+ * 单独给一个子进程发 SIGQUIT 会让它排空后由父进程重启
+ */
+int main(int argc, char *argv[]) {
+    std::vector<int> cpus;
+    int process_number = 8;
+    long worker_requests = 0;
+    DispatchMode mode = DISPATCH_EXCLUSIVE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:n:w:")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (!ParseCpuList(optarg, cpus)) {
+                printf("bad cpu list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'd':
+            if (!ParseDispatchMode(optarg, &mode)) {
+                printf("bad dispatch mode: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            process_number = atoi(optarg);
+            break;
+        case 'w':
+            worker_requests = atol(optarg);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (argc - optind < 2) {
+        printf("usage: %s [-c cpu_list] "
+               "[-d parent|reuseport|exclusive|leastload] [-n process_number] "
+               "[-w requests_per_cgi_worker] ip_address port_number\n",
+               basename(argv[0]));
+        return 1;
+    }
+    const char *ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+
+    // 由旧主进程热升级启动时沿用它的监听 socket，不再 bind
+    std::vector<int> inherited;
+    int listenfd;
+    if (InheritListeners(inherited)) {
+        listenfd = inherited[0];
+    }
+    else {
+        listenfd = OpenListenFD(ip, port, mode == DISPATCH_REUSEPORT);
+    }
+
+    // 每个子进程各自维护常驻的 CGI worker，-w 0 表示每个请求都 fork
+    cgipool_init(worker_requests, 30);
 
-    ProcessPool<CgiConn> *pool = ProcessPool<CgiConn>::Create(listenfd);
+    ProcessPool<CgiConn> *pool =
+        ProcessPool<CgiConn>::Create(listenfd, process_number, cpus, mode);
     if (pool) {
+        pool->EnableUpgrade(argv);
         pool->Run();
         delete pool;
     }
@@ -16,11 +16,91 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <vector>
+
+#include "../affinity.hpp"
 
 #define OUT stdout
 
 using SA = struct sockaddr;
 
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+// 热升级时告诉新主进程与旧主进程通信的 unix socket 描述符的环境变量
+#define UPGRADE_ENV "PROCESS_POOL_UPGRADE_FD"
+// 一次热升级最多传递的监听 socket 数，即进程池的最大子进程数
+#define MAX_LISTEN_FDS 16
+
+/*
+ * 新连接的分配方式
+ *   DISPATCH_PARENT      父进程监听 socket，轮流通知子进程 accept（原来的方式），
+ *                        每个连接多一次 IPC 和两次上下文切换，通知到的子进程
+ *                        还可能被别的子进程抢先
+ *   DISPATCH_REUSEPORT   每个子进程有自己的 SO_REUSEPORT 监听 socket，由内核按
+ *                        四元组哈希分配连接；子进程绑定了 CPU 时，再挂一个 CBPF
+ *                        程序把连接交给收到它的 CPU 上的子进程（SO_INCOMING_CPU）
+ *   DISPATCH_EXCLUSIVE   子进程共享监听 socket，以 EPOLLEXCLUSIVE 等待，
+ *                        每个连接只唤醒一个子进程，避免惊群
+ *   DISPATCH_LEAST_LOADED 子进程共享监听 socket，连接数比最空闲的子进程多出
+ *                        LOAD_SLACK 以上的子进程暂时退出等待，新连接只落在
+ *                        较空闲的子进程上；不用 EPOLLEXCLUSIVE，因为过载而
+ *                        停下的子进程留在队列里的连接要能唤醒其他子进程
+ *   后三种方式父进程不再参与 accept，只管理子进程
+ */
+enum DispatchMode {
+    DISPATCH_PARENT = 0,
+    DISPATCH_REUSEPORT,
+    DISPATCH_EXCLUSIVE,
+    DISPATCH_LEAST_LOADED
+};
+
+// 解析命令行中的分配方式名字，不认识时返回 false
+static inline bool ParseDispatchMode(const char *name, DispatchMode *mode) {
+    static const char *names[] = { "parent", "reuseport",
+                                   "exclusive", "leastload" };
+    for (int i = 0; i < 4; ++i) {
+        if (strcmp(name, names[i]) == 0) {
+            *mode = static_cast<DispatchMode>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 请求耗时直方图的桶数，第 b 个桶计 [2^b, 2^(b+1)) 微秒，最后一个桶计更长的
+#define LATENCY_BUCKETS 24
+
+/*
+ * 子进程的状态和统计，放在父子进程共享的匿名映射中
+ *   每个子进程一个按缓存行对齐的槽，子进程之间不会伪共享。
+ *   子进程是自己槽中计数的唯一写者，用原子读写、不加锁；父进程只读，
+ *   另外维护 pid、restarts 和 live（可以接受新连接，创建和回收子进程时设置，
+ *   子进程开始排空时自己清零）。
+ *   conns 是当前连接数，DISPATCH_LEAST_LOADED 据此分配连接；
+ *   其他计数是累计值，子进程重启后接着计
+ */
+struct alignas(64) ChildStats {
+    long     conns;
+    int      accepting;     // 监听 socket 在它的 epoll 事件表中
+    int      live;
+    pid_t    pid;
+    uint64_t restarts;
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t latency[LATENCY_BUCKETS];
+};
+
 /*
  * 表示一个子进程的类，
  * pid_ 是目标子进程的 pid，
@@ -28,11 +108,23 @@ using SA = struct sockaddr;
  */
 class Process {
 public:
-    Process() : pid_(-1) { }
+    Process()
+        : pid_(-1), listenfd_(-1), wakefd_(-1), draining_(false),
+          started_ms_(0), respawn_ms_(0), backoff_ms_(0) { }
 
 public:
     pid_t pid_;
     int   pipefd_[2];
+    // DISPATCH_REUSEPORT 下该子进程自己的监听 socket
+    int   listenfd_;
+    // DISPATCH_LEAST_LOADED 下让该子进程重新比较负载的 eventfd
+    int   wakefd_;
+    // 父进程已让它排空，不再给它分配连接
+    bool  draining_;
+    // 启动时间，到期重启的时间（0 表示没有安排），下一次重启前的等待时间
+    int64_t started_ms_;
+    int64_t respawn_ms_;
+    int     backoff_ms_;
 };
 
 /*
@@ -41,28 +133,59 @@ public:
 template <typename T>
 class ProcessPool {
 private:
-    ProcessPool(int listenfd, int process_number = 8);
+    ProcessPool(int listenfd, int process_number,
+                const std::vector<int> &cpus, DispatchMode mode);
 public:
     // 单例模式，保证程序最多创建一个 ProcessPool 对象，这是程序正确处理信号的必要条件
-    static ProcessPool<T> *Create(int listenfd, int process_number = 8) {
+    // cpus 非空时第 i 个子进程被绑定到 cpus[i % cpus.size()] 上
+    // DISPATCH_REUSEPORT 要求 listenfd 在 bind 之前设置了 SO_REUSEPORT
+    static ProcessPool<T> *Create(int listenfd, int process_number = 8,
+                                  const std::vector<int> &cpus =
+                                      std::vector<int>(),
+                                  DispatchMode mode = DISPATCH_EXCLUSIVE) {
         if (!instance_) {
-            instance_ = new ProcessPool<T>(listenfd, process_number);
+            instance_ = new ProcessPool<T>(listenfd, process_number,
+                                           cpus, mode);
         }
         return instance_;
     }
 
-    ~ProcessPool() { delete[] sub_process_; }
+    ~ProcessPool() {
+        delete[] sub_process_;
+        munmap(stats_, sizeof(ChildStats) * MAX_PROCESS_NUMBER);
+    }
+
+    // 输出所有子进程的统计和汇总，父进程收到 SIGUSR1 时调用
+    void DumpStats(FILE *out) const;
+
+    // 允许 SIGUSR2 热升级：以 argv 重新执行程序文件，argv 要在进程池存在期间有效
+    void EnableUpgrade(char *const argv[]) { argv_ = argv; }
 
     void Run();
 
 private:
     void SetupSigPipe();
+    void CreateReuseportListeners();
+    void AttachCpuSteering();
 
+    void SpawnChild(int i);
+    void ScheduleRespawn(int i);
+    int  NextRespawnWait() const;
+    void RespawnDue();
+    void ReapChildren();
+    void StopChildren(int sig);
+    void StartUpgrade();
+    void FinishUpgrade();
     void ProcessNewConnInParent(int &sub_process_counter);
     void ProcessSigInParent();
     void RunParent();
 
     int  ProcessNewConnInChild(int sockfd, T *const users);
+    void AcceptConns(T *const users);
+    bool Overloaded() const;
+    void StopAccepting();
+    void BalanceLoad();
+    void StartDrain();
     int  ProcessSigInChild();
     void CoreRunChild(const struct epoll_event *events,
                       int i, int pipefd, T *const users);
@@ -73,6 +196,15 @@ private:
     static const int MAX_PROCESS_NUMBER = 16;
     // 每个子进程最多可以处理的客户数量
     static const int USER_PER_PROCESS = 65536;
+    // DISPATCH_LEAST_LOADED 下允许超出最空闲子进程的连接数
+    static const long LOAD_SLACK = 2;
+    // 子进程退出后重启的等待时间，连续崩溃时从最小值开始加倍（毫秒）
+    static const int RESPAWN_MIN_MS = 100;
+    static const int RESPAWN_MAX_MS = 30000;
+    // 子进程运行了这么久才退出，就不算连续崩溃，等待时间恢复到最小值
+    static const int STABLE_MS = 10000;
+    // 排空的子进程最多等待已有连接这么久（毫秒）
+    static const int DRAIN_TIMEOUT_MS = 30000;
     // epoll 最多可以处理的事件数
     static const int MAX_EVENT_NUMBER = 10000;
     // 进程池中的进程总数
@@ -85,8 +217,28 @@ private:
     int listenfd_;
     // 子进程通过 stop 来决定是否停止运行
     int stop_;
+    // 父进程正在停止：不再重启子进程，子进程全部退出后父进程退出
+    bool stopping_;
+    // 子进程正在排空：不再接受新连接，已有连接结束后退出
+    bool draining_;
+    int64_t drain_deadline_;
+    // 热升级用的命令行，nullptr 表示不支持
+    char *const *argv_;
+    // 正在启动的新主进程及与它通信的 unix socket
+    pid_t upgrade_pid_;
+    int   upgrade_sock_;
     // 保存所有子进程的描述信息
     Process *sub_process_;
+    // 子进程绑定的 CPU 列表，为空表示不绑定
+    std::vector<int> cpus_;
+    // 新连接的分配方式
+    DispatchMode mode_;
+    // 子进程 accept 所用的监听 socket，DISPATCH_PARENT 下为 -1
+    int accept_fd_;
+    // 监听 socket 是否在本进程的 epoll 事件表中
+    bool accepting_;
+    // 所有子进程的状态和统计，父子进程共享
+    ChildStats *stats_;
     // 进程池静态对象
     static ProcessPool<T> *instance_;
 };
@@ -97,6 +249,81 @@ ProcessPool<T> *ProcessPool<T>::instance_ = nullptr;
 // 用于处理信号的管道，以实现统一事件源，简称为信号管道
 static int sig_pipefd[2];
 
+// 热升级时新主进程从旧主进程收到的监听 socket，以及回复旧主进程的 unix socket
+static std::vector<int> inherited_listeners;
+static int upgrade_fd = -1;
+
+static int64_t NowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * 热升级：新主进程在创建监听 socket 之前调用，
+ * 返回 true 时 listeners 中是旧主进程传来的监听 socket，不要再 bind，
+ * 第一个用作 Create 的 listenfd；不是由旧主进程启动的返回 false
+ */
+static bool InheritListeners(std::vector<int> &listeners) {
+    const char *env = getenv(UPGRADE_ENV);
+    if (!env) {
+        return false;
+    }
+    int fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+
+    int count = 0;
+    struct iovec iov = { &count, sizeof(count) };
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTEN_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = nullptr;
+    if (recvmsg(fd, &msg, 0) == sizeof(count)) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+    }
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS || count < 1) {
+        fprintf(OUT, "no listen socket from the old master\n");
+        close(fd);
+        return false;
+    }
+
+    const int *fds = (const int *)CMSG_DATA(cmsg);
+    listeners.assign(fds, fds + count);
+    inherited_listeners = listeners;
+    upgrade_fd = fd;
+    return true;
+}
+
+/*
+ * 通过 unix socket 把监听 socket 交给新主进程
+ */
+static bool SendListeners(int sock, const std::vector<int> &fds) {
+    int count = fds.size();
+    struct iovec iov = { &count, sizeof(count) };
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTEN_FDS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * count);
+
+    return sendmsg(sock, &msg, 0) == sizeof(count);
+}
+
 static int SetNonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
     int new_option = old_option | O_NONBLOCK;
@@ -112,9 +339,58 @@ static void AddFD(int epollfd, int fd) {
     SetNonblocking(fd);
 }
 
+// 子进程中指向自己的统计槽，父进程中为 nullptr
+static ChildStats *child_stats = nullptr;
+
+// 唯一写者的计数：读出加上再写回，不需要带锁前缀的原子加
+template <typename C>
+static inline void StatAdd(C *counter, C n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static void CountAccepted() {
+    StatAdd(&child_stats->conns, 1L);
+    StatAdd(&child_stats->accepted, (uint64_t)1);
+}
+
 static void RemoveFD(int epollfd, int fd) {
     epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
     close(fd);
+    if (child_stats) {
+        StatAdd(&child_stats->conns, -1L);
+        StatAdd(&child_stats->closed, (uint64_t)1);
+    }
+}
+
+/*
+ * 模板参数 T 处理完一个请求后调用，usec 是处理耗时，failed 表示出错
+ */
+static void PoolCountRequest(int64_t usec, bool failed) {
+    if (!child_stats) {
+        return;
+    }
+    StatAdd(&child_stats->requests, (uint64_t)1);
+    if (failed) {
+        StatAdd(&child_stats->errors, (uint64_t)1);
+    }
+    int bucket = usec > 1 ? 63 - __builtin_clzll((uint64_t)usec) : 0;
+    if (bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+    StatAdd(&child_stats->latency[bucket], (uint64_t)1);
+}
+
+/*
+ * 监听 socket 以水平触发方式注册，一次唤醒没有 accept 完的连接会再次唤醒；
+ * exclusive 为 true 时同一 socket 上的多个 epoll 每次只唤醒一个
+ */
+static void AddListenFD(int epollfd, int fd, bool exclusive) {
+    struct epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | (exclusive ? (uint32_t)EPOLLEXCLUSIVE : 0u);
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    SetNonblocking(fd);
 }
 
 static void SigHandler(int sig) {
@@ -138,37 +414,257 @@ static void AddSig(int sig, void(*Handler)(int), bool restart = true) {
 
 /*
  * 进程池构造函数
- *   参数 listenfd 是监听 socket，它必须在创建进程池之前被创建，
- *   否则子进程无法直接引用它。
+ *   参数 listenfd 是监听 socket，它必须在创建进程池之前被创建（或由
+ *   InheritListeners 从旧主进程继承），否则子进程无法直接引用它。
  *   参数 process_number 指定进程池中子进程的数量
+ *   参数 mode 指定新连接的分配方式
  */
 template <typename T>
-ProcessPool<T>::ProcessPool(int listenfd, int process_number)
-    : listenfd_(listenfd),
-      process_number_(process_number),
+ProcessPool<T>::ProcessPool(int listenfd, int process_number,
+                            const std::vector<int> &cpus, DispatchMode mode)
+    : process_number_(process_number),
       idx_(-1),
-      stop_(false) {
+      listenfd_(listenfd),
+      stop_(false),
+      stopping_(false),
+      draining_(false),
+      drain_deadline_(0),
+      argv_(nullptr),
+      upgrade_pid_(-1),
+      upgrade_sock_(-1),
+      cpus_(cpus),
+      mode_(mode),
+      accept_fd_(-1),
+      accepting_(false) {
     assert((process_number > 0) && (process_number <= MAX_PROCESS_NUMBER));
 
     sub_process_ = new Process[process_number];
     assert(sub_process_);
 
+    stats_ = static_cast<ChildStats *>(
+        mmap(NULL, sizeof(ChildStats) * MAX_PROCESS_NUMBER,
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    assert(stats_ != MAP_FAILED);
+    memset(stats_, 0, sizeof(ChildStats) * MAX_PROCESS_NUMBER);
+
+    if (mode_ == DISPATCH_REUSEPORT) {
+        CreateReuseportListeners();
+    }
+    // 热升级继承来的其他监听 socket 用不上了
+    for (size_t i = 1; i < inherited_listeners.size(); ++i) {
+        if (mode_ != DISPATCH_REUSEPORT || (int)i >= process_number_) {
+            close(inherited_listeners[i]);
+        }
+    }
+    if (mode_ == DISPATCH_LEAST_LOADED) {
+        for (int i = 0; i < process_number; ++i) {
+            sub_process_[i].wakefd_ = eventfd(0, EFD_NONBLOCK);
+            assert(sub_process_[i].wakefd_ >= 0);
+        }
+    }
+
     // 创建 process_number 个子进程，并建立它们和父进程之间的管道
     for (int i = 0; i < process_number; ++i) {
-        int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sub_process_[i].pipefd_);
-        assert(ret == 0);
+        SpawnChild(i);
+        if (idx_ != -1) {
+            break;
+        }
+    }
+}
+
+/*
+ * 创建第 i 个子进程，子进程中返回时 idx_ 为 i；
+ *   DISPATCH_REUSEPORT 下父进程一直持有所有子进程的监听 socket，
+ *   重启的子进程接着使用原来的 socket，排在它队列中的连接不会丢失
+ */
+template <typename T>
+void ProcessPool<T>::SpawnChild(int i) {
+    Process &child = sub_process_[i];
+    int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, child.pipefd_);
+    assert(ret == 0);
+
+    // 上一个子进程留下的连接已随它关闭
+    stats_[i].conns = 0;
+    stats_[i].live = 1;
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(child.pipefd_[0]);
+        close(child.pipefd_[1]);
+        stats_[i].live = 0;
+        ScheduleRespawn(i);
+        return;
+    }
+    if (pid > 0) {
+        close(child.pipefd_[1]);
+        if (child.started_ms_ != 0) {
+            ++stats_[i].restarts;
+        }
+        stats_[i].pid = pid;
+        child.pid_ = pid;
+        child.draining_ = false;
+        child.started_ms_ = NowMs();
+        child.respawn_ms_ = 0;
+        return;
+    }
 
-        sub_process_[i].pid_ = fork();
-        assert(sub_process_[i].pid_ >= 0);
-        if (sub_process_[i].pid_ > 0) {
-            close(sub_process_[i].pipefd_[1]);
+    // 子进程只留下自己的管道和监听 socket
+    close(child.pipefd_[0]);
+    idx_ = i;
+    for (int j = 0; j < process_number_; ++j) {
+        if (j == i) {
             continue;
         }
-        else {
-            close(sub_process_[i].pipefd_[0]);
-            idx_ = i;
-            break;
+        if (sub_process_[j].pid_ != -1) {
+            close(sub_process_[j].pipefd_[0]);
+        }
+        if (mode_ == DISPATCH_REUSEPORT) {
+            close(sub_process_[j].listenfd_);
+        }
+    }
+    if (upgrade_sock_ != -1) {
+        close(upgrade_sock_);
+    }
+    if (upgrade_fd != -1) {
+        close(upgrade_fd);
+        upgrade_fd = -1;
+    }
+}
+
+/*
+ * 安排重启退出的第 i 个子进程：连续崩溃时等待时间加倍，避免反复 fork
+ */
+template <typename T>
+void ProcessPool<T>::ScheduleRespawn(int i) {
+    Process &child = sub_process_[i];
+    int64_t now = NowMs();
+    if (child.backoff_ms_ == 0 || now - child.started_ms_ >= STABLE_MS) {
+        child.backoff_ms_ = RESPAWN_MIN_MS;
+    }
+    else if (child.backoff_ms_ < RESPAWN_MAX_MS) {
+        child.backoff_ms_ *= 2;
+        if (child.backoff_ms_ > RESPAWN_MAX_MS) {
+            child.backoff_ms_ = RESPAWN_MAX_MS;
+        }
+    }
+    child.respawn_ms_ = now + child.backoff_ms_;
+    printf("respawn child %d in %d ms\n", i, child.backoff_ms_);
+}
+
+// 距最早的重启还有多少毫秒，没有要重启的子进程时返回 -1
+template <typename T>
+int ProcessPool<T>::NextRespawnWait() const {
+    int64_t now = NowMs();
+    int wait = -1;
+    for (int i = 0; i < process_number_; ++i) {
+        int64_t at = sub_process_[i].respawn_ms_;
+        if (sub_process_[i].pid_ == -1 && at != 0) {
+            int left = at > now ? (int)(at - now) : 0;
+            if (wait == -1 || left < wait) {
+                wait = left;
+            }
+        }
+    }
+    return wait;
+}
+
+template <typename T>
+void ProcessPool<T>::RespawnDue() {
+    int64_t now = NowMs();
+    for (int i = 0; i < process_number_ && !stopping_; ++i) {
+        Process &child = sub_process_[i];
+        if (child.pid_ == -1 && child.respawn_ms_ != 0 &&
+            child.respawn_ms_ <= now) {
+            SpawnChild(i);
+            if (idx_ != -1) {
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * 为子进程 1..n-1 创建绑定到同一地址的 SO_REUSEPORT 监听 socket，
+ * 子进程 0 使用传入的 listenfd，热升级时优先沿用继承来的 socket；
+ * listenfd 没有设置 SO_REUSEPORT 时改用 DISPATCH_EXCLUSIVE
+ */
+template <typename T>
+void ProcessPool<T>::CreateReuseportListeners() {
+    int reuse = 0;
+    socklen_t len = sizeof(reuse);
+    getsockopt(listenfd_, SOL_SOCKET, SO_REUSEPORT, &reuse, &len);
+    if (!reuse) {
+        fprintf(OUT, "listen socket has no SO_REUSEPORT, "
+                     "using exclusive dispatch\n");
+        mode_ = DISPATCH_EXCLUSIVE;
+        return;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int ret = getsockname(listenfd_, (SA *)&addr, &addr_len);
+    assert(ret == 0);
+
+    // 按序号依次 listen，子进程 i 的 socket 在 reuseport 组中的下标就是 i
+    sub_process_[0].listenfd_ = listenfd_;
+    for (int i = 1; i < process_number_; ++i) {
+        if (i < (int)inherited_listeners.size()) {
+            sub_process_[i].listenfd_ = inherited_listeners[i];
+            continue;
         }
+        int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        ret = bind(fd, (SA *)&addr, addr_len);
+        assert(ret != -1);
+        ret = listen(fd, SOMAXCONN);
+        assert(ret != -1);
+        sub_process_[i].listenfd_ = fd;
+    }
+
+    if (!cpus_.empty()) {
+        AttachCpuSteering();
+    }
+}
+
+/*
+ * 子进程绑定了 CPU 时，让内核把连接交给收到它的 CPU 上的子进程：
+ *   CBPF 程序读出当前 CPU（即处理该 SYN 的 CPU），查表得到绑定在该 CPU 上的
+ *   第一个子进程的下标；没有子进程绑定在该 CPU 上时返回 cpu % n
+ */
+template <typename T>
+void ProcessPool<T>::AttachCpuSteering() {
+    std::vector<struct sock_filter> code;
+    code.push_back((struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 (__u32)(SKF_AD_OFF + SKF_AD_CPU)));
+
+    std::vector<int> seen;
+    for (int i = 0; i < process_number_; ++i) {
+        int cpu = PickCpu(cpus_, i);
+        bool dup = false;
+        for (int c : seen) {
+            dup = dup || c == cpu;
+        }
+        if (cpu == -1 || dup) {
+            continue;
+        }
+        seen.push_back(cpu);
+        code.push_back((struct sock_filter)
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (__u32)cpu, 0, 1));
+        code.push_back((struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (__u32)i));
+    }
+    code.push_back((struct sock_filter)
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (__u32)process_number_));
+    code.push_back((struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0));
+
+    struct sock_fprog prog;
+    prog.len = code.size();
+    prog.filter = code.data();
+    if (setsockopt(listenfd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(prog)) == -1) {
+        perror("SO_ATTACH_REUSEPORT_CBPF");
     }
 }
 
@@ -191,6 +687,9 @@ void ProcessPool<T>::SetupSigPipe() {
     AddSig(SIGCHLD, SigHandler);
     AddSig(SIGTERM, SigHandler);
     AddSig(SIGINT,  SigHandler);
+    AddSig(SIGQUIT, SigHandler);
+    AddSig(SIGUSR1, SigHandler);
+    AddSig(SIGUSR2, SigHandler);
     AddSig(SIGPIPE, SIG_IGN);
 }
 
@@ -227,6 +726,7 @@ int ProcessPool<T>::ProcessNewConnInChild(int sockfd, T *const users) {
             return -1;
         }
         AddFD(epollfd_, connfd);
+        CountAccepted();
         // 模板类 T 必须实现 init 方法，以初始化一个客户连接。
         // 我们直接使用 connfd 来索引逻辑处理对象（T 类型的对象），以提高程序效率
         users[connfd].Init(epollfd_, connfd, cli_addr);
@@ -235,6 +735,114 @@ int ProcessPool<T>::ProcessNewConnInChild(int sockfd, T *const users) {
     return 0;
 }
 
+/*
+ * 监听 socket 可读时由子进程自己 accept，直到没有新连接；
+ * DISPATCH_LEAST_LOADED 下负载超出后就停下，剩下的连接留给别的子进程
+ */
+template <typename T>
+void ProcessPool<T>::AcceptConns(T *const users) {
+    while (!draining_ && !(mode_ == DISPATCH_LEAST_LOADED && Overloaded())) {
+        struct sockaddr_in cli_addr;
+        socklen_t cli_addr_len = sizeof(cli_addr);
+        int connfd = accept(accept_fd_, (SA *)&cli_addr, &cli_addr_len);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("accept error");
+            }
+            break;
+        }
+        if (connfd >= USER_PER_PROCESS) {
+            close(connfd);
+            continue;
+        }
+        AddFD(epollfd_, connfd);
+        CountAccepted();
+        users[connfd].Init(epollfd_, connfd, cli_addr);
+    }
+}
+
+/*
+ * 本子进程的连接数是否比最空闲的存活子进程多出 LOAD_SLACK 以上
+ */
+template <typename T>
+bool ProcessPool<T>::Overloaded() const {
+    long mine = __atomic_load_n(&stats_[idx_].conns, __ATOMIC_RELAXED);
+    long least = mine;
+    for (int i = 0; i < process_number_; ++i) {
+        if (__atomic_load_n(&stats_[i].live, __ATOMIC_RELAXED)) {
+            long conns = __atomic_load_n(&stats_[i].conns, __ATOMIC_RELAXED);
+            if (conns < least) {
+                least = conns;
+            }
+        }
+    }
+    return mine > least + LOAD_SLACK;
+}
+
+/*
+ * 把监听 socket 移出 epoll 事件表，内核就只唤醒其他子进程。
+ *   DISPATCH_LEAST_LOADED 下要叫醒同样退出了等待的子进程重新比较：
+ *   它们是按旧的负载退出的，本进程的连接数增加后它们可能已是最空闲的，
+ *   否则可能没有任何子进程在等待新连接
+ */
+template <typename T>
+void ProcessPool<T>::StopAccepting() {
+    if (!accepting_) {
+        return;
+    }
+    epoll_ctl(epollfd_, EPOLL_CTL_DEL, accept_fd_, NULL);
+    accepting_ = false;
+    __atomic_store_n(&stats_[idx_].accepting, 0, __ATOMIC_RELAXED);
+    if (mode_ != DISPATCH_LEAST_LOADED) {
+        return;
+    }
+
+    uint64_t one = 1;
+    for (int i = 0; i < process_number_; ++i) {
+        if (i != idx_ &&
+            __atomic_load_n(&stats_[i].live, __ATOMIC_RELAXED) &&
+            !__atomic_load_n(&stats_[i].accepting, __ATOMIC_RELAXED)) {
+            ssize_t ret = write(sub_process_[i].wakefd_, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+}
+
+/*
+ * DISPATCH_LEAST_LOADED：过载时停止等待新连接，负载降下来后再把监听
+ * socket 加回 epoll 事件表
+ */
+template <typename T>
+void ProcessPool<T>::BalanceLoad() {
+    bool overloaded = Overloaded();
+    if (overloaded && accepting_) {
+        StopAccepting();
+    }
+    else if (!overloaded && !accepting_) {
+        // 水平触发，队列中已有的连接会立即报告
+        AddListenFD(epollfd_, accept_fd_, false);
+        accepting_ = true;
+        __atomic_store_n(&stats_[idx_].accepting, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * 排空：不再接受新连接，已有连接都关闭（或等满 DRAIN_TIMEOUT_MS）后退出
+ */
+template <typename T>
+void ProcessPool<T>::StartDrain() {
+    if (draining_) {
+        return;
+    }
+    draining_ = true;
+    drain_deadline_ = NowMs() + DRAIN_TIMEOUT_MS;
+    __atomic_store_n(&stats_[idx_].live, 0, __ATOMIC_RELAXED);
+    StopAccepting();
+}
+
 template <typename T>
 int ProcessPool<T>::ProcessSigInChild() {
     char signals[1024];
@@ -256,6 +864,9 @@ int ProcessPool<T>::ProcessSigInChild() {
             case SIGINT:
                 stop_ = true;
                 break;
+            case SIGQUIT:
+                StartDrain();
+                break;
             default:
                 break;
             }
@@ -269,7 +880,16 @@ template <typename T>
 void ProcessPool<T>::CoreRunChild(const struct epoll_event *events,
                                   int i, int pipefd, T *const users) {
     int sockfd = events[i].data.fd;
-    if ((sockfd == pipefd) && (events[i].events & EPOLLIN)) {
+    if (sockfd == accept_fd_) {
+        AcceptConns(users);
+    }
+    else if (sockfd == sub_process_[idx_].wakefd_) {
+        // 只需清零计数，主循环下一轮会重新比较负载
+        uint64_t count;
+        ssize_t ret = read(sockfd, &count, sizeof(count));
+        (void)ret;
+    }
+    else if ((sockfd == pipefd) && (events[i].events & EPOLLIN)) {
         int ret = ProcessNewConnInChild(sockfd, users);
         if (ret == -1) {
             fprintf(OUT, "ProcessNewConnInChild error\n");
@@ -292,19 +912,49 @@ void ProcessPool<T>::CoreRunChild(const struct epoll_event *events,
 
 template <typename T>
 void ProcessPool<T>::RunChild() {
+    // 先绑定 CPU 再分配 users，使连接对象落在本地 NUMA 节点上
+    int cpu = PickCpu(cpus_, idx_);
+    if (cpu != -1) {
+        PinSelfToCpu(cpu);
+    }
+
     SetupSigPipe();
+    child_stats = &stats_[idx_];
 
     // 每个子进程都通过其在进程池中的序号值 idx 找到与父进程通信的管道
     int pipefd = sub_process_[idx_].pipefd_[1];
-    // 子进程需要监听管道文件描述符 pipefd，因为父进程将通过它来通知子进程 accept 新连接
+    // DISPATCH_PARENT 下父进程通过管道 pipefd 通知子进程 accept 新连接，
+    // 其他方式下子进程直接等待监听 socket
     AddFD(epollfd_, pipefd);
+    if (mode_ != DISPATCH_PARENT) {
+        accept_fd_ = mode_ == DISPATCH_REUSEPORT ? sub_process_[idx_].listenfd_
+                                                 : listenfd_;
+        AddListenFD(epollfd_, accept_fd_, mode_ == DISPATCH_EXCLUSIVE);
+        accepting_ = true;
+        __atomic_store_n(&stats_[idx_].accepting, 1, __ATOMIC_RELAXED);
+    }
+    if (mode_ == DISPATCH_LEAST_LOADED) {
+        AddFD(epollfd_, sub_process_[idx_].wakefd_);
+    }
 
     struct epoll_event events[MAX_EVENT_NUMBER];
     T *users = new T[USER_PER_PROCESS];
     assert(users);
 
-    while (stop_) {
-        int number = epoll_wait(epollfd_, events, MAX_EVENT_NUMBER, -1);
+    while (!stop_) {
+        int timeout = -1;
+        if (draining_) {
+            int64_t left = drain_deadline_ - NowMs();
+            if (__atomic_load_n(&child_stats->conns, __ATOMIC_RELAXED) <= 0 ||
+                left <= 0) {
+                break;
+            }
+            timeout = (int)left;
+        }
+        else if (mode_ == DISPATCH_LEAST_LOADED) {
+            BalanceLoad();
+        }
+        int number = epoll_wait(epollfd_, events, MAX_EVENT_NUMBER, timeout);
         if ((number < 0) && (errno != EINTR)) {
             perror("epoll failure");
             break;
@@ -324,12 +974,12 @@ template <typename T>
 void ProcessPool<T>::ProcessNewConnInParent(int &sub_process_counter) {
     int i = sub_process_counter;
     do {
-        if (sub_process_[i].pid_ != -1) break;
+        if (sub_process_[i].pid_ != -1 && !sub_process_[i].draining_) break;
         i = (i + 1) % process_number_;
     } while (i != sub_process_counter);
 
-    if (sub_process_[i].pid_ == -1) {
-        stop_ = true;
+    // 所有子进程都在重启或排空，连接留在队列中
+    if (sub_process_[i].pid_ == -1 || sub_process_[i].draining_) {
         return;
     }
 
@@ -340,6 +990,209 @@ void ProcessPool<T>::ProcessNewConnInParent(int &sub_process_counter) {
     printf("send request to child %d\n", i);
 }
 
+/*
+ * 回收退出的子进程并安排重启；停止过程中所有子进程都退出后父进程退出
+ */
+template <typename T>
+void ProcessPool<T>::ReapChildren() {
+    pid_t pid;
+    int stat;
+    while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+        if (pid == upgrade_pid_) {
+            printf("new master %d exited\n", pid);
+            upgrade_pid_ = -1;
+            FinishUpgrade();
+            continue;
+        }
+        for (int j = 0; j < process_number_; ++j) {
+            // 如果进程池中第 j 个子进程退出了，则主进程关闭相应的通信管道，
+            // 并设置相应的 pid 为-1，以标记该子进程已经退出
+            if (sub_process_[j].pid_ == pid) {
+                printf("child %d join\n", j);
+                close(sub_process_[j].pipefd_[0]);
+                sub_process_[j].pid_ = -1;
+                __atomic_store_n(&stats_[j].live, 0, __ATOMIC_RELAXED);
+                if (!stopping_) {
+                    ScheduleRespawn(j);
+                }
+            }
+        }
+    }
+
+    if (stopping_) {
+        stop_ = true;
+        for (int j = 0; j < process_number_; ++j) {
+            if (sub_process_[j].pid_ != -1) {
+                stop_ = false;
+            }
+        }
+    }
+}
+
+template <typename T>
+void ProcessPool<T>::DumpStats(FILE *out) const {
+    ChildStats total;
+    memset(&total, 0, sizeof(total));
+    fprintf(out, "%5s %7s %4s %7s %10s %10s %10s %8s %8s\n", "child", "pid",
+            "live", "conns", "accepted", "closed", "requests", "errors",
+            "restarts");
+    for (int i = 0; i < process_number_; ++i) {
+        // 逐个字段原子读取，各字段之间不保证是同一时刻的值
+        ChildStats c;
+        c.pid      = __atomic_load_n(&stats_[i].pid, __ATOMIC_RELAXED);
+        c.live     = __atomic_load_n(&stats_[i].live, __ATOMIC_RELAXED);
+        c.conns    = __atomic_load_n(&stats_[i].conns, __ATOMIC_RELAXED);
+        c.accepted = __atomic_load_n(&stats_[i].accepted, __ATOMIC_RELAXED);
+        c.closed   = __atomic_load_n(&stats_[i].closed, __ATOMIC_RELAXED);
+        c.requests = __atomic_load_n(&stats_[i].requests, __ATOMIC_RELAXED);
+        c.errors   = __atomic_load_n(&stats_[i].errors, __ATOMIC_RELAXED);
+        c.restarts = __atomic_load_n(&stats_[i].restarts, __ATOMIC_RELAXED);
+        fprintf(out, "%5d %7d %4d %7ld %10lu %10lu %10lu %8lu %8lu\n", i,
+                (int)c.pid, c.live, c.conns, c.accepted, c.closed,
+                c.requests, c.errors, c.restarts);
+
+        total.conns    += c.conns;
+        total.accepted += c.accepted;
+        total.closed   += c.closed;
+        total.requests += c.requests;
+        total.errors   += c.errors;
+        total.restarts += c.restarts;
+        for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+            total.latency[b] +=
+                __atomic_load_n(&stats_[i].latency[b], __ATOMIC_RELAXED);
+        }
+    }
+    fprintf(out, "%5s %7s %4s %7ld %10lu %10lu %10lu %8lu %8lu\n", "total",
+            "", "", total.conns, total.accepted, total.closed,
+            total.requests, total.errors, total.restarts);
+
+    if (total.requests == 0) {
+        fflush(out);
+        return;
+    }
+    // 百分位取所在桶的上界
+    const double percents[] = { 50, 90, 99, 99.9 };
+    fprintf(out, "latency");
+    for (double pct : percents) {
+        uint64_t want = (uint64_t)(total.requests * pct / 100);
+        uint64_t seen = 0;
+        int b = 0;
+        for ( ; b < LATENCY_BUCKETS - 1; ++b) {
+            seen += total.latency[b];
+            if (seen > want) {
+                break;
+            }
+        }
+        fprintf(out, "  p%g <%luus", pct, 2UL << b);
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+/*
+ * 停止进程池：SIGTERM 让子进程立即退出，SIGQUIT 让子进程排空后退出
+ */
+template <typename T>
+void ProcessPool<T>::StopChildren(int sig) {
+    stopping_ = true;
+    if (mode_ == DISPATCH_PARENT) {
+        epoll_ctl(epollfd_, EPOLL_CTL_DEL, listenfd_, NULL);
+    }
+    for (int j = 0; j < process_number_; ++j) {
+        sub_process_[j].respawn_ms_ = 0;
+        if (sub_process_[j].pid_ != -1) {
+            sub_process_[j].draining_ = true;
+            kill(sub_process_[j].pid_, sig);
+        }
+    }
+    // 没有子进程在运行时 ReapChildren 不会再被调用
+    ReapChildren();
+}
+
+/*
+ * 热升级（SIGUSR2）：用 argv_ 重新执行程序文件作为新主进程，
+ * 通过 unix socket 以 SCM_RIGHTS 把监听 socket 传给它；
+ * 新主进程的子进程都启动后它回复一个字节，旧主进程再排空自己的子进程并退出。
+ * 新主进程启动失败时旧主进程照常服务
+ */
+template <typename T>
+void ProcessPool<T>::StartUpgrade() {
+    if (!argv_ || upgrade_pid_ != -1 || stopping_) {
+        printf("upgrade ignored\n");
+        return;
+    }
+
+    std::vector<int> fds;
+    if (mode_ == DISPATCH_REUSEPORT) {
+        for (int i = 0; i < process_number_; ++i) {
+            fds.push_back(sub_process_[i].listenfd_);
+        }
+    }
+    else {
+        fds.push_back(listenfd_);
+    }
+
+    int sv[2];
+    if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("socketpair");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        // 新主进程只带着这个 unix socket 执行，监听 socket 从它收取
+        dup2(sv[1], 3);
+        close_range(4, ~0U, 0);
+        setenv(UPGRADE_ENV, "3", 1);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execvp(argv_[0], argv_);
+        perror("execvp");
+        _exit(1);
+    }
+
+    close(sv[1]);
+    upgrade_pid_ = pid;
+    upgrade_sock_ = sv[0];
+    if (!SendListeners(upgrade_sock_, fds)) {
+        perror("sendmsg");
+    }
+    AddFD(epollfd_, upgrade_sock_);
+    printf("upgrading, new master %d\n", pid);
+}
+
+/*
+ * 新主进程回复了就绪，或者关闭了 unix socket（启动失败）
+ */
+template <typename T>
+void ProcessPool<T>::FinishUpgrade() {
+    if (upgrade_sock_ == -1) {
+        return;
+    }
+    char ready = 0;
+    int ret = recv(upgrade_sock_, &ready, 1, 0);
+    if (ret < 0 && errno == EAGAIN) {
+        return;
+    }
+    epoll_ctl(epollfd_, EPOLL_CTL_DEL, upgrade_sock_, NULL);
+    close(upgrade_sock_);
+    upgrade_sock_ = -1;
+
+    if (ret == 1) {
+        printf("new master is ready, draining the children\n");
+        StopChildren(SIGQUIT);
+    }
+    else {
+        printf("upgrade failed, keep serving\n");
+    }
+}
+
 template <typename T>
 void ProcessPool<T>::ProcessSigInParent() {
     char signals[1024];
@@ -349,35 +1202,24 @@ void ProcessPool<T>::ProcessSigInParent() {
     for (int i = 0; i < ret; ++i) {
         switch (signals[i]) {
         case SIGCHLD:
-            pid_t pid;
-            int stat;
-            while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
-                for (int j = 0; j < process_number_; ++j) {
-                    // 如果进程池中第 i 个子进程退出了，则主进程关闭相应的通信管道，
-                    // 并设置相应的 pid 为-1，以标记该子进程已经退出
-                    if (sub_process_[j].pid_ == pid) {
-                        printf("child %d join\n", j);
-                        close(sub_process_[j].pipefd_[0]);
-                        sub_process_[j].pid_ = -1;
-                    }
-                }
-            }
-            // 如果所有的子进程都退出了，则父进程也退出
-            stop_ = true;
-            for (int j = 0; j < process_number_; ++j) {
-                if (sub_process_[j].pid_ != -1) {
-                    stop_ = false;
-                }
-            }
+            ReapChildren();
             break;
         case SIGTERM:
         case SIGINT:
             // 如果是父进程收到终止信号，则杀死所有子进程，并等待它们全部结束。
             printf("kill all the child now\n");
-            for (int j = 0; j < process_number_; ++j) {
-                int pid = sub_process_[j].pid_;
-                if (pid != -1) kill(pid, SIGTERM);
-            }
+            StopChildren(SIGTERM);
+            break;
+        case SIGQUIT:
+            // 优雅退出：子进程处理完已有连接后退出
+            printf("drain all the child now\n");
+            StopChildren(SIGQUIT);
+            break;
+        case SIGUSR1:
+            DumpStats(OUT);
+            break;
+        case SIGUSR2:
+            StartUpgrade();
             break;
         default:
             break;
@@ -390,13 +1232,25 @@ template <typename T>
 void ProcessPool<T>::RunParent() {
     SetupSigPipe();
 
-    AddFD(epollfd_, listenfd_);
+    // 只有 DISPATCH_PARENT 下父进程参与 accept
+    if (mode_ == DISPATCH_PARENT) {
+        AddFD(epollfd_, listenfd_);
+    }
+
+    // 由旧主进程热升级而来：子进程都已启动，通知旧主进程排空退出
+    if (upgrade_fd != -1) {
+        char ready = 1;
+        send(upgrade_fd, &ready, 1, 0);
+        close(upgrade_fd);
+        upgrade_fd = -1;
+    }
 
     epoll_event events[MAX_EVENT_NUMBER];
     int sub_process_counter = 0;
 
     while (!stop_) {
-        int number = epoll_wait(epollfd_, events, MAX_EVENT_NUMBER, -1);
+        int number = epoll_wait(epollfd_, events, MAX_EVENT_NUMBER,
+                                NextRespawnWait());
         if ((number < 0) && (errno != EINTR)) {
             perror("epoll_wait");
             break;
@@ -404,17 +1258,30 @@ void ProcessPool<T>::RunParent() {
 
         for (int i = 0; i < number; ++i) {
             int sockfd = events[i].data.fd;
-            if (sockfd == listenfd_) {
+            if (mode_ == DISPATCH_PARENT && sockfd == listenfd_) {
                 // 如果有新连接到来，采用 round robin 方式将其分配给一个子进程来处理
                 ProcessNewConnInParent(sub_process_counter);
             }
-            else if ((sockfd = sig_pipefd[0]) && (events[i].events & EPOLLIN)) {
+            else if ((sockfd == sig_pipefd[0]) && (events[i].events & EPOLLIN)) {
                 ProcessSigInParent();
             }
+            else if (sockfd == upgrade_sock_) {
+                FinishUpgrade();
+            }
             else {
                 ;
             }
         }
+
+        RespawnDue();
+        if (idx_ != -1) {
+            // 这里已是重启出的子进程，丢下父进程的事件表和信号管道
+            close(epollfd_);
+            close(sig_pipefd[0]);
+            close(sig_pipefd[1]);
+            RunChild();
+            return;
+        }
     }
 
     close(epollfd_);
@@ -0,0 +1,338 @@
+#include "wrap.h"
+#include "parse.h"
+
+#ifdef HTTPS
+
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+/*
+ *  TLS session resumption across the forked connection processes
+ *      every connection is served by a short-lived child, so OpenSSL's own
+ *      per-process cache and its random ticket keys die with it. Everything
+ *      resumption needs lives instead in one MAP_SHARED region created by
+ *      tls_session_init() before the listener forks:
+ *
+ *      - session ticket keys (stateless resumption, TLS 1.2 and 1.3): the
+ *        current key encrypts new tickets and is replaced every
+ *        tls_ticket_rotate seconds, the previous keys still decrypt, and a
+ *        ticket under an old key is renewed
+ *      - an optional session cache of tls_session_cache slots (session ids
+ *        of clients without ticket support), DER encoded sessions in a
+ *        direct-mapped table
+ *      - handshake counters, tls_session_account() adds each handshake and
+ *        a summary goes to syslog every tls_stats_every handshakes
+ *
+ *      A robust process-shared mutex guards keys and cache, a child killed
+ *      while holding it does not wedge the others. Counters are atomics.
+ */
+
+#define TICKET_KEYS      3          /* current + 2 still accepted */
+#define SESSION_DER_MAX  2048
+
+struct ticket_key {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    time_t created;                 /* 0 -> unused */
+};
+
+struct session_slot {
+    unsigned int  id_len;           /* 0 -> empty */
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    time_t        expires;
+    unsigned int  der_len;
+    unsigned char der[SESSION_DER_MAX];
+};
+
+struct tls_shared {
+    pthread_mutex_t lock;
+    int current;                    /* index into keys */
+    struct ticket_key keys[TICKET_KEYS];
+    struct tls_stats stats;
+    int slot_count;
+    struct session_slot slots[];
+};
+
+static struct tls_shared *shared = NULL;
+static long rotate_interval = 3600;
+static long stats_every = 1000;
+
+static void lock_shared(void) {
+    if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+        // the holder died, keys and slots are rewritten whole, go on
+        pthread_mutex_consistent(&shared->lock);
+    }
+}
+
+static void unlock_shared(void) {
+    pthread_mutex_unlock(&shared->lock);
+}
+
+/*
+ * called with the lock held
+ */
+static struct ticket_key *current_key(void) {
+    time_t now = time(NULL);
+    struct ticket_key *key = &shared->keys[shared->current];
+    if (key->created != 0 && now - key->created < rotate_interval) {
+        return key;
+    }
+
+    int next = key->created == 0 ? shared->current
+                                 : (shared->current + 1) % TICKET_KEYS;
+    struct ticket_key fresh;
+    if (RAND_bytes(fresh.name, sizeof(fresh.name)) != 1 ||
+        RAND_bytes(fresh.aes_key, sizeof(fresh.aes_key)) != 1 ||
+        RAND_bytes(fresh.hmac_key, sizeof(fresh.hmac_key)) != 1) {
+        return key->created ? key : NULL;
+    }
+    fresh.created = now;
+    shared->keys[next] = fresh;
+    shared->current = next;
+    __atomic_fetch_add(&shared->stats.key_rotations, 1, __ATOMIC_RELAXED);
+    return &shared->keys[next];
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_mac_t;
+
+static int set_mac_key(ticket_mac_t *hctx, unsigned char *hmac_key) {
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                  hmac_key, 32);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 "sha256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+typedef HMAC_CTX ticket_mac_t;
+
+static int set_mac_key(ticket_mac_t *hctx, unsigned char *hmac_key) {
+    return HMAC_Init_ex(hctx, hmac_key, 32, EVP_sha256(), NULL);
+}
+#endif
+
+/*
+ * enc = 1: pick the key for a new ticket, enc = 0: find the key a ticket
+ * was made with, 1 -> ok, 2 -> ok but issue a fresh ticket, 0 -> unknown
+ */
+static int ticket_key_cb(SSL *ssl, unsigned char key_name[16],
+                         unsigned char *iv, EVP_CIPHER_CTX *ctx,
+                         ticket_mac_t *hctx, int enc) {
+    struct ticket_key key;
+    int is_current = 0;
+
+    lock_shared();
+    if (enc) {
+        struct ticket_key *k = current_key();
+        if (k) {
+            key = *k;
+            is_current = 1;
+        }
+    }
+    else {
+        for (int i = 0; i < TICKET_KEYS; ++i) {
+            struct ticket_key *k = &shared->keys[i];
+            if (k->created != 0 && memcmp(k->name, key_name, 16) == 0 &&
+                time(NULL) - k->created < TICKET_KEYS * rotate_interval) {
+                key = *k;
+                is_current = i == shared->current ? 1 : 2;
+                break;
+            }
+        }
+    }
+    unlock_shared();
+
+    if (enc) {
+        if (!is_current || RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+            return -1;
+        }
+        memcpy(key_name, key.name, 16);
+        if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
+                               key.aes_key, iv) != 1 ||
+            set_mac_key(hctx, key.hmac_key) != 1) {
+            return -1;
+        }
+        __atomic_fetch_add(&shared->stats.tickets_issued, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    if (!is_current) {
+        __atomic_fetch_add(&shared->stats.tickets_unknown, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
+                           key.aes_key, iv) != 1 ||
+        set_mac_key(hctx, key.hmac_key) != 1) {
+        return -1;
+    }
+    if (is_current == 2) {
+        __atomic_fetch_add(&shared->stats.tickets_renewed, 1, __ATOMIC_RELAXED);
+    }
+    return is_current;
+}
+
+/* ---- shared session cache ---- */
+
+static struct session_slot *slot_of(const unsigned char *id, unsigned int len) {
+    unsigned int h = 2166136261u;
+    for (unsigned int i = 0; i < len; ++i) {
+        h ^= id[i];
+        h *= 16777619u;
+    }
+    return &shared->slots[h % shared->slot_count];
+}
+
+static int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(session, &id_len);
+    int der_len = i2d_SSL_SESSION(session, NULL);
+    if (id_len == 0 || der_len <= 0 || der_len > SESSION_DER_MAX) {
+        return 0;
+    }
+
+    unsigned char der[SESSION_DER_MAX];
+    unsigned char *p = der;
+    i2d_SSL_SESSION(session, &p);
+
+    lock_shared();
+    struct session_slot *slot = slot_of(id, id_len);
+    slot->id_len = id_len;
+    memcpy(slot->id, id, id_len);
+    slot->expires = SSL_SESSION_get_time(session) +
+                    SSL_SESSION_get_timeout(session);
+    slot->der_len = der_len;
+    memcpy(slot->der, der, der_len);
+    unlock_shared();
+
+    __atomic_fetch_add(&shared->stats.cache_stores, 1, __ATOMIC_RELAXED);
+    return 0;   /* we did not keep a reference */
+}
+
+static SSL_SESSION *get_session_cb(SSL *ssl, const unsigned char *id,
+                                   int id_len, int *copy) {
+    unsigned char der[SESSION_DER_MAX];
+    unsigned int der_len = 0;
+
+    *copy = 0;
+    lock_shared();
+    struct session_slot *slot = slot_of(id, id_len);
+    if (slot->id_len == (unsigned int)id_len &&
+        memcmp(slot->id, id, id_len) == 0 && slot->expires > time(NULL)) {
+        der_len = slot->der_len;
+        memcpy(der, slot->der, der_len);
+    }
+    unlock_shared();
+
+    const unsigned char *p = der;
+    SSL_SESSION *session = der_len ? d2i_SSL_SESSION(NULL, &p, der_len) : NULL;
+    __atomic_fetch_add(session ? &shared->stats.cache_hits
+                               : &shared->stats.cache_misses,
+                       1, __ATOMIC_RELAXED);
+    return session;
+}
+
+static void remove_session_cb(SSL_CTX *ctx, SSL_SESSION *session) {
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(session, &id_len);
+
+    lock_shared();
+    struct session_slot *slot = slot_of(id, id_len);
+    if (slot->id_len == id_len && memcmp(slot->id, id, id_len) == 0) {
+        slot->id_len = 0;
+    }
+    unlock_shared();
+}
+
+void tls_session_init(SSL_CTX *ctx) {
+    rotate_interval = Getconfig_int("tls_ticket_rotate", 3600);
+    stats_every = Getconfig_int("tls_stats_every", 1000);
+    long slot_count = Getconfig_int("tls_session_cache", 1024);
+    if (rotate_interval <= 0) rotate_interval = 3600;
+    if (slot_count < 0)       slot_count = 0;
+
+    size_t bytes = sizeof(struct tls_shared) +
+                   slot_count * sizeof(struct session_slot);
+    shared = Mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memset(shared, 0, sizeof(*shared));
+    shared->slot_count = slot_count;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    lock_shared();
+    current_key();
+    unlock_shared();
+
+    long timeout = Getconfig_int("tls_session_timeout", 3600);
+    SSL_CTX_set_timeout(ctx, timeout);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"twebs", 5);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+#endif
+
+    if (slot_count > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER |
+                                            SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+        SSL_CTX_sess_set_get_cb(ctx, get_session_cb);
+        SSL_CTX_sess_set_remove_cb(ctx, remove_session_cb);
+    }
+    else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+}
+
+void tls_session_get_stats(struct tls_stats *out) {
+    memset(out, 0, sizeof(*out));
+    if (shared == NULL) {
+        return;
+    }
+    out->handshakes     = __atomic_load_n(&shared->stats.handshakes, __ATOMIC_RELAXED);
+    out->resumed        = __atomic_load_n(&shared->stats.resumed, __ATOMIC_RELAXED);
+    out->tickets_issued = __atomic_load_n(&shared->stats.tickets_issued, __ATOMIC_RELAXED);
+    out->tickets_renewed = __atomic_load_n(&shared->stats.tickets_renewed, __ATOMIC_RELAXED);
+    out->tickets_unknown = __atomic_load_n(&shared->stats.tickets_unknown, __ATOMIC_RELAXED);
+    out->cache_stores   = __atomic_load_n(&shared->stats.cache_stores, __ATOMIC_RELAXED);
+    out->cache_hits     = __atomic_load_n(&shared->stats.cache_hits, __ATOMIC_RELAXED);
+    out->cache_misses   = __atomic_load_n(&shared->stats.cache_misses, __ATOMIC_RELAXED);
+    out->key_rotations  = __atomic_load_n(&shared->stats.key_rotations, __ATOMIC_RELAXED);
+}
+
+void tls_session_account(SSL *ssl) {
+    if (shared == NULL) {
+        return;
+    }
+    unsigned long n = __atomic_add_fetch(&shared->stats.handshakes, 1,
+                                         __ATOMIC_RELAXED);
+    if (SSL_session_reused(ssl)) {
+        __atomic_fetch_add(&shared->stats.resumed, 1, __ATOMIC_RELAXED);
+    }
+
+    if (stats_every > 0 && n % stats_every == 0) {
+        struct tls_stats s;
+        tls_session_get_stats(&s);
+        syslog(LOG_INFO, "tls: %lu handshakes, %lu resumed (%.1f%%), "
+               "tickets %lu issued %lu renewed %lu unknown, "
+               "cache %lu stores %lu hits %lu misses, %lu key rotations",
+               s.handshakes, s.resumed, 100.0 * s.resumed / s.handshakes,
+               s.tickets_issued, s.tickets_renewed, s.tickets_unknown,
+               s.cache_stores, s.cache_hits, s.cache_misses, s.key_rotations);
+    }
+}
+
+#endif
@@ -0,0 +1,531 @@
+/*
+ *  blogdump - decode and aggregate the binary access log of twebs
+ *
+ *      blogdump [-s] [-n top] [-j threads] log
+ *
+ *      log is the "binlog" path of config.ini, all of its segments
+ *      (log.000001, ...) and the url dictionary (log.urls) are read.
+ *      Without -s every record is printed as a text line, in order; with -s
+ *      a summary is printed instead: status counts, the top urls and the
+ *      latency percentiles.
+ *
+ *      The segments are mapped read only and cut into chunks of records,
+ *      worker threads take chunks off a shared counter. For the summary
+ *      each thread keeps its own histogram and url table, merged at the end;
+ *      for the text dump each chunk is formatted into its own buffer and the
+ *      main thread writes the buffers out in chunk order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "binlog.h"
+
+#define CHUNK_RECORDS 65536
+#define WINDOW        64            /* chunks formatted ahead of the writer */
+#define MAXLINE       8192
+
+/* latency histogram: exact below 128us, then 64 buckets per power of 2 */
+#define HIST_EXACT    128
+#define HIST_SUB      64
+#define HIST_BUCKETS  (HIST_EXACT + 25 * HIST_SUB)
+#define MAX_STATUS    600
+
+struct segment {
+    const struct binlog_header *header;
+    const struct binlog_record *records;
+    uint64_t count;                 /* claimed slots, capped at capacity */
+    size_t   bytes;
+};
+
+struct chunk {
+    const struct binlog_record *first;
+    uint64_t count;
+    char    *text;                  /* dump mode: formatted lines */
+    size_t   text_len;
+    int      done;
+};
+
+struct url_stat {
+    uint32_t id;
+    int      used;
+    uint64_t hits;
+    uint64_t bytes;
+    uint64_t latency;               /* sum, microseconds */
+};
+
+struct url_table {
+    struct url_stat *slots;
+    size_t cap;                     /* power of 2 */
+    size_t count;
+};
+
+struct summary {
+    uint64_t records;
+    uint64_t skipped;               /* slots claimed but never committed */
+    uint64_t bytes;
+    uint64_t first_us;
+    uint64_t last_us;
+    uint64_t status[MAX_STATUS];
+    uint64_t hist[HIST_BUCKETS];
+    struct url_table urls;
+};
+
+struct dict_entry {
+    uint32_t id;
+    char    *url;
+};
+
+static struct segment *segments = NULL;
+static int segment_count = 0;
+
+static struct chunk *chunks = NULL;
+static size_t chunk_count = 0;
+static size_t next_chunk = 0;       /* taken with an atomic add */
+
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  chunk_cond = PTHREAD_COND_INITIALIZER;
+static size_t written = 0;          /* chunks already written out */
+
+static struct dict_entry *dict = NULL;
+static size_t dict_cap = 0;
+
+static int summary_mode = 0;
+
+static const char *method_name[] = { "-", "GET", "POST", "HEAD" };
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s] [-n top] [-j threads] log\n"
+                    "  -s          summary instead of the text dump\n"
+                    "  -n top      urls listed in the summary (10)\n"
+                    "  -j threads  worker threads (number of cpus)\n", prog);
+    exit(1);
+}
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (p == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return p;
+}
+
+/* ---- url dictionary ---- */
+
+static struct dict_entry *dict_slot(uint32_t id) {
+    size_t i = id & (dict_cap - 1);
+    while (dict[i].url != NULL && dict[i].id != id) {
+        i = (i + 1) & (dict_cap - 1);
+    }
+    return &dict[i];
+}
+
+static void load_dict(const char *base) {
+    char path[MAXLINE];
+    snprintf(path, sizeof(path), "%s.urls", base);
+
+    dict_cap = 1024;
+    dict = xcalloc(dict_cap, sizeof(*dict));
+    size_t used = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "warning: cannot open %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    char line[MAXLINE];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *tab = strchr(line, '\t');
+        if (tab == NULL) {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        uint32_t id = strtoul(line, NULL, 10);
+
+        if (2 * (used + 1) > dict_cap) {
+            struct dict_entry *old = dict;
+            size_t old_cap = dict_cap;
+            dict_cap *= 2;
+            dict = xcalloc(dict_cap, sizeof(*dict));
+            for (size_t i = 0; i < old_cap; ++i) {
+                if (old[i].url) *dict_slot(old[i].id) = old[i];
+            }
+            free(old);
+        }
+
+        struct dict_entry *entry = dict_slot(id);
+        if (entry->url == NULL) {
+            entry->id = id;
+            entry->url = strdup(tab + 1);
+            ++used;
+        }
+    }
+    fclose(fp);
+}
+
+static const char *url_of(uint32_t id) {
+    struct dict_entry *entry = dict_slot(id);
+    return entry->url ? entry->url : "?";
+}
+
+/* ---- segments ---- */
+
+static void map_segments(const char *base) {
+    for (uint32_t seq = 1; ; ++seq) {
+        char path[MAXLINE];
+        snprintf(path, sizeof(path), "%s.%0*u", base, BINLOG_SEQ_WIDTH, seq);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            break;
+        }
+
+        struct stat st;
+        fstat(fd, &st);
+        void *addr = MAP_FAILED;
+        if ((size_t)st.st_size >= sizeof(struct binlog_header)) {
+            addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+
+        const struct binlog_header *header = addr;
+        if (addr == MAP_FAILED || header->magic != BINLOG_MAGIC ||
+            header->version != BINLOG_VERSION ||
+            header->record_size != sizeof(struct binlog_record)) {
+            fprintf(stderr, "%s: not a version %d segment, skipped\n",
+                    path, BINLOG_VERSION);
+            if (addr != MAP_FAILED) munmap(addr, st.st_size);
+            continue;
+        }
+
+        uint64_t count = header->next < header->capacity ?
+                         header->next : header->capacity;
+        uint64_t fits = (st.st_size - sizeof(*header)) / header->record_size;
+        if (count > fits) count = fits;
+
+        segments = realloc(segments, (segment_count + 1) * sizeof(*segments));
+        segments[segment_count].header  = header;
+        segments[segment_count].records =
+            (const struct binlog_record *)(header + 1);
+        segments[segment_count].count   = count;
+        segments[segment_count].bytes   = st.st_size;
+        ++segment_count;
+
+        for (uint64_t off = 0; off < count; off += CHUNK_RECORDS) {
+            chunks = realloc(chunks, (chunk_count + 1) * sizeof(*chunks));
+            memset(&chunks[chunk_count], 0, sizeof(*chunks));
+            chunks[chunk_count].first = segments[segment_count - 1].records + off;
+            chunks[chunk_count].count = count - off < CHUNK_RECORDS ?
+                                        count - off : CHUNK_RECORDS;
+            ++chunk_count;
+        }
+    }
+}
+
+/* ---- aggregation ---- */
+
+static int hist_index(uint32_t v) {
+    if (v < HIST_EXACT) {
+        return v;
+    }
+    int e = 31 - __builtin_clz(v);          /* >= 7 */
+    int sub = (v >> (e - 6)) & (HIST_SUB - 1);
+    return HIST_EXACT + (e - 7) * HIST_SUB + sub;
+}
+
+static uint64_t hist_value(int idx) {
+    if (idx < HIST_EXACT) {
+        return idx;
+    }
+    int e = (idx - HIST_EXACT) / HIST_SUB + 7;
+    int sub = (idx - HIST_EXACT) % HIST_SUB;
+    return (uint64_t)(HIST_SUB + sub) << (e - 6);
+}
+
+static struct url_stat *url_slot(struct url_table *t, uint32_t id) {
+    if (2 * (t->count + 1) > t->cap) {
+        struct url_stat *old = t->slots;
+        size_t old_cap = t->cap;
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        t->slots = xcalloc(t->cap, sizeof(*t->slots));
+        for (size_t i = 0; i < old_cap; ++i) {
+            if (old[i].used) *url_slot(t, old[i].id) = old[i];
+        }
+        free(old);
+    }
+
+    size_t i = (id * 2654435761u) & (t->cap - 1);
+    while (t->slots[i].used && t->slots[i].id != id) {
+        i = (i + 1) & (t->cap - 1);
+    }
+    if (!t->slots[i].used) {
+        t->slots[i].used = 1;
+        t->slots[i].id = id;
+        ++t->count;
+    }
+    return &t->slots[i];
+}
+
+static void summarize(struct summary *s, const struct chunk *c) {
+    for (uint64_t i = 0; i < c->count; ++i) {
+        const struct binlog_record *r = &c->first[i];
+        if (!(__atomic_load_n(&r->flags, __ATOMIC_ACQUIRE) & BINLOG_COMMITTED)) {
+            ++s->skipped;
+            continue;
+        }
+        ++s->records;
+        s->bytes += r->bytes;
+        if (s->first_us == 0 || r->time_us < s->first_us) s->first_us = r->time_us;
+        if (r->time_us > s->last_us) s->last_us = r->time_us;
+        ++s->status[r->status < MAX_STATUS ? r->status : 0];
+        ++s->hist[hist_index(r->latency_us)];
+
+        struct url_stat *u = url_slot(&s->urls, r->url_id);
+        ++u->hits;
+        u->bytes += r->bytes;
+        u->latency += r->latency_us;
+    }
+}
+
+static void merge(struct summary *into, const struct summary *from) {
+    into->records += from->records;
+    into->skipped += from->skipped;
+    into->bytes   += from->bytes;
+    if (from->first_us &&
+        (into->first_us == 0 || from->first_us < into->first_us)) {
+        into->first_us = from->first_us;
+    }
+    if (from->last_us > into->last_us) into->last_us = from->last_us;
+    for (int i = 0; i < MAX_STATUS; ++i)   into->status[i] += from->status[i];
+    for (int i = 0; i < HIST_BUCKETS; ++i) into->hist[i] += from->hist[i];
+
+    for (size_t i = 0; i < from->urls.cap; ++i) {
+        const struct url_stat *u = &from->urls.slots[i];
+        if (!u->used) continue;
+        struct url_stat *t = url_slot(&into->urls, u->id);
+        t->hits    += u->hits;
+        t->bytes   += u->bytes;
+        t->latency += u->latency;
+    }
+}
+
+/* ---- text dump ---- */
+
+static void format_addr(const uint8_t *addr, char *out, size_t len) {
+    static const uint8_t mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+    if (memcmp(addr, mapped, 12) == 0) {
+        inet_ntop(AF_INET, addr + 12, out, len);
+    }
+    else {
+        inet_ntop(AF_INET6, addr, out, len);
+    }
+}
+
+static void format_chunk(struct chunk *c) {
+    size_t cap = c->count * 96 + 1;
+    char *text = malloc(cap);
+    size_t len = 0;
+
+    for (uint64_t i = 0; i < c->count; ++i) {
+        const struct binlog_record *r = &c->first[i];
+        if (!(__atomic_load_n(&r->flags, __ATOMIC_ACQUIRE) & BINLOG_COMMITTED)) {
+            continue;
+        }
+
+        char addr[INET6_ADDRSTRLEN];
+        char stamp[32];
+        time_t sec = r->time_us / 1000000;
+        struct tm local;
+        format_addr(r->addr, addr, sizeof(addr));
+        strftime(stamp, sizeof(stamp), "%Y/%m/%d %H:%M:%S",
+                 localtime_r(&sec, &local));
+
+        const char *url = url_of(r->url_id);
+        size_t need = strlen(url) + 160;
+        if (len + need > cap) {
+            cap = 2 * cap + need;
+            text = realloc(text, cap);
+        }
+        len += snprintf(text + len, cap - len,
+                        "%s.%06u %s %s %u %u %uus %s\n",
+                        stamp, (unsigned)(r->time_us % 1000000), addr,
+                        method_name[r->method < 4 ? r->method : 0],
+                        r->status, r->bytes, r->latency_us, url);
+    }
+    c->text = text;
+    c->text_len = len;
+}
+
+static void *worker_main(void *arg) {
+    struct summary *s = arg;
+    for (;;) {
+        size_t k = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED);
+        if (k >= chunk_count) {
+            break;
+        }
+
+        if (summary_mode) {
+            summarize(s, &chunks[k]);
+            continue;
+        }
+
+        // bound the memory held by formatted but unwritten chunks
+        pthread_mutex_lock(&chunk_lock);
+        while (k >= written + WINDOW) {
+            pthread_cond_wait(&chunk_cond, &chunk_lock);
+        }
+        pthread_mutex_unlock(&chunk_lock);
+
+        format_chunk(&chunks[k]);
+
+        pthread_mutex_lock(&chunk_lock);
+        chunks[k].done = 1;
+        pthread_cond_broadcast(&chunk_cond);
+        pthread_mutex_unlock(&chunk_lock);
+    }
+    return NULL;
+}
+
+static void write_chunks(void) {
+    for (size_t k = 0; k < chunk_count; ++k) {
+        pthread_mutex_lock(&chunk_lock);
+        while (!chunks[k].done) {
+            pthread_cond_wait(&chunk_cond, &chunk_lock);
+        }
+        pthread_mutex_unlock(&chunk_lock);
+
+        fwrite(chunks[k].text, 1, chunks[k].text_len, stdout);
+        free(chunks[k].text);
+        chunks[k].text = NULL;
+
+        pthread_mutex_lock(&chunk_lock);
+        written = k + 1;
+        pthread_cond_broadcast(&chunk_cond);
+        pthread_mutex_unlock(&chunk_lock);
+    }
+}
+
+/* ---- report ---- */
+
+static int by_hits(const void *a, const void *b) {
+    const struct url_stat *x = a, *y = b;
+    if (x->hits != y->hits) return x->hits < y->hits ? 1 : -1;
+    return 0;
+}
+
+static uint64_t percentile(const struct summary *s, double p) {
+    uint64_t rank = (uint64_t)(p * s->records);
+    if (rank >= s->records) rank = s->records - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += s->hist[i];
+        if (seen > rank) return hist_value(i);
+    }
+    return 0;
+}
+
+static void report(struct summary *s, int top) {
+    printf("segments  %d\n", segment_count);
+    printf("records   %llu", (unsigned long long)s->records);
+    if (s->skipped) {
+        printf(" (%llu unfinished)", (unsigned long long)s->skipped);
+    }
+    printf("\nbytes     %llu\n", (unsigned long long)s->bytes);
+    if (s->records == 0) {
+        return;
+    }
+
+    double span = (s->last_us - s->first_us) / 1e6;
+    printf("span      %.1fs", span);
+    if (span > 0) printf(", %.1f req/s", s->records / span);
+    printf("\n\nstatus\n");
+    for (int i = 0; i < MAX_STATUS; ++i) {
+        if (s->status[i]) {
+            printf("  %3d %12llu\n", i, (unsigned long long)s->status[i]);
+        }
+    }
+
+    printf("\nlatency (us)  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu\n",
+           (unsigned long long)percentile(s, 0.50),
+           (unsigned long long)percentile(s, 0.90),
+           (unsigned long long)percentile(s, 0.99),
+           (unsigned long long)percentile(s, 0.999));
+
+    struct url_stat *list = xcalloc(s->urls.count + 1, sizeof(*list));
+    size_t n = 0;
+    for (size_t i = 0; i < s->urls.cap; ++i) {
+        if (s->urls.slots[i].used) list[n++] = s->urls.slots[i];
+    }
+    qsort(list, n, sizeof(*list), by_hits);
+
+    printf("\n  %-40s %12s %14s %10s\n", "top urls", "hits", "bytes", "avg us");
+    for (size_t i = 0; i < n && i < (size_t)top; ++i) {
+        printf("  %-40s %12llu %14llu %10llu\n", url_of(list[i].id),
+               (unsigned long long)list[i].hits,
+               (unsigned long long)list[i].bytes,
+               (unsigned long long)(list[i].latency / list[i].hits));
+    }
+    free(list);
+}
+
+int main(int argc, char *argv[]) {
+    int top = 10;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "sn:j:h")) != -1) {
+        switch (opt) {
+        case 's': summary_mode = 1;           break;
+        case 'n': top = atoi(optarg);         break;
+        case 'j': threads = atol(optarg);     break;
+        default:  usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    load_dict(argv[optind]);
+    map_segments(argv[optind]);
+    if (segment_count == 0) {
+        fprintf(stderr, "no segments found for %s\n", argv[optind]);
+        return 1;
+    }
+
+    pthread_t *tids = xcalloc(threads, sizeof(*tids));
+    struct summary *sums = xcalloc(threads, sizeof(*sums));
+    for (long i = 0; i < threads; ++i) {
+        if (pthread_create(&tids[i], NULL, worker_main, &sums[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    if (!summary_mode) {
+        write_chunks();
+    }
+    for (long i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+
+    if (summary_mode) {
+        struct summary *total = xcalloc(1, sizeof(*total));
+        for (long i = 0; i < threads; ++i) {
+            merge(total, &sums[i]);
+        }
+        report(total, top);
+    }
+    return 0;
+}
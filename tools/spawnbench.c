@@ -0,0 +1,160 @@
+/*
+ *  spawnbench - how launching a CGI program costs as the server grows
+ *
+ *      spawnbench [-n launches] [-s mb,mb,...] [-t threads] [program]
+ *
+ *      For every size the process first grows its resident memory to that
+ *      many megabytes (touched heap, like the HttpConn array of ss or the
+ *      buffers of a busy twebs), then starts program (/bin/true) launches
+ *      times and waits for it, in three ways:
+ *
+ *        fork         fork + execve, what the servers used to do
+ *        vfork        vfork + execve
+ *        posix_spawn  cgi_spawn() of cgipool.c, glibc runs the child on the
+ *                     parent's memory (CLONE_VM | CLONE_VFORK) until exec
+ *
+ *      fork copies the page tables of the whole address space, so its time
+ *      grows with the size; the other two stay flat. -t starts idle threads
+ *      first, as ss has its worker threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "cgipool.h"
+
+enum { MODE_FORK = 0, MODE_VFORK, MODE_SPAWN, MODES };
+
+static const char *mode_name[] = { "fork", "vfork", "posix_spawn" };
+
+extern char **environ;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n launches] [-s mb,mb,...] [-t threads] "
+                    "[program]\n"
+                    "  -n launches  programs started per size and mode (200)\n"
+                    "  -s sizes     resident sizes in MB (0,64,256,1024)\n"
+                    "  -t threads   idle threads to start first (0)\n",
+            prog);
+    exit(1);
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void *idle_thread(void *arg) {
+    (void)arg;
+    pause();
+    return NULL;
+}
+
+/*
+ * start program once and wait for it, return 0 if it exited with 0
+ */
+static int launch(int mode, const char *program) {
+    char *argv[] = { (char *)program, NULL };
+    pid_t pid;
+
+    switch (mode) {
+    case MODE_FORK:
+        if ((pid = fork()) == 0) {
+            execve(program, argv, environ);
+            _exit(127);
+        }
+        break;
+    case MODE_VFORK:
+        if ((pid = vfork()) == 0) {
+            execve(program, argv, environ);
+            _exit(127);
+        }
+        break;
+    default:
+        pid = cgi_spawn(program, environ, -1, -1);
+        break;
+    }
+    if (pid < 0) {
+        return -1;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    int launches = 200;
+    char sizes_arg[256] = "0,64,256,1024";
+    int threads = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:t:h")) != -1) {
+        switch (opt) {
+        case 'n': launches = atoi(optarg);  break;
+        case 's': snprintf(sizes_arg, sizeof(sizes_arg), "%s", optarg); break;
+        case 't': threads = atoi(optarg);   break;
+        default:  usage(argv[0]);
+        }
+    }
+    if (launches < 1 || threads < 0) {
+        usage(argv[0]);
+    }
+    const char *program = optind < argc ? argv[optind] : "/bin/true";
+    if (launch(MODE_SPAWN, program) < 0) {
+        fprintf(stderr, "%s does not run and exit 0\n", program);
+        return 1;
+    }
+
+    for (int i = 0; i < threads; ++i) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, idle_thread, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    printf("%-10s", "RSS MB");
+    for (int mode = 0; mode < MODES; ++mode) {
+        printf("%16s", mode_name[mode]);
+    }
+    printf("   (us per launch, %d launches, %d threads)\n", launches, threads);
+
+    // the heap only grows, each size adds to what the previous ones touched
+    size_t resident = 0;
+    for (char *p = strtok(sizes_arg, ","); p; p = strtok(NULL, ",")) {
+        size_t size = (size_t)atol(p) << 20;
+        if (size > resident) {
+            char *grow = malloc(size - resident);
+            if (grow == NULL) {
+                fprintf(stderr, "cannot allocate %s MB\n", p);
+                return 1;
+            }
+            memset(grow, 1, size - resident);
+            resident = size;
+        }
+
+        printf("%-10zu", resident >> 20);
+        for (int mode = 0; mode < MODES; ++mode) {
+            double start = now_us();
+            for (int i = 0; i < launches; ++i) {
+                if (launch(mode, program) < 0) {
+                    fprintf(stderr, "%s failed\n", mode_name[mode]);
+                    return 1;
+                }
+            }
+            printf("%16.0f", (now_us() - start) / launches);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    return 0;
+}
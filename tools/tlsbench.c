@@ -0,0 +1,322 @@
+/*
+ *  tlsbench - compare sending a static file over TLS with user-space
+ *             SSL_write against kernel TLS (kTLS) with SSL_sendfile
+ *
+ *      tlsbench [-s size_mb] [-n rounds] [-c ciphersuite] [file]
+ *
+ *      A server and a client talk over a loopback TCP connection, with a
+ *      throw-away self-signed certificate. The server sends the file (or
+ *      size_mb of random data) rounds times per mode:
+ *
+ *        SSL_write       mmap'd file, encrypted by OpenSSL
+ *        ktls write      SSL_OP_ENABLE_KTLS, the kernel encrypts the copy
+ *        ktls sendfile   SSL_OP_ENABLE_KTLS + SSL_sendfile, no user copy
+ *
+ *      The kTLS modes are reported as unavailable when the kernel has no tls
+ *      module or the cipher is not offloadable, which is exactly when the
+ *      servers fall back to SSL_write. The client decrypts in user space in
+ *      every mode, so the numbers compare the sending side under a constant
+ *      receiving cost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+enum { MODE_WRITE = 0, MODE_KTLS_WRITE, MODE_KTLS_SENDFILE };
+
+static const char *mode_name[] = { "SSL_write", "ktls write", "ktls sendfile" };
+
+struct client_arg {
+    SSL_CTX *ctx;
+    int      port;
+    size_t   expect;
+    int      ok;
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s size_mb] [-n rounds] [-c ciphersuite] [file]\n"
+                    "  -s size_mb     random payload when no file is given (64)\n"
+                    "  -n rounds      times the file is sent per mode (8)\n"
+                    "  -c ciphersuite TLS 1.3 suite (TLS_AES_128_GCM_SHA256)\n",
+            prog);
+    exit(1);
+}
+
+static void die(const char *what) {
+    fprintf(stderr, "%s failed\n", what);
+    ERR_print_errors_fp(stderr);
+    exit(1);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * self-signed P-256 certificate, valid for one day
+ */
+static void make_cert(EVP_PKEY **pkey, X509 **cert) {
+    *pkey = EVP_EC_gen("P-256");
+    *cert = X509_new();
+    if (*pkey == NULL || *cert == NULL) {
+        die("key generation");
+    }
+    ASN1_INTEGER_set(X509_get_serialNumber(*cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(*cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(*cert), 86400);
+    X509_set_pubkey(*cert, *pkey);
+    X509_NAME *name = X509_get_subject_name(*cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *)"tlsbench", -1, -1, 0);
+    X509_set_issuer_name(*cert, name);
+    if (X509_sign(*cert, *pkey, EVP_sha256()) == 0) {
+        die("X509_sign");
+    }
+}
+
+static void *client_main(void *arg) {
+    struct client_arg *c = arg;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(c->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return NULL;
+    }
+
+    SSL *ssl = SSL_new(c->ctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        close(fd);
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    static __thread char buf[1 << 16];
+    size_t got = 0;
+    while (got < c->expect) {
+        int n = SSL_read(ssl, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    c->ok = got == c->expect;
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+    return NULL;
+}
+
+/*
+ * MB/s of one mode, 0 if the mode is unavailable, -1 on error
+ */
+static double run(SSL_CTX *sctx, SSL_CTX *cctx, int mode, int file_fd,
+                  const char *map, size_t size, int rounds) {
+    SSL_CTX_clear_options(sctx, SSL_OP_ENABLE_KTLS);
+    if (mode != MODE_WRITE) {
+        SSL_CTX_set_options(sctx, SSL_OP_ENABLE_KTLS);
+    }
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    struct client_arg c = { cctx, ntohs(addr.sin_port),
+                            (size_t)rounds * size, 0 };
+    pthread_t tid;
+    pthread_create(&tid, NULL, client_main, &c);
+
+    int fd = accept(listenfd, NULL, NULL);
+    close(listenfd);
+    SSL *ssl = SSL_new(sctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) != 1) {
+        die("SSL_accept");
+    }
+
+    double result = -1;
+    int ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    if (mode != MODE_WRITE && !ktls) {
+        // nothing will be sent, let the client give up
+        result = 0;
+        c.expect = 0;
+        shutdown(fd, SHUT_RDWR);
+        pthread_join(tid, NULL);
+        SSL_free(ssl);
+        close(fd);
+        return result;
+    }
+
+    double start = now();
+    int failed = 0;
+    for (int r = 0; r < rounds && !failed; ++r) {
+        size_t off = 0;
+        while (off < size) {
+            ossl_ssize_t n;
+            if (mode == MODE_KTLS_SENDFILE) {
+                n = SSL_sendfile(ssl, file_fd, off, size - off, 0);
+            }
+            else {
+                size_t chunk = size - off > (1 << 30) ? (1 << 30) : size - off;
+                n = SSL_write(ssl, map + off, chunk);
+            }
+            if (n <= 0) {
+                ERR_print_errors_fp(stderr);
+                failed = 1;
+                break;
+            }
+            off += n;
+        }
+    }
+    SSL_shutdown(ssl);
+    pthread_join(tid, NULL);
+    double elapsed = now() - start;
+
+    if (!failed && c.ok) {
+        result = (double)size * rounds / elapsed / (1 << 20);
+    }
+    SSL_free(ssl);
+    close(fd);
+    return result;
+}
+
+static int temp_file(size_t size) {
+    char path[] = "/tmp/tlsbench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(path);
+
+    char buf[1 << 16];
+    int rnd = open("/dev/urandom", O_RDONLY);
+    for (size_t done = 0; done < size; ) {
+        size_t n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        if (read(rnd, buf, n) != (ssize_t)n || write(fd, buf, n) != (ssize_t)n) {
+            perror("temp file");
+            exit(1);
+        }
+        done += n;
+    }
+    close(rnd);
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size_mb = 64;
+    int rounds = 8;
+    const char *suite = "TLS_AES_128_GCM_SHA256";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:c:h")) != -1) {
+        switch (opt) {
+        case 's': size_mb = atol(optarg);  break;
+        case 'n': rounds = atoi(optarg);   break;
+        case 'c': suite = optarg;          break;
+        default:  usage(argv[0]);
+        }
+    }
+    if (rounds < 1 || size_mb < 1) {
+        usage(argv[0]);
+    }
+
+    int file_fd;
+    if (optind < argc) {
+        if ((file_fd = open(argv[optind], O_RDONLY)) < 0) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+    else {
+        file_fd = temp_file(size_mb << 20);
+    }
+    struct stat st;
+    fstat(file_fd, &st);
+    size_t size = st.st_size;
+    if (size == 0) {
+        fprintf(stderr, "empty file\n");
+        return 1;
+    }
+    const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    EVP_PKEY *pkey;
+    X509 *cert;
+    make_cert(&pkey, &cert);
+
+    SSL_CTX *sctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *cctx = SSL_CTX_new(TLS_client_method());
+    if (sctx == NULL || cctx == NULL ||
+        SSL_CTX_use_certificate(sctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey(sctx, pkey) != 1 ||
+        SSL_CTX_set_ciphersuites(sctx, suite) != 1 ||
+        SSL_CTX_set_ciphersuites(cctx, suite) != 1) {
+        die("SSL_CTX setup");
+    }
+    SSL_CTX_set_min_proto_version(sctx, TLS1_3_VERSION);
+    SSL_CTX_set_num_tickets(sctx, 0);
+
+    printf("%zu bytes x %d rounds, %s\n", size, rounds, suite);
+    double base = 0;
+    for (int mode = MODE_WRITE; mode <= MODE_KTLS_SENDFILE; ++mode) {
+        double mbs = run(sctx, cctx, mode, file_fd, map, size, rounds);
+        if (mbs < 0) {
+            printf("  %-14s failed\n", mode_name[mode]);
+        }
+        else if (mbs == 0) {
+            printf("  %-14s unavailable (no kernel tls module or cipher "
+                   "not offloadable)\n", mode_name[mode]);
+        }
+        else {
+            if (mode == MODE_WRITE) base = mbs;
+            printf("  %-14s %9.1f MB/s", mode_name[mode], mbs);
+            if (mode != MODE_WRITE && base > 0) {
+                printf("  %.2fx", mbs / base);
+            }
+            printf("\n");
+        }
+    }
+
+    SSL_CTX_free(sctx);
+    SSL_CTX_free(cctx);
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+    return 0;
+}
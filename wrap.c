@@ -607,10 +607,20 @@ ssize_t Rio_readn(int fd, void *ptr, size_t nbytes)
     return n;
 }
 
+/*
+ * set when a write found the peer gone (EPIPE/ECONNRESET); that ends the
+ * connection, not the process, the caller clears it per connection
+ */
+int rio_peer_gone = 0;
+
 void Rio_writen(int fd, void *usrbuf, size_t n)
 {
     if (rio_writen(fd, usrbuf, n) != n)
     {
+        if (errno == EPIPE || errno == ECONNRESET) {
+            rio_peer_gone = 1;
+            return;
+        }
         syslog(LOG_CRIT,"Rio_writen error");
         unix_error("Rio_writen error");
     }
@@ -118,6 +118,7 @@ ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Wrappers for Rio package */
+extern int rio_peer_gone;   /* a Rio_writen peer closed or reset */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void    Rio_writen(int fd, void *usrbuf, size_t n);
 void    Rio_readinitb(rio_t *rp, int fd);